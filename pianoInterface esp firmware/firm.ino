@@ -8,22 +8,36 @@
 #include "src/lighting/lighting.h"
 #include "src/m_error.h"
 #include "src/m_constants.h"
+#include "src/metrics.h"
 #include "src/music.h"
 #include "src/network.h"
+#include "src/ota.h"
 #include "src/pinaoCom.h"
+#include "src/serialControl.h"
 #include "src/settings.h"
 #include "src/serialDebug.h"
+#include "src/trace.h"
+#include "src/webSocket.h"
+
+// Both threads run on core 1. MIDI has the higher priority so that a slow client
+// or a large song upload can never hold up note events.
+constexpr UBaseType_t MIDIThreadPriority = 2;
+constexpr UBaseType_t networkThreadPriority = 1;
 
 TaskHandle_t taskA;
+TaskHandle_t networkTask;
 void PollThreadFunc(void *pvParameters);
+void NetworkThreadFunc(void *pvParameters);
 
 unsigned long poll100Timer = 0;
 void poll100();
 
 void setup()
 {
+  // The serial port carries control commands even when debug output is turned off
+  serialControl::begin();
+  metrics::registerTask("loop", xTaskGetCurrentTaskHandle());
 #ifdef ENABLE_SERIAL
-  Serial.begin(115200);
   Serial.println("Started");
 #endif
 
@@ -50,57 +64,70 @@ void setup()
   // LEDs so that the error code can be displayed.
   if (USBSuccess)
   {
-    // Start up the network connection
+    // The piano and lights work straight away, the network comes up in the background
+    lights::setAnimationMode(lights::AnimationMode::KeyIndicateFade);
+    MIDI::setLogicalLayerEnable(true);
+
+    // Start up the network connection and the firmware update task
     network::beginConnection();
+    ota::begin();
 
-    // Spin up the second thread on core 1 which handles TCP and MIDI
+    // Spin up the second thread on core 1 which handles MIDI
     xTaskCreatePinnedToCore(
         PollThreadFunc,
         "thread2",
         10000,
         NULL,
-        1,
+        MIDIThreadPriority,
         &taskA,
         1);
+
+    // and the network thread which handles HTTP at a lower priority
+    xTaskCreatePinnedToCore(
+        NetworkThreadFunc,
+        "network",
+        10000,
+        NULL,
+        networkThreadPriority,
+        &networkTask,
+        1);
+    metrics::registerTask("midi", taskA);
+    metrics::registerTask("network", networkTask);
   }
 }
 
 void PollThreadFunc(void *pvParameters)
 {
-  Event e;
-  e.action = []() {
-    lights::setAnimationMode(lights::AnimationMode::BlinkSuccess);
-    while (!lights::animationCompleted())
-    {
-      lights::updateAnimation();
-    }
-
-    lights::setAnimationMode(lights::AnimationMode::KeyIndicateFade);
-    
-    MIDI::setLogicalLayerEnable(true);
-  };
-
-  if (network::waitForConnection())
+  // THREAD 1 endless loop
+  for (;;)
   {
-    network::startServer();
-    PushEvent(e);
+    MIDI::pollMIDI();
+
+    // Sleep for a tick so the lower priority network thread gets to run
+    vTaskDelay(1);
   }
+}
 
-  // THREAD 1 endless loop
+void NetworkThreadFunc(void *pvParameters)
+{
+  // The servers listen on every interface so they can start before there is a connection
+  network::startServer();
+
+  // NETWORK THREAD endless loop. Handles at most one client per tick.
   for (;;)
   {
+    network::updateConnection();
     network::pollEvents();
-    MIDI::pollMIDI();
+    serialControl::poll();
+    vTaskDelay(1);
   }
 }
 
 // THREAD 0 endless loop
 void loop()
 {
-  // Check for any new firmware updates on the network
-  if(network::isConnected()){
-    network::pollOTA();
-  }
+  // Decide whether a freshly updated firmware image gets kept
+  ota::checkImage();
 
   // If there is an error, show the error code until reset
   if (isErrorLocked())
@@ -116,7 +143,7 @@ void loop()
     Event e;
     while (PopEvent(&e))
     {
-      e.action();
+      RunEvent(e);
     }
   }
 
@@ -131,6 +158,17 @@ void loop()
 
   //  update the animations as often as possible
   lights::updateAnimation();
+
+  // the strip has just been updated so this is the best time for a firmware update to write flash
+  ota::renderFrameEnd();
+
+  // send everything that changed this frame to the live socket client
+  websocket::renderFrameEnd();
+
+  // checkpoint the song position and settings for the input trace now and then
+  trace::renderFrameEnd();
+
+  metrics::frameEnd();
 }
 
 void poll100()
@@ -0,0 +1,88 @@
+#include <chrono>
+#include <sim.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "circularBuffer.h"
+#include "commands.h"
+#include "lighting/lighting.h"
+#include "memoryStats.h"
+#include "settings.h"
+
+/**
+ * Times commands::dispatch() on the host for a few typical requests, and counts the heap
+ * allocations they make, which should be none. Only good for comparing one change against
+ * another on the same machine, the ESP32 is a lot slower.
+ *
+ *   commandBench [requests]
+ */
+
+namespace
+{
+    typedef std::chrono::steady_clock benchClock;
+
+    struct benchRequest
+    {
+        const char *name;
+        uint8_t bytes[8];
+        unsigned int length;
+    };
+
+    const benchRequest requests[] = {
+        {"GetSongIndex", {static_cast<uint8_t>(commands::Opcode::GetSongIndex)}, 1},
+        {"GetSetting", {static_cast<uint8_t>(commands::Opcode::GetSetting), 3}, 2},
+        {"GetLedLayout", {static_cast<uint8_t>(commands::Opcode::GetLedLayout)}, 1},
+        {"ChangeFloatSetting", {static_cast<uint8_t>(commands::Opcode::ChangeFloatSetting), 0, 0x00, 0x00, 0x80, 0x3E}, 6},
+        {"SetAnimationMode", {static_cast<uint8_t>(commands::Opcode::SetAnimationMode), 1}, 2},
+        {"GetLatencyStats", {static_cast<uint8_t>(commands::Opcode::GetLatencyStats)}, 1},
+        {"bad length", {static_cast<uint8_t>(commands::Opcode::GetSetting)}, 1},
+        {"unknown opcode", {0x7F}, 1}};
+
+    // Changes go to the render loop as events, which are taken off again so the queue never fills
+    void dropEvents()
+    {
+        Event e;
+        while (PopEvent(&e))
+        {
+        }
+    }
+
+    double nanosPerRequest(const benchRequest &request, unsigned int count, uint32_t *allocations)
+    {
+        uint8_t reply[commands::maxReplySize];
+        uint32_t allocationsBefore = memoryStats::allocationCount();
+        benchClock::time_point start = benchClock::now();
+        for (unsigned int i = 0; i < count; i++)
+        {
+            commands::dispatch(request.bytes, request.length, reply, sizeof(reply));
+            if (i % 32 == 31)
+            {
+                dropEvents();
+            }
+        }
+        double nanos = std::chrono::duration<double, std::nano>(benchClock::now() - start).count() / count;
+        *allocations = memoryStats::allocationCount() - allocationsBefore;
+        dropEvents();
+        return nanos;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    unsigned int count = argc > 1 ? atoi(argv[1]) : 200000;
+    sim::setSerialEcho(false);
+    sim::setMicros(1000000);
+    settings::init();
+    lights::init();
+    InitBuffer();
+
+    uint32_t allocations;
+    nanosPerRequest(requests[0], count / 10, &allocations); // warm up
+    for (const benchRequest &request : requests)
+    {
+        double nanos = nanosPerRequest(request, count, &allocations);
+        printf("%-20s %8.1f ns/request, %u allocations\n", request.name, nanos, allocations);
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <chrono>
+#include <sim.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "circularBuffer.h"
+#include "lighting/LEDCom.h"
+#include "lighting/lighting.h"
+#include "m_constants.h"
+#include "pinaoCom.h"
+#include "settings.h"
+
+/**
+ * Times the output stage (gamma, white balance, white extraction, power limit and dithering)
+ * and a whole KeyIndicateFade frame on the host. Only good for comparing one change against
+ * another on the same machine, the ESP32 is a lot slower.
+ *
+ *   outputBench [frames]
+ */
+
+namespace
+{
+    typedef std::chrono::steady_clock benchClock;
+
+    double nanosPerFrame(benchClock::time_point start, unsigned int frames)
+    {
+        return std::chrono::duration<double, std::nano>(benchClock::now() - start).count() / frames;
+    }
+
+    // Every key changes every frame so nothing is skipped
+    double outputStage(unsigned int frames)
+    {
+        benchClock::time_point start = benchClock::now();
+        for (unsigned int frame = 0; frame < frames; frame++)
+        {
+            for (unsigned int key = 0; key < _KEYCOUNT; key++)
+            {
+                uint8_t level = (frame + key * 3) & 0xFF;
+                LEDCom::setColor(key, level, 255 - level, (level * 7) & 0xFF);
+            }
+            LEDCom::updateLEDS();
+        }
+        return nanosPerFrame(start, frames);
+    }
+
+    // The usual playing mode with a key going down every few frames, 4ms of simulated time a frame
+    double keyIndicateFrame(unsigned int frames)
+    {
+        lights::setAnimationMode(lights::AnimationMode::KeyIndicateFade);
+        benchClock::time_point start = benchClock::now();
+        for (unsigned int frame = 0; frame < frames; frame++)
+        {
+            sim::advanceMicros(4000);
+            if (frame % 8 == 0)
+            {
+                const uint8_t packet[4] = {9, 0x90, static_cast<uint8_t>(MIDI::noteNumberOffset + frame % _PIANOSIZE), 100};
+                MIDI::handlePacket(packet, static_cast<uint32_t>(sim::getMicros()));
+            }
+            if (frame % 3 == 0)
+            {
+                MIDI::copyLogicalStateBuffer();
+            }
+            lights::updateAnimation();
+        }
+        return nanosPerFrame(start, frames);
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    unsigned int frames = argc > 1 ? atoi(argv[1]) : 20000;
+    sim::setSerialEcho(false);
+    sim::setMicros(1000000);
+    settings::init();
+    lights::init();
+    InitBuffer();
+    MIDI::setLogicalLayerEnable(true);
+
+    outputStage(frames / 10); // warm up
+    printf("output stage:          %8.0f ns/frame\n", outputStage(frames));
+    LEDCom::setPowerBudget(1000); // low enough that the limit dims every frame
+    printf("  power limited:       %8.0f ns/frame\n", outputStage(frames));
+    LEDCom::setPowerBudget(_POWER_BUDGET_MILLIAMPS);
+    printf("KeyIndicateFade frame: %8.0f ns/frame\n", keyIndicateFrame(frames));
+    printf("strip transfer time:   %8u us/frame (the time the frame takes on the wire)\n", LEDCom::getFrameTransferMicros());
+    return 0;
+}
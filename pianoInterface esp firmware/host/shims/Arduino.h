@@ -0,0 +1,76 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Just enough of the ESP32 Arduino core for the firmware to build on Linux. Time comes from
+// the simulated clock in sim.h, pins do nothing and Serial goes to stdout.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x02
+
+#define IRAM_ATTR
+
+unsigned long micros();
+unsigned long millis();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+class HardwareSerial
+{
+public:
+    void begin(unsigned long baud);
+    size_t setRxBufferSize(size_t size);
+    int available();
+    int read();
+    size_t readBytes(uint8_t *buffer, size_t length);
+    size_t write(uint8_t value);
+    size_t write(const uint8_t *buffer, size_t length);
+    void flush();
+
+    size_t print(const char *text);
+    size_t print(char value);
+    size_t print(int value);
+    size_t print(unsigned int value);
+    size_t print(long value);
+    size_t print(unsigned long value);
+    size_t print(double value);
+    size_t println(const char *text);
+    size_t println(int value);
+    size_t println(unsigned int value);
+    size_t println(long value);
+    size_t println(unsigned long value);
+    size_t println(double value);
+    size_t println();
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+extern HardwareSerial Serial;
+
+class EspClass
+{
+public:
+    uint32_t getCpuFreqMHz();
+    uint32_t getFreeHeap();
+    void restart();
+};
+
+extern EspClass ESP;
+
+#endif
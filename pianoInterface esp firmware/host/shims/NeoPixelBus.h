@@ -0,0 +1,77 @@
+#ifndef HOST_NEOPIXELBUS_H
+#define HOST_NEOPIXELBUS_H
+
+// The parts of NeoPixelBus the firmware uses. Instead of going out on a pin a shown frame is
+// kept by the sim::strip underneath, see sim.h.
+
+#include <stdint.h>
+
+#include "sim.h"
+
+struct RgbColor
+{
+    RgbColor(uint8_t r, uint8_t g, uint8_t b) : R(r), G(g), B(b) {}
+    uint8_t R, G, B;
+};
+
+struct RgbwColor
+{
+    RgbwColor(uint8_t r, uint8_t g, uint8_t b, uint8_t w) : R(r), G(g), B(b), W(w) {}
+    RgbwColor(const RgbColor &color) : R(color.R), G(color.G), B(color.B), W(0) {}
+    uint8_t R, G, B, W;
+};
+
+struct NeoGrbwFeature
+{
+    static constexpr uint8_t PixelSize = 4;
+
+    static void applyPixelColor(uint8_t *pixels, uint16_t index, RgbwColor color)
+    {
+        uint8_t *p = pixels + index * PixelSize;
+        p[0] = color.G;
+        p[1] = color.R;
+        p[2] = color.B;
+        p[3] = color.W;
+    }
+};
+
+struct NeoEsp32Rmt0800KbpsMethod {};
+struct NeoEsp32Rmt1800KbpsMethod {};
+struct NeoEsp32Rmt2800KbpsMethod {};
+struct NeoEsp32Rmt3800KbpsMethod {};
+struct NeoEsp32Rmt4800KbpsMethod {};
+struct NeoEsp32Rmt5800KbpsMethod {};
+struct NeoEsp32Rmt6800KbpsMethod {};
+struct NeoEsp32Rmt7800KbpsMethod {};
+typedef NeoEsp32Rmt6800KbpsMethod Neo800KbpsMethod;
+
+template <class Feature, class Method>
+class NeoPixelBus
+{
+public:
+    NeoPixelBus(uint16_t pixelCount, uint8_t pin) : strip(pixelCount, Feature::PixelSize, pin) {}
+
+    void Begin() {}
+    bool CanShow() const { return true; }
+    void Dirty() {}
+    void Show(bool maintainBufferConsistency = true)
+    {
+        (void)maintainBufferConsistency;
+        strip.show();
+    }
+
+    uint8_t *Pixels() { return strip.pixels(); }
+    size_t PixelsSize() const { return strip.size(); }
+    uint16_t PixelCount() const { return strip.getPixelCount(); }
+
+    template <class Color>
+    void SetPixelColor(uint16_t index, Color color)
+    {
+        Feature::applyPixelColor(strip.pixels(), index, color);
+    }
+
+private:
+    sim::strip strip;
+};
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+// Nothing talks SPI on the host, the USB host shield is simulated at the USB level (see usbhub.h)
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef HOST_UPDATE_H
+#define HOST_UPDATE_H
+
+// The firmware updater. The image is kept in memory and nothing is ever booted, see
+// sim::setUpdateWriteHandler() for watching when the writes happen. No md5 check.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class UpdateClass
+{
+public:
+    bool begin(size_t size);
+    bool setMD5(const char *md5);
+    size_t write(uint8_t *data, size_t length);
+    bool end(bool evenIfRemaining = false);
+    void abort();
+    const char *errorString();
+
+    const std::vector<uint8_t> &image() const { return written; }
+    bool ended() const { return accepted; }
+
+private:
+    std::vector<uint8_t> written;
+    size_t size = 0;
+    bool accepted = false;
+    const char *error = "";
+};
+
+extern UpdateClass Update;
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+// TCP over real sockets on the loopback interface, so the servers can be driven by a local
+// client. Servers listen on a free port rather than the one they ask for, see
+// sim::getServerPort(). The station never connects to a network.
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    WL_IDLE_STATUS = 0,
+    WL_NO_SSID_AVAIL = 1,
+    WL_SCAN_COMPLETED = 2,
+    WL_CONNECTED = 3,
+    WL_CONNECT_FAILED = 4,
+    WL_CONNECTION_LOST = 5,
+    WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum
+{
+    WIFI_OFF = 0,
+    WIFI_STA = 1,
+    WIFI_AP = 2,
+    WIFI_AP_STA = 3
+} wifi_mode_t;
+
+class IPAddress
+{
+public:
+    IPAddress() : address(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address((uint32_t)a << 24 | (uint32_t)b << 16 | (uint32_t)c << 8 | d) {}
+
+    bool operator==(const IPAddress &other) const { return address == other.address; }
+    bool operator!=(const IPAddress &other) const { return address != other.address; }
+
+private:
+    uint32_t address;
+};
+
+class WiFiClient
+{
+public:
+    WiFiClient() {}
+    explicit WiFiClient(int socket);
+
+    int available();
+    int read();
+    int read(uint8_t *buffer, size_t length);
+    size_t write(const uint8_t *buffer, size_t length);
+    uint8_t connected();
+    void stop();
+    IPAddress localIP();
+    operator bool() const { return socket != nullptr; }
+
+private:
+    struct handle
+    {
+        explicit handle(int fd) : fd(fd) {}
+        ~handle();
+        int fd;
+    };
+    std::shared_ptr<handle> socket; // closed when the last copy lets go, as on the device
+};
+
+class WiFiServer
+{
+public:
+    explicit WiFiServer(uint16_t port) : port(port) {}
+
+    void begin();
+    WiFiClient available();
+
+private:
+    uint16_t port;
+    int listener = -1;
+};
+
+class WiFiClass
+{
+public:
+    bool mode(wifi_mode_t mode);
+    bool setAutoReconnect(bool enabled);
+    wl_status_t begin(const char *ssid, const char *key);
+    wl_status_t status();
+    bool disconnect();
+    bool softAP(const char *ssid, const char *key);
+    bool softAPdisconnect();
+    IPAddress softAPIP();
+};
+
+extern WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef HOST_WIFIUDP_H
+#define HOST_WIFIUDP_H
+
+// A UDP socket fed from a queue of packets a test puts in with sim::sendUdpPacket(). Only
+// packets sent to the port the socket began on come out of it.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class WiFiUDP
+{
+public:
+    uint8_t begin(uint16_t port);
+    void stop();
+    int parsePacket();
+    int available();
+    int read(uint8_t *buffer, size_t length);
+
+private:
+    uint16_t port = 0;
+    std::vector<uint8_t> packet; // the one parsePacket() took, read from the front
+    size_t readPosition = 0;
+};
+
+#endif
@@ -0,0 +1,331 @@
+#include <Arduino.h>
+#include <atomic>
+#include <esp_heap_caps.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+namespace
+{
+    std::atomic<uint64_t> clockMicros(0);
+    std::atomic<bool> serialEcho(true);
+    int serialPty = -1; // master side of the pseudo terminal Serial is attached to, if any
+    uint8_t pinLevels[40];
+
+    void realSleep(uint32_t micros)
+    {
+        timespec duration = {static_cast<time_t>(micros / 1000000), static_cast<long>(micros % 1000000) * 1000};
+        nanosleep(&duration, nullptr);
+    }
+
+    size_t echo(const char *text, size_t length)
+    {
+        if (serialPty >= 0)
+        {
+            size_t written = 0;
+            while (written < length)
+            {
+                ssize_t count = write(serialPty, text + written, length - written);
+                if (count <= 0)
+                {
+                    break;
+                }
+                written += count;
+            }
+            return length;
+        }
+        if (serialEcho.load(std::memory_order_relaxed))
+        {
+            fwrite(text, 1, length, stdout);
+        }
+        return length;
+    }
+
+    size_t echof(const char *format, ...) __attribute__((format(printf, 1, 2)));
+    size_t echof(const char *format, ...)
+    {
+        char text[256];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        if (length < 0)
+        {
+            return 0;
+        }
+        return echo(text, (size_t)length < sizeof(text) ? length : sizeof(text) - 1);
+    }
+} // namespace
+
+namespace sim
+{
+
+void setMicros(uint64_t micros)
+{
+    clockMicros.store(micros, std::memory_order_relaxed);
+}
+
+void advanceMicros(uint64_t micros)
+{
+    clockMicros.fetch_add(micros, std::memory_order_relaxed);
+}
+
+uint64_t getMicros()
+{
+    return clockMicros.load(std::memory_order_relaxed);
+}
+
+uint8_t getPinLevel(uint8_t pin)
+{
+    return pin < sizeof(pinLevels) ? pinLevels[pin] : 0;
+}
+
+void setSerialEcho(bool enabled)
+{
+    serialEcho.store(enabled, std::memory_order_relaxed);
+}
+
+// The terminal side is opened here too and left open in raw mode, so the test can come and go
+const char *attachSerialPty()
+{
+    static char path[64];
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 || ptsname_r(master, path, sizeof(path)) != 0)
+    {
+        return nullptr;
+    }
+    int terminal = open(path, O_RDWR | O_NOCTTY);
+    termios mode;
+    if (terminal < 0 || tcgetattr(terminal, &mode) != 0)
+    {
+        return nullptr;
+    }
+    cfmakeraw(&mode);
+    tcsetattr(terminal, TCSANOW, &mode);
+    serialPty = master;
+    return path;
+}
+
+} // namespace sim
+
+// Wraps like the real thing, after 71 minutes
+unsigned long micros()
+{
+    return static_cast<uint32_t>(sim::getMicros());
+}
+
+unsigned long millis()
+{
+    return static_cast<uint32_t>(sim::getMicros() / 1000);
+}
+
+// Waiting doesn't move the simulated clock, it only gives other threads a moment to run
+void delay(uint32_t ms)
+{
+    realSleep(ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    realSleep(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    (void)pin;
+    (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    if (pin < sizeof(pinLevels))
+    {
+        pinLevels[pin] = value;
+    }
+}
+
+int digitalRead(uint8_t pin)
+{
+    return sim::getPinLevel(pin);
+}
+
+HardwareSerial Serial;
+
+void HardwareSerial::begin(unsigned long baud)
+{
+    (void)baud;
+}
+
+size_t HardwareSerial::setRxBufferSize(size_t size)
+{
+    return size;
+}
+
+// Nothing ever comes in on the host unless a pseudo terminal is attached
+int HardwareSerial::available()
+{
+    int count = 0;
+    if (serialPty < 0 || ioctl(serialPty, FIONREAD, &count) != 0)
+    {
+        return 0;
+    }
+    return count;
+}
+
+int HardwareSerial::read()
+{
+    uint8_t value;
+    return readBytes(&value, 1) == 1 ? value : -1;
+}
+
+// Only ever called for bytes available() has counted, so it doesn't wait
+size_t HardwareSerial::readBytes(uint8_t *buffer, size_t length)
+{
+    if (serialPty < 0)
+    {
+        return 0;
+    }
+    ssize_t count = ::read(serialPty, buffer, length);
+    return count > 0 ? count : 0;
+}
+
+size_t HardwareSerial::write(uint8_t value)
+{
+    return echo(reinterpret_cast<const char *>(&value), 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t length)
+{
+    return echo(reinterpret_cast<const char *>(buffer), length);
+}
+
+void HardwareSerial::flush()
+{
+    fflush(stdout);
+}
+
+size_t HardwareSerial::print(const char *text)
+{
+    return echo(text, strlen(text));
+}
+
+size_t HardwareSerial::print(char value)
+{
+    return echo(&value, 1);
+}
+
+size_t HardwareSerial::print(int value)
+{
+    return echof("%d", value);
+}
+
+size_t HardwareSerial::print(unsigned int value)
+{
+    return echof("%u", value);
+}
+
+size_t HardwareSerial::print(long value)
+{
+    return echof("%ld", value);
+}
+
+size_t HardwareSerial::print(unsigned long value)
+{
+    return echof("%lu", value);
+}
+
+size_t HardwareSerial::print(double value)
+{
+    return echof("%.2f", value);
+}
+
+size_t HardwareSerial::println(const char *text)
+{
+    return print(text) + println();
+}
+
+size_t HardwareSerial::println(int value)
+{
+    return print(value) + println();
+}
+
+size_t HardwareSerial::println(unsigned int value)
+{
+    return print(value) + println();
+}
+
+size_t HardwareSerial::println(long value)
+{
+    return print(value) + println();
+}
+
+size_t HardwareSerial::println(unsigned long value)
+{
+    return print(value) + println();
+}
+
+size_t HardwareSerial::println(double value)
+{
+    return print(value) + println();
+}
+
+size_t HardwareSerial::println()
+{
+    return echo("\r\n", 2);
+}
+
+size_t HardwareSerial::printf(const char *format, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return 0;
+    }
+    return echo(text, (size_t)length < sizeof(text) ? length : sizeof(text) - 1);
+}
+
+EspClass ESP;
+
+uint32_t EspClass::getCpuFreqMHz()
+{
+    return 240;
+}
+
+uint32_t EspClass::getFreeHeap()
+{
+    return 300 * 1024;
+}
+
+// Nothing to restart into, a restart ends the program
+void EspClass::restart()
+{
+    fflush(stdout);
+    exit(0);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    (void)caps;
+    return 300 * 1024;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+    (void)caps;
+    return 300 * 1024;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    (void)caps;
+    return 110 * 1024;
+}
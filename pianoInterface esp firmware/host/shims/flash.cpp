@@ -0,0 +1,129 @@
+#include <esp_partition.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "sim.h"
+
+namespace
+{
+    // The data partitions from partitions.csv, the app partitions aren't needed
+    esp_partition_t partitions[] = {
+        {ESP_PARTITION_TYPE_DATA, 0x01, 0x9000, 0x5000, "nvs", false},
+        {ESP_PARTITION_TYPE_DATA, 0x40, 0x290000, 0x2000, "settings", false},
+    };
+    constexpr unsigned int partitionCount = sizeof(partitions) / sizeof(partitions[0]);
+
+    std::vector<uint8_t> &contents(const esp_partition_t *partition)
+    {
+        static std::vector<uint8_t> flash[partitionCount];
+        std::vector<uint8_t> &bytes = flash[partition - partitions];
+        if (bytes.size() != partition->size)
+        {
+            bytes.assign(partition->size, 0xFF);
+        }
+        return bytes;
+    }
+
+    // Every byte programmed or erased counts one step, the power goes after powerCutStep of them
+    size_t flashSteps = 0;
+    size_t powerCutStep = SIZE_MAX;
+
+    // How many of the next size bytes still get done before the power goes
+    size_t poweredBytes(size_t size)
+    {
+        size_t left = flashSteps < powerCutStep ? powerCutStep - flashSteps : 0;
+        flashSteps += size;
+        return size < left ? size : left;
+    }
+
+    bool inRange(const esp_partition_t *partition, size_t offset, size_t size)
+    {
+        return partition != nullptr && offset <= partition->size && size <= partition->size - offset;
+    }
+} // namespace
+
+namespace sim
+{
+
+void eraseFlash()
+{
+    for (unsigned int i = 0; i < partitionCount; i++)
+    {
+        std::vector<uint8_t> &bytes = contents(&partitions[i]);
+        memset(bytes.data(), 0xFF, bytes.size());
+    }
+}
+
+void cutFlashPowerAfter(size_t bytes)
+{
+    powerCutStep = flashSteps + bytes;
+}
+
+void restoreFlashPower()
+{
+    powerCutStep = SIZE_MAX;
+}
+
+size_t getFlashBytesTouched()
+{
+    return flashSteps;
+}
+
+} // namespace sim
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    for (unsigned int i = 0; i < partitionCount; i++)
+    {
+        const esp_partition_t &partition = partitions[i];
+        if (partition.type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || partition.subtype == subtype) &&
+            (label == nullptr || strcmp(partition.label, label) == 0))
+        {
+            return &partition;
+        }
+    }
+    return nullptr;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *destination, size_t size)
+{
+    if (!inRange(partition, offset, size))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(destination, contents(partition).data() + offset, size);
+    return ESP_OK;
+}
+
+// NOR flash: programming can only clear bits. Bytes go in one at a time from the start, so a
+// power cut leaves a write done up to some byte.
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *source, size_t size)
+{
+    if (!inRange(partition, offset, size))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint8_t *bytes = contents(partition).data() + offset;
+    const uint8_t *data = static_cast<const uint8_t *>(source);
+    size_t written = poweredBytes(size);
+    for (size_t i = 0; i < written; i++)
+    {
+        bytes[i] &= data[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (!inRange(partition, offset, size))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(contents(partition).data() + offset, 0xFF, poweredBytes(size));
+    return ESP_OK;
+}
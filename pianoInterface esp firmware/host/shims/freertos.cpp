@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+struct hostTask
+{
+    pthread_t thread;
+    TaskFunction_t function;
+    void *parameters;
+    uint32_t stackDepth;
+    pthread_mutex_t notifyMutex;
+    pthread_cond_t notified;
+    uint32_t notifyCount;
+};
+
+struct hostQueue
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    std::vector<uint8_t> items;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    UBaseType_t head;
+    UBaseType_t count;
+};
+
+namespace
+{
+    constexpr uint32_t mainStackDepth = 8192; // the Arduino loop task
+
+    hostTask mainTask = {pthread_self(), nullptr, nullptr, mainStackDepth, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+    thread_local hostTask *currentTask = &mainTask;
+
+    void *runTask(void *argument)
+    {
+        hostTask *task = static_cast<hostTask *>(argument);
+        currentTask = task;
+        task->function(task->parameters);
+        return nullptr;
+    }
+
+    // Waits on the queue's condition for up to ticks milliseconds of real time. False on timeout.
+    bool waitForChange(hostQueue *queue, TickType_t ticks)
+    {
+        if (ticks == 0)
+        {
+            return false;
+        }
+        if (ticks == portMAX_DELAY)
+        {
+            pthread_cond_wait(&queue->changed, &queue->mutex);
+            return true;
+        }
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ticks / 1000;
+        deadline.tv_nsec += (long)(ticks % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        return pthread_cond_timedwait(&queue->changed, &queue->mutex, &deadline) != ETIMEDOUT;
+    }
+} // namespace
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth, void *parameters,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core)
+{
+    (void)name;
+    (void)priority;
+    (void)core;
+    hostTask *task = new hostTask{pthread_t(), function, parameters, stackDepth, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+    if (pthread_create(&task->thread, nullptr, runTask, task) != 0)
+    {
+        delete task;
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    if (created != nullptr)
+    {
+        *created = task;
+    }
+    return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    return currentTask;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    timespec duration = {static_cast<time_t>(ticks / 1000), static_cast<long>(ticks % 1000) * 1000000};
+    nanosleep(&duration, nullptr);
+}
+
+TickType_t xTaskGetTickCount()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<TickType_t>(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+// Waits up to ticks milliseconds of real time for a notification
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait)
+{
+    hostTask *task = currentTask;
+    pthread_mutex_lock(&task->notifyMutex);
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ticksToWait / 1000;
+    deadline.tv_nsec += (long)(ticksToWait % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (task->notifyCount == 0 && ticksToWait != 0)
+    {
+        if (ticksToWait == portMAX_DELAY)
+        {
+            pthread_cond_wait(&task->notified, &task->notifyMutex);
+        }
+        else if (pthread_cond_timedwait(&task->notified, &task->notifyMutex, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    uint32_t count = task->notifyCount;
+    if (count != 0)
+    {
+        task->notifyCount = clearCountOnExit ? 0 : count - 1;
+    }
+    pthread_mutex_unlock(&task->notifyMutex);
+    return count;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->notifyMutex);
+    task->notifyCount++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->notifyMutex);
+    return pdPASS;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    return task == nullptr ? currentTask->stackDepth : task->stackDepth;
+}
+
+BaseType_t xPortGetCoreID()
+{
+    return 1;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+    hostQueue *queue = new hostQueue;
+    pthread_mutex_init(&queue->mutex, nullptr);
+    pthread_cond_init(&queue->changed, nullptr);
+    queue->items.resize(length * (itemSize == 0 ? 1 : itemSize));
+    queue->length = length;
+    queue->itemSize = itemSize;
+    queue->head = 0;
+    queue->count = 0;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    pthread_cond_destroy(&queue->changed);
+    pthread_mutex_destroy(&queue->mutex);
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticksToWait)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->length)
+    {
+        if (!waitForChange(queue, ticksToWait))
+        {
+            pthread_mutex_unlock(&queue->mutex);
+            return pdFALSE;
+        }
+    }
+    UBaseType_t slot = (queue->head + queue->count) % queue->length;
+    if (queue->itemSize != 0 && item != nullptr)
+    {
+        memcpy(&queue->items[slot * queue->itemSize], item, queue->itemSize);
+    }
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticksToWait)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0)
+    {
+        if (!waitForChange(queue, ticksToWait))
+        {
+            pthread_mutex_unlock(&queue->mutex);
+            return pdFALSE;
+        }
+    }
+    if (queue->itemSize != 0 && item != nullptr)
+    {
+        memcpy(item, &queue->items[queue->head * queue->itemSize], queue->itemSize);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->mutex);
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    SemaphoreHandle_t semaphore = xQueueCreate(1, 0);
+    xQueueSend(semaphore, nullptr, 0);
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait)
+{
+    return xQueueReceive(semaphore, nullptr, ticksToWait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return xQueueSend(semaphore, nullptr, 0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    vQueueDelete(semaphore);
+}
@@ -0,0 +1,26 @@
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include "FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+
+// The task runs on its own pthread. Priority and core are ignored.
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth, void *parameters,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+
+// Sleeps for real so other threads get to run, the simulated clock stays where it is
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+
+// Notifications count up like a semaphore. The wait is in real time.
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+
+// Stacks aren't measured on the host, always reports the whole stack as unused
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+
+BaseType_t xPortGetCoreID();
+
+#endif
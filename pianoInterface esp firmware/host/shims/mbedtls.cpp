@@ -0,0 +1,175 @@
+#include <mbedtls/md.h>
+#include <string.h>
+
+// SHA-256 as in FIPS 180-4, and HMAC over it as in RFC 2104
+
+struct mbedtls_md_info_t
+{
+    mbedtls_md_type_t type;
+};
+
+namespace
+{
+    const mbedtls_md_info_t sha256Info = {MBEDTLS_MD_SHA256};
+
+    const uint32_t roundConstants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    inline uint32_t rotate(uint32_t value, unsigned int bits)
+    {
+        return (value >> bits) | (value << (32 - bits));
+    }
+
+    void compress(mbedtls_sha256_state &state, const uint8_t *block)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t v[8];
+        memcpy(v, state.hash, sizeof(v));
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t s1 = rotate(v[4], 6) ^ rotate(v[4], 11) ^ rotate(v[4], 25);
+            uint32_t choose = (v[4] & v[5]) ^ (~v[4] & v[6]);
+            uint32_t t1 = v[7] + s1 + choose + roundConstants[i] + w[i];
+            uint32_t s0 = rotate(v[0], 2) ^ rotate(v[0], 13) ^ rotate(v[0], 22);
+            uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+            memmove(v + 1, v, 7 * sizeof(uint32_t));
+            v[4] += t1;
+            v[0] = t1 + s0 + majority;
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            state.hash[i] += v[i];
+        }
+    }
+
+    void start(mbedtls_sha256_state &state)
+    {
+        const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(state.hash, initial, sizeof(initial));
+        state.length = 0;
+    }
+
+    void update(mbedtls_sha256_state &state, const uint8_t *input, size_t length)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            state.block[state.length++ % 64] = input[i];
+            if (state.length % 64 == 0)
+            {
+                compress(state, state.block);
+            }
+        }
+    }
+
+    void finish(mbedtls_sha256_state &state, uint8_t *output)
+    {
+        uint64_t bits = state.length * 8;
+        const uint8_t one = 0x80;
+        const uint8_t zero = 0;
+        update(state, &one, 1);
+        while (state.length % 64 != 56)
+        {
+            update(state, &zero, 1);
+        }
+        for (int i = 7; i >= 0; i--)
+        {
+            uint8_t byte = bits >> (i * 8);
+            update(state, &byte, 1);
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            output[i * 4] = state.hash[i] >> 24;
+            output[i * 4 + 1] = state.hash[i] >> 16;
+            output[i * 4 + 2] = state.hash[i] >> 8;
+            output[i * 4 + 3] = state.hash[i];
+        }
+    }
+} // namespace
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t type)
+{
+    return type == MBEDTLS_MD_SHA256 ? &sha256Info : nullptr;
+}
+
+void mbedtls_md_init(mbedtls_md_context_t *context)
+{
+    memset(context, 0, sizeof(*context));
+}
+
+void mbedtls_md_free(mbedtls_md_context_t *context)
+{
+    memset(context, 0, sizeof(*context));
+}
+
+int mbedtls_md_setup(mbedtls_md_context_t *context, const mbedtls_md_info_t *info, int hmac)
+{
+    if (info == nullptr || !hmac)
+    {
+        return -1;
+    }
+    context->info = info;
+    return 0;
+}
+
+// Keys longer than a block are hashed first
+int mbedtls_md_hmac_starts(mbedtls_md_context_t *context, const unsigned char *key, size_t keyLength)
+{
+    uint8_t block[64] = {0};
+    if (keyLength > sizeof(block))
+    {
+        start(context->inner);
+        update(context->inner, key, keyLength);
+        finish(context->inner, block);
+    }
+    else
+    {
+        memcpy(block, key, keyLength);
+    }
+
+    uint8_t pad[64];
+    start(context->inner);
+    for (int i = 0; i < 64; i++)
+    {
+        pad[i] = block[i] ^ 0x36;
+    }
+    update(context->inner, pad, sizeof(pad));
+    start(context->outer);
+    for (int i = 0; i < 64; i++)
+    {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    update(context->outer, pad, sizeof(pad));
+    return 0;
+}
+
+int mbedtls_md_hmac_update(mbedtls_md_context_t *context, const unsigned char *input, size_t length)
+{
+    update(context->inner, input, length);
+    return 0;
+}
+
+int mbedtls_md_hmac_finish(mbedtls_md_context_t *context, unsigned char *output)
+{
+    uint8_t innerHash[32];
+    finish(context->inner, innerHash);
+    update(context->outer, innerHash, sizeof(innerHash));
+    finish(context->outer, output);
+    return 0;
+}
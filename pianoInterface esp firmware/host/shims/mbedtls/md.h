@@ -0,0 +1,40 @@
+#ifndef HOST_MBEDTLS_MD_H
+#define HOST_MBEDTLS_MD_H
+
+// The part of the mbedtls message digest API the firmware uses, HMAC-SHA256 only
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    MBEDTLS_MD_NONE = 0,
+    MBEDTLS_MD_SHA256 = 6
+} mbedtls_md_type_t;
+
+typedef struct mbedtls_md_info_t mbedtls_md_info_t;
+
+struct mbedtls_sha256_state
+{
+    uint32_t hash[8];
+    uint8_t block[64];
+    uint64_t length; // bytes hashed so far
+};
+
+typedef struct
+{
+    const mbedtls_md_info_t *info;
+    mbedtls_sha256_state inner;
+    mbedtls_sha256_state outer;
+} mbedtls_md_context_t;
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t type);
+
+void mbedtls_md_init(mbedtls_md_context_t *context);
+void mbedtls_md_free(mbedtls_md_context_t *context);
+int mbedtls_md_setup(mbedtls_md_context_t *context, const mbedtls_md_info_t *info, int hmac);
+int mbedtls_md_hmac_starts(mbedtls_md_context_t *context, const unsigned char *key, size_t keyLength);
+int mbedtls_md_hmac_update(mbedtls_md_context_t *context, const unsigned char *input, size_t length);
+int mbedtls_md_hmac_finish(mbedtls_md_context_t *context, unsigned char *output);
+
+#endif
@@ -0,0 +1,21 @@
+#include "../../src/webSocket.h"
+
+// The WebSocket module isn't part of the host build, its handshake needs more of mbedtls
+// than the shims have. This stands in for it as a device with no WebSocket client.
+
+namespace websocket
+{
+
+void begin()
+{
+}
+
+void poll()
+{
+}
+
+void renderFrameEnd()
+{
+}
+
+} // namespace websocket
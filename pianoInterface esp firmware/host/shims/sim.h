@@ -0,0 +1,93 @@
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Control over the simulated hardware of the host build, for tests, benchmarks and the replay.
+ *
+ * The clock only moves when it is told to, so code which reads micros() sees the same times on
+ * every run. Every strip the firmware makes keeps a copy of the last frame it showed, and the
+ * flash partitions live in memory with the erase and write rules of real NOR flash.
+ */
+
+namespace sim
+{
+
+void setMicros(uint64_t micros);
+void advanceMicros(uint64_t micros);
+uint64_t getMicros();
+
+// One NeoPixelBus. The firmware writes pixels(), show() copies them to shownPixels().
+class strip
+{
+public:
+    strip(uint16_t pixelCount, uint8_t pixelSize, uint8_t pin);
+    ~strip();
+
+    strip(const strip &) = delete;
+    strip &operator=(const strip &) = delete;
+
+    uint8_t *pixels() { return buffer.data(); }
+    const uint8_t *shownPixels() const { return shown.data(); }
+    size_t size() const { return buffer.size(); }
+    uint16_t getPixelCount() const { return pixelCount; }
+    uint8_t getPin() const { return pin; }
+    uint32_t getShowCount() const { return showCount; }
+
+    void show();
+
+private:
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> shown;
+    uint16_t pixelCount;
+    uint8_t pin;
+    uint32_t showCount = 0;
+};
+
+// Strips in the order they were made, which is the order of the segments
+unsigned int stripCount();
+const strip &getStrip(unsigned int index);
+
+// The last frame shown on every strip one after another, as the wire bytes. Returns the bytes copied.
+size_t copyShownFrame(uint8_t *out, size_t capacity);
+
+// Sets every byte of every flash partition back to 0xFF
+void eraseFlash();
+
+// Power cuts on the flash. Every byte programmed or erased is one step, after the given number
+// of steps from now all writes and erases are silently dropped until the power is restored.
+// A write or erase cut part way has been done from its start up to the cut.
+void cutFlashPowerAfter(size_t bytes);
+void restoreFlashPower();
+size_t getFlashBytesTouched();
+
+// Level last written to an output pin
+uint8_t getPinLevel(uint8_t pin);
+
+// The loopback port a WiFiServer made for devicePort is really listening on, 0 if there isn't one
+uint16_t getServerPort(uint16_t devicePort);
+
+// Queues a UDP packet for the WiFiUDP which began on port, from any thread
+void sendUdpPacket(uint16_t port, const uint8_t *data, size_t length);
+size_t getUdpPacketsWaiting();
+
+// Clients of every server seem to have come in through the soft access point, off by default
+void setClientsOnSoftAP(bool enabled);
+
+// Called with the length of every Update.write(), on the writing thread
+typedef void (*updateWriteHandler)(size_t length);
+void setUpdateWriteHandler(updateWriteHandler handler);
+
+// Whether Serial output goes to stdout, on by default
+void setSerialEcho(bool enabled);
+
+// Connects Serial to a new pseudo terminal instead of stdout, so a test can talk to the firmware
+// over it the way a host program talks to the USB port. Returns the path to open, nullptr if it failed.
+const char *attachSerialPty();
+
+} // namespace sim
+
+#endif
@@ -0,0 +1,58 @@
+#include <algorithm>
+#include <string.h>
+
+#include "sim.h"
+
+namespace
+{
+    std::vector<sim::strip *> &strips()
+    {
+        static std::vector<sim::strip *> made;
+        return made;
+    }
+} // namespace
+
+namespace sim
+{
+
+strip::strip(uint16_t pixelCount, uint8_t pixelSize, uint8_t pin)
+    : buffer(pixelCount * pixelSize, 0), shown(pixelCount * pixelSize, 0), pixelCount(pixelCount), pin(pin)
+{
+    strips().push_back(this);
+}
+
+strip::~strip()
+{
+    std::vector<strip *> &made = strips();
+    made.erase(std::remove(made.begin(), made.end(), this), made.end());
+}
+
+void strip::show()
+{
+    shown = buffer;
+    showCount++;
+}
+
+unsigned int stripCount()
+{
+    return strips().size();
+}
+
+const strip &getStrip(unsigned int index)
+{
+    return *strips()[index];
+}
+
+size_t copyShownFrame(uint8_t *out, size_t capacity)
+{
+    size_t copied = 0;
+    for (const strip *s : strips())
+    {
+        size_t length = std::min(s->size(), capacity - copied);
+        memcpy(out + copied, s->shownPixels(), length);
+        copied += length;
+    }
+    return copied;
+}
+
+} // namespace sim
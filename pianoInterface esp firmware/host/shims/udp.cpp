@@ -0,0 +1,85 @@
+#include <WiFiUdp.h>
+#include <deque>
+#include <mutex>
+#include <string.h>
+
+#include "sim.h"
+
+namespace
+{
+    struct queuedPacket
+    {
+        uint16_t port;
+        std::vector<uint8_t> data;
+    };
+
+    std::mutex queueMutex;
+    std::deque<queuedPacket> &queue()
+    {
+        static std::deque<queuedPacket> packets;
+        return packets;
+    }
+} // namespace
+
+namespace sim
+{
+
+void sendUdpPacket(uint16_t port, const uint8_t *data, size_t length)
+{
+    std::lock_guard<std::mutex> lock(queueMutex);
+    queue().push_back({port, std::vector<uint8_t>(data, data + length)});
+}
+
+size_t getUdpPacketsWaiting()
+{
+    std::lock_guard<std::mutex> lock(queueMutex);
+    return queue().size();
+}
+
+} // namespace sim
+
+uint8_t WiFiUDP::begin(uint16_t port)
+{
+    this->port = port;
+    return 1;
+}
+
+void WiFiUDP::stop()
+{
+    port = 0;
+}
+
+// Takes the oldest packet for this port, whatever is left of the last one is thrown away as on the device
+int WiFiUDP::parsePacket()
+{
+    packet.clear();
+    readPosition = 0;
+    if (port == 0)
+    {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(queueMutex);
+    for (auto i = queue().begin(); i != queue().end(); ++i)
+    {
+        if (i->port == port)
+        {
+            packet.swap(i->data);
+            queue().erase(i);
+            return packet.size();
+        }
+    }
+    return 0;
+}
+
+int WiFiUDP::available()
+{
+    return packet.size() - readPosition;
+}
+
+int WiFiUDP::read(uint8_t *buffer, size_t length)
+{
+    size_t count = packet.size() - readPosition < length ? packet.size() - readPosition : length;
+    memcpy(buffer, packet.data() + readPosition, count);
+    readPosition += count;
+    return count;
+}
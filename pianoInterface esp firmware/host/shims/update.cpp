@@ -0,0 +1,89 @@
+#include <Update.h>
+#include <esp_ota_ops.h>
+
+#include "sim.h"
+
+namespace
+{
+    sim::updateWriteHandler writeHandler = nullptr;
+} // namespace
+
+namespace sim
+{
+
+void setUpdateWriteHandler(updateWriteHandler handler)
+{
+    writeHandler = handler;
+}
+
+} // namespace sim
+
+UpdateClass Update;
+
+bool UpdateClass::begin(size_t imageSize)
+{
+    written.clear();
+    size = imageSize;
+    accepted = false;
+    error = "";
+    return true;
+}
+
+bool UpdateClass::setMD5(const char *md5)
+{
+    (void)md5;
+    return true;
+}
+
+size_t UpdateClass::write(uint8_t *data, size_t length)
+{
+    if (writeHandler != nullptr)
+    {
+        writeHandler(length);
+    }
+    written.insert(written.end(), data, data + length);
+    return length;
+}
+
+bool UpdateClass::end(bool evenIfRemaining)
+{
+    if (!evenIfRemaining && written.size() != size)
+    {
+        error = "image incomplete";
+        return false;
+    }
+    accepted = true;
+    return true;
+}
+
+void UpdateClass::abort()
+{
+    error = "aborted";
+}
+
+const char *UpdateClass::errorString()
+{
+    return error;
+}
+
+const esp_partition_t *esp_ota_get_running_partition()
+{
+    return nullptr;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *state)
+{
+    (void)partition;
+    *state = ESP_OTA_IMG_VALID;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback()
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot()
+{
+    return ESP_OK;
+}
@@ -0,0 +1,24 @@
+#ifndef HOST_USBH_MIDI_H
+#define HOST_USBH_MIDI_H
+
+#include <stdint.h>
+
+#include "usbhub.h"
+
+class USBH_MIDI
+{
+public:
+    explicit USBH_MIDI(USB *usb) { (void)usb; }
+
+    uint8_t RecvData(uint16_t *received, uint8_t *buffer)
+    {
+        (void)buffer;
+        *received = 0;
+        return 0;
+    }
+
+    uint16_t vid = 0;
+    uint16_t pid = 0;
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef HOST_USBHUB_H
+#define HOST_USBHUB_H
+
+// The USB host shield with no device plugged in. MIDI input on the host goes straight to
+// MIDI::handlePacket instead, which is what the trace replay does.
+
+#include <stdint.h>
+
+#define USB_STATE_DETACHED 0x10
+#define USB_STATE_RUNNING 0x90
+
+class USB
+{
+public:
+    int Init() { return 0; }
+    void Task() {}
+    uint8_t getUsbTaskState() { return USB_STATE_DETACHED; }
+};
+
+#endif
@@ -0,0 +1,206 @@
+#include <WiFi.h>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+namespace
+{
+    std::mutex portsMutex;
+    std::atomic<bool> clientsOnSoftAP(false);
+    const IPAddress softAPAddress(192, 168, 4, 1);
+    const IPAddress stationAddress(127, 0, 0, 1);
+
+    std::map<uint16_t, uint16_t> &ports()
+    {
+        static std::map<uint16_t, uint16_t> listening; // device port -> loopback port
+        return listening;
+    }
+} // namespace
+
+namespace sim
+{
+
+void setClientsOnSoftAP(bool enabled)
+{
+    clientsOnSoftAP.store(enabled);
+}
+
+uint16_t getServerPort(uint16_t devicePort)
+{
+    std::lock_guard<std::mutex> lock(portsMutex);
+    auto found = ports().find(devicePort);
+    return found == ports().end() ? 0 : found->second;
+}
+
+} // namespace sim
+
+WiFiClass WiFi;
+
+WiFiClient::WiFiClient(int socket) : socket(std::make_shared<handle>(socket))
+{
+}
+
+WiFiClient::handle::~handle()
+{
+    close(fd);
+}
+
+int WiFiClient::available()
+{
+    int count = 0;
+    if (!socket || ioctl(socket->fd, FIONREAD, &count) != 0)
+    {
+        return 0;
+    }
+    return count;
+}
+
+int WiFiClient::read()
+{
+    uint8_t value;
+    return read(&value, 1) == 1 ? value : -1;
+}
+
+// Doesn't wait, like the device it returns -1 when nothing has come in
+int WiFiClient::read(uint8_t *buffer, size_t length)
+{
+    if (!socket)
+    {
+        return -1;
+    }
+    ssize_t count = recv(socket->fd, buffer, length, MSG_DONTWAIT);
+    return count > 0 ? count : -1;
+}
+
+size_t WiFiClient::write(const uint8_t *buffer, size_t length)
+{
+    if (!socket)
+    {
+        return 0;
+    }
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t count = send(socket->fd, buffer + written, length - written, MSG_NOSIGNAL);
+        if (count <= 0)
+        {
+            break;
+        }
+        written += count;
+    }
+    return written;
+}
+
+// Still connected while there is data left to read, even if the other end has closed
+uint8_t WiFiClient::connected()
+{
+    if (!socket)
+    {
+        return 0;
+    }
+    uint8_t peek;
+    ssize_t count = recv(socket->fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        socket.reset();
+        return 0;
+    }
+    return 1;
+}
+
+void WiFiClient::stop()
+{
+    socket.reset();
+}
+
+// The address of the interface the client came in on
+IPAddress WiFiClient::localIP()
+{
+    return clientsOnSoftAP.load() ? softAPAddress : stationAddress;
+}
+
+void WiFiServer::begin()
+{
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t addressLength = sizeof(address);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listener, 8) != 0 || getsockname(listener, reinterpret_cast<sockaddr *>(&address), &addressLength) != 0)
+    {
+        return;
+    }
+    fcntl(listener, F_SETFL, O_NONBLOCK);
+    std::lock_guard<std::mutex> lock(portsMutex);
+    ports()[port] = ntohs(address.sin_port);
+}
+
+// The next client waiting to be accepted, an empty client if there isn't one
+WiFiClient WiFiServer::available()
+{
+    int client = listener < 0 ? -1 : accept(listener, nullptr, nullptr);
+    if (client < 0)
+    {
+        return WiFiClient();
+    }
+    int noDelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return WiFiClient(client);
+}
+
+bool WiFiClass::mode(wifi_mode_t mode)
+{
+    (void)mode;
+    return true;
+}
+
+bool WiFiClass::setAutoReconnect(bool enabled)
+{
+    (void)enabled;
+    return true;
+}
+
+wl_status_t WiFiClass::begin(const char *ssid, const char *key)
+{
+    (void)ssid;
+    (void)key;
+    return WL_DISCONNECTED;
+}
+
+wl_status_t WiFiClass::status()
+{
+    return WL_DISCONNECTED;
+}
+
+bool WiFiClass::disconnect()
+{
+    return true;
+}
+
+bool WiFiClass::softAP(const char *ssid, const char *key)
+{
+    (void)ssid;
+    (void)key;
+    return true;
+}
+
+bool WiFiClass::softAPdisconnect()
+{
+    return true;
+}
+
+IPAddress WiFiClass::softAPIP()
+{
+    return softAPAddress;
+}
@@ -0,0 +1,111 @@
+#include <atomic>
+#include <chrono>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <sim.h>
+
+#include "circularBuffer.h"
+#include "m_error.h"
+#include "test.h"
+
+// The event que between threads, with the other side on a real pthread task
+
+namespace
+{
+    constexpr int eventCount = 50; // fewer than the que holds, a full que is a fatal error
+    int received[eventCount];
+    int receivedCount = 0;
+
+    void receive(const EventParam *params)
+    {
+        received[receivedCount++] = params[0].i;
+    }
+
+    void producer(void *parameters)
+    {
+        (void)parameters;
+        for (int i = 0; i < eventCount; i++)
+        {
+            PushEvent(receive, i);
+            vTaskDelay(0);
+        }
+        vTaskDelay(portMAX_DELAY);
+    }
+
+    void eventsArriveInOrder()
+    {
+        TaskHandle_t task = nullptr;
+        CHECK_EQUAL(pdPASS, xTaskCreatePinnedToCore(producer, "producer", 4096, nullptr, 1, &task, 1));
+        CHECK(task != nullptr && task != xTaskGetCurrentTaskHandle());
+
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (receivedCount < eventCount && std::chrono::steady_clock::now() < deadline)
+        {
+            Event e;
+            while (PopEvent(&e))
+            {
+                RunEvent(e);
+            }
+        }
+        CHECK_EQUAL(eventCount, receivedCount);
+        for (int i = 0; i < receivedCount; i++)
+        {
+            CHECK_EQUAL(i, received[i]);
+        }
+        CHECK_EQUAL(0, EventQueLength());
+        CHECK(!isErrorLocked());
+    }
+
+    QueueHandle_t numbers;
+
+    void echo(void *parameters)
+    {
+        (void)parameters;
+        uint32_t value;
+        while (xQueueReceive(numbers, &value, portMAX_DELAY) == pdTRUE && value != 0)
+        {
+        }
+        vTaskDelay(portMAX_DELAY);
+    }
+
+    void queueBlocksUntilThereIsRoom()
+    {
+        numbers = xQueueCreate(2, sizeof(uint32_t));
+        uint32_t value = 7;
+        CHECK_EQUAL(pdTRUE, xQueueSend(numbers, &value, 0));
+        CHECK_EQUAL(pdTRUE, xQueueSend(numbers, &value, 0));
+        CHECK_EQUAL(pdFALSE, xQueueSend(numbers, &value, 0)); // full, doesn't wait
+        CHECK_EQUAL(2, uxQueueMessagesWaiting(numbers));
+
+        // The consumer empties it so a waiting send gets through
+        CHECK_EQUAL(pdPASS, xTaskCreatePinnedToCore(echo, "echo", 4096, nullptr, 1, nullptr, 1));
+        for (uint32_t i = 1; i <= 20; i++)
+        {
+            value = i == 20 ? 0 : i;
+            CHECK_EQUAL(pdTRUE, xQueueSend(numbers, &value, 5000));
+        }
+    }
+
+    void mutexExcludes()
+    {
+        SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+        CHECK_EQUAL(pdTRUE, xSemaphoreTake(mutex, portMAX_DELAY));
+        CHECK_EQUAL(pdFALSE, xSemaphoreTake(mutex, 0));
+        CHECK_EQUAL(pdFALSE, xSemaphoreTake(mutex, 10)); // times out in real time
+        CHECK_EQUAL(pdTRUE, xSemaphoreGive(mutex));
+        CHECK_EQUAL(pdTRUE, xSemaphoreTake(mutex, 0));
+        xSemaphoreGive(mutex);
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+    InitBuffer();
+
+    RUN_TEST(eventsArriveInOrder);
+    RUN_TEST(queueBlocksUntilThereIsRoom);
+    RUN_TEST(mutexExcludes);
+    return test::finish();
+}
@@ -0,0 +1,70 @@
+#include "histogram.h"
+#include "test.h"
+
+namespace
+{
+    void bucketsCoverEveryValue()
+    {
+        // Every value lands in the bucket whose bound is at or above it and whose last bound is below it
+        const uint32_t values[] = {0, 1, 3, 4, 5, 7, 8, 100, 1000, 65535, 65536, 1234567, 0x7FFFFFFF, 0xFFFFFFFF};
+        for (uint32_t value : values)
+        {
+            unsigned int index = histogram::bucketIndex(value);
+            CHECK(index < histogram::bucketCount);
+            CHECK(histogram::bucketUpperBound(index) >= value);
+            if (index > 0)
+            {
+                CHECK(histogram::bucketUpperBound(index - 1) < value);
+            }
+        }
+        CHECK_EQUAL(histogram::bucketCount - 1, histogram::bucketIndex(0xFFFFFFFF));
+    }
+
+    void boundsRiseByAQuarter()
+    {
+        for (unsigned int i = histogram::subBuckets * 2; i < histogram::bucketCount; i++)
+        {
+            uint64_t lower = (uint64_t)histogram::bucketUpperBound(i - 1) + 1;
+            uint64_t width = (uint64_t)histogram::bucketUpperBound(i) - lower + 1;
+            CHECK(width * 4 <= lower);
+        }
+    }
+
+    void percentilesWithinABucket()
+    {
+        histogram h;
+        for (uint32_t value = 1; value <= 1000; value++)
+        {
+            h.record(value);
+        }
+        CHECK_EQUAL(1000, h.count());
+        CHECK_EQUAL(1000, h.max());
+        CHECK_EQUAL(500500, h.valueSum());
+
+        uint32_t p50 = h.percentile(0.5f);
+        uint32_t p99 = h.percentile(0.99f);
+        CHECK(p50 >= 500 && p50 <= 625);
+        CHECK(p99 >= 990 && p99 <= 1000); // clamped to the largest value seen
+        CHECK_EQUAL(1000, h.percentile(1.0f));
+    }
+
+    void emptyAndReset()
+    {
+        histogram h;
+        CHECK_EQUAL(0, h.percentile(0.5f));
+        h.record(42);
+        h.reset();
+        CHECK_EQUAL(0, h.count());
+        CHECK_EQUAL(0, h.max());
+        CHECK_EQUAL(0, h.percentile(0.99f));
+    }
+} // namespace
+
+int main()
+{
+    RUN_TEST(bucketsCoverEveryValue);
+    RUN_TEST(boundsRiseByAQuarter);
+    RUN_TEST(percentilesWithinABucket);
+    RUN_TEST(emptyAndReset);
+    return test::finish();
+}
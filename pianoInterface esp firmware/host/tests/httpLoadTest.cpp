@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <netinet/in.h>
+#include <sim.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "circularBuffer.h"
+#include "httpServer.h"
+#include "lighting/lighting.h"
+#include "m_error.h"
+#include "memoryStats.h"
+#include "music.h"
+#include "network.h"
+#include "pinaoCom.h"
+#include "settings.h"
+#include "test.h"
+
+// The HTTP server under load from local stand-in clients, with the render loop, the MIDI
+// thread and the network thread split the same way as on the device. MIDI polling must keep
+// its pace whatever the clients do, every change a request makes reaches the render loop
+// through the event que, and handling a request never touches the heap.
+
+namespace
+{
+    typedef std::chrono::steady_clock realClock;
+
+    std::atomic<bool> running(true);
+    std::atomic<bool> clockRunning(true);
+    std::atomic<bool> renderStalled(false); // THREAD 0 held up, as it is in a BlinkSuccess
+    std::atomic<long long> longestMidiGapMicros(0);
+    std::atomic<unsigned int> midiPolls(0);
+
+    struct response
+    {
+        int code;
+        std::string body;
+    };
+
+    int connectToServer()
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(sim::getServerPort(http::port));
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Sends the request in pieces with a pause after each, then reads until the server closes
+    response send(const std::string &request, size_t pieceSize = 0, unsigned int pauseMicros = 0)
+    {
+        response r = {0, ""};
+        int fd = connectToServer();
+        if (fd < 0)
+        {
+            return r;
+        }
+        pieceSize = pieceSize == 0 ? request.size() : pieceSize;
+        for (size_t sent = 0; sent < request.size(); sent += pieceSize)
+        {
+            size_t length = std::min(pieceSize, request.size() - sent);
+            if (::send(fd, request.data() + sent, length, MSG_NOSIGNAL) != (ssize_t)length)
+            {
+                break;
+            }
+            if (pauseMicros != 0)
+            {
+                usleep(pauseMicros);
+            }
+        }
+        std::string received;
+        char buffer[512];
+        ssize_t count;
+        while ((count = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+        {
+            received.append(buffer, count);
+        }
+        close(fd);
+
+        if (received.compare(0, 9, "HTTP/1.1 ") == 0)
+        {
+            r.code = atoi(received.c_str() + 9);
+        }
+        size_t bodyStart = received.find("\r\n\r\n");
+        r.body = bodyStart == std::string::npos ? "" : received.substr(bodyStart + 4);
+        return r;
+    }
+
+    response get(const std::string &path)
+    {
+        return send("GET " + path + " HTTP/1.1\r\nHost: piano\r\n\r\n");
+    }
+
+    // One chord per frame in the upload format
+    std::string songBody(unsigned int frames)
+    {
+        std::string body;
+        for (unsigned int i = 0; i < frames; i++)
+        {
+            body += static_cast<char>(i % _PIANOSIZE);
+            body += static_cast<char>(((i + 7) % _PIANOSIZE) | music::handBit);
+            body += static_cast<char>(music::frameEndMarker);
+        }
+        return body;
+    }
+
+    response upload(const char *name, unsigned int frames, size_t pieceSize = 0, unsigned int pauseMicros = 0)
+    {
+        std::string body = songBody(frames);
+        std::string request = "POST /uploadSong?name=" + std::string(name) + "&frames=" + std::to_string(frames) +
+                              "&notes=" + std::to_string(frames * 2) + " HTTP/1.1\r\nHost: piano\r\nContent-Length: " +
+                              std::to_string(body.size()) + "\r\n\r\n" + body;
+        response r;
+        while ((r = send(request, pieceSize, pauseMicros)).code == 503)
+        {
+            usleep(1000); // the render loop hasn't taken the last song yet
+        }
+        return r;
+    }
+
+    bool waitForSong(const char *name)
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            if (get("/getSongName").body == name)
+            {
+                return true;
+            }
+            usleep(1000);
+        }
+        return false;
+    }
+
+    // Nothing here allocates, so the count for the request is the server's alone
+    int sendWithoutAllocating(const char *request)
+    {
+        int fd = connectToServer();
+        if (fd < 0 || ::send(fd, request, strlen(request), MSG_NOSIGNAL) != (ssize_t)strlen(request))
+        {
+            close(fd);
+            return 0;
+        }
+        char received[4096];
+        size_t length = 0;
+        ssize_t count;
+        while (length < sizeof(received) - 1 && (count = recv(fd, received + length, sizeof(received) - 1 - length, 0)) > 0)
+        {
+            length += count;
+        }
+        close(fd);
+        received[length] = '\0';
+        return strncmp(received, "HTTP/1.1 ", 9) == 0 ? atoi(received + 9) : 0;
+    }
+
+    void mallocIsCounted()
+    {
+        CHECK(memoryStats::countsMalloc());
+        uint32_t before = memoryStats::allocationCount();
+        void *block = malloc(16);
+        block = realloc(block, 32);
+        free(block);
+        CHECK_EQUAL(2, memoryStats::allocationCount() - before);
+    }
+
+    void requestsDoNotAllocate()
+    {
+        const char *requests[] = {"GET /getSongIndex HTTP/1.1\r\n\r\n",
+                                  "GET /getSettings?setting=3 HTTP/1.1\r\n\r\n",
+                                  "GET /changeFloatSetting?setting=0&value=0.25 HTTP/1.1\r\n\r\n",
+                                  "GET /metrics HTTP/1.1\r\n\r\n",
+                                  "GET /getLatencyStats HTTP/1.1\r\n\r\n",
+                                  "GET /nothingHere HTTP/1.1\r\n\r\n"};
+        for (const char *request : requests)
+        {
+            CHECK(sendWithoutAllocating(request) != 0);
+            if (http::getLastRequestAllocations() != 0)
+            {
+                printf("%u allocations for %s", http::getLastRequestAllocations(), request);
+            }
+            CHECK_EQUAL(0, http::getLastRequestAllocations());
+        }
+    }
+
+    void manyClientsAtOnce()
+    {
+        const char *paths[] = {"/getSongIndex", "/getSettings?setting=0", "/metrics", "/getStatus",
+                               "/changeFloatSetting?setting=0&value=0.5", "/nothingHere"};
+        std::atomic<unsigned int> served(0);
+        std::atomic<unsigned int> wrong(0);
+        std::vector<std::thread> clients;
+        for (unsigned int c = 0; c < 6; c++)
+        {
+            clients.emplace_back([&, c]() {
+                for (unsigned int i = 0; i < 40; i++)
+                {
+                    unsigned int route = (c + i) % (sizeof(paths) / sizeof(paths[0]));
+                    response r = get(paths[route]);
+                    (r.code == (route == 5 ? 404 : 200) ? served : wrong)++;
+                }
+            });
+        }
+        for (std::thread &client : clients)
+        {
+            client.join();
+        }
+        CHECK_EQUAL(240, served.load());
+        CHECK_EQUAL(0, wrong.load());
+    }
+
+    // The song goes in while other clients keep asking for the song index
+    void uploadUnderLoad()
+    {
+        std::atomic<bool> polling(true);
+        std::thread poller([&]() {
+            while (polling.load())
+            {
+                get("/getSongIndex");
+            }
+        });
+        CHECK_EQUAL(200, upload("loaded", 4000).code);
+        polling.store(false);
+        poller.join();
+
+        CHECK(waitForSong("loaded"));
+        CHECK_EQUAL(4000, music::frameCount());
+        CHECK(get("/setAnimationMode?mode=5").code == 200); // Waiting
+        CHECK(!isErrorLocked());
+    }
+
+    // A client which takes its time sending a song holds up the network thread for the whole
+    // request, but MIDI is polled by its own thread and must not notice
+    void slowClientDoesNotHoldUpMidi()
+    {
+        longestMidiGapMicros.store(0);
+        unsigned int pollsBefore = midiPolls.load();
+        realClock::time_point start = realClock::now();
+        CHECK_EQUAL(200, upload("slow", 300, 40, 2000).code);
+        long long requestMicros = std::chrono::duration_cast<std::chrono::microseconds>(realClock::now() - start).count();
+
+        CHECK(requestMicros > 30000);
+        CHECK(midiPolls.load() - pollsBefore > 10);
+        CHECK(longestMidiGapMicros.load() < requestMicros / 2);
+        printf("slow upload took %lldms, longest gap between MIDI polls %lldms\n", requestMicros / 1000, longestMidiGapMicros.load() / 1000);
+        CHECK(waitForSong("slow"));
+        CHECK(!isErrorLocked());
+    }
+    // Writes pile up while the render loop is held up. Once the event que is full they are turned
+    // away with 503 instead of locking up the device, and go through again once it catches up.
+    void fullEventQueueIsBusy()
+    {
+        renderStalled.store(true);
+        unsigned int ok = 0;
+        unsigned int busy = 0;
+        for (unsigned int i = 0; i < eventBufferSize + 20; i++)
+        {
+            int code = get("/changeSetting?setting=0&A=" + std::to_string(i % 200) + "&B=2&C=3").code;
+            (code == 200 ? ok : busy)++;
+            CHECK(code == 200 || code == 503);
+        }
+        CHECK_EQUAL(eventBufferSize, (unsigned int)EventQueLength());
+        CHECK(ok <= eventBufferSize);
+        CHECK(busy >= 20);
+        CHECK_EQUAL(503, get("/setAnimationMode?mode=1").code);
+        CHECK(!isErrorLocked());
+
+        renderStalled.store(false);
+        for (int i = 0; i < 1000 && EventQueLength() != 0; i++)
+        {
+            usleep(1000);
+        }
+        CHECK_EQUAL(200, get("/changeSetting?setting=0&A=7&B=2&C=3").code);
+        CHECK(!isErrorLocked());
+    }
+
+    // Arguments used to be cut down to their field as they were, A=256 set the red channel to 0
+    void outOfRangeArgsAreRejected()
+    {
+        CHECK_EQUAL(400, get("/changeSetting?setting=0&A=256&B=2&C=3").code);
+        CHECK_EQUAL(400, get("/changeSetting?setting=0&A=-1&B=2&C=3").code);
+        CHECK_EQUAL(400, get("/setSongIndex?index=65536").code);
+        CHECK_EQUAL(200, get("/changeSetting?setting=0&A=255&B=2&C=3").code);
+        CHECK_EQUAL(200, get("/setSongIndex?index=0").code);
+        CHECK(!isErrorLocked());
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+    sim::setMicros(1000000);
+    settings::init();
+    lights::init();
+    InitBuffer();
+    MIDI::setLogicalLayerEnable(true);
+    network::startServer();
+
+    // THREAD 0, the same steps as loop()
+    std::thread render([]() {
+        while (running.load())
+        {
+            if (!isErrorLocked() && !renderStalled.load())
+            {
+                Event e;
+                while (PopEvent(&e))
+                {
+                    RunEvent(e);
+                }
+                MIDI::copyLogicalStateBuffer();
+                lights::updateAnimation();
+            }
+            usleep(200);
+        }
+    });
+    // Four times real time, so waits inside events end quickly and requests still time out late
+    std::thread clock([]() {
+        while (clockRunning.load())
+        {
+            sim::advanceMicros(1000);
+            usleep(250);
+        }
+    });
+    // THREAD 1, a key pressed or released every poll
+    std::thread midi([]() {
+        realClock::time_point last = realClock::now();
+        for (unsigned int i = 0; running.load(); i++)
+        {
+            const uint8_t packet[4] = {9, static_cast<uint8_t>(i % 2 ? 0x80 : 0x90), static_cast<uint8_t>(MIDI::noteNumberOffset + (i / 2) % _PIANOSIZE), 64};
+            MIDI::handlePacket(packet, micros());
+            midiPolls++;
+
+            realClock::time_point now = realClock::now();
+            long long gap = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+            last = now;
+            if (gap > longestMidiGapMicros.load())
+            {
+                longestMidiGapMicros.store(gap);
+            }
+            delay(1);
+        }
+    });
+    // NETWORK THREAD
+    std::thread network([]() {
+        while (running.load())
+        {
+            network::pollEvents();
+            delay(1);
+        }
+    });
+
+    RUN_TEST(mallocIsCounted);
+    RUN_TEST(requestsDoNotAllocate);
+    RUN_TEST(manyClientsAtOnce);
+    RUN_TEST(uploadUnderLoad);
+    RUN_TEST(slowClientDoesNotHoldUpMidi);
+    RUN_TEST(fullEventQueueIsBusy);
+    RUN_TEST(outOfRangeArgsAreRejected);
+
+    running.store(false);
+    network.join();
+    midi.join();
+    render.join(); // may be waiting out a BlinkSuccess, so the clock stops last
+    clockRunning.store(false);
+    clock.join();
+    return test::finish();
+}
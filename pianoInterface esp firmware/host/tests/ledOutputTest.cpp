@@ -0,0 +1,354 @@
+#include <sim.h>
+#include <string.h>
+
+#include "lighting/LEDCom.h"
+#include "lighting/gamma.h"
+#include "lighting/segments.h"
+#include "m_constants.h"
+#include "settings.h"
+#include "test.h"
+
+// The output stage: key to LED layout, segments, gamma and white extraction and the current estimate
+
+namespace
+{
+    uint8_t frame[_LEDCOUNT * 4];
+
+    void clearKeys()
+    {
+        LEDCom::setAll({0.0f, 0.0f, 0.0f});
+        LEDCom::updateLEDS();
+    }
+
+    // The frame as it went out, GRBW per LED
+    const uint8_t *shownLed(unsigned int led)
+    {
+        sim::copyShownFrame(frame, sizeof(frame));
+        return frame + led * 4;
+    }
+
+    void segmentsMakeOneStripEach()
+    {
+        CHECK_EQUAL(segments::count, sim::stripCount());
+        unsigned int leds = 0;
+        for (unsigned int s = 0; s < sim::stripCount(); s++)
+        {
+            CHECK_EQUAL(segments::layout[s].pin, sim::getStrip(s).getPin());
+            CHECK_EQUAL(segments::layout[s].ledCount, sim::getStrip(s).getPixelCount());
+            CHECK_EQUAL(leds, segments::firstLed(s));
+            leds += sim::getStrip(s).getPixelCount();
+        }
+        CHECK_EQUAL(_LEDCOUNT, leds);
+    }
+
+    void transferTimeIsTheLongestSegment()
+    {
+        uint16_t longest = 0;
+        for (unsigned int s = 0; s < segments::count; s++)
+        {
+            longest = segments::layout[s].ledCount > longest ? segments::layout[s].ledCount : longest;
+        }
+        CHECK_EQUAL(30 * 40 + 80, segments::transferMicros(30));
+        CHECK_EQUAL(segments::transferMicros(longest), segments::frameTransferMicros());
+        CHECK_EQUAL(segments::frameTransferMicros(), LEDCom::getFrameTransferMicros());
+    }
+
+    // Which strip and pixel a lit LED went out on, for a frame with only that LED lit
+    bool shownOn(unsigned int segment, unsigned int pixel)
+    {
+        unsigned int lit = 0;
+        for (unsigned int s = 0; s < sim::stripCount(); s++)
+        {
+            const sim::strip &strip = sim::getStrip(s);
+            for (size_t i = 0; i < strip.size(); i++)
+            {
+                lit += strip.shownPixels()[i] != 0;
+            }
+        }
+        return lit == 1 && sim::getStrip(segment).shownPixels()[pixel * 4 + 1] == 255;
+    }
+
+    // The LEDs either side of every segment boundary go out on the right strip, whether they are
+    // written by the output stage or by the error overlay
+    void segmentBoundaries()
+    {
+        LEDCom::setLayout({0, 16, 0});
+        for (unsigned int s = 0; s < segments::count; s++)
+        {
+            const unsigned int first = segments::firstLed(s);
+            const unsigned int last = first + segments::layout[s].ledCount - 1;
+            const unsigned int keys[] = {first, last};
+            for (unsigned int key : keys)
+            {
+                clearKeys();
+                LEDCom::setColor(key, 255, 0, 0);
+                LEDCom::updateLEDS();
+                CHECK(shownOn(s, key - first));
+            }
+        }
+        clearKeys();
+
+        for (unsigned int bit = 0; bit < 8; bit++)
+        {
+            unsigned int s = 0;
+            while (bit >= segments::firstLed(s) + segments::layout[s].ledCount)
+            {
+                s++;
+            }
+            LEDCom::setErrorCode(1 << bit);
+            LEDCom::setColor(0, 0, 0, 0); // something to send
+            LEDCom::updateLEDS();
+            CHECK_EQUAL(255, sim::getStrip(s).shownPixels()[(bit - segments::firstLed(s)) * 4 + 2]);
+        }
+        LEDCom::setErrorCode(0);
+        LEDCom::setLayout(settings::getPalette().layout);
+        clearKeys();
+    }
+
+    void defaultLayoutRunsFromTheTopKey()
+    {
+        LEDCom::setLayout({_LEDCOUNT - 1, 16, 1});
+        clearKeys();
+        LEDCom::setColor(0, 255, 0, 0);
+        LEDCom::updateLEDS();
+
+        const uint8_t *lowest = shownLed(_LEDCOUNT - 1);
+        CHECK_EQUAL(0, lowest[0]);
+        CHECK_EQUAL(255, lowest[1]);
+        CHECK_EQUAL(0, lowest[2]);
+        CHECK_EQUAL(0, lowest[3]);
+        CHECK_EQUAL(0, shownLed(0)[1]);
+    }
+
+    void twoLedsPerKey()
+    {
+        LEDCom::setLayout({0, 32, 0});
+        CHECK_EQUAL(0, LEDCom::getKeySpan(0).first);
+        CHECK_EQUAL(2, LEDCom::getKeySpan(0).count);
+        CHECK_EQUAL(10, LEDCom::getKeySpan(5).first);
+        CHECK_EQUAL(0, LEDCom::getKeySpan(_KEYCOUNT - 1).count); // past the end of the strip
+
+        clearKeys();
+        LEDCom::setColor(5, 0, 0, 255);
+        LEDCom::updateLEDS();
+        CHECK_EQUAL(255, shownLed(10)[2]);
+        CHECK_EQUAL(255, shownLed(11)[2]);
+        CHECK_EQUAL(0, shownLed(12)[2]);
+
+        LEDCom::setLayout(settings::getPalette().layout);
+    }
+
+    // Stream pixels are in strip order, so the first one is the LED at the start of the strip
+    // which the default layout puts under the highest key
+    void streamPixelsInStripOrder()
+    {
+        clearKeys();
+        uint8_t rgb[_LEDCOUNT * 3] = {};
+        rgb[0] = 255;
+        rgb[(_LEDCOUNT - 1) * 3 + 2] = 255;
+        LEDCom::writePixels(rgb, _LEDCOUNT);
+        LEDCom::updateLEDS();
+        CHECK_EQUAL(255, shownLed(0)[1]);
+        CHECK_EQUAL(0, shownLed(0)[2]);
+        CHECK_EQUAL(255, shownLed(_LEDCOUNT - 1)[2]);
+        CHECK_EQUAL(0, shownLed(1)[1]);
+        CHECK(LEDCom::getColor(_KEYCOUNT - 1).r == 1.0f);
+        CHECK(LEDCom::getColor(0).b == 1.0f);
+        clearKeys();
+    }
+
+    void whiteGoesToTheWhiteDie()
+    {
+        clearKeys();
+        LEDCom::setColor(3, 255, 255, 255);
+        LEDCom::updateLEDS();
+        const uint8_t *led = shownLed(LEDCom::getKeySpan(3).first);
+        CHECK_EQUAL(0, led[0]);
+        CHECK_EQUAL(0, led[1]);
+        CHECK_EQUAL(0, led[2]);
+        CHECK_EQUAL(255, led[3]);
+    }
+
+    void gammaDarkensTheMiddle()
+    {
+        clearKeys();
+        LEDCom::setColor(3, 128, 0, 0);
+        LEDCom::updateLEDS();
+        uint8_t red = shownLed(LEDCom::getKeySpan(3).first)[1];
+        CHECK(red > 0 && red < 100);
+    }
+
+    // A level between two strip values is dithered over frames and the strip keeps being sent
+    // while it is. Over 256 frames the shown values add up to exactly the 8.8 level.
+    void ditheringAveragesToTheLevel()
+    {
+        const float reds[] = {0.03f, 0.1f, 0.37f};
+        unsigned int fractional = 0;
+        for (float red : reds)
+        {
+            clearKeys();
+            LEDCom::setColor(3, colorF{red, 0.0f, 0.0f});
+            const uint32_t level = gammaCorrection::lut::values[(int)(red * gammaCorrection::maxIndex + 0.5f)];
+            fractional += (level & 0xFF) != 0;
+
+            const unsigned int led = LEDCom::getKeySpan(3).first;
+            const uint32_t shows = sim::getStrip(0).getShowCount();
+            uint32_t sum = 0;
+            for (unsigned int frame = 0; frame < 256; frame++)
+            {
+                LEDCom::updateLEDS();
+                sum += shownLed(led)[1];
+            }
+            CHECK_EQUAL(level, sum);
+            if (level & 0xFF)
+            {
+                CHECK_EQUAL(shows + 256, sim::getStrip(0).getShowCount());
+            }
+        }
+        CHECK(fractional != 0);
+        clearKeys();
+    }
+
+    void currentEstimate()
+    {
+        // Red and blue at full on every LED, the most current any one color can draw once white is extracted
+        LEDCom::setAll({1.0f, 0.0f, 1.0f});
+        LEDCom::updateLEDS();
+        CHECK_EQUAL(_LEDCOUNT * (_PIXEL_IDLE_MILLIAMPS + 2 * _CHANNEL_MILLIAMPS), LEDCom::getEstimatedMilliamps());
+        CHECK(LEDCom::getPowerScale() == 1.0f); // still within budget
+
+        clearKeys();
+        CHECK_EQUAL(_LEDCOUNT * _PIXEL_IDLE_MILLIAMPS, LEDCom::getEstimatedMilliamps());
+    }
+
+    // Current of the frame as it went out, from the strip bytes rather than the estimate
+    uint32_t shownMilliamps()
+    {
+        sim::copyShownFrame(frame, sizeof(frame));
+        uint32_t total = 0;
+        for (uint8_t value : frame)
+        {
+            total += value;
+        }
+        return _LEDCOUNT * _PIXEL_IDLE_MILLIAMPS + total * _CHANNEL_MILLIAMPS / 255;
+    }
+
+    // The frame which first goes over the budget is already dimmed to fit
+    void limitDropsAtOnce()
+    {
+        clearKeys();
+        LEDCom::setPowerBudget(1000);
+        LEDCom::setAll({1.0f, 0.0f, 1.0f});
+        LEDCom::updateLEDS();
+        CHECK(LEDCom::getPowerScale() < 0.3f);
+        CHECK(LEDCom::getEstimatedMilliamps() <= 1000);
+        CHECK(LEDCom::getEstimatedMilliamps() > 990);
+        LEDCom::setPowerBudget(_POWER_BUDGET_MILLIAMPS);
+        clearKeys();
+    }
+
+    // Whatever the keys show, no frame goes out over the budget. Dithering can put a die one
+    // step above its level for a frame, which is all the shown current may be over by.
+    void neverOverBudget()
+    {
+        constexpr uint32_t budget = 1500;
+        constexpr uint32_t ditherSlack = _LEDCOUNT * 4 * _CHANNEL_MILLIAMPS / 255 + 1;
+        LEDCom::setPowerBudget(budget);
+        uint32_t overBudget = 0;
+        for (unsigned int frame = 0; frame < 400; frame++)
+        {
+            // Bright and dark stretches so the limit both engages and lets go
+            const float bright = (frame / 50) % 2 ? 1.0f : 0.1f;
+            for (unsigned int key = 0; key < _KEYCOUNT; key++)
+            {
+                const unsigned int level = (frame * 7 + key * 13) & 0xFF;
+                LEDCom::setColor(key, colorF{level / 255.0f, (255 - level) / 255.0f, ((level * 5) & 0xFF) / 255.0f} * bright);
+            }
+            LEDCom::updateLEDS();
+            if (LEDCom::getEstimatedMilliamps() > budget || shownMilliamps() > budget + ditherSlack)
+            {
+                overBudget++;
+            }
+        }
+        CHECK_EQUAL(0, overBudget);
+        LEDCom::setPowerBudget(_POWER_BUDGET_MILLIAMPS);
+        clearKeys();
+    }
+
+    // Once the frame fits again the scale moves a sixteenth of the way back up every frame,
+    // and the strip keeps being sent while it does even though no key changes
+    void limitRecoversGradually()
+    {
+        LEDCom::setPowerBudget(1000);
+        LEDCom::setAll({1.0f, 0.0f, 1.0f});
+        LEDCom::updateLEDS();
+        uint32_t scale = (uint32_t)(LEDCom::getPowerScale() * 65536.0f);
+        CHECK(scale < 65536);
+
+        LEDCom::setAll({0.1f, 0.0f, 0.0f});
+        unsigned int frames = 0;
+        while (scale < 65536 && frames < 1000)
+        {
+            uint32_t shows = sim::getStrip(0).getShowCount();
+            LEDCom::updateLEDS();
+            uint32_t expected = scale + ((65536 - scale + 15) >> 4);
+            scale = (uint32_t)(LEDCom::getPowerScale() * 65536.0f);
+            CHECK_EQUAL(expected, scale);
+            CHECK_EQUAL(shows + 1, sim::getStrip(0).getShowCount());
+            frames++;
+        }
+        CHECK(frames > 16 && frames < 300);
+        CHECK(LEDCom::getPowerScale() == 1.0f);
+        LEDCom::setPowerBudget(_POWER_BUDGET_MILLIAMPS);
+        clearKeys();
+    }
+
+    void nothingChangedNothingSent()
+    {
+        clearKeys();
+        for (int i = 0; i < 200; i++)
+        {
+            LEDCom::updateLEDS(); // let the limiter and dithering settle
+        }
+        uint32_t shows = sim::getStrip(0).getShowCount();
+        LEDCom::updateLEDS();
+        CHECK_EQUAL(shows, sim::getStrip(0).getShowCount());
+    }
+
+    // The key to light latency is only taken for frames which change what the strip shows
+    void showSaysIfAnythingChanged()
+    {
+        clearKeys();
+        LEDCom::setColor(3, 255, 0, 0);
+        CHECK(LEDCom::updateLEDS());
+        LEDCom::setColor(3, 255, 0, 0); // sent again, but the same
+        CHECK(!LEDCom::updateLEDS());
+        CHECK(!LEDCom::updateLEDS()); // nothing sent
+        LEDCom::setColor(3, 0, 0, 0);
+        CHECK(LEDCom::updateLEDS());
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+    settings::init();
+    LEDCom::stripInit();
+
+    RUN_TEST(segmentsMakeOneStripEach);
+    RUN_TEST(transferTimeIsTheLongestSegment);
+    RUN_TEST(segmentBoundaries);
+    RUN_TEST(defaultLayoutRunsFromTheTopKey);
+    RUN_TEST(twoLedsPerKey);
+    RUN_TEST(streamPixelsInStripOrder);
+    RUN_TEST(whiteGoesToTheWhiteDie);
+    RUN_TEST(gammaDarkensTheMiddle);
+    RUN_TEST(ditheringAveragesToTheLevel);
+    RUN_TEST(currentEstimate);
+    RUN_TEST(limitDropsAtOnce);
+    RUN_TEST(neverOverBudget);
+    RUN_TEST(limitRecoversGradually);
+    RUN_TEST(nothingChangedNothingSent);
+    RUN_TEST(showSaysIfAnythingChanged);
+    return test::finish();
+}
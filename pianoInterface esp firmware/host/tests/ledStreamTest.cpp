@@ -0,0 +1,218 @@
+#include <atomic>
+#include <sim.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "circularBuffer.h"
+#include "commands.h"
+#include "ledStream.h"
+#include "lighting/LEDCom.h"
+#include "lighting/lighting.h"
+#include "m_constants.h"
+#include "settings.h"
+#include "test.h"
+
+// DDP frames coming in at 100 frames a second while the render loop shows them in the Stream
+// mode. Each frame goes out in two packets the way a renderer splits a strip, and frames with
+// a packet missing must never reach the strip.
+
+namespace
+{
+    constexpr unsigned int frameBytes = _LEDCOUNT * 3;
+    constexpr unsigned int packetBytes = frameBytes / 2;
+    constexpr uint32_t senderClockAhead = 123456789; // the sender's clock has nothing to do with ours
+
+    std::atomic<bool> running(true);
+    std::atomic<bool> clockRunning(true);
+    uint8_t sequence = 0;
+
+    // Sender micros as a DDP timecode, seconds in 16.16
+    uint32_t timecode(uint32_t senderMicros)
+    {
+        return (senderMicros / 1000000) << 16 | (uint32_t)((uint64_t)(senderMicros % 1000000) * 65536 / 1000000);
+    }
+
+    // Sends a frame with every byte set to value. A skipped packet still uses up its sequence number.
+    void sendFrame(uint8_t value, bool timed, uint32_t senderMicros, int skippedPacket = -1)
+    {
+        for (unsigned int p = 0; p < 2; p++)
+        {
+            sequence = sequence % 15 + 1;
+            if ((int)p == skippedPacket)
+            {
+                continue;
+            }
+            const uint32_t offset = p * packetBytes;
+            std::vector<uint8_t> packet = {static_cast<uint8_t>(0x40 | (timed ? 0x10 : 0) | (p == 1 ? 0x01 : 0)), sequence, 0x0B, 1,
+                                           0, 0, static_cast<uint8_t>(offset >> 8), static_cast<uint8_t>(offset & 0xFF),
+                                           static_cast<uint8_t>(packetBytes >> 8), static_cast<uint8_t>(packetBytes & 0xFF)};
+            if (timed)
+            {
+                const uint32_t code = timecode(senderMicros);
+                packet.insert(packet.end(), {static_cast<uint8_t>(code >> 24), static_cast<uint8_t>(code >> 16),
+                                             static_cast<uint8_t>(code >> 8), static_cast<uint8_t>(code)});
+            }
+            packet.insert(packet.end(), packetBytes, value);
+            sim::sendUdpPacket(ledStream::port, packet.data(), packet.size());
+        }
+    }
+
+    uint32_t senderNow()
+    {
+        return (uint32_t)sim::getMicros() + senderClockAhead;
+    }
+
+    // Waits for the network thread to read everything and the render loop to show it
+    bool waitForShown(uint32_t frames)
+    {
+        for (int i = 0; i < 2000; i++)
+        {
+            if (sim::getUdpPacketsWaiting() == 0 && ledStream::getStats().framesShown >= frames)
+            {
+                usleep(2000); // and anything it was about to show
+                return true;
+            }
+            usleep(1000);
+        }
+        return false;
+    }
+
+    std::vector<uint8_t> shownFrame()
+    {
+        std::vector<uint8_t> frame(_LEDCOUNT * 4);
+        sim::copyShownFrame(frame.data(), frame.size());
+        return frame;
+    }
+
+    void everyFrameShownAt100fps()
+    {
+        ledStream::resetStats();
+        for (unsigned int i = 0; i < 200; i++)
+        {
+            sendFrame(i & 0xFF, true, senderNow());
+            usleep(10000);
+        }
+        CHECK(waitForShown(200));
+
+        ledStream::streamStats stats = ledStream::getStats();
+        CHECK_EQUAL(400, stats.packetsRecieved);
+        CHECK_EQUAL(0, stats.packetsLost);
+        CHECK_EQUAL(200, stats.framesRecieved);
+        CHECK_EQUAL(0, stats.framesIncomplete);
+        CHECK_EQUAL(0, stats.framesLate);
+        CHECK_EQUAL(200, stats.framesShown);
+        CHECK(stats.latencyMaxMicros < 10000);
+        printf("latency average %uus, max %uus\n", stats.latencyAverageMicros, stats.latencyMaxMicros);
+    }
+
+    // A frame missing a packet is dropped whole and the last whole frame stays up
+    void incompleteFramesDropped()
+    {
+        ledStream::resetStats();
+        sendFrame(200, true, senderNow());
+        CHECK(waitForShown(1));
+        const std::vector<uint8_t> before = shownFrame();
+
+        sendFrame(50, true, senderNow(), 0); // the first half never comes
+        usleep(20000);
+        sendFrame(60, true, senderNow(), 1); // the push never comes, it runs into the next frame
+        sendFrame(70, true, senderNow());
+        usleep(20000);
+        CHECK(waitForShown(1));
+        CHECK(shownFrame() == before);
+
+        ledStream::streamStats stats = ledStream::getStats();
+        CHECK_EQUAL(2, stats.framesIncomplete);
+        CHECK_EQUAL(2, stats.packetsLost);
+        CHECK_EQUAL(1, stats.framesRecieved);
+        CHECK_EQUAL(1, stats.framesShown);
+
+        sendFrame(80, true, senderNow()); // back in step
+        CHECK(waitForShown(2));
+        CHECK(shownFrame() != before);
+        CHECK_EQUAL(2, ledStream::getStats().framesRecieved);
+    }
+
+    // Frames held up in the network count from when they were sent, not when they arrived
+    void latencyFromTimecode()
+    {
+        ledStream::resetStats();
+        for (unsigned int i = 0; i < 20; i++)
+        {
+            sendFrame(i, true, senderNow() - (i < 10 ? 0 : 30000));
+            usleep(10000);
+        }
+        CHECK(waitForShown(20));
+        ledStream::streamStats stats = ledStream::getStats();
+        CHECK(stats.latencyLastMicros >= 30000);
+        CHECK(stats.latencyLastMicros < 40000);
+
+        sendFrame(21, false, 0);
+        CHECK(waitForShown(21));
+        CHECK(ledStream::getStats().latencyLastMicros < 10000); // without a timecode only the device's part counts
+    }
+
+    void statsCommandHasIncompleteFrames()
+    {
+        const uint8_t request[] = {static_cast<uint8_t>(commands::Opcode::GetStreamStats)};
+        uint8_t reply[commands::maxReplySize];
+        CHECK_EQUAL(2 + 10 * 4, commands::dispatch(request, sizeof(request), reply, sizeof(reply)));
+        const uint8_t *incomplete = reply + 2 + 5 * 4;
+        CHECK_EQUAL(ledStream::getStats().framesIncomplete, (uint32_t)(incomplete[0] | incomplete[1] << 8 | incomplete[2] << 16 | incomplete[3] << 24));
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+    sim::setMicros(1000000);
+    settings::init();
+    lights::init();
+    InitBuffer();
+    ledStream::begin();
+    lights::setAnimationMode(lights::AnimationMode::Stream);
+
+    // THREAD 0, the same steps as loop()
+    std::thread render([]() {
+        while (running.load())
+        {
+            Event e;
+            while (PopEvent(&e))
+            {
+                RunEvent(e);
+            }
+            lights::updateAnimation();
+            usleep(200);
+        }
+    });
+    // About real time
+    std::thread clock([]() {
+        while (clockRunning.load())
+        {
+            sim::advanceMicros(100);
+            usleep(100);
+        }
+    });
+    // NETWORK THREAD
+    std::thread network([]() {
+        while (running.load())
+        {
+            ledStream::poll();
+            usleep(200);
+        }
+    });
+
+    RUN_TEST(everyFrameShownAt100fps);
+    RUN_TEST(incompleteFramesDropped);
+    RUN_TEST(latencyFromTimecode);
+    RUN_TEST(statsCommandHasIncompleteFrames);
+
+    running.store(false);
+    network.join();
+    render.join();
+    clockRunning.store(false);
+    clock.join();
+    return test::finish();
+}
@@ -0,0 +1,201 @@
+#include <freertos/task.h>
+#include <sim.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "circularBuffer.h"
+#include "commands.h"
+#include "metrics.h"
+#include "test.h"
+
+// Reads /metrics the way a Prometheus scraper would
+
+namespace
+{
+    struct sample
+    {
+        std::string name; // without the labels
+        std::string labels;
+        double value;
+    };
+
+    bool isNameChar(char c, bool first)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == ':' || (!first && c >= '0' && c <= '9');
+    }
+
+    bool validName(const std::string &name)
+    {
+        if (name.empty())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < name.size(); i++)
+        {
+            if (!isNameChar(name[i], i == 0))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The family a sample belongs to, summaries add _count and _sum to their name
+    std::string family(const std::string &name, const std::string &declared)
+    {
+        if (name == declared)
+        {
+            return name;
+        }
+        for (const char *suffix : {"_count", "_sum"})
+        {
+            size_t length = strlen(suffix);
+            if (name.size() > length && name.compare(name.size() - length, length, suffix) == 0)
+            {
+                return name.substr(0, name.size() - length);
+            }
+        }
+        return name;
+    }
+
+    // Parses the text format. Fails a check for anything a scraper would reject.
+    std::vector<sample> scrape(const std::string &text)
+    {
+        std::vector<sample> samples;
+        std::string declared;
+        size_t start = 0;
+        CHECK(!text.empty() && text.back() == '\n');
+        while (start < text.size())
+        {
+            size_t end = text.find('\n', start);
+            std::string line = text.substr(start, end - start);
+            start = end == std::string::npos ? text.size() : end + 1;
+
+            if (line.compare(0, 7, "# HELP ") == 0)
+            {
+                CHECK(validName(line.substr(7, line.find(' ', 7) - 7)));
+                continue;
+            }
+            if (line.compare(0, 7, "# TYPE ") == 0)
+            {
+                size_t space = line.find(' ', 7);
+                declared = line.substr(7, space - 7);
+                std::string type = line.substr(space + 1);
+                CHECK(validName(declared));
+                CHECK(type == "gauge" || type == "counter" || type == "summary");
+                continue;
+            }
+
+            sample s;
+            size_t nameEnd = line.find_first_of("{ ");
+            s.name = line.substr(0, nameEnd);
+            CHECK(validName(s.name));
+            size_t valueStart = nameEnd + 1;
+            if (nameEnd != std::string::npos && line[nameEnd] == '{')
+            {
+                size_t close = line.find('}', nameEnd);
+                CHECK(close != std::string::npos);
+                s.labels = line.substr(nameEnd + 1, close - nameEnd - 1);
+                valueStart = close + 2;
+            }
+            char *parsed = nullptr;
+            const char *value = line.c_str() + valueStart;
+            s.value = strtod(value, &parsed);
+            CHECK(parsed != value && *parsed == '\0');
+            CHECK(family(s.name, declared) == declared); // every sample comes after the TYPE of its family
+            samples.push_back(s);
+        }
+        return samples;
+    }
+
+    const sample *find(const std::vector<sample> &samples, const char *name, const char *labels = "")
+    {
+        for (const sample &s : samples)
+        {
+            if (s.name == name && s.labels == labels)
+            {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+
+    void snapshotParses()
+    {
+        metrics::snapshot();
+        std::string text(metrics::getText(), metrics::getTextLength());
+        CHECK(metrics::getTextLength() < metrics::textSize - 1); // not cut off
+        std::vector<sample> samples = scrape(text);
+        CHECK(samples.size() > 20);
+        CHECK(find(samples, "piano_fps") != nullptr);
+        CHECK(find(samples, "piano_key_latency_micros", "quantile=\"0.99\"") != nullptr);
+        CHECK(find(samples, "piano_task_stack_free_bytes", "task=\"loop\"") != nullptr);
+        CHECK(text.find("# HELP piano_heap_allocations_total Heap allocations since boot, malloc and new.\n") != std::string::npos);
+    }
+
+    void recordedValuesShowUp()
+    {
+        // 200 frames a second
+        for (int i = 0; i < 20; i++)
+        {
+            sim::advanceMicros(5000);
+            metrics::frameEnd();
+        }
+        for (int i = 0; i < 7; i++)
+        {
+            metrics::midiEvent();
+        }
+        metrics::midiEventDropped();
+
+        metrics::snapshot();
+        std::vector<sample> samples = scrape(std::string(metrics::getText(), metrics::getTextLength()));
+        const sample *frames = find(samples, "piano_frame_micros_count");
+        const sample *frameSum = find(samples, "piano_frame_micros_sum");
+        const sample *fps = find(samples, "piano_fps");
+        const sample *events = find(samples, "piano_midi_events_total");
+        const sample *dropped = find(samples, "piano_midi_events_dropped_total");
+        CHECK(frames != nullptr && frames->value == 19);
+        CHECK(frameSum != nullptr && frameSum->value == 19 * 5000);
+        CHECK(find(samples, "piano_key_latency_micros_sum") != nullptr);
+        CHECK(fps != nullptr && fps->value == 200);
+        CHECK(events != nullptr && events->value == 7);
+        CHECK(dropped != nullptr && dropped->value == 1);
+    }
+
+    void pagedOverTheCommandProtocol()
+    {
+        std::string paged;
+        uint8_t request[3] = {static_cast<uint8_t>(commands::Opcode::GetMetricsText), 0, 0};
+        uint8_t reply[commands::maxReplySize];
+        for (;;)
+        {
+            request[1] = paged.size() & 0xFF;
+            request[2] = paged.size() >> 8;
+            unsigned int length = commands::dispatch(request, sizeof(request), reply, sizeof(reply));
+            CHECK(length >= 2);
+            CHECK_EQUAL(static_cast<uint8_t>(commands::Status::OK), reply[1]);
+            if (length <= 2 || reply[1] != 0)
+            {
+                break;
+            }
+            paged.append(reinterpret_cast<const char *>(reply + 2), length - 2);
+        }
+        CHECK(paged == std::string(metrics::getText(), metrics::getTextLength()));
+        scrape(paged);
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+    sim::setMicros(1000000);
+    InitBuffer();
+    metrics::registerTask("loop", xTaskGetCurrentTaskHandle());
+
+    RUN_TEST(snapshotParses);
+    RUN_TEST(recordedValuesShowUp);
+    RUN_TEST(pagedOverTheCommandProtocol);
+    return test::finish();
+}
@@ -0,0 +1,116 @@
+#include <sim.h>
+
+#include "keyMask.h"
+#include "pinaoCom.h"
+#include "test.h"
+
+// The MIDI parser and the note layers it feeds
+
+namespace
+{
+    void packet(uint8_t note, uint8_t velocity, uint32_t time, uint8_t code = 9)
+    {
+        const uint8_t bytes[4] = {code, static_cast<uint8_t>(velocity ? 0x90 : 0x80), note, velocity};
+        MIDI::handlePacket(bytes, time);
+    }
+
+    void drainEvents()
+    {
+        MIDI::noteEvent e;
+        while (MIDI::popNoteEvent(&e))
+        {
+        }
+        MIDI::getLogicalStates();
+    }
+
+    void pressAndRelease()
+    {
+        drainEvents();
+        const uint8_t note = MIDI::noteNumberOffset + 40;
+        packet(note, 100, 1000);
+        CHECK(MIDI::getNoteState(40));
+        CHECK(MIDI::anyNoteDown());
+        CHECK_EQUAL(100, MIDI::getNoteVelocity(40));
+
+        packet(note, 0, 2000);
+        CHECK(!MIDI::getNoteState(40));
+        CHECK(!MIDI::anyNoteDown());
+
+        MIDI::noteEvent e;
+        CHECK(MIDI::popNoteEvent(&e));
+        CHECK_EQUAL(40, e.note);
+        CHECK_EQUAL(100, e.velocity);
+        CHECK_EQUAL(1000, e.time);
+        CHECK(MIDI::popNoteEvent(&e));
+        CHECK_EQUAL(0, e.velocity);
+        CHECK_EQUAL(2000, e.time);
+        CHECK(!MIDI::popNoteEvent(&e));
+    }
+
+    void logicalLayerKeepsShortPresses()
+    {
+        drainEvents();
+        // Pressed and released between two polls still counts as a press, once
+        packet(MIDI::noteNumberOffset + 3, 80, 0);
+        packet(MIDI::noteNumberOffset + 3, 0, 10);
+        MIDI::copyLogicalStateBuffer();
+        CHECK(MIDI::getLogicalState(3));
+        CHECK(!MIDI::getLogicalState(3));
+
+        MIDI::copyLogicalStateBuffer();
+        CHECK(isEmpty(MIDI::getLogicalStates()));
+    }
+
+    void outOfRangeAndOtherPacketsIgnored()
+    {
+        drainEvents();
+        packet(MIDI::noteNumberOffset - 1, 100, 0);        // below the lowest key
+        packet(MIDI::noteNumberOffset + _PIANOSIZE, 100, 0); // above the highest key
+        packet(MIDI::noteNumberOffset + 5, 100, 0, 0x0B);   // a control change
+        CHECK(!MIDI::anyNoteDown());
+        MIDI::noteEvent e;
+        CHECK(!MIDI::popNoteEvent(&e));
+    }
+
+    void fullQueueDropsEvents()
+    {
+        drainEvents();
+        for (unsigned int i = 0; i < MIDI::noteEventBufferSize + 10; i++)
+        {
+            packet(MIDI::noteNumberOffset + (i % 2), i % 4 < 2 ? 90 : 0, i);
+        }
+        unsigned int events = 0;
+        MIDI::noteEvent e;
+        while (MIDI::popNoteEvent(&e))
+        {
+            CHECK_EQUAL(events, e.time); // the oldest are kept
+            events++;
+        }
+        CHECK_EQUAL(MIDI::noteEventBufferSize, events);
+    }
+
+    void nothingQueuedWithTheLayerOff()
+    {
+        drainEvents();
+        MIDI::setLogicalLayerEnable(false);
+        packet(MIDI::noteNumberOffset + 7, 100, 0);
+        CHECK(MIDI::getNoteState(7)); // real time state is always kept
+        MIDI::noteEvent e;
+        CHECK(!MIDI::popNoteEvent(&e));
+        packet(MIDI::noteNumberOffset + 7, 0, 0);
+        MIDI::setLogicalLayerEnable(true);
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+    MIDI::setLogicalLayerEnable(true);
+
+    RUN_TEST(pressAndRelease);
+    RUN_TEST(logicalLayerKeepsShortPresses);
+    RUN_TEST(outOfRangeAndOtherPacketsIgnored);
+    RUN_TEST(fullQueueDropsEvents);
+    RUN_TEST(nothingQueuedWithTheLayerOff);
+    return test::finish();
+}
@@ -0,0 +1,121 @@
+#include <sim.h>
+#include <string.h>
+
+#include "keyMask.h"
+#include "m_error.h"
+#include "music.h"
+#include "test.h"
+
+// Song storage and decoding frames into key and hand masks
+
+namespace
+{
+    void load(const uint8_t *notes, uint8_t count)
+    {
+        CHECK(music::uploadFrame(notes, count));
+    }
+
+    void loadSong()
+    {
+        CHECK(music::beginUpload("test", 4));
+        const uint8_t chord[] = {10, 14 | music::handBit, 10, 17}; // 10 twice, the old pointer walk stopped at the second one
+        const uint8_t single[] = {40};
+        const uint8_t outOfRange[] = {_PIANOSIZE + 3, 5};
+        load(chord, sizeof(chord));
+        load(single, sizeof(single));
+        load(outOfRange, sizeof(outOfRange));
+        load(nullptr, 0);
+        CHECK(music::endUpload());
+        CHECK(music::swapInUpload());
+    }
+
+    void framesDecodeIntoMasks()
+    {
+        loadSong();
+        CHECK_EQUAL(4, music::frameCount());
+
+        music::songFrame frame;
+        CHECK(music::getFrame(0, &frame));
+        keyMask keys = emptyKeyMask;
+        setKey(keys, 10);
+        setKey(keys, 14);
+        setKey(keys, 17);
+        CHECK(frame.keys == keys);
+        keyMask hands = emptyKeyMask;
+        setKey(hands, 14);
+        CHECK(frame.hands == hands);
+
+        CHECK(music::getFrame(2, &frame));
+        CHECK(testKey(frame.keys, 5));
+        CHECK(!testKey(frame.keys, (_PIANOSIZE + 3) & 0x7F)); // off the keyboard, skipped
+
+        CHECK(music::getFrame(3, &frame));
+        CHECK(isEmpty(frame.keys));
+    }
+
+    void liveFrameFollowsTheIndex()
+    {
+        loadSong();
+        CHECK(testKey(music::currentFrame().keys, 17));
+        music::nextFrame();
+        CHECK_EQUAL(1, music::currentFrameIndex());
+        CHECK(testKey(music::currentFrame().keys, 40));
+        CHECK(!testKey(music::currentFrame().keys, 17));
+
+        music::setFrame(music::frameCount()); // past the end wraps to the start
+        CHECK_EQUAL(0, music::currentFrameIndex());
+        CHECK(testKey(music::currentFrame().keys, 17));
+        CHECK_EQUAL(1, music::followingFrameIndex(0));
+    }
+
+    // The live song plays on untouched until the render loop swaps the new one in
+    void reloadReplacesTheSong()
+    {
+        loadSong();
+        music::setFrame(3);
+        music::setLoopingSettings(true, 2, 4);
+        uint16_t generation = music::getSongGeneration();
+
+        CHECK(music::beginUpload("other song", 10));
+        const uint8_t other[] = {60};
+        load(other, sizeof(other));
+        CHECK_EQUAL(4, music::frameCount());
+        CHECK_EQUAL(3, music::currentFrameIndex());
+        CHECK(strcmp(music::getSongName(), "test") == 0);
+        CHECK(music::endUpload());
+        CHECK(!music::beginUpload("too soon", 8)); // the last one hasn't been taken yet
+
+        CHECK(music::swapInUpload());
+        CHECK(!music::swapInUpload());
+        CHECK_EQUAL(generation + 1, music::getSongGeneration());
+        CHECK_EQUAL(1, music::frameCount());
+        CHECK_EQUAL(0, music::currentFrameIndex());
+        CHECK(!music::getLoopingEnabled());
+        CHECK(strcmp(music::getSongName(), "other song") == 0);
+        CHECK(testKey(music::currentFrame().keys, 60));
+        CHECK(!testKey(music::currentFrame().keys, 10));
+        music::nextFrame();
+        CHECK(!isErrorLocked());
+    }
+
+    void unfinishedUploadsAreDropped()
+    {
+        loadSong();
+        CHECK(music::beginUpload("empty", 5));
+        CHECK(!music::endUpload()); // no frames
+        CHECK(!music::swapInUpload());
+        CHECK(!music::uploadFrame(nullptr, 0)); // not uploading any more
+        CHECK_EQUAL(4, music::frameCount());
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+
+    RUN_TEST(framesDecodeIntoMasks);
+    RUN_TEST(liveFrameFollowsTheIndex);
+    RUN_TEST(reloadReplacesTheSong);
+    RUN_TEST(unfinishedUploadsAreDropped);
+    return test::finish();
+}
@@ -0,0 +1,213 @@
+#include <Update.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <mbedtls/md.h>
+#include <netinet/in.h>
+#include <sim.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "circularBuffer.h"
+#include "lighting/lighting.h"
+#include "m_constants.h"
+#include "ota.h"
+#include "settings.h"
+#include "test.h"
+
+// Firmware updates from a local client while the render loop runs. Images have to be signed
+// and can't come in through the access point, and the image is written one chunk per frame
+// in the idle time right after the frame has gone out.
+
+namespace
+{
+    constexpr unsigned int frameMicros = 4000;
+
+    std::atomic<bool> running(true);
+    std::atomic<bool> rendering(false); // THREAD 0 is between the start of a frame and renderFrameEnd()
+    std::atomic<unsigned int> frameNumber(0);
+
+    // Update.write() calls, counted on the OTA task
+    std::atomic<unsigned int> idleWrites(0);
+    std::atomic<unsigned int> writesDuringFrame(0);
+    std::atomic<unsigned int> secondWritesInFrame(0);
+    unsigned int lastWriteFrame = 0xFFFFFFFF;
+
+    void onUpdateWrite(size_t length)
+    {
+        (rendering.load() ? writesDuringFrame : idleWrites)++;
+        if (frameNumber.load() == lastWriteFrame)
+        {
+            secondWritesInFrame++;
+        }
+        lastWriteFrame = frameNumber.load();
+    }
+
+    std::string hmac(const char *key, const uint8_t *data, size_t length)
+    {
+        mbedtls_md_context_t context;
+        mbedtls_md_init(&context);
+        mbedtls_md_setup(&context, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+        mbedtls_md_hmac_starts(&context, reinterpret_cast<const unsigned char *>(key), strlen(key));
+        mbedtls_md_hmac_update(&context, data, length);
+        uint8_t digest[32];
+        mbedtls_md_hmac_finish(&context, digest);
+        mbedtls_md_free(&context);
+
+        char hex[65];
+        for (int i = 0; i < 32; i++)
+        {
+            snprintf(hex + i * 2, 3, "%02x", digest[i]);
+        }
+        return hex;
+    }
+
+    std::vector<uint8_t> makeImage(size_t size)
+    {
+        std::vector<uint8_t> image(size);
+        for (size_t i = 0; i < size; i++)
+        {
+            image[i] = (i * 31 + (i >> 8)) & 0xFF;
+        }
+        return image;
+    }
+
+    // Posts the image and returns the response code, 0 if there wasn't one
+    int postImage(const std::vector<uint8_t> &image, const char *query, const std::string &signature)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(sim::getServerPort(ota::port));
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            close(fd);
+            return 0;
+        }
+        std::string header = "POST /update" + std::string(query) + " HTTP/1.1\r\nContent-Length: " + std::to_string(image.size()) + "\r\n";
+        if (!signature.empty())
+        {
+            header += "X-Signature: " + signature + "\r\n";
+        }
+        header += "\r\n";
+        send(fd, header.data(), header.size(), MSG_NOSIGNAL);
+        send(fd, image.data(), image.size(), MSG_NOSIGNAL);
+
+        std::string received;
+        char buffer[256];
+        ssize_t count;
+        while ((count = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+        {
+            received.append(buffer, count);
+        }
+        close(fd);
+        return received.compare(0, 9, "HTTP/1.1 ") == 0 ? atoi(received.c_str() + 9) : 0;
+    }
+
+    // RFC 4231 test case 2
+    void hmacMatchesKnownAnswer()
+    {
+        const char *data = "what do ya want for nothing?";
+        CHECK(hmac("Jefe", reinterpret_cast<const uint8_t *>(data), strlen(data)) ==
+              "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+    }
+
+    void unsignedImagesRefused()
+    {
+        std::vector<uint8_t> image = makeImage(4096);
+        CHECK_EQUAL(401, postImage(image, "", ""));
+        CHECK_EQUAL(401, postImage(image, "", "not hex"));
+        CHECK(ota::getStatus().state == ota::State::Idle);
+        CHECK(Update.image().empty());
+    }
+
+    void accessPointClientsRefused()
+    {
+        std::vector<uint8_t> image = makeImage(4096);
+        sim::setClientsOnSoftAP(true);
+        CHECK_EQUAL(403, postImage(image, "", hmac(_OTA_KEY, image.data(), image.size())));
+        sim::setClientsOnSoftAP(false);
+        CHECK(ota::getStatus().state == ota::State::Idle);
+        CHECK(Update.image().empty());
+    }
+
+    // Signed with another key, the whole image goes in but it is never switched to
+    void wrongKeyNeverApplied()
+    {
+        std::vector<uint8_t> image = makeImage(8192);
+        CHECK_EQUAL(403, postImage(image, "", hmac("some other key", image.data(), image.size())));
+        CHECK(ota::getStatus().state == ota::State::Failed);
+        CHECK(!Update.ended());
+    }
+
+    void simulatedUpdateWritesBetweenFrames()
+    {
+        std::vector<uint8_t> image = makeImage(64 * 1024 + 100);
+        idleWrites.store(0);
+        writesDuringFrame.store(0);
+        secondWritesInFrame.store(0);
+        CHECK_EQUAL(200, postImage(image, "?simulate=1", hmac(_OTA_KEY, image.data(), image.size())));
+
+        ota::otaStatus status = ota::getStatus();
+        CHECK(status.state == ota::State::Succeeded);
+        CHECK_EQUAL(image.size(), status.bytesWritten);
+        CHECK(Update.image() == image);
+        CHECK(!Update.ended()); // simulated, never switched to
+
+        CHECK_EQUAL((image.size() + ota::chunkSize - 1) / ota::chunkSize, idleWrites.load());
+        CHECK_EQUAL(0, writesDuringFrame.load());
+        CHECK_EQUAL(0, secondWritesInFrame.load());
+        CHECK_EQUAL(frameMicros, status.frameMaxMicros); // writing never held up a frame
+        CHECK_EQUAL(frameMicros, status.frameAverageMicros);
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+    sim::setMicros(1000000);
+    sim::setUpdateWriteHandler(onUpdateWrite);
+    settings::init();
+    lights::init();
+    InitBuffer();
+    ota::begin();
+
+    // THREAD 0, every frame takes frameMicros of simulated time and is followed by some idle time
+    std::thread render([]() {
+        while (running.load())
+        {
+            rendering.store(true);
+            Event e;
+            while (PopEvent(&e))
+            {
+                RunEvent(e);
+            }
+            lights::updateAnimation();
+            sim::advanceMicros(frameMicros);
+            frameNumber++;
+            rendering.store(false);
+            ota::renderFrameEnd();
+            usleep(2000);
+        }
+    });
+
+    for (int i = 0; i < 1000 && sim::getServerPort(ota::port) == 0; i++)
+    {
+        usleep(1000);
+    }
+    CHECK(sim::getServerPort(ota::port) != 0);
+
+    RUN_TEST(hmacMatchesKnownAnswer);
+    RUN_TEST(unsignedImagesRefused);
+    RUN_TEST(accessPointClientsRefused);
+    RUN_TEST(wrongKeyNeverApplied);
+    RUN_TEST(simulatedUpdateWritesBetweenFrames);
+
+    running.store(false);
+    render.join();
+    return test::finish();
+}
@@ -0,0 +1,360 @@
+#include <chrono>
+#include <sim.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "circularBuffer.h"
+#include "commands.h"
+#include "lighting/LEDCom.h"
+#include "lighting/lighting.h"
+#include "music.h"
+#include "pinaoCom.h"
+#include "settings.h"
+#include "test.h"
+#include "trace.h"
+#include "traceReplay.h"
+
+// A trace dumped the way GET /trace sends it, replayed through the lighting and music code
+
+namespace
+{
+    constexpr uint32_t traceStart = 5000000;
+    constexpr uint32_t checkpointTraceStart = traceStart + 20000000;
+    constexpr uint8_t blackKey = 40; // C#4
+    constexpr uint8_t indicateBlack = static_cast<uint8_t>(settings::Colors::IndicateBlack);
+
+    std::vector<uint8_t> dump;
+    std::vector<uint8_t> checkpointDump; // the same records, then a new song and a checkpoint
+    std::vector<uint8_t> *collecting = &dump;
+
+    void collect(const uint8_t *data, unsigned int length)
+    {
+        collecting->insert(collecting->end(), data, data + length);
+    }
+
+    void press(uint8_t key, uint8_t velocity, uint32_t time)
+    {
+        const uint8_t packet[4] = {9, static_cast<uint8_t>(velocity ? 0x90 : 0x80), static_cast<uint8_t>(MIDI::noteNumberOffset + key), velocity};
+        trace::recordMidiPacket(packet, time);
+    }
+
+    void command(const uint8_t *request, unsigned int length, uint32_t time)
+    {
+        sim::setMicros(time);
+        trace::recordCommand(request, length);
+    }
+
+    // About ten seconds of playing, recorded straight into the trace as the device would have
+    void recordTrace()
+    {
+        sim::setMicros(traceStart);
+        trace::recordModeChange(static_cast<uint8_t>(lights::AnimationMode::KeyIndicateFade));
+
+        // Black keys light up green from now on
+        const uint8_t changeSetting[] = {static_cast<uint8_t>(commands::Opcode::ChangeSetting), indicateBlack, 0, 255, 0};
+        command(changeSetting, sizeof(changeSetting), traceStart + 1000);
+
+        // Long enough to take several records
+        const uint8_t unknown[] = {0x7F, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+        command(unknown, sizeof(unknown), traceStart + 2000);
+
+        for (uint32_t i = 0; i < 40; i++)
+        {
+            uint32_t time = traceStart + 100000 + i * 250000;
+            press(i % 2 ? blackKey : (i * 7) % _PIANOSIZE, 64 + i, time);
+            press(i % 2 ? blackKey : (i * 7) % _PIANOSIZE, 0, time + 120000);
+        }
+        trace::writeDump(collect);
+    }
+
+    // Later on a song comes in and gets a loop, and THREAD 0 checkpoints at the end of the frame
+    void recordCheckpointTrace()
+    {
+        sim::setMicros(checkpointTraceStart);
+        settings::saveColorSetting(settings::Colors::IndicateBlack, {10, 20, 30});
+        music::beginUpload("checkpoint song", 15);
+        for (uint8_t i = 0; i < 50; i++)
+        {
+            const uint8_t notes[2] = {i, static_cast<uint8_t>((i + 7) | music::handBit)};
+            music::uploadFrame(notes, 2);
+        }
+        music::endUpload();
+        music::swapInUpload();
+        music::setLoopingSettings(true, 10, 20);
+        music::setFrame(12);
+        lights::setAnimationMode(lights::AnimationMode::Waiting);
+        trace::renderFrameEnd();
+        trace::renderFrameEnd(); // nothing new, no second checkpoint
+
+        press(60, 80, checkpointTraceStart + 100000); // not in the frame, it stays put
+        press(60, 0, checkpointTraceStart + 200000);
+    }
+
+    struct replayResult
+    {
+        unsigned int frames;
+        unsigned int greenFrames; // frames where the black key showed the color set by the command
+        uint64_t hash;            // over every frame sent to the strip
+        uint64_t wallMicros;
+
+        // State once the replay is done
+        char songName[music::maxSongNameLength + 1];
+        unsigned int songFrames;
+        int frameIndex;
+        bool looping;
+        int loopStart;
+        int loopEnd;
+        lights::AnimationMode mode;
+        color indicateBlack;
+    };
+
+    replayResult result;
+
+    void hashFrame(unsigned int frame, uint32_t micros)
+    {
+        static uint8_t pixels[_LEDCOUNT * 4];
+        sim::copyShownFrame(pixels, sizeof(pixels));
+        for (uint8_t byte : pixels)
+        {
+            result.hash = (result.hash ^ byte) * 0x100000001B3ULL;
+        }
+        const uint8_t *led = pixels + LEDCom::getKeySpan(blackKey).first * 4;
+        if (led[0] > 0 && led[1] == 0 && led[2] == 0)
+        {
+            result.greenFrames++;
+        }
+        result.frames = frame + 1;
+    }
+
+    // Records in a child process on top of what the ring holds already, so the song and settings
+    // don't carry over into the replays. Returns the dump.
+    std::vector<uint8_t> dumpFromChild(void (*record)())
+    {
+        int fds[2];
+        CHECK(pipe(fds) == 0);
+        pid_t child = fork();
+        if (child == 0)
+        {
+            close(fds[0]);
+            record();
+            std::vector<uint8_t> recorded;
+            collecting = &recorded;
+            trace::writeDump(collect);
+            ssize_t written = write(fds[1], recorded.data(), recorded.size());
+            _exit(written == (ssize_t)recorded.size() ? 0 : 1);
+        }
+        close(fds[1]);
+        std::vector<uint8_t> received;
+        uint8_t buffer[4096];
+        ssize_t count;
+        while ((count = read(fds[0], buffer, sizeof(buffer))) > 0)
+        {
+            received.insert(received.end(), buffer, buffer + count);
+        }
+        close(fds[0]);
+        int status = 0;
+        waitpid(child, &status, 0);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        return received;
+    }
+
+    // Replays in a child process so every run starts from the same freshly booted state
+    replayResult replayInChild(const uint8_t *data, unsigned int length, bool withSong = true)
+    {
+        int fds[2];
+        CHECK(pipe(fds) == 0);
+        pid_t child = fork();
+        if (child == 0)
+        {
+            close(fds[0]);
+            settings::init();
+            lights::init();
+            InitBuffer();
+
+            static trace::record records[trace::ringSize];
+            unsigned int count = traceReplay::parse(data, length, records, trace::ringSize);
+            traceReplay::song song;
+            const bool hasSong = withSong && traceReplay::parseSong(data, length, &song);
+            traceReplay::options opts = {1000000 / 250, 500000, [](uint32_t micros) { sim::setMicros(micros); }, hashFrame, hasSong ? &song : nullptr};
+
+            result = {};
+            result.hash = 0xCBF29CE484222325ULL;
+            auto start = std::chrono::steady_clock::now();
+            traceReplay::run(records, count, opts);
+            result.wallMicros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+            strncpy(result.songName, music::getSongName(), music::maxSongNameLength);
+            result.songFrames = music::frameCount();
+            result.frameIndex = music::currentFrameIndex();
+            result.looping = music::getLoopingEnabled();
+            result.loopStart = music::getLoopStart();
+            result.loopEnd = music::getLoopEnd();
+            result.mode = lights::getAnimationMode();
+            result.indicateBlack = settings::getColorSetting(settings::Colors::IndicateBlack);
+
+            ssize_t written = write(fds[1], &result, sizeof(result));
+            _exit(written == sizeof(result) ? 0 : 1);
+        }
+        close(fds[1]);
+        replayResult r = {};
+        CHECK(read(fds[0], &r, sizeof(r)) == sizeof(r));
+        close(fds[0]);
+        int status = 0;
+        waitpid(child, &status, 0);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        return r;
+    }
+
+    void dumpRoundTrips()
+    {
+        trace::dumpHeader header;
+        CHECK(dump.size() >= sizeof(header));
+        memcpy(&header, dump.data(), sizeof(header));
+        // mode, command + 1, command + 3, and a press and release per note
+        CHECK_EQUAL(1 + 2 + 4 + 80, header.recordCount);
+        const char *noSong = "no song loaded";
+        CHECK_EQUAL(sizeof(header) + header.recordCount * sizeof(trace::record) + sizeof(trace::songHeader) + strlen(noSong), dump.size());
+
+        traceReplay::song song;
+        CHECK(traceReplay::parseSong(dump.data(), dump.size(), &song));
+        CHECK_EQUAL(0, song.generation);
+        CHECK_EQUAL(0, song.frameCount);
+        CHECK(song.nameLength == strlen(noSong) && memcmp(song.name, noSong, song.nameLength) == 0);
+        CHECK(!traceReplay::parseSong(dump.data(), dump.size() - 1, &song));
+
+        static trace::record records[trace::ringSize];
+        CHECK_EQUAL(header.recordCount, traceReplay::parse(dump.data(), dump.size(), records, trace::ringSize));
+        CHECK(records[0].type == trace::RecordType::ModeChange);
+        CHECK(records[1].type == trace::RecordType::Command);
+        CHECK(records[2].type == trace::RecordType::CommandData);
+
+        std::vector<uint8_t> bad(dump);
+        bad[0] = 'X';
+        CHECK_EQUAL(0, traceReplay::parse(bad.data(), bad.size(), records, trace::ringSize));
+    }
+
+    void sameTraceSameFrames()
+    {
+        replayResult first = replayInChild(dump.data(), dump.size());
+        replayResult second = replayInChild(dump.data(), dump.size());
+        CHECK(first.frames > 2500); // about ten and a half seconds at 250 frames a second
+        CHECK_EQUAL(first.frames, second.frames);
+        CHECK(first.hash == second.hash);
+        CHECK_EQUAL(first.greenFrames, second.greenFrames);
+        CHECK(first.greenFrames > 0); // the command and the presses both made it
+
+        double traceSeconds = first.frames / 250.0;
+        printf("replayed %.1fs of trace in %.1fms\n", traceSeconds, first.wallMicros / 1000.0);
+        CHECK(first.wallMicros < traceSeconds * 1000000); // faster than real time
+    }
+
+    void cutOffCommandSkipped()
+    {
+        // The ring wrapped half way through the command, its data records are the oldest left
+        std::vector<uint8_t> cut(dump);
+        trace::dumpHeader header;
+        memcpy(&header, cut.data(), sizeof(header));
+        const unsigned int dropped = 4; // the mode change, the first command and the second command's start
+        cut.erase(cut.begin() + sizeof(header), cut.begin() + sizeof(header) + dropped * sizeof(trace::record));
+        header.recordCount -= dropped;
+        memcpy(cut.data(), &header, sizeof(header));
+
+        replayResult r = replayInChild(cut.data(), cut.size());
+        CHECK(r.frames > 0);
+        CHECK_EQUAL(0, r.greenFrames); // the color change was cut off with the rest
+    }
+
+    void songAndCheckpointInDump()
+    {
+        trace::dumpHeader header;
+        memcpy(&header, checkpointDump.data(), sizeof(header));
+        // the first trace, mode, a checkpoint in one record and 11 of data, and a press and release
+        const unsigned int checkpointRecords = 1 + (sizeof(trace::checkpoint) + trace::recordDataSize - 1) / trace::recordDataSize;
+        CHECK_EQUAL(87 + 1 + checkpointRecords + 2, header.recordCount);
+
+        traceReplay::song song;
+        CHECK(traceReplay::parseSong(checkpointDump.data(), checkpointDump.size(), &song));
+        CHECK_EQUAL(1, song.generation);
+        CHECK_EQUAL(50, song.frameCount);
+        CHECK_EQUAL(50 * 3, song.dataLength);
+        CHECK_EQUAL(12, song.data[12 * 3]);
+        CHECK_EQUAL(music::frameEndMarker, song.data[12 * 3 + 2]);
+    }
+
+    // The replay loads the song and picks up where the checkpoint was, skipping everything before it
+    void replayStartsAtCheckpoint()
+    {
+        replayResult r = replayInChild(checkpointDump.data(), checkpointDump.size());
+        CHECK(strcmp(r.songName, "checkpoint song") == 0);
+        CHECK_EQUAL(50, r.songFrames);
+        CHECK_EQUAL(12, r.frameIndex);
+        CHECK(r.looping);
+        CHECK_EQUAL(10, r.loopStart);
+        CHECK_EQUAL(20, r.loopEnd);
+        CHECK(r.mode == lights::AnimationMode::Waiting);
+        CHECK_EQUAL(10, r.indicateBlack.r);
+        CHECK_EQUAL(30, r.indicateBlack.b);
+        CHECK(r.frames < 250); // from the checkpoint to half a second past the last press, not from the first record
+        CHECK_EQUAL(0, r.greenFrames); // the color change before the checkpoint wasn't replayed
+
+        // Without the song it can only start at the first record, from the start up state
+        replayResult fromStart = replayInChild(checkpointDump.data(), checkpointDump.size(), false);
+        CHECK(fromStart.frames > 20 * 250);
+        CHECK(strcmp(fromStart.songName, "no song loaded") == 0);
+    }
+
+    // Reads and song uploads through the dispatcher leave nothing in the trace, changes do
+    void onlyChangesAreTraced()
+    {
+        std::vector<uint8_t> before;
+        collecting = &before;
+        trace::writeDump(collect);
+
+        uint8_t reply[commands::maxReplySize];
+        const uint8_t reads[][3] = {{static_cast<uint8_t>(commands::Opcode::GetStatus)},
+                                    {static_cast<uint8_t>(commands::Opcode::GetMetricsText), 0, 0},
+                                    {static_cast<uint8_t>(commands::Opcode::SongData), 1, music::frameEndMarker},
+                                    {static_cast<uint8_t>(commands::Opcode::SaveSettings)}};
+        const unsigned int readLengths[] = {1, 3, 3, 1};
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            commands::dispatch(reads[i], readLengths[i], reply, sizeof(reply));
+        }
+        std::vector<uint8_t> afterReads;
+        collecting = &afterReads;
+        trace::writeDump(collect);
+
+        const uint8_t change[] = {static_cast<uint8_t>(commands::Opcode::SetSongIndex), 3, 0};
+        commands::dispatch(change, sizeof(change), reply, sizeof(reply));
+        std::vector<uint8_t> afterChange;
+        collecting = &afterChange;
+        trace::writeDump(collect);
+        collecting = &dump;
+
+        trace::dumpHeader headers[3];
+        memcpy(&headers[0], before.data(), sizeof(trace::dumpHeader));
+        memcpy(&headers[1], afterReads.data(), sizeof(trace::dumpHeader));
+        memcpy(&headers[2], afterChange.data(), sizeof(trace::dumpHeader));
+        CHECK_EQUAL(headers[0].recordCount, headers[1].recordCount);
+        CHECK_EQUAL(headers[0].recordCount + 2, headers[2].recordCount);
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+    settings::init();
+    recordTrace();
+    checkpointDump = dumpFromChild(recordCheckpointTrace);
+
+    RUN_TEST(dumpRoundTrips);
+    RUN_TEST(sameTraceSameFrames);
+    RUN_TEST(cutOffCommandSkipped);
+    RUN_TEST(songAndCheckpointInDump);
+    RUN_TEST(replayStartsAtCheckpoint);
+    InitBuffer(); // the dispatcher pushes events, no more replays in a child after this
+    RUN_TEST(onlyChangesAreTraced);
+    return test::finish();
+}
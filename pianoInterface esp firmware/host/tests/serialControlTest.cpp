@@ -0,0 +1,331 @@
+#include <atomic>
+#include <fcntl.h>
+#include <poll.h>
+#include <sim.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "circularBuffer.h"
+#include "commands.h"
+#include "lighting/lighting.h"
+#include "m_error.h"
+#include "music.h"
+#include "serialControl.h"
+#include "settings.h"
+#include "test.h"
+
+// The serial transport over a pseudo terminal, with the render loop and the network thread
+// running as they do on the device. Songs are uploaded again and again while one plays.
+
+namespace
+{
+    constexpr int replyTimeoutMillis = 2000;
+
+    std::atomic<bool> running(true);
+    std::atomic<bool> clockRunning(true);
+    std::atomic<bool> clockPaused(false);
+    std::atomic<bool> pollStalled(false); // the network thread is busy with something else
+    int port = -1;
+
+    uint16_t crc16(uint16_t crc, const uint8_t *data, unsigned int length)
+    {
+        for (unsigned int i = 0; i < length; i++)
+        {
+            crc ^= (uint16_t)data[i] << 8;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+        }
+        return crc;
+    }
+
+    bool readPort(uint8_t *byte)
+    {
+        pollfd waiting = {port, POLLIN, 0};
+        return poll(&waiting, 1, replyTimeoutMillis) == 1 && read(port, byte, 1) == 1;
+    }
+
+    std::vector<uint8_t> requestFrame(const std::vector<uint8_t> &payload)
+    {
+        std::vector<uint8_t> frame = {serialControl::syncByte, static_cast<uint8_t>(payload.size() & 0xFF), static_cast<uint8_t>(payload.size() >> 8)};
+        for (uint8_t byte : payload)
+        {
+            frame.push_back(byte);
+        }
+        uint16_t crc = crc16(0xFFFF, frame.data() + 1, frame.size() - 1);
+        frame.push_back(crc & 0xFF);
+        frame.push_back(crc >> 8);
+        return frame;
+    }
+
+    // Waits for the reply to a request, skipping any debug text printed in between.
+    // Returns the reply status, or 0xFF if no good reply came.
+    uint8_t readReply(const std::vector<uint8_t> &payload, std::vector<uint8_t> *replyPayload = nullptr)
+    {
+        uint8_t byte = 0;
+        while (byte != serialControl::syncByte)
+        {
+            if (!readPort(&byte))
+            {
+                return 0xFF;
+            }
+        }
+        uint8_t reply[3 + commands::maxReplySize + 2] = {serialControl::syncByte};
+        if (!readPort(reply + 1) || !readPort(reply + 2))
+        {
+            return 0xFF;
+        }
+        unsigned int length = reply[1] | (reply[2] << 8);
+        if (length < 2 || length > commands::maxReplySize)
+        {
+            return 0xFF;
+        }
+        for (unsigned int i = 0; i < length + 2; i++)
+        {
+            if (!readPort(reply + 3 + i))
+            {
+                return 0xFF;
+            }
+        }
+        uint16_t replyCrc = reply[3 + length] | (reply[4 + length] << 8);
+        if (replyCrc != crc16(0xFFFF, reply + 1, 2 + length) || reply[3] != payload[0])
+        {
+            return 0xFF;
+        }
+        if (replyPayload != nullptr)
+        {
+            replyPayload->assign(reply + 5, reply + 3 + length);
+        }
+        return reply[4];
+    }
+
+    // Sends a request and waits for its reply
+    uint8_t request(const std::vector<uint8_t> &payload, std::vector<uint8_t> *replyPayload = nullptr)
+    {
+        std::vector<uint8_t> frame = requestFrame(payload);
+        if (write(port, frame.data(), frame.size()) != (ssize_t)frame.size())
+        {
+            return 0xFF;
+        }
+        return readReply(payload, replyPayload);
+    }
+
+    uint8_t request(commands::Opcode opcode, std::vector<uint8_t> payload = {}, std::vector<uint8_t> *replyPayload = nullptr)
+    {
+        payload.insert(payload.begin(), static_cast<uint8_t>(opcode));
+        return request(payload, replyPayload);
+    }
+
+    // One chord per frame, going up the keyboard
+    bool upload(const char *name, unsigned int frames)
+    {
+        unsigned int notes = frames * 2;
+        std::vector<uint8_t> begin = {static_cast<uint8_t>(frames & 0xFF), static_cast<uint8_t>(frames >> 8),
+                                      static_cast<uint8_t>(notes & 0xFF), static_cast<uint8_t>(notes >> 8)};
+        begin.insert(begin.end(), name, name + strlen(name));
+        uint8_t status;
+        while ((status = request(commands::Opcode::BeginSongUpload, begin)) == static_cast<uint8_t>(commands::Status::Busy))
+        {
+            usleep(1000); // the render loop hasn't taken the last one yet
+        }
+        if (status != 0)
+        {
+            return false;
+        }
+        usleep(5000); // a slow host, the render loop gets to draw a few frames mid upload
+
+        std::vector<uint8_t> data;
+        for (unsigned int i = 0; i < frames; i++)
+        {
+            data.push_back(i % _PIANOSIZE);
+            data.push_back(((i + 4) % _PIANOSIZE) | music::handBit);
+            data.push_back(music::frameEndMarker);
+            if (data.size() > 200 || i == frames - 1)
+            {
+                if (request(commands::Opcode::SongData, data) != 0)
+                {
+                    return false;
+                }
+                data.clear();
+            }
+        }
+        return request(commands::Opcode::EndSongUpload) == 0;
+    }
+
+    bool waitForSong(const char *name)
+    {
+        for (int i = 0; i < 2000; i++)
+        {
+            std::vector<uint8_t> reply;
+            if (request(commands::Opcode::GetSongName, {}, &reply) == 0 &&
+                reply.size() == strlen(name) && memcmp(reply.data(), name, reply.size()) == 0)
+            {
+                return true;
+            }
+            usleep(1000);
+        }
+        return false;
+    }
+
+    void uploadAndPlay()
+    {
+        CHECK(upload("long song", 3000));
+        CHECK(waitForSong("long song"));
+        CHECK_EQUAL(0, request(commands::Opcode::SetAnimationMode, {5})); // Waiting
+        std::vector<uint8_t> reply;
+        CHECK_EQUAL(0, request(commands::Opcode::GetStatus, {}, &reply));
+        CHECK(reply.size() == 1 && reply[0] == static_cast<uint8_t>(ErrorCode::NO_ERROR));
+    }
+
+    // The old loader was reset from the network thread while the render loop was reading the
+    // song, a shorter song coming in could leave the live frame past its end
+    void reuploadWhilePlaying()
+    {
+        for (unsigned int round = 0; round < 20; round++)
+        {
+            CHECK_EQUAL(0, request(commands::Opcode::SetSongIndex, {0xB8, 0x0B})); // 3000, past the end of the short songs
+            const char *name = round % 2 ? "long song" : "short song";
+            CHECK(upload(name, round % 2 ? 3000 : 5 + round));
+            usleep(20000); // about a second of device time, long enough to get back to Waiting
+        }
+        CHECK(waitForSong("short song") || waitForSong("long song"));
+
+        std::vector<uint8_t> reply;
+        CHECK_EQUAL(0, request(commands::Opcode::GetStatus, {}, &reply));
+        CHECK(reply.size() == 1 && reply[0] == static_cast<uint8_t>(ErrorCode::NO_ERROR));
+        CHECK(!isErrorLocked());
+        CHECK_EQUAL(0, serialControl::getDroppedFrames());
+    }
+
+    // A one frame song used to get a loop from 0 to 0, and a loop past the end of the song went
+    // through to the render loop, both locked the device up
+    void loopRangeIsChecked()
+    {
+        CHECK(upload("one frame", 1));
+        CHECK(waitForSong("one frame"));
+        usleep(20000); // the loop is set by the same event that swaps the song in
+        std::vector<uint8_t> reply;
+        CHECK_EQUAL(0, request(commands::Opcode::GetLoopSetting, {}, &reply));
+        CHECK(reply == std::vector<uint8_t>({1, 0, 0, 1, 0}));
+
+        const uint8_t invalid = static_cast<uint8_t>(commands::Status::InvalidArgument);
+        CHECK_EQUAL(invalid, request(commands::Opcode::SetLoopSetting, {1, 0, 0, 2, 0})); // past the end
+        CHECK_EQUAL(invalid, request(commands::Opcode::SetLoopSetting, {1, 1, 0, 1, 0})); // empty
+        CHECK_EQUAL(invalid, request(commands::Opcode::SetLoopSetting, {0, 0, 0, 0, 0}));
+        CHECK_EQUAL(0, request(commands::Opcode::SetLoopSetting, {0, 0, 0, 1, 0}));
+        for (int i = 0; i < 2000 && reply[0] != 0; i++)
+        {
+            usleep(1000); // the render loop may still be blinking for the upload
+            CHECK_EQUAL(0, request(commands::Opcode::GetLoopSetting, {}, &reply));
+        }
+        CHECK(reply == std::vector<uint8_t>({0, 0, 0, 1, 0}));
+        CHECK(!isErrorLocked());
+    }
+
+    // The network thread is held up between two polls for longer than the frame timeout while the
+    // rest of a frame comes in. It was dropped before the bytes waiting in the RX buffer were read.
+    void frameBufferedAcrossLongGap()
+    {
+        const uint32_t dropped = serialControl::getDroppedFrames();
+        const std::vector<uint8_t> payload = {static_cast<uint8_t>(commands::Opcode::GetStatus)};
+        const std::vector<uint8_t> frame = requestFrame(payload);
+        clockPaused.store(true); // so the frame can't time out while it is polled
+        CHECK(write(port, frame.data(), 2) == 2);
+        usleep(5000); // polled, the frame is under way
+        pollStalled.store(true);
+        usleep(5000);
+        CHECK(write(port, frame.data() + 2, frame.size() - 2) == (ssize_t)frame.size() - 2);
+        const unsigned long stalledAt = millis();
+        clockPaused.store(false);
+        while (millis() - stalledAt < 4 * serialControl::frameTimeoutMillis)
+        {
+            usleep(1000);
+        }
+        pollStalled.store(false);
+
+        CHECK_EQUAL(0, readReply(payload));
+        CHECK_EQUAL(dropped, serialControl::getDroppedFrames());
+    }
+
+    void badFramesAreDropped()
+    {
+        const uint8_t corrupt[] = {serialControl::syncByte, 1, 0, static_cast<uint8_t>(commands::Opcode::GetStatus), 0, 0};
+        CHECK(write(port, corrupt, sizeof(corrupt)) == sizeof(corrupt));
+        CHECK_EQUAL(0, request(commands::Opcode::GetStatus)); // still in step after the bad frame
+        CHECK_EQUAL(1, serialControl::getDroppedFrames());
+    }
+} // namespace
+
+int main()
+{
+    const char *path = sim::attachSerialPty();
+    CHECK(path != nullptr);
+    if (path == nullptr)
+    {
+        return test::finish();
+    }
+    port = open(path, O_RDWR | O_NOCTTY);
+    CHECK(port >= 0);
+
+    sim::setMicros(1000000);
+    settings::init();
+    lights::init();
+    InitBuffer();
+    serialControl::begin();
+
+    // THREAD 0, the same steps as loop()
+    std::thread render([]() {
+        while (running.load())
+        {
+            if (!isErrorLocked())
+            {
+                Event e;
+                while (PopEvent(&e))
+                {
+                    RunEvent(e);
+                }
+                lights::updateAnimation();
+            }
+            usleep(200);
+        }
+    });
+    // Time moves for the BlinkSuccess wait inside the upload event as well
+    std::thread clock([]() {
+        while (clockRunning.load())
+        {
+            if (!clockPaused.load())
+            {
+                sim::advanceMicros(1000);
+            }
+            usleep(20);
+        }
+    });
+    // NETWORK THREAD
+    std::thread network([]() {
+        while (running.load())
+        {
+            if (!pollStalled.load())
+            {
+                serialControl::poll();
+            }
+            delay(1);
+        }
+    });
+
+    RUN_TEST(uploadAndPlay);
+    RUN_TEST(reuploadWhilePlaying);
+    RUN_TEST(loopRangeIsChecked);
+    RUN_TEST(frameBufferedAcrossLongGap);
+    RUN_TEST(badFramesAreDropped);
+
+    running.store(false);
+    network.join();
+    render.join(); // may be waiting out a BlinkSuccess, so the clock stops last
+    clockRunning.store(false);
+    clock.join();
+    close(port);
+    return test::finish();
+}
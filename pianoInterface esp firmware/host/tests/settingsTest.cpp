@@ -0,0 +1,265 @@
+#include <atomic>
+#include <esp_partition.h>
+#include <math.h>
+#include <sim.h>
+#include <string.h>
+#include <thread>
+
+#include "circularBuffer.h"
+#include "commands.h"
+#include "m_constants.h"
+#include "settings.h"
+#include "test.h"
+
+// The settings journal on the simulated flash
+
+namespace
+{
+    constexpr uint32_t slotSize = 64;       // see settings.cpp
+    constexpr uint32_t slotsPerSector = 64; // including the header slot
+
+    void startFresh()
+    {
+        sim::eraseFlash();
+        settings::init();
+        settings::loadSettings();
+    }
+
+    void defaultsWhenNothingSaved()
+    {
+        startFresh();
+        color ambiant = settings::getColorSetting(settings::Colors::Ambiant);
+        CHECK_EQUAL(21, ambiant.r);
+        CHECK_EQUAL(255, settings::getColorSetting(settings::Colors::WhiteBalance).g);
+        CHECK(settings::getFloatSetting(settings::Floats::ChordWindow) == 0.3f);
+    }
+
+    void committedSettingsComeBack()
+    {
+        startFresh();
+        settings::saveColorSetting(settings::Colors::IndicateWhite, {1, 2, 3});
+        settings::saveFloatSetting(settings::Floats::IndicateFadeTime, 1.5f);
+        settings::saveLedLayout({10, 12, 0});
+        settings::commitSettings();
+
+        // Changed but not committed, a reload throws it away
+        settings::saveColorSetting(settings::Colors::IndicateWhite, {9, 9, 9});
+        settings::loadSettings();
+
+        color indicate = settings::getColorSetting(settings::Colors::IndicateWhite);
+        CHECK_EQUAL(1, indicate.r);
+        CHECK_EQUAL(3, indicate.b);
+        CHECK(settings::getFloatSetting(settings::Floats::IndicateFadeTime) == 1.5f);
+        CHECK(settings::getLedLayout() == (settings::ledLayout{10, 12, 0}));
+        CHECK(settings::getPalette().layout == (settings::ledLayout{10, 12, 0}));
+    }
+
+    void newestOfManyCommitsWins()
+    {
+        startFresh();
+        // Enough to fill a sector and move over to the other one a few times
+        for (int i = 0; i < 300; i++)
+        {
+            settings::saveColorSetting(settings::Colors::Ambiant, {(uint8_t)i, 0, 0});
+            settings::commitSettings();
+        }
+        settings::loadSettings();
+        CHECK_EQUAL(299 & 0xFF, settings::getColorSetting(settings::Colors::Ambiant).r);
+    }
+
+    void tornRecordFallsBack()
+    {
+        startFresh();
+        settings::saveColorSetting(settings::Colors::Ambiant, {50, 0, 0});
+        settings::commitSettings(); // sector 0 slot 1
+        settings::saveColorSetting(settings::Colors::Ambiant, {60, 0, 0});
+        settings::commitSettings(); // sector 0 slot 2
+
+        // A bit of the payload never made it, which only the crc can tell
+        const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "settings");
+        const uint8_t cleared = 0;
+        CHECK_EQUAL(ESP_OK, esp_partition_write(partition, 2 * slotSize + 12, &cleared, 1));
+
+        settings::loadSettings();
+        CHECK_EQUAL(50, settings::getColorSetting(settings::Colors::Ambiant).r);
+    }
+
+    void restoreDefaultsIsSaved()
+    {
+        startFresh();
+        settings::saveColorSetting(settings::Colors::Ambiant, {70, 0, 0});
+        settings::commitSettings();
+        settings::restoreDefaults();
+        settings::loadSettings();
+        CHECK_EQUAL(21, settings::getColorSetting(settings::Colors::Ambiant).r);
+    }
+    // Every key has to land on the strip, from the setting and from the command
+    void layoutsMustFit()
+    {
+        startFresh();
+        const settings::ledLayout fits[] = {{_LEDCOUNT - 1, 16, 1}, {0, 16, 0}, {10, 12, 0}, {_LEDCOUNT - 11, 12, 1}};
+        const settings::ledLayout doesNotFit[] = {{1, 16, 0}, {_LEDCOUNT - 2, 16, 1}, {10, 24, 0}, {0, 0, 0}, {0, 16, 2}, {_LEDCOUNT, 1, 0}};
+        for (const settings::ledLayout &layout : fits)
+        {
+            CHECK(settings::layoutFits(layout));
+            CHECK(settings::saveLedLayout(layout));
+            CHECK(settings::getLedLayout() == layout);
+        }
+        for (const settings::ledLayout &layout : doesNotFit)
+        {
+            CHECK(!settings::layoutFits(layout));
+            CHECK(!settings::saveLedLayout(layout));
+            CHECK(settings::getLedLayout() == fits[3]);
+
+            const uint8_t request[] = {static_cast<uint8_t>(commands::Opcode::SetLedLayout), static_cast<uint8_t>(layout.firstLed & 0xFF),
+                                       static_cast<uint8_t>(layout.firstLed >> 8), layout.ledsPerKey, layout.reversed};
+            uint8_t reply[commands::maxReplySize];
+            CHECK_EQUAL(2, commands::dispatch(request, sizeof(request), reply, sizeof(reply)));
+            CHECK_EQUAL(static_cast<uint8_t>(commands::Status::InvalidArgument), reply[1]);
+        }
+    }
+
+    uint8_t changeFloatSetting(settings::Floats setting, float value)
+    {
+        uint8_t request[6] = {static_cast<uint8_t>(commands::Opcode::ChangeFloatSetting), static_cast<uint8_t>(setting)};
+        memcpy(request + 2, &value, sizeof(value));
+        uint8_t reply[commands::maxReplySize];
+        CHECK_EQUAL(2, commands::dispatch(request, sizeof(request), reply, sizeof(reply)));
+        Event e;
+        while (PopEvent(&e))
+        {
+            RunEvent(e);
+        }
+        return reply[1];
+    }
+
+    // Tolerances are turned into microseconds, which is undefined for a negative or NaN value
+    void floatSettingsMustBeUsable()
+    {
+        startFresh();
+        const float unusable[] = {NAN, INFINITY, -INFINITY, -1.0f, -0.001f};
+        for (float value : unusable)
+        {
+            CHECK_EQUAL(static_cast<uint8_t>(commands::Status::InvalidArgument), changeFloatSetting(settings::Floats::ReleaseTolerance, value));
+            CHECK(settings::getFloatSetting(settings::Floats::ReleaseTolerance) >= 0.0f);
+        }
+        CHECK_EQUAL(0, changeFloatSetting(settings::Floats::ReleaseTolerance, 0.0f));
+        CHECK(settings::getFloatSetting(settings::Floats::ReleaseTolerance) == 0.0f);
+        CHECK_EQUAL(0, changeFloatSetting(settings::Floats::ChordWindow, 0.5f));
+        CHECK(settings::getFloatSetting(settings::Floats::ChordWindow) == 0.5f);
+    }
+
+    // The network thread reads the settings while THREAD 0 changes them, several times a frame
+    void paletteCopiesNeverTear()
+    {
+        startFresh();
+        uint8_t snapshots[2][settings::snapshotSize];
+        for (uint8_t i = 0; i < 2; i++)
+        {
+            for (unsigned int setting = 0; setting < settings::colorSettingCount; setting++)
+            {
+                settings::saveColorSetting(setting, {(uint8_t)(i * 200), (uint8_t)(i * 200), (uint8_t)(i * 200)});
+            }
+            settings::saveFloatSetting(settings::Floats::IndicateFadeTime, i);
+            settings::saveFloatSetting(settings::Floats::LookaheadBrightness, i);
+            settings::copySnapshot(snapshots[i]);
+        }
+
+        std::atomic<bool> running(true);
+        std::thread writer([&]() {
+            // Switching every third change, so both palette buffers get both snapshots
+            for (unsigned int i = 0; running.load(); i++)
+            {
+                settings::restoreSnapshot(snapshots[(i / 3) % 2]);
+            }
+        });
+        unsigned int torn = 0;
+        for (int i = 0; i < 200000; i++)
+        {
+            settings::palette copy = settings::copyPalette();
+            const float first = copy.colors[0].r;
+            for (unsigned int setting = 0; setting < settings::colorSettingCount; setting++)
+            {
+                torn += copy.colors[setting].r != first || copy.colors[setting].b != first;
+            }
+            torn += copy.get(settings::Floats::IndicateFadeTime) != copy.get(settings::Floats::LookaheadBrightness);
+        }
+        running.store(false);
+        writer.join();
+        CHECK_EQUAL(0, torn);
+    }
+
+    // Commits a different Ambiant for every one of the first commits, then commits newValue with
+    // the power cut after every possible byte of it. Each time the device comes back with either
+    // the last value or the new one, and the journal still takes new commits after that.
+    void cutEveryByteOfCommit(int commits, uint8_t newValue)
+    {
+        size_t touched = 0;
+        for (size_t cut = 0; cut == 0 || cut < touched; cut++)
+        {
+            startFresh();
+            for (int i = 0; i < commits; i++)
+            {
+                settings::saveColorSetting(settings::Colors::Ambiant, {(uint8_t)i, 0, 0});
+                settings::commitSettings();
+            }
+            size_t before = sim::getFlashBytesTouched();
+            sim::cutFlashPowerAfter(cut);
+            settings::saveColorSetting(settings::Colors::Ambiant, {newValue, 0, 0});
+            settings::commitSettings();
+            sim::restoreFlashPower();
+            touched = sim::getFlashBytesTouched() - before;
+
+            settings::init();
+            settings::loadSettings();
+            uint8_t loaded = settings::getColorSetting(settings::Colors::Ambiant).r;
+            CHECK(loaded == commits - 1 || loaded == newValue);
+            if (loaded != commits - 1 && loaded != newValue)
+            {
+                printf("power cut after %zu of %zu bytes came back with %u\n", cut, touched, loaded);
+                return;
+            }
+
+            settings::saveColorSetting(settings::Colors::Ambiant, {(uint8_t)(newValue + 1), 0, 0});
+            settings::commitSettings();
+            settings::loadSettings();
+            CHECK_EQUAL(newValue + 1, settings::getColorSetting(settings::Colors::Ambiant).r);
+        }
+        CHECK(touched >= slotSize);
+    }
+
+    void powerCutDuringCommit()
+    {
+        cutEveryByteOfCommit(3, 200);
+    }
+
+    // The active sector is full so the commit erases the other one and starts it
+    void powerCutDuringSectorSwitch()
+    {
+        cutEveryByteOfCommit(slotsPerSector - 1, 200);
+    }
+
+    // The same, moving back onto a sector still full of older records
+    void powerCutDuringSecondSectorSwitch()
+    {
+        cutEveryByteOfCommit(2 * (slotsPerSector - 1), 200);
+    }
+} // namespace
+
+int main()
+{
+    sim::setSerialEcho(false);
+    InitBuffer();
+    RUN_TEST(defaultsWhenNothingSaved);
+    RUN_TEST(committedSettingsComeBack);
+    RUN_TEST(newestOfManyCommitsWins);
+    RUN_TEST(tornRecordFallsBack);
+    RUN_TEST(restoreDefaultsIsSaved);
+    RUN_TEST(layoutsMustFit);
+    RUN_TEST(floatSettingsMustBeUsable);
+    RUN_TEST(paletteCopiesNeverTear);
+    RUN_TEST(powerCutDuringCommit);
+    RUN_TEST(powerCutDuringSectorSwitch);
+    RUN_TEST(powerCutDuringSecondSectorSwitch);
+    return test::finish();
+}
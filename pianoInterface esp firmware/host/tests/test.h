@@ -0,0 +1,73 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdio.h>
+
+/**
+ * The smallest test harness that does the job. Each test file is one executable with its own
+ * copy of the firmware's globals, lists its tests in main() with RUN_TEST and returns finish().
+ * A failed CHECK prints where it was and carries on with the rest of the test.
+ */
+
+namespace test
+{
+
+inline int &failures()
+{
+    static int count = 0;
+    return count;
+}
+
+inline void fail(const char *file, int line, const char *expression)
+{
+    printf("%s:%d: CHECK(%s) failed\n", file, line, expression);
+    failures()++;
+}
+
+inline void failEqual(const char *file, int line, const char *expected, const char *actual, long long expectedValue, long long actualValue)
+{
+    printf("%s:%d: CHECK_EQUAL(%s, %s) failed, %lld != %lld\n", file, line, expected, actual, expectedValue, actualValue);
+    failures()++;
+}
+
+inline int finish()
+{
+    if (failures() != 0)
+    {
+        printf("%d checks failed\n", failures());
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
+
+} // namespace test
+
+#define CHECK(expression)                                   \
+    do                                                      \
+    {                                                       \
+        if (!(expression))                                  \
+        {                                                   \
+            test::fail(__FILE__, __LINE__, #expression);    \
+        }                                                   \
+    } while (0)
+
+#define CHECK_EQUAL(expected, actual)                                                                         \
+    do                                                                                                        \
+    {                                                                                                         \
+        long long expectedValue = (long long)(expected);                                                     \
+        long long actualValue = (long long)(actual);                                                         \
+        if (expectedValue != actualValue)                                                                     \
+        {                                                                                                     \
+            test::failEqual(__FILE__, __LINE__, #expected, #actual, expectedValue, actualValue);              \
+        }                                                                                                     \
+    } while (0)
+
+#define RUN_TEST(name)           \
+    do                           \
+    {                            \
+        printf("%s\n", #name);   \
+        name();                  \
+    } while (0)
+
+#endif
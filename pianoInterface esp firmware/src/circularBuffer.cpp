@@ -29,19 +29,22 @@ int EventQueLength(){
     return eventCount;
 }
 
-// Adds a new event which will be executed on the main thread
-void PushEvent(Event e){
+// Adds a new event which will be executed on the main thread. Returns false and leaves the que as it
+// was if it is full, so requests from clients can be turned away instead of locking up the device.
+bool TryPushEvent(Event e){
     if(!assert_fatal(bufferInit, ErrorCode::BUFFER_OVERRUN)){
-        return;
+        return false;
     }
     xSemaphoreTake(xMutex, portMAX_DELAY);
 
-    if(!assert_fatal(eventCount < eventBufferSize, ErrorCode::BUFFER_OVERRUN)){
-        return;
+    if(eventCount >= eventBufferSize){
+        xSemaphoreGive(xMutex);
+        return false;
     }
 
     if(!assert_fatal(head < eventBufferSize, ErrorCode::IMPOSSIBLE_INTERNAL)){
-        return;
+        xSemaphoreGive(xMutex);
+        return false;
     }
 
     eventBuffer[head] = e;
@@ -54,14 +57,63 @@ void PushEvent(Event e){
     }
 
     xSemaphoreGive(xMutex);
+    return true;
+}
+
+bool TryPushEvent(void (*Action)()){
+    Event e = {};
+    e.action = Action;
+    return TryPushEvent(e);
+}
+
+bool TryPushEvent(void (*Action)(const EventParam *), int32_t A, int32_t B, int32_t C, int32_t D){
+    Event e = {};
+    e.paramAction = Action;
+    e.params[0].i = A;
+    e.params[1].i = B;
+    e.params[2].i = C;
+    e.params[3].i = D;
+    return TryPushEvent(e);
+}
+
+bool TryPushEvent(void (*Action)(const EventParam *), int32_t A, float B){
+    Event e = {};
+    e.paramAction = Action;
+    e.params[0].i = A;
+    e.params[1].f = B;
+    return TryPushEvent(e);
+}
+
+// Adds a new event which will be executed on the main thread. A full que is a fatal error,
+// for events the firmware itself can't do without.
+void PushEvent(Event e){
+    assert_fatal(TryPushEvent(e), ErrorCode::BUFFER_OVERRUN);
 }
 
 void PushEvent(void (*Action)()){
-    Event e;
+    Event e = {};
     e.action = Action;
     PushEvent(e);
 }
 
+void PushEvent(void (*Action)(const EventParam *), int32_t A, int32_t B, int32_t C, int32_t D){
+    Event e = {};
+    e.paramAction = Action;
+    e.params[0].i = A;
+    e.params[1].i = B;
+    e.params[2].i = C;
+    e.params[3].i = D;
+    PushEvent(e);
+}
+
+void PushEvent(void (*Action)(const EventParam *), int32_t A, float B){
+    Event e = {};
+    e.paramAction = Action;
+    e.params[0].i = A;
+    e.params[1].f = B;
+    PushEvent(e);
+}
+
 // THREAD 0 ONLY: Takes an event from the event que  
 bool PopEvent(Event * e){
     assert_fatal(bufferInit, ErrorCode::BUFFER_OVERRUN);
@@ -87,4 +139,14 @@ bool PopEvent(Event * e){
 
     xSemaphoreGive(xMutex);
     return true;
+}
+
+// THREAD 0 ONLY: Executes an event taken from the event que
+void RunEvent(const Event &e){
+    if(e.paramAction != nullptr){
+        e.paramAction(e.params);
+    }
+    else{
+        e.action();
+    }
 }
\ No newline at end of file
@@ -11,8 +11,21 @@
 //         void (*animationAction)(lights::AnimationMode);
 //     };
 // };
-union Event{
+
+// Argument passed along with an event
+union EventParam{
+    int32_t i;
+    float f;
+};
+
+constexpr unsigned int eventParamCount = 4;
+
+// Either action or paramAction is called when the event is handled. Use
+// paramAction to pass values from another thread to THREAD 0.
+struct Event{
     void (*action)();
+    void (*paramAction)(const EventParam *params);
+    EventParam params[eventParamCount];
 };
 
 constexpr unsigned int eventBufferSize = 100;
@@ -23,7 +36,14 @@ int EventQueLength();
 
 void PushEvent(Event e);
 void PushEvent(void (*Action)());
-#define _pushModeSwitchEvent(mode) PushEvent([]() {lights::setAnimationMode(mode);});
+void PushEvent(void (*Action)(const EventParam *), int32_t A, int32_t B = 0, int32_t C = 0, int32_t D = 0);
+void PushEvent(void (*Action)(const EventParam *), int32_t A, float B);
+bool TryPushEvent(Event e);
+bool TryPushEvent(void (*Action)());
+bool TryPushEvent(void (*Action)(const EventParam *), int32_t A, int32_t B = 0, int32_t C = 0, int32_t D = 0);
+bool TryPushEvent(void (*Action)(const EventParam *), int32_t A, float B);
+#define _tryPushModeSwitchEvent(mode) TryPushEvent([]() {lights::setAnimationMode(mode);})
 bool PopEvent(Event * e);
+void RunEvent(const Event &e);
 
 #endif
\ No newline at end of file
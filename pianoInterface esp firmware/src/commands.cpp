@@ -0,0 +1,560 @@
+#include <Arduino.h>
+#include <math.h>
+
+#include "circularBuffer.h"
+#include "commands.h"
+#include "httpServer.h"
+#include "latency.h"
+#include "ledStream.h"
+#include "lighting/lighting.h"
+#include "m_error.h"
+#include "m_constants.h"
+#include "memoryStats.h"
+#include "metrics.h"
+#include "music.h"
+#include "network.h"
+#include "ota.h"
+#include "profiler.h"
+#include "settings.h"
+#include "trace.h"
+
+namespace
+{
+    using commands::Status;
+
+    // State of the song upload in progress. Only touched by the network thread.
+    struct songUpload
+    {
+        bool active;
+        bool handOverPending; // finished and staged, but THREAD 0 hasn't been sent the event to take it yet
+        unsigned int expectedFrames;
+        unsigned int expectedNotes;
+        unsigned int frames;
+        unsigned int notes;
+        uint8_t frameLength;
+        uint8_t frameNotes[_PIANOSIZE];
+    };
+
+    songUpload upload = {};
+
+    typedef Status (*commandHandler)(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity);
+
+    struct commandEntry
+    {
+        const char *requestFormat;
+        const char *replyFormat;
+        commandHandler handler;
+        bool traced; // changes what the lights show, so the trace keeps it for the replay
+    };
+
+    uint16_t readU16(const uint8_t *data)
+    {
+        return data[0] | (data[1] << 8);
+    }
+
+    void writeU16(uint8_t *data, uint16_t value)
+    {
+        data[0] = value & 0xFF;
+        data[1] = value >> 8;
+    }
+
+    void writeU32(uint8_t *data, uint32_t value)
+    {
+        data[0] = value & 0xFF;
+        data[1] = (value >> 8) & 0xFF;
+        data[2] = (value >> 16) & 0xFF;
+        data[3] = value >> 24;
+    }
+
+    Status getStatus(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        reply[0] = static_cast<uint8_t>(getCurrentError());
+        *replyLength = 1;
+        return Status::OK;
+    }
+
+    Status getSongIndex(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        writeU16(reply, music::currentFrameIndex());
+        *replyLength = 2;
+        return Status::OK;
+    }
+
+    Status setSongIndex(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        bool queued = TryPushEvent([](const EventParam *params) {
+            music::setFrame(params[0].i);
+            lights::forceRefresh();
+        }, readU16(payload));
+        return queued ? Status::OK : Status::Busy;
+    }
+
+    Status getSongName(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        const char *name = music::getSongName();
+        unsigned int length = strlen(name);
+        if (length > replyCapacity)
+        {
+            length = replyCapacity;
+        }
+        memcpy(reply, name, length);
+        *replyLength = length;
+        return Status::OK;
+    }
+
+    Status changeSetting(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        if (payload[0] >= settings::colorSettingCount)
+        {
+            return Status::InvalidArgument;
+        }
+        bool queued = TryPushEvent([](const EventParam *params) {
+            settings::saveColorSetting(static_cast<unsigned int>(params[0].i),
+                                       {static_cast<uint8_t>(params[1].i), static_cast<uint8_t>(params[2].i), static_cast<uint8_t>(params[3].i)});
+        }, payload[0], payload[1], payload[2], payload[3]);
+        return queued ? Status::OK : Status::Busy;
+    }
+
+    Status getSetting(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        if (payload[0] >= settings::colorSettingCount)
+        {
+            return Status::InvalidArgument;
+        }
+        // The published palette, the values behind it belong to THREAD 0. Every byte comes back exactly out of the float.
+        color col = colorFToColor(settings::copyPalette().colors[payload[0]]);
+        reply[0] = col.r;
+        reply[1] = col.g;
+        reply[2] = col.b;
+        *replyLength = 3;
+        return Status::OK;
+    }
+
+    Status changeFloatSetting(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        if (payload[0] >= settings::floatSettingCount)
+        {
+            return Status::InvalidArgument;
+        }
+        float value;
+        memcpy(&value, payload + 1, sizeof(value));
+        // All of them are times, counts or levels
+        if (!isfinite(value) || value < 0.0f)
+        {
+            return Status::InvalidArgument;
+        }
+        bool queued = TryPushEvent([](const EventParam *params) {
+            settings::saveFloatSetting(static_cast<settings::Floats>(params[0].i), params[1].f);
+        }, payload[0], value);
+        return queued ? Status::OK : Status::Busy;
+    }
+
+    Status getFloatSetting(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        if (payload[0] >= settings::floatSettingCount)
+        {
+            return Status::InvalidArgument;
+        }
+        float value = settings::copyPalette().floats[payload[0]];
+        memcpy(reply, &value, sizeof(value));
+        *replyLength = sizeof(value);
+        return Status::OK;
+    }
+
+    Status setLoopSetting(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        unsigned int start = readU16(payload + 1);
+        unsigned int end = readU16(payload + 3);
+        if (start >= end || end > music::frameCount())
+        {
+            return Status::InvalidArgument;
+        }
+        bool queued = TryPushEvent([](const EventParam *params) {
+            // A shorter song may have been swapped in since the range was checked
+            if (static_cast<unsigned int>(params[2].i) > music::frameCount())
+            {
+                return;
+            }
+            music::setLoopingSettings(params[0].i != 0, params[1].i, params[2].i);
+            lights::forceRefresh();
+        }, payload[0], start, end);
+        return queued ? Status::OK : Status::Busy;
+    }
+
+    Status getLoopSetting(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        reply[0] = music::getLoopingEnabled() ? 1 : 0;
+        writeU16(reply + 1, music::getLoopStart());
+        writeU16(reply + 3, music::getLoopEnd());
+        *replyLength = 5;
+        return Status::OK;
+    }
+
+    Status restoreSettings(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        bool queued = TryPushEvent([]() {
+            settings::restoreDefaults();
+        });
+        return queued ? Status::OK : Status::Busy;
+    }
+
+    Status saveSettings(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        bool queued = TryPushEvent([]() {
+            settings::commitSettings();
+        });
+        return queued ? Status::OK : Status::Busy;
+    }
+
+    Status setAnimationMode(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        bool queued;
+        switch (payload[0])
+        {
+        case 0:
+            queued = _tryPushModeSwitchEvent(lights::AnimationMode::None);
+            break;
+        case 1:
+            queued = _tryPushModeSwitchEvent(lights::AnimationMode::Ambiant);
+            break;
+        case 2:
+            queued = _tryPushModeSwitchEvent(lights::AnimationMode::ColorfulIdle);
+            break;
+        case 3:
+            queued = _tryPushModeSwitchEvent(lights::AnimationMode::KeyIndicate);
+            break;
+        case 4:
+            queued = _tryPushModeSwitchEvent(lights::AnimationMode::KeyIndicateFade);
+            break;
+        case 5:
+            queued = _tryPushModeSwitchEvent(lights::AnimationMode::Waiting);
+            break;
+        case 6:
+            queued = _tryPushModeSwitchEvent(lights::AnimationMode::Stream);
+            break;
+        default:
+            return Status::InvalidArgument;
+        }
+        return queued ? Status::OK : Status::Busy;
+    }
+
+    Status getStreamStats(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        ledStream::streamStats stats = ledStream::getStats();
+        const uint32_t values[] = {stats.packetsRecieved, stats.packetsLost, stats.framesRecieved, stats.framesOverflowed,
+                                   stats.framesLate, stats.framesIncomplete, stats.framesShown, stats.latencyLastMicros,
+                                   stats.latencyMaxMicros, stats.latencyAverageMicros};
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        {
+            writeU32(reply + i * 4, values[i]);
+        }
+        *replyLength = sizeof(values);
+        return Status::OK;
+    }
+
+    // THREAD 0 takes the staged song between two frames, nothing reads it half written. With the event que
+    // full the song stays staged, and the next EndSongUpload or BeginSongUpload tries again.
+    bool handOverUpload()
+    {
+        bool queued = TryPushEvent([](const EventParam *params) {
+            if (!music::swapInUpload())
+            {
+                return;
+            }
+            music::setLoopingSettings(true, 0, params[0].i); // the end is one past the last frame
+            lights::setAnimationMode(lights::AnimationMode::BlinkSuccess);
+            while (!lights::animationCompleted())
+            {
+                lights::updateAnimation();
+            }
+            lights::setAnimationMode(lights::AnimationMode::Waiting);
+        }, upload.frames);
+        upload.handOverPending = !queued;
+        return queued;
+    }
+
+    Status beginSongUpload(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        if (upload.handOverPending)
+        {
+            handOverUpload();
+            return Status::Busy;
+        }
+        unsigned int frames = readU16(payload);
+        unsigned int notes = readU16(payload + 2);
+        if (frames == 0 || frames > music::maxSongLength || notes > music::maxNoteCount)
+        {
+            return Status::InvalidArgument;
+        }
+
+        // The live song keeps playing while the new one goes into the other buffer
+        if (!music::beginUpload(reinterpret_cast<const char *>(payload + 4), payloadLength - 4))
+        {
+            return Status::Busy;
+        }
+        upload = {};
+        upload.active = true;
+        upload.expectedFrames = frames;
+        upload.expectedNotes = notes;
+        return Status::OK;
+    }
+
+    Status songData(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        if (!upload.active)
+        {
+            return Status::InvalidArgument;
+        }
+        for (unsigned int i = 0; i < payloadLength; i++)
+        {
+            if (payload[i] == music::frameEndMarker)
+            {
+                if (upload.frames >= upload.expectedFrames)
+                {
+                    upload.active = false;
+                    return Status::InvalidArgument;
+                }
+                if (!music::uploadFrame(upload.frameNotes, upload.frameLength))
+                {
+                    upload.active = false;
+                    return Status::InvalidArgument;
+                }
+                upload.frames++;
+                upload.frameLength = 0;
+            }
+            else
+            {
+                if (upload.notes >= upload.expectedNotes || upload.frameLength >= _PIANOSIZE)
+                {
+                    upload.active = false;
+                    return Status::InvalidArgument;
+                }
+                upload.frameNotes[upload.frameLength++] = payload[i];
+                upload.notes++;
+            }
+        }
+        return Status::OK;
+    }
+
+    Status endSongUpload(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        if (!upload.handOverPending)
+        {
+            bool complete = upload.active && upload.frameLength == 0 &&
+                            upload.frames == upload.expectedFrames && upload.notes == upload.expectedNotes;
+            upload.active = false;
+            if (!complete || !music::endUpload())
+            {
+                return Status::InvalidArgument;
+            }
+            upload.handOverPending = true;
+        }
+
+        return handOverUpload() ? Status::OK : Status::Busy;
+    }
+
+    Status getHeapStats(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        memoryStats::heapStats stats = memoryStats::getHeapStats();
+        const uint32_t values[] = {stats.allocations, stats.frees, stats.freeBytes, stats.minimumFreeBytes,
+                                   stats.largestFreeBlock, http::getLastRequestAllocations()};
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        {
+            writeU32(reply + i * 4, values[i]);
+        }
+        *replyLength = sizeof(values);
+        return Status::OK;
+    }
+
+    Status getNetworkStatus(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        reply[0] = static_cast<uint8_t>(network::getConnectionState());
+        reply[1] = network::isAccessPointActive() ? 1 : 0;
+        *replyLength = 2;
+        return Status::OK;
+    }
+
+    Status getOtaStatus(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        ota::otaStatus status = ota::getStatus();
+        reply[0] = static_cast<uint8_t>(status.state);
+        writeU32(reply + 1, status.bytesWritten);
+        writeU32(reply + 5, status.imageSize);
+        writeU32(reply + 9, status.frameMaxMicros);
+        writeU32(reply + 13, status.frameAverageMicros);
+        *replyLength = 17;
+        return Status::OK;
+    }
+
+    Status setLedLayout(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        uint16_t firstLed = readU16(payload);
+        if (!settings::layoutFits({firstLed, payload[2], payload[3]}))
+        {
+            return Status::InvalidArgument;
+        }
+        bool queued = TryPushEvent([](const EventParam *params) {
+            settings::saveLedLayout({static_cast<uint16_t>(params[0].i), static_cast<uint8_t>(params[1].i), static_cast<uint8_t>(params[2].i)});
+        }, firstLed, payload[2], payload[3]);
+        return queued ? Status::OK : Status::Busy;
+    }
+
+    Status getLedLayout(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        settings::ledLayout layout = settings::copyPalette().layout;
+        writeU16(reply, layout.firstLed);
+        reply[2] = layout.ledsPerKey;
+        reply[3] = layout.reversed;
+        *replyLength = 4;
+        return Status::OK;
+    }
+
+    Status getLatencyStats(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        writeU32(reply, latency::getSampleCount());
+        *replyLength = 4;
+        for (unsigned int i = 0; i < latency::stageCount; i++)
+        {
+            latency::stageStats stats = latency::getStats(static_cast<latency::Stage>(i));
+            writeU32(reply + *replyLength, stats.p50Micros);
+            writeU32(reply + *replyLength + 4, stats.p99Micros);
+            writeU32(reply + *replyLength + 8, stats.maxMicros);
+            *replyLength += 12;
+        }
+        return Status::OK;
+    }
+
+    Status resetLatencyStats(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        latency::reset();
+        return Status::OK;
+    }
+
+    Status getMetricsText(const uint8_t *payload, unsigned int payloadLength, uint8_t *reply, unsigned int *replyLength, unsigned int replyCapacity)
+    {
+        unsigned int offset = readU16(payload);
+        unsigned int length = offset == 0 ? metrics::snapshot() : metrics::getTextLength();
+        if (offset > length)
+        {
+            return Status::InvalidArgument;
+        }
+        unsigned int count = length - offset < replyCapacity ? length - offset : replyCapacity;
+        memcpy(reply, metrics::getText() + offset, count);
+        *replyLength = count;
+        return Status::OK;
+    }
+
+    // Indexed by opcode. Reads aren't traced, nor are songs, which the trace dump carries whole
+    // instead of as the upload chunks. Saving settings doesn't change what is shown.
+    const commandEntry commandTable[commands::opcodeCount] = {
+        {nullptr, nullptr, nullptr, false},
+        {"", "B", getStatus, false},
+        {"", "H", getSongIndex, false},
+        {"H", "", setSongIndex, true},
+        {"", "s", getSongName, false},
+        {"BBBB", "", changeSetting, true},
+        {"B", "BBB", getSetting, false},
+        {"Bf", "", changeFloatSetting, true},
+        {"B", "f", getFloatSetting, false},
+        {"BHH", "", setLoopSetting, true},
+        {"", "BHH", getLoopSetting, false},
+        {"", "", restoreSettings, true},
+        {"", "", saveSettings, false},
+        {"B", "", setAnimationMode, true},
+        {"", "IIIIIIIIII", getStreamStats, false},
+        {"HHs", "", beginSongUpload, false},
+        {"s", "", songData, false},
+        {"", "", endSongUpload, false},
+        {"", "IIIIII", getHeapStats, false},
+        {"", "BB", getNetworkStatus, false},
+        {"", "BIIII", getOtaStatus, false},
+        {"HBB", "", setLedLayout, true},
+        {"", "HBB", getLedLayout, false},
+        {"", "IIIIIIIIIIIII", getLatencyStats, false},
+        {"", "", resetLatencyStats, false},
+        {"H", "s", getMetricsText, false}};
+
+    static_assert(commands::formatSize("IIIIIIIIIIIII") + 2 <= commands::maxReplySize, "maxReplySize is too small for every reply");
+} // namespace
+
+namespace commands
+{
+
+// Gets the payload layout of a command. Returns false if the opcode doesn't exist.
+bool getInfo(uint8_t opcode, commandInfo *info)
+{
+    if (opcode >= opcodeCount || commandTable[opcode].handler == nullptr)
+    {
+        return false;
+    }
+    info->requestFormat = commandTable[opcode].requestFormat;
+    info->replyFormat = commandTable[opcode].replyFormat;
+    return true;
+}
+
+// Runs a request and writes the reply. Returns the length of the reply.
+// Safe to call from any thread other than THREAD 0 as changes are applied through the event que.
+unsigned int dispatch(const uint8_t *request, unsigned int requestLength, uint8_t *reply, unsigned int replyCapacity)
+{
+    PROFILE_ZONE("dispatch");
+    if (requestLength != 0 && request[0] < opcodeCount && commandTable[request[0]].traced)
+    {
+        trace::recordCommand(request, requestLength);
+    }
+    if (replyCapacity < 2)
+    {
+        return 0;
+    }
+    reply[0] = requestLength == 0 ? 0 : request[0];
+
+    Status status;
+    unsigned int replyLength = 0;
+    if (requestLength == 0)
+    {
+        status = Status::BadLength;
+    }
+    else if (request[0] >= opcodeCount || commandTable[request[0]].handler == nullptr)
+    {
+        status = Status::UnknownOpcode;
+    }
+    else
+    {
+        const commandEntry &entry = commandTable[request[0]];
+        const unsigned int payloadLength = requestLength - 1;
+        const unsigned int fixedLength = formatSize(entry.requestFormat);
+        const bool variableLength = strchr(entry.requestFormat, 's') != nullptr;
+        if ((variableLength ? payloadLength < fixedLength : payloadLength != fixedLength) ||
+            replyCapacity - 2 < formatSize(entry.replyFormat))
+        {
+            status = Status::BadLength;
+        }
+        else
+        {
+            status = entry.handler(request + 1, payloadLength, reply + 2, &replyLength, replyCapacity - 2);
+        }
+    }
+
+    reply[1] = static_cast<uint8_t>(status);
+    return status == Status::OK ? 2 + replyLength : 2;
+}
+
+const char *statusText(Status status)
+{
+    switch (status)
+    {
+    case Status::OK:
+        return "OK";
+    case Status::UnknownOpcode:
+        return "Unknown command";
+    case Status::BadLength:
+        return "Wrong payload length";
+    case Status::InvalidArgument:
+        return "Invalid argument";
+    case Status::Busy:
+        return "Busy, try again";
+    default:
+        return "Unknown status";
+    }
+}
+
+} // namespace commands
@@ -0,0 +1,90 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdint.h>
+
+/**
+ * The control protocol shared by every transport (HTTP, WebSocket and serial).
+ *
+ * Request: [opcode, payload...]
+ * Reply:   [opcode, status, payload...]
+ *
+ * Every opcode has a fixed payload layout described by a format string, one character per field:
+ * B = uint8, H = uint16, I = uint32, f = float32, s = bytes/string (rest of the payload, only as the last field).
+ * Multi byte values are little endian. The dispatcher itself never allocates.
+ *
+ * A song is uploaded with BeginSongUpload, any number of SongData chunks and then EndSongUpload.
+ * Song data is the note bytes of each frame followed by music::frameEndMarker. The song playing
+ * carries on until EndSongUpload, and BeginSongUpload replies Busy until the render loop has
+ * taken up the last upload.
+ *
+ * Changes are handed to the render loop through the event que. When it is full the command
+ * replies Busy and changes nothing, send it again later.
+ */
+
+namespace commands
+{
+
+enum class Opcode : uint8_t
+{
+    GetStatus = 0x01,          // -> B error code
+    GetSongIndex = 0x02,       // -> H index
+    SetSongIndex = 0x03,       // H index
+    GetSongName = 0x04,        // -> s name
+    ChangeSetting = 0x05,      // B setting, B r, B g, B b
+    GetSetting = 0x06,         // B setting -> B r, B g, B b
+    ChangeFloatSetting = 0x07, // B setting, f value
+    GetFloatSetting = 0x08,    // B setting -> f value
+    SetLoopSetting = 0x09,     // B enabled, H start, H end, end is one past the last frame
+    GetLoopSetting = 0x0A,     // -> B enabled, H start, H end
+    RestoreSettings = 0x0B,
+    SaveSettings = 0x0C,
+    SetAnimationMode = 0x0D,   // B mode (0 None, 1 Ambiant, 2 ColorfulIdle, 3 KeyIndicate, 4 KeyIndicateFade, 5 Waiting, 6 Stream)
+    GetStreamStats = 0x0E,     // -> I x 10, see ledStream::streamStats
+    BeginSongUpload = 0x0F,    // H frames, H notes, s name
+    SongData = 0x10,           // s song data
+    EndSongUpload = 0x11,      // checks the frame and note counts then starts the song
+    GetHeapStats = 0x12,       // -> I x 5 see memoryStats::heapStats, I allocations during the last HTTP request
+    GetNetworkStatus = 0x13,   // -> B network::ConnectionState, B access point active
+    GetOtaStatus = 0x14,       // -> B ota::State, I x 4 see ota::otaStatus
+    SetLedLayout = 0x15,       // H first LED, B LEDs per key in 16ths, B reversed, see settings::ledLayout. Every key has to be on the strip.
+    GetLedLayout = 0x16,       // -> H first LED, B LEDs per key in 16ths, B reversed
+    GetLatencyStats = 0x17,    // -> I samples, then I p50, I p99, I max in micros for each latency::Stage
+    ResetLatencyStats = 0x18,
+    GetMetricsText = 0x19      // H offset -> s the Prometheus text from offset on, as much as fits. Offset 0 takes a new snapshot.
+};
+constexpr unsigned int opcodeCount = 0x1A;
+
+enum class Status : uint8_t
+{
+    OK = 0,
+    UnknownOpcode = 1,
+    BadLength = 2,
+    InvalidArgument = 3,
+    Busy = 4 // the event que is full or the last song upload hasn't been taken up by the render loop yet
+};
+
+constexpr unsigned int maxRequestSize = 256; // transports never pass on anything longer
+constexpr unsigned int maxReplySize = 64;
+
+struct commandInfo
+{
+    const char *requestFormat;
+    const char *replyFormat;
+};
+
+bool getInfo(uint8_t opcode, commandInfo *info);
+
+unsigned int dispatch(const uint8_t *request, unsigned int requestLength, uint8_t *reply, unsigned int replyCapacity);
+
+const char *statusText(Status status);
+
+// Size in bytes of a fixed format (strings count as 0)
+constexpr unsigned int formatSize(const char *format)
+{
+    return *format == '\0' ? 0 : (*format == 'B' ? 1 : *format == 'H' ? 2 : (*format == 'I' || *format == 'f') ? 4 : 0) + formatSize(format + 1);
+}
+
+} // namespace commands
+
+#endif
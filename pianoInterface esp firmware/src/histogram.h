@@ -0,0 +1,117 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <atomic>
+#include <stdint.h>
+
+// A histogram of uint32 values, one writer and any number of readers. Buckets are a quarter of a
+// power of two wide so a percentile read back from it is within 25% of the real value, over the
+// whole uint32 range with a fixed 500 bytes. Recording is a couple of instructions and one
+// relaxed atomic add, so it can be used on the hot path.
+class histogram
+{
+public:
+    static constexpr unsigned int subBucketBits = 2;
+    static constexpr unsigned int subBuckets = 1 << subBucketBits;
+    static constexpr unsigned int bucketCount = (32 - subBucketBits + 1) * subBuckets;
+
+    void record(uint32_t value)
+    {
+        buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        if (value > maximum.load(std::memory_order_relaxed))
+        {
+            maximum.store(value, std::memory_order_relaxed);
+        }
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint32_t count() const
+    {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    uint32_t max() const
+    {
+        return maximum.load(std::memory_order_relaxed);
+    }
+
+    // Wraps after 4 billion, only good for rates and averages over a scrape interval
+    uint32_t valueSum() const
+    {
+        return sum.load(std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the given fraction (0 - 1) of the values, 0 if there are none
+    uint32_t percentile(float fraction) const
+    {
+        uint32_t values = count();
+        if (values == 0)
+        {
+            return 0;
+        }
+        uint32_t wanted = (uint32_t)(fraction * values + 0.5f);
+        wanted = wanted == 0 ? 1 : wanted;
+        uint32_t seen = 0;
+        for (unsigned int i = 0; i < bucketCount; i++)
+        {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= wanted)
+            {
+                uint32_t upper = bucketUpperBound(i);
+                return upper < max() ? upper : max();
+            }
+        }
+        return max();
+    }
+
+    // Values counted in one bucket, for exporting the whole histogram
+    uint32_t bucket(unsigned int index) const
+    {
+        return buckets[index].load(std::memory_order_relaxed);
+    }
+
+    // Not atomic as a whole, values recorded while it runs may be partly kept
+    void reset()
+    {
+        for (unsigned int i = 0; i < bucketCount; i++)
+        {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        maximum.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+    }
+
+    static unsigned int bucketIndex(uint32_t value)
+    {
+        if (value < subBuckets)
+        {
+            return value;
+        }
+        unsigned int exponent = 31 - __builtin_clz(value);
+        unsigned int mantissa = (value >> (exponent - subBucketBits)) & (subBuckets - 1);
+        return (exponent - subBucketBits + 1) * subBuckets + mantissa;
+    }
+
+    static uint32_t bucketUpperBound(unsigned int index)
+    {
+        if (index < subBuckets)
+        {
+            return index;
+        }
+        unsigned int exponent = index / subBuckets + subBucketBits - 1;
+        unsigned int mantissa = index % subBuckets;
+        uint64_t lower = (uint64_t)(subBuckets + mantissa) << (exponent - subBucketBits);
+        uint64_t upper = lower + ((uint64_t)1 << (exponent - subBucketBits)) - 1;
+        return upper > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)upper;
+    }
+
+private:
+    std::atomic<uint32_t> buckets[bucketCount] = {};
+    std::atomic<uint32_t> total{0};
+    std::atomic<uint32_t> maximum{0};
+    std::atomic<uint32_t> sum{0};
+};
+
+#endif
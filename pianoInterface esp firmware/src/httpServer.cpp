@@ -0,0 +1,380 @@
+#include <Arduino.h>
+#include <WiFi.h>
+
+#include "httpServer.h"
+#include "memoryStats.h"
+#include "metrics.h"
+
+namespace
+{
+    WiFiServer server(http::port);
+    WiFiClient client;
+    http::requestHandler handler = nullptr;
+
+    // NETWORK THREAD state
+    char headerBuffer[http::maxHeaderSize];
+    unsigned int headerLength = 0;
+    unsigned int bodyStart = 0;     // index in the header buffer of any body bytes read along with the header
+    unsigned int bodyRemaining = 0; // body bytes the handler hasn't read yet
+    unsigned long lastActivityMillis = 0;
+    bool responseSent = false;
+    uint32_t lastRequestAllocations = 0;
+
+    void closeClient()
+    {
+        client.stop();
+        headerLength = 0;
+        bodyStart = 0;
+        bodyRemaining = 0;
+    }
+
+    const char *statusText(int code)
+    {
+        switch (code)
+        {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 413:
+            return "Payload Too Large";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "Internal Server Error";
+        }
+    }
+
+    // Finds the value of a header (case insensitive name). Returns nullptr if it isn't there.
+    const char *findHeader(const char *name)
+    {
+        unsigned int nameLength = strlen(name);
+        const char *line = strstr(headerBuffer, "\r\n");
+        while (line != nullptr && line[2] != '\0')
+        {
+            line += 2;
+            if (strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':')
+            {
+                const char *value = line + nameLength + 1;
+                while (*value == ' ')
+                {
+                    value++;
+                }
+                return value;
+            }
+            line = strstr(line, "\r\n");
+        }
+        return nullptr;
+    }
+
+    // Finds an argument in the query string. The value ends at the next '&' or the end of the query.
+    const char *findArg(const http::request &req, const char *name, unsigned int *length)
+    {
+        unsigned int nameLength = strlen(name);
+        const char *arg = req.query;
+        while (*arg != '\0')
+        {
+            const char *argEnd = strchr(arg, '&');
+            if (argEnd == nullptr)
+            {
+                argEnd = arg + strlen(arg);
+            }
+            if (strncmp(arg, name, nameLength) == 0 && arg[nameLength] == '=')
+            {
+                *length = argEnd - (arg + nameLength + 1);
+                return arg + nameLength + 1;
+            }
+            arg = *argEnd == '&' ? argEnd + 1 : argEnd;
+        }
+        return nullptr;
+    }
+
+    int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f')
+        {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F')
+        {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    // Parses the request line and headers in place and passes the request to the handler
+    void handleRequest()
+    {
+        const char *contentLength = findHeader("Content-Length");
+
+        char *method = headerBuffer;
+        char *path = strchr(method, ' ');
+        if (path == nullptr)
+        {
+            http::send(400, "bad request line");
+            return;
+        }
+        *path++ = '\0';
+        char *pathEnd = strchr(path, ' ');
+        if (pathEnd == nullptr)
+        {
+            http::send(400, "bad request line");
+            return;
+        }
+        *pathEnd = '\0';
+
+        http::request req;
+        req.post = strcmp(method, "POST") == 0;
+        req.path = path;
+        char *query = strchr(path, '?');
+        if (query != nullptr)
+        {
+            *query++ = '\0';
+            req.query = query;
+        }
+        else
+        {
+            req.query = "";
+        }
+        req.contentLength = contentLength == nullptr ? 0 : strtoul(contentLength, nullptr, 10);
+
+        bodyRemaining = req.contentLength;
+        handler(req);
+        if (!responseSent)
+        {
+            http::send(500, "no response");
+        }
+    }
+} // namespace
+
+namespace http
+{
+
+// Starts listening for clients. Every request is passed to the handler.
+void begin(requestHandler requestHandler)
+{
+    handler = requestHandler;
+    server.begin();
+}
+
+// NETWORK THREAD: Accepts a client and reads its request a bit at a time. The handler runs once the headers are in.
+void poll()
+{
+    if (!client.connected())
+    {
+        if (headerLength != 0)
+        {
+            closeClient();
+        }
+        client = server.available();
+        if (!client)
+        {
+            return;
+        }
+        lastActivityMillis = millis();
+    }
+
+    bool readAnything = false;
+    while (client.available() && headerLength < maxHeaderSize - 1)
+    {
+        headerBuffer[headerLength++] = client.read();
+        readAnything = true;
+    }
+    headerBuffer[headerLength] = '\0';
+
+    unsigned long now = millis();
+    if (readAnything)
+    {
+        lastActivityMillis = now;
+    }
+
+    char *headerEnd = strstr(headerBuffer, "\r\n\r\n");
+    if (headerEnd == nullptr)
+    {
+        if (headerLength == maxHeaderSize - 1)
+        {
+            send(413, "header too large");
+            closeClient();
+        }
+        else if (now - lastActivityMillis > timeoutMillis)
+        {
+            closeClient();
+        }
+        return;
+    }
+    bodyStart = headerEnd + 4 - headerBuffer;
+    headerEnd[2] = '\0'; // keeps the last header's line ending so findHeader knows where the headers stop
+
+    uint32_t allocationsBefore = memoryStats::allocationCount();
+    uint32_t requestStart = micros();
+    responseSent = false;
+    handleRequest();
+    metrics::recordHttpMicros(micros() - requestStart);
+    lastRequestAllocations = memoryStats::allocationCount() - allocationsBefore;
+
+    closeClient();
+}
+
+bool hasArg(const request &req, const char *name)
+{
+    unsigned int length;
+    return findArg(req, name, &length) != nullptr;
+}
+
+bool intArg(const request &req, const char *name, long *value)
+{
+    char text[16];
+    if (copyArg(req, name, text, sizeof(text)) < 0)
+    {
+        return false;
+    }
+    *value = strtol(text, nullptr, 10);
+    return true;
+}
+
+bool floatArg(const request &req, const char *name, float *value)
+{
+    char text[24];
+    if (copyArg(req, name, text, sizeof(text)) < 0)
+    {
+        return false;
+    }
+    *value = strtof(text, nullptr);
+    return true;
+}
+
+// Url decodes an argument into the buffer and null terminates it, truncating if needed.
+// Returns the decoded length or -1 if the argument is missing.
+int copyArg(const request &req, const char *name, char *buffer, unsigned int capacity)
+{
+    unsigned int length;
+    const char *value = findArg(req, name, &length);
+    if (value == nullptr || capacity == 0)
+    {
+        return -1;
+    }
+
+    unsigned int decoded = 0;
+    for (unsigned int i = 0; i < length && decoded < capacity - 1; i++)
+    {
+        if (value[i] == '+')
+        {
+            buffer[decoded++] = ' ';
+        }
+        else if (value[i] == '%' && i + 2 < length && hexValue(value[i + 1]) >= 0 && hexValue(value[i + 2]) >= 0)
+        {
+            buffer[decoded++] = hexValue(value[i + 1]) << 4 | hexValue(value[i + 2]);
+            i += 2;
+        }
+        else
+        {
+            buffer[decoded++] = value[i];
+        }
+    }
+    buffer[decoded] = '\0';
+    return decoded;
+}
+
+// Reads the next part of the request body. Waits for the client if none has arrived yet.
+// Returns 0 once the whole body has been read or the client stops sending.
+unsigned int readBody(uint8_t *buffer, unsigned int capacity)
+{
+    unsigned int count = 0;
+
+    // Anything which arrived along with the header first
+    while (bodyStart < headerLength && count < capacity && bodyRemaining != 0)
+    {
+        buffer[count++] = headerBuffer[bodyStart++];
+        bodyRemaining--;
+    }
+
+    unsigned long waitStart = millis();
+    while (count < capacity && bodyRemaining != 0)
+    {
+        int available = client.available();
+        if (available > 0)
+        {
+            unsigned int wanted = capacity - count < bodyRemaining ? capacity - count : bodyRemaining;
+            int bytesRead = client.read(buffer + count, (unsigned int)available < wanted ? available : wanted);
+            if (bytesRead > 0)
+            {
+                count += bytesRead;
+                bodyRemaining -= bytesRead;
+            }
+            waitStart = millis();
+        }
+        else if (count != 0)
+        {
+            break;
+        }
+        else if (!client.connected() || millis() - waitStart > timeoutMillis)
+        {
+            bodyRemaining = 0;
+            break;
+        }
+        else
+        {
+            delay(1);
+        }
+    }
+    return count;
+}
+
+// Sends a plain text response. Only the first call for a request does anything.
+void send(int code, const char *text)
+{
+    if (responseSent)
+    {
+        return;
+    }
+    responseSent = true;
+
+    char header[128];
+    unsigned int textLength = strlen(text);
+    int length = snprintf(header, sizeof(header),
+                          "HTTP/1.1 %d %s\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: %u\r\n"
+                          "Connection: close\r\n\r\n",
+                          code, statusText(code), textLength);
+    client.write(reinterpret_cast<uint8_t *>(header), length);
+    client.write(reinterpret_cast<const uint8_t *>(text), textLength);
+}
+
+// Starts a response whose length isn't known up front. The body is whatever gets passed to
+// writeStream until the connection closes. Counts as the response for the request.
+void beginStream(int code, const char *contentType)
+{
+    if (responseSent)
+    {
+        return;
+    }
+    responseSent = true;
+
+    char header[128];
+    int length = snprintf(header, sizeof(header),
+                          "HTTP/1.1 %d %s\r\n"
+                          "Content-Type: %s\r\n"
+                          "Connection: close\r\n\r\n",
+                          code, statusText(code), contentType);
+    client.write(reinterpret_cast<uint8_t *>(header), length);
+}
+
+void writeStream(const char *data, unsigned int length)
+{
+    client.write(reinterpret_cast<const uint8_t *>(data), length);
+}
+
+// How many heap allocations were made while handling the last request. Should always be 0.
+uint32_t getLastRequestAllocations()
+{
+    return lastRequestAllocations;
+}
+
+} // namespace http
@@ -0,0 +1,51 @@
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+#include <stdint.h>
+
+/**
+ * A minimal HTTP/1.1 server (port 80) which handles one request per connection
+ * entirely out of fixed buffers. Arguments are read straight out of the request
+ * line and the body is streamed to the handler in chunks, so handling a request
+ * never touches the heap.
+ */
+
+namespace http
+{
+
+constexpr uint16_t port = 80;
+constexpr unsigned int maxHeaderSize = 1024;
+constexpr unsigned long timeoutMillis = 2000;
+
+// Views into the header buffer, only valid for the duration of the handler
+struct request
+{
+    bool post;
+    const char *path;  // null terminated
+    const char *query; // null terminated, still url encoded
+    unsigned int contentLength;
+};
+
+typedef void (*requestHandler)(const request &req);
+
+void begin(requestHandler handler);
+
+void poll();
+
+bool hasArg(const request &req, const char *name);
+bool intArg(const request &req, const char *name, long *value);
+bool floatArg(const request &req, const char *name, float *value);
+int copyArg(const request &req, const char *name, char *buffer, unsigned int capacity);
+
+unsigned int readBody(uint8_t *buffer, unsigned int capacity);
+
+void send(int code, const char *text);
+
+void beginStream(int code, const char *contentType);
+void writeStream(const char *data, unsigned int length);
+
+uint32_t getLastRequestAllocations();
+
+} // namespace http
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef INDEX_LIST_H
+#define INDEX_LIST_H
+
+/**
+ * Compile time index lists, used to fill constexpr lookup tables from a generator function:
+ *
+ *   template <unsigned int... I>
+ *   struct table<meta::indexList<I...>> { static constexpr T values[sizeof...(I)] = {entry(I)...}; };
+ *   typedef table<meta::makeIndexList<N>::type> lut;
+ */
+
+namespace meta
+{
+
+template <unsigned int... I>
+struct indexList
+{
+};
+
+template <class A, class B>
+struct concatIndexList;
+
+template <unsigned int... A, unsigned int... B>
+struct concatIndexList<indexList<A...>, indexList<B...>>
+{
+    typedef indexList<A..., (sizeof...(A) + B)...> type;
+};
+
+// indexList<0, 1, ..., N - 1>, built by halves so the template depth stays small
+template <unsigned int N>
+struct makeIndexList
+{
+    typedef typename concatIndexList<typename makeIndexList<N / 2>::type, typename makeIndexList<N - N / 2>::type>::type type;
+};
+
+template <>
+struct makeIndexList<0>
+{
+    typedef indexList<> type;
+};
+
+template <>
+struct makeIndexList<1>
+{
+    typedef indexList<0> type;
+};
+
+} // namespace meta
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef KEYMASK_H
+#define KEYMASK_H
+
+#include <stdint.h>
+
+#include "m_constants.h"
+
+constexpr unsigned int keyMaskWords = 3; // 96 bits, enough for any keyboard up to 96 keys
+
+static_assert(_PIANOSIZE <= keyMaskWords * 32, "keyMask is too small for the piano size");
+
+// A set of piano keys stored as a bitset. Bit n of the mask represents note n
+// (the same 0 based note number used by MIDI:: and music::)
+struct keyMask
+{
+    uint32_t words[keyMaskWords];
+};
+
+constexpr keyMask emptyKeyMask = {{0, 0, 0}};
+
+inline void setKey(keyMask &mask, uint8_t note)
+{
+    mask.words[note >> 5] |= 1UL << (note & 31);
+}
+
+inline void clearKey(keyMask &mask, uint8_t note)
+{
+    mask.words[note >> 5] &= ~(1UL << (note & 31));
+}
+
+inline bool testKey(const keyMask &mask, uint8_t note)
+{
+    return (mask.words[note >> 5] >> (note & 31)) & 1;
+}
+
+inline bool isEmpty(const keyMask &mask)
+{
+    return (mask.words[0] | mask.words[1] | mask.words[2]) == 0;
+}
+
+// Whether every key in subset is also in set
+inline bool containsAll(const keyMask &set, const keyMask &subset)
+{
+    return (set.words[0] & subset.words[0]) == subset.words[0] &&
+           (set.words[1] & subset.words[1]) == subset.words[1] &&
+           (set.words[2] & subset.words[2]) == subset.words[2];
+}
+
+inline keyMask operator&(const keyMask &a, const keyMask &b)
+{
+    return {{a.words[0] & b.words[0], a.words[1] & b.words[1], a.words[2] & b.words[2]}};
+}
+
+inline keyMask operator|(const keyMask &a, const keyMask &b)
+{
+    return {{a.words[0] | b.words[0], a.words[1] | b.words[1], a.words[2] | b.words[2]}};
+}
+
+inline keyMask operator^(const keyMask &a, const keyMask &b)
+{
+    return {{a.words[0] ^ b.words[0], a.words[1] ^ b.words[1], a.words[2] ^ b.words[2]}};
+}
+
+inline keyMask operator~(const keyMask &a)
+{
+    return {{~a.words[0], ~a.words[1], ~a.words[2]}};
+}
+
+inline bool operator==(const keyMask &a, const keyMask &b)
+{
+    return a.words[0] == b.words[0] && a.words[1] == b.words[1] && a.words[2] == b.words[2];
+}
+
+inline bool operator!=(const keyMask &a, const keyMask &b)
+{
+    return !(a == b);
+}
+
+// Calls func(note) for every key in the mask, lowest note first.
+// Only visits set bits, so sparse masks (chords) are cheap to walk.
+template <typename F>
+inline void forEachKey(const keyMask &mask, F func)
+{
+    for (unsigned int w = 0; w < keyMaskWords; w++)
+    {
+        uint32_t bits = mask.words[w];
+        while (bits)
+        {
+            unsigned int bit = __builtin_ctz(bits);
+            func(static_cast<uint8_t>(w * 32 + bit));
+            bits &= bits - 1;
+        }
+    }
+}
+
+#endif
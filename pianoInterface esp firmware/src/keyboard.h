@@ -0,0 +1,119 @@
+#ifndef KEYBOARD_H
+#define KEYBOARD_H
+
+#include <stdint.h>
+
+#include "indexList.h"
+
+/**
+ * Compile time model of a keyboard, from the MIDI note of its lowest key and its key count.
+ * Everything about a key (black or white, pitch class, octave, position among the white keys)
+ * is worked out by the compiler into one table, so looking it up costs a single load.
+ *
+ * Keys are numbered from 0 at the lowest key, the same as note numbers everywhere else.
+ */
+
+namespace keyboard
+{
+
+struct keyInfo
+{
+    uint8_t pitchClass; // 0 = C ... 11 = B
+    uint8_t octave;     // MIDI octave, note 60 (middle C) is in octave 5
+    uint8_t whiteIndex; // white keys below this one
+    bool black;
+};
+
+constexpr bool isBlackPitch(unsigned int pitchClass)
+{
+    return pitchClass == 1 || pitchClass == 3 || pitchClass == 6 || pitchClass == 8 || pitchClass == 10;
+}
+
+constexpr unsigned int whiteKeysBelow(unsigned int firstNote, unsigned int key)
+{
+    return key == 0 ? 0 : whiteKeysBelow(firstNote, key - 1) + (isBlackPitch((firstNote + key - 1) % 12) ? 0 : 1);
+}
+
+constexpr keyInfo makeKeyInfo(unsigned int firstNote, unsigned int key)
+{
+    return {static_cast<uint8_t>((firstNote + key) % 12),
+            static_cast<uint8_t>((firstNote + key) / 12),
+            static_cast<uint8_t>(whiteKeysBelow(firstNote, key)),
+            isBlackPitch((firstNote + key) % 12)};
+}
+
+template <unsigned int FirstNote, class List>
+struct keyTable;
+
+template <unsigned int FirstNote, unsigned int... I>
+struct keyTable<FirstNote, meta::indexList<I...>>
+{
+    static constexpr keyInfo keys[sizeof...(I)] = {makeKeyInfo(FirstNote, I)...};
+};
+
+template <unsigned int FirstNote, unsigned int... I>
+constexpr keyInfo keyTable<FirstNote, meta::indexList<I...>>::keys[sizeof...(I)];
+
+template <uint8_t FirstNote, uint8_t KeyCount>
+struct model
+{
+    static_assert(FirstNote + KeyCount <= 128, "the keyboard has to fit in the MIDI note range");
+
+    static constexpr uint8_t firstNote = FirstNote; // MIDI note number of key 0
+    static constexpr uint8_t keyCount = KeyCount;
+
+    typedef keyTable<FirstNote, typename meta::makeIndexList<KeyCount>::type> table;
+
+    static constexpr const keyInfo &key(unsigned int key)
+    {
+        return table::keys[key];
+    }
+
+    static constexpr bool isBlack(unsigned int key)
+    {
+        return table::keys[key].black;
+    }
+
+    static constexpr uint8_t whiteKeyCount = whiteKeysBelow(FirstNote, KeyCount);
+};
+
+template <uint8_t FirstNote, uint8_t KeyCount>
+constexpr uint8_t model<FirstNote, KeyCount>::firstNote;
+template <uint8_t FirstNote, uint8_t KeyCount>
+constexpr uint8_t model<FirstNote, KeyCount>::keyCount;
+template <uint8_t FirstNote, uint8_t KeyCount>
+constexpr uint8_t model<FirstNote, KeyCount>::whiteKeyCount;
+
+typedef model<21, 88> piano88; // A0 - C8
+typedef model<28, 76> piano76; // E1 - G7
+typedef model<36, 61> piano61; // C2 - C7
+
+static_assert(piano88::whiteKeyCount == 52 && piano76::whiteKeyCount == 45 && piano61::whiteKeyCount == 36, "wrong white key count");
+static_assert(!piano88::isBlack(0) && piano88::isBlack(1) && piano88::key(87).pitchClass == 0, "88 key model is off");
+static_assert(piano61::key(0).pitchClass == 0 && piano61::isBlack(1) && !piano61::isBlack(4), "61 key model is off");
+
+// The standard model with the given number of keys
+template <unsigned int KeyCount>
+struct standard;
+
+template <>
+struct standard<88>
+{
+    typedef piano88 type;
+};
+
+template <>
+struct standard<76>
+{
+    typedef piano76 type;
+};
+
+template <>
+struct standard<61>
+{
+    typedef piano61 type;
+};
+
+} // namespace keyboard
+
+#endif
@@ -0,0 +1,116 @@
+#include <Arduino.h>
+#include <atomic>
+
+#include "histogram.h"
+#include "latency.h"
+#include "m_constants.h"
+
+namespace
+{
+    // Written by THREAD 1. The capture time goes in before the note's bit so THREAD 0 never sees a bit without its time.
+    std::atomic<uint32_t> captureTimes[_PIANOSIZE];
+    std::atomic<uint32_t> capturedWords[keyMaskWords];
+
+    // THREAD 0 only
+    uint32_t captures[_PIANOSIZE];
+    uint32_t pickups[_PIANOSIZE];
+    keyMask pickedUp = emptyKeyMask; // picked up since the last frame was drawn
+    keyMask rendered = emptyKeyMask; // in the frame which was just drawn, waiting for it to go out
+    uint32_t renderedMicros = 0;
+
+    histogram stages[latency::stageCount];
+
+    histogram &stage(latency::Stage s)
+    {
+        return stages[static_cast<unsigned int>(s)];
+    }
+
+    // THREAD 0: Takes the stamps of the notes which were pressed since they were last picked up
+    void pickUp(unsigned int word, uint32_t bits, uint32_t now)
+    {
+        uint32_t hits = capturedWords[word].fetch_and(~bits, std::memory_order_acquire) & bits;
+        while (hits)
+        {
+            unsigned int note = word * 32 + __builtin_ctz(hits);
+            captures[note] = captureTimes[note].load(std::memory_order_relaxed);
+            pickups[note] = now;
+            setKey(pickedUp, note);
+            hits &= hits - 1;
+        }
+    }
+} // namespace
+
+namespace latency
+{
+
+// THREAD 1: A note was pressed in the USB packet recieved at captureMicros
+void notePressed(uint8_t note, uint32_t captureMicros)
+{
+    captureTimes[note].store(captureMicros, std::memory_order_relaxed);
+    capturedWords[note >> 5].fetch_or(1UL << (note & 31), std::memory_order_release);
+}
+
+// THREAD 0: A press was taken off the note event queue
+void notePickedUp(uint8_t note)
+{
+    pickUp(note >> 5, 1UL << (note & 31), micros());
+}
+
+// THREAD 0: Presses were copied into the logical layer
+void notesPickedUp(const keyMask &notes)
+{
+    uint32_t now = micros();
+    for (unsigned int i = 0; i < keyMaskWords; i++)
+    {
+        if (notes.words[i])
+        {
+            pickUp(i, notes.words[i], now);
+        }
+    }
+}
+
+// THREAD 0: The animation has drawn the frame, everything picked up so far is in it
+void frameRendered()
+{
+    rendered = pickedUp;
+    pickedUp = emptyKeyMask;
+    renderedMicros = micros();
+}
+
+// THREAD 0: The frame has started going out to the strip
+void frameShown()
+{
+    if (isEmpty(rendered))
+    {
+        return;
+    }
+    uint32_t now = micros();
+    forEachKey(rendered, [now](uint8_t note) {
+        stage(Stage::Queue).record(pickups[note] - captures[note]);
+        stage(Stage::Render).record(renderedMicros - pickups[note]);
+        stage(Stage::Output).record(now - renderedMicros);
+        stage(Stage::Total).record(now - captures[note]);
+    });
+    rendered = emptyKeyMask;
+}
+
+uint32_t getSampleCount()
+{
+    return stage(Stage::Total).count();
+}
+
+stageStats getStats(Stage s)
+{
+    const histogram &h = stage(s);
+    return {h.percentile(0.5f), h.percentile(0.99f), h.max(), h.valueSum()};
+}
+
+void reset()
+{
+    for (unsigned int i = 0; i < stageCount; i++)
+    {
+        stages[i].reset();
+    }
+}
+
+} // namespace latency
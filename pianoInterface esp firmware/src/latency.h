@@ -0,0 +1,59 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+#include "keyMask.h"
+
+/**
+ * Key to light latency. Every press is stamped when its USB packet comes in and the stamp follows
+ * the press through to the first frame sent out to the strip after THREAD 0 picked it up.
+ * Each stage of the way gets its own histogram:
+ *
+ * Queue:  USB packet recieved -> THREAD 0 picks the press up (MIDI task, poll100 copy or note event)
+ * Render: picked up -> the animation has drawn the frame
+ * Output: frame drawn -> output stage done and the frame starts going out to the strip
+ * Total:  USB packet recieved -> frame starts going out
+ *
+ * Presses are only stamped while the logical layer is enabled (MIDI::setLogicalLayerEnable), the
+ * animations which don't follow the keys leave it off and record nothing. frameShown() is only
+ * called for a frame which changed some LED, a press rendered into a frame that looked the same
+ * as the last one is never counted.
+ */
+
+namespace latency
+{
+
+enum class Stage : uint8_t
+{
+    Queue = 0,
+    Render = 1,
+    Output = 2,
+    Total = 3
+};
+constexpr unsigned int stageCount = 4;
+
+struct stageStats
+{
+    uint32_t p50Micros;
+    uint32_t p99Micros;
+    uint32_t maxMicros;
+    uint32_t sumMicros; // of every sample, wraps
+};
+
+void notePressed(uint8_t note, uint32_t captureMicros);
+
+void notePickedUp(uint8_t note);
+void notesPickedUp(const keyMask &notes);
+
+void frameRendered();
+void frameShown();
+
+uint32_t getSampleCount();
+stageStats getStats(Stage stage);
+
+void reset();
+
+} // namespace latency
+
+#endif
@@ -0,0 +1,143 @@
+#include <Arduino.h>
+
+#include "keyMask.h"
+#include "learning.h"
+#include "m_constants.h"
+#include "pinaoCom.h"
+#include "settings.h"
+
+namespace
+{
+uint32_t pressTimes[_PIANOSIZE];   // time of the last note on event of every note
+uint32_t releaseTimes[_PIANOSIZE]; // time of the last note off event of every note
+
+keyMask heldKeys;     // notes currently held down according to the note events
+keyMask consumedKeys; // notes whose last press already completed a frame
+keyMask frameKeys;    // notes of the frame being matched
+keyMask matched;      // notes of the frame which currently count as played
+bool complete = false;
+
+constexpr float maxToleranceSeconds = 60.0f;
+
+// Clamped while still a float, a saved setting from an older firmware could be anything
+uint32_t secondsToMicros(float seconds)
+{
+    seconds = seconds > 0.0f ? (seconds < maxToleranceSeconds ? seconds : maxToleranceSeconds) : 0.0f;
+    return static_cast<uint32_t>(seconds * 1000000.0f);
+}
+
+// Drops released notes from the match once their release tolerance has run out
+void expireReleased(uint32_t time)
+{
+    const uint32_t tolerance = secondsToMicros(settings::getPalette().get(settings::Floats::ReleaseTolerance));
+    keyMask released = matched & ~heldKeys;
+    forEachKey(released, [&](uint8_t note) {
+        if (time - releaseTimes[note] > tolerance)
+        {
+            clearKey(matched, note);
+        }
+    });
+}
+
+bool checkComplete()
+{
+    if (!complete && matched == frameKeys)
+    {
+        complete = true;
+        consumedKeys = consumedKeys | frameKeys;
+    }
+    return complete;
+}
+} // namespace
+
+namespace learning
+{
+
+// Forgets every note event. Only notes pressed after this count towards a frame.
+void reset(const keyMask &held)
+{
+    heldKeys = held;
+    consumedKeys = ~emptyKeyMask;
+    frameKeys = emptyKeyMask;
+    matched = emptyKeyMask;
+    complete = false;
+}
+
+// Starts matching a new frame. Notes pressed shortly before the frame started count towards it.
+void setFrame(const keyMask &keys, uint32_t time)
+{
+    const uint32_t window = secondsToMicros(settings::getPalette().get(settings::Floats::ChordWindow));
+    const uint32_t tolerance = secondsToMicros(settings::getPalette().get(settings::Floats::ReleaseTolerance));
+
+    frameKeys = keys;
+    matched = emptyKeyMask;
+    complete = false;
+
+    keyMask candidates = keys & ~consumedKeys;
+    forEachKey(candidates, [&](uint8_t note) {
+        if (time - pressTimes[note] > window)
+        {
+            return;
+        }
+        if (testKey(heldKeys, note) || time - releaseTimes[note] <= tolerance)
+        {
+            setKey(matched, note);
+        }
+    });
+    checkComplete();
+}
+
+// Applies a single note event. Returns whether the frame is complete.
+bool noteEvent(const MIDI::noteEvent &e)
+{
+    if (e.note >= _PIANOSIZE)
+    {
+        return complete;
+    }
+
+    if (e.velocity != 0)
+    {
+        pressTimes[e.note] = e.time;
+        setKey(heldKeys, e.note);
+        clearKey(consumedKeys, e.note);
+        if (!complete && testKey(frameKeys, e.note))
+        {
+            setKey(matched, e.note);
+        }
+    }
+    else
+    {
+        releaseTimes[e.note] = e.time;
+        clearKey(heldKeys, e.note);
+    }
+
+    if (complete)
+    {
+        return true;
+    }
+    expireReleased(e.time);
+    return checkComplete();
+}
+
+// Advances time without any new events. Returns whether the frame is complete.
+bool update(uint32_t time)
+{
+    if (!complete)
+    {
+        expireReleased(time);
+    }
+    return complete;
+}
+
+bool frameComplete()
+{
+    return complete;
+}
+
+// Notes of the current frame which count as played
+keyMask matchedKeys()
+{
+    return matched;
+}
+
+} // namespace learning
@@ -0,0 +1,37 @@
+#ifndef LEARNING_H
+#define LEARNING_H
+
+#include <stdint.h>
+
+#include "keyMask.h"
+#include "pinaoCom.h"
+
+/**
+ * Decides when the notes of a song frame have been played in learning mode.
+ * Matching is driven by the timestamped note events from MIDI:: and is updated
+ * one event at a time, so the cost of an event only depends on the size of the chord.
+ *
+ * A note of the frame counts as played when it was pressed after the frame started,
+ * or up to the chord window before it (rolled chords, fast runs). A released note keeps
+ * counting for the release tolerance so chords don't have to be held artificially.
+ * A press can only ever count towards one frame.
+ */
+
+namespace learning
+{
+
+void reset(const keyMask &heldKeys);
+
+void setFrame(const keyMask &frameKeys, uint32_t time);
+
+bool noteEvent(const MIDI::noteEvent &e);
+
+bool update(uint32_t time);
+
+bool frameComplete();
+
+keyMask matchedKeys();
+
+} // namespace learning
+
+#endif
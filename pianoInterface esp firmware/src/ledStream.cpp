@@ -0,0 +1,302 @@
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include <atomic>
+
+#include "ledStream.h"
+#include "m_constants.h"
+
+/**
+ * DDP header (10 bytes, 14 with a timecode):
+ * Byte 0: flags. Version in the top 2 bits (01), 0x10 = timecode present, 0x01 = push (last packet of a frame)
+ * Byte 1: sequence number in the low 4 bits (1 - 15, 0 = not used)
+ * Byte 2: data type
+ * Byte 3: destination id. 1 is the default output, 246 and up are control/status queries
+ * Byte 4 - 7: data offset in bytes (big endian)
+ * Byte 8 - 9: data length in bytes (big endian)
+ * Byte 10 - 13: timecode when flagged, seconds in 16.16 fixed point on the sender's clock (big endian)
+ */
+
+namespace
+{
+    constexpr unsigned int headerSize = 10;
+    constexpr unsigned int timecodeSize = 4;
+    constexpr unsigned int frameSize = _LEDCOUNT * 3; // one pixel per LED in strip order
+    constexpr unsigned int maxPacketsPerPoll = 8;
+
+    constexpr uint8_t flagVersionMask = 0xC0;
+    constexpr uint8_t flagVersion1 = 0x40;
+    constexpr uint8_t flagTimecode = 0x10;
+    constexpr uint8_t flagPush = 0x01;
+    constexpr uint8_t firstControlId = 246;
+
+    constexpr int32_t senderClockJumpMicros = 1000000; // further off than this and the sender's clock is learned again
+
+    struct jitterSlot
+    {
+        uint8_t pixels[frameSize];
+        uint16_t length;
+        uint32_t origin; // micros() the frame was sent at going by its timecode, or when its last packet arrived
+    };
+
+    WiFiUDP udp;
+
+    // Single producer (network thread), single consumer (THREAD 0) ring of frames.
+    // The producer assembles the next frame in the slot at head and only publishes it once complete.
+    jitterSlot slots[ledStream::jitterSlots];
+    std::atomic<uint32_t> head(0);
+    std::atomic<uint32_t> tail(0);
+    uint16_t assemblingLength = 0;   // bytes from the start of the frame which have all come in
+    bool assemblingBroken = false;   // a packet of the frame is missing, it is dropped at its push
+    bool assemblingTimed = false;
+    uint32_t assemblingTimecode = 0; // sender micros of the frame's first timecode
+    uint8_t lastSequence = 0;
+
+    // Sender clock to micros(), the smallest arrival - timecode seen. The fastest packet is taken
+    // to have taken no time at all, so latency counts any time past that spent in the network.
+    bool senderClockKnown = false;
+    uint32_t senderClockOffset = 0;
+
+    // THREAD 0
+    bool frameTaken = false;
+    uint32_t takenOrigin = 0;
+
+    std::atomic<uint32_t> packetsRecieved(0);
+    std::atomic<uint32_t> packetsLost(0);
+    std::atomic<uint32_t> framesRecieved(0);
+    std::atomic<uint32_t> framesOverflowed(0);
+    std::atomic<uint32_t> framesLate(0);
+    std::atomic<uint32_t> framesIncomplete(0);
+    std::atomic<uint32_t> framesShown(0);
+    std::atomic<uint32_t> latencyLast(0);
+    std::atomic<uint32_t> latencyMax(0);
+    std::atomic<uint32_t> latencyAverage(0);
+
+    void increment(std::atomic<uint32_t> &counter, uint32_t amount = 1)
+    {
+        counter.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    uint32_t timecodeMicros(const uint8_t *timecode)
+    {
+        const uint32_t seconds = timecode[0] << 8 | timecode[1];
+        const uint32_t fraction = timecode[2] << 8 | timecode[3];
+        return seconds * 1000000 + (uint32_t)((uint64_t)fraction * 1000000 >> 16);
+    }
+
+    // Local micros() the frame was sent at by the sender's timecode
+    uint32_t senderToLocal(uint32_t senderMicros, uint32_t arrival)
+    {
+        const uint32_t transit = arrival - senderMicros;
+        const int32_t difference = (int32_t)(transit - senderClockOffset);
+        if (!senderClockKnown || difference < 0 || difference > senderClockJumpMicros)
+        {
+            senderClockOffset = transit;
+            senderClockKnown = true;
+        }
+        return senderMicros + senderClockOffset;
+    }
+
+    void startAssembling()
+    {
+        assemblingLength = 0;
+        assemblingBroken = false;
+        assemblingTimed = false;
+    }
+
+    // Reads one DDP packet straight into the slot being assembled
+    void readPacket(int packetSize)
+    {
+        uint8_t header[headerSize + timecodeSize];
+        if (packetSize < (int)headerSize || udp.read(header, headerSize) != (int)headerSize)
+        {
+            return;
+        }
+        if ((header[0] & flagVersionMask) != flagVersion1 || header[3] >= firstControlId)
+        {
+            return;
+        }
+        if ((header[0] & flagTimecode) && udp.read(header + headerSize, timecodeSize) == (int)timecodeSize && !assemblingTimed)
+        {
+            assemblingTimecode = timecodeMicros(header + headerSize);
+            assemblingTimed = true;
+        }
+        increment(packetsRecieved);
+
+        uint8_t sequence = header[1] & 0x0F;
+        if (sequence != 0 && lastSequence != 0)
+        {
+            uint8_t expected = lastSequence % 15 + 1;
+            if (sequence != expected)
+            {
+                increment(packetsLost, (sequence + 15 - expected) % 15);
+                assemblingBroken = true; // whichever frame the lost packets were for, this one can't be trusted
+            }
+        }
+        lastSequence = sequence;
+
+        uint32_t offset = (uint32_t)header[4] << 24 | (uint32_t)header[5] << 16 | (uint32_t)header[6] << 8 | header[7];
+        uint16_t length = header[8] << 8 | header[9];
+
+        uint32_t slotHead = head.load(std::memory_order_relaxed);
+        if (slotHead - tail.load(std::memory_order_acquire) >= ledStream::jitterSlots)
+        {
+            // Nowhere to put it. THREAD 0 is behind and the oldest frames have priority.
+            if (header[0] & flagPush)
+            {
+                increment(framesOverflowed);
+                startAssembling();
+            }
+            return;
+        }
+
+        // Packets come in order, one starting past the bytes so far means one in between is missing
+        jitterSlot &slot = slots[slotHead & (ledStream::jitterSlots - 1)];
+        if (offset < frameSize)
+        {
+            if (offset > assemblingLength)
+            {
+                assemblingBroken = true;
+            }
+            if (offset + length > frameSize)
+            {
+                length = frameSize - offset;
+            }
+            int bytesRead = udp.read(slot.pixels + offset, length);
+            if (bytesRead != (int)length)
+            {
+                assemblingBroken = true; // the packet was shorter than it said
+            }
+            if (bytesRead > 0 && offset + bytesRead > assemblingLength)
+            {
+                assemblingLength = offset + bytesRead;
+            }
+        }
+
+        if (header[0] & flagPush)
+        {
+            // Half a frame would show as a jump on part of the strip, the last whole one stays up instead
+            if (assemblingBroken || assemblingLength == 0)
+            {
+                increment(framesIncomplete);
+                startAssembling();
+                return;
+            }
+            const uint32_t arrival = micros();
+            slot.length = assemblingLength;
+            slot.origin = assemblingTimed ? senderToLocal(assemblingTimecode, arrival) : arrival;
+            startAssembling();
+            head.store(slotHead + 1, std::memory_order_release);
+            increment(framesRecieved);
+        }
+    }
+
+    // THREAD 0: Gives the slot of the taken frame back to the network thread
+    void releaseFrame()
+    {
+        if (frameTaken)
+        {
+            tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            frameTaken = false;
+        }
+    }
+} // namespace
+
+namespace ledStream
+{
+
+// Starts listening for DDP packets
+void begin()
+{
+    udp.begin(port);
+}
+
+// NETWORK THREAD: Reads any waiting packets into the jitter buffer
+void poll()
+{
+    for (unsigned int i = 0; i < maxPacketsPerPoll; i++)
+    {
+        int packetSize = udp.parsePacket();
+        if (packetSize <= 0)
+        {
+            return;
+        }
+        readPacket(packetSize);
+    }
+}
+
+// THREAD 0: Gets the next frame to show. Frames which have fallen more than the jitter depth
+// behind are skipped. The pixels stay valid until frameShown() or the next takeFrame().
+bool takeFrame(const uint8_t **pixels, unsigned int *length)
+{
+    releaseFrame();
+
+    uint32_t slotTail = tail.load(std::memory_order_relaxed);
+    const uint32_t slotHead = head.load(std::memory_order_acquire);
+    if (slotHead == slotTail)
+    {
+        return false;
+    }
+    if (slotHead - slotTail > jitterDepth)
+    {
+        increment(framesLate, slotHead - slotTail - jitterDepth);
+        slotTail = slotHead - jitterDepth;
+        tail.store(slotTail, std::memory_order_release);
+    }
+
+    const jitterSlot &slot = slots[slotTail & (jitterSlots - 1)];
+    *pixels = slot.pixels;
+    *length = slot.length;
+    takenOrigin = slot.origin;
+    frameTaken = true;
+    return true;
+}
+
+// THREAD 0: Call once the taken frame has been sent out to the strip
+void frameShown()
+{
+    if (!frameTaken)
+    {
+        return;
+    }
+    uint32_t latency = micros() - takenOrigin;
+    latencyLast.store(latency, std::memory_order_relaxed);
+    if (latency > latencyMax.load(std::memory_order_relaxed))
+    {
+        latencyMax.store(latency, std::memory_order_relaxed);
+    }
+    uint32_t average = latencyAverage.load(std::memory_order_relaxed);
+    latencyAverage.store(average == 0 ? latency : average + ((int32_t)(latency - average) >> 4), std::memory_order_relaxed);
+    increment(framesShown);
+    releaseFrame();
+}
+
+streamStats getStats()
+{
+    return {
+        packetsRecieved.load(std::memory_order_relaxed),
+        packetsLost.load(std::memory_order_relaxed),
+        framesRecieved.load(std::memory_order_relaxed),
+        framesOverflowed.load(std::memory_order_relaxed),
+        framesLate.load(std::memory_order_relaxed),
+        framesIncomplete.load(std::memory_order_relaxed),
+        framesShown.load(std::memory_order_relaxed),
+        latencyLast.load(std::memory_order_relaxed),
+        latencyMax.load(std::memory_order_relaxed),
+        latencyAverage.load(std::memory_order_relaxed)};
+}
+
+void resetStats()
+{
+    packetsRecieved.store(0);
+    packetsLost.store(0);
+    framesRecieved.store(0);
+    framesOverflowed.store(0);
+    framesLate.store(0);
+    framesIncomplete.store(0);
+    framesShown.store(0);
+    latencyLast.store(0);
+    latencyMax.store(0);
+    latencyAverage.store(0);
+}
+
+} // namespace ledStream
@@ -0,0 +1,54 @@
+#ifndef LEDSTREAM_H
+#define LEDSTREAM_H
+
+#include <stdint.h>
+
+/**
+ * Recieves pixel frames over UDP using the DDP protocol (the format used by xLights,
+ * LedFx, WLED etc.) so an external renderer can drive the strip in the Stream
+ * animation mode. A frame is one RGB pixel per LED in strip order, whatever the key layout.
+ * Packets are read straight into a small jitter buffer by the network thread and copied once
+ * from there into the LEDCom frame buffer by THREAD 0.
+ *
+ * A frame with any packet missing is dropped at its push and the last whole frame stays up.
+ * Latency runs from when the frame was sent, by its DDP timecode, to the strip update. The
+ * sender's clock is lined up with ours by the quickest frame seen, so the time any frame spends
+ * in the network beyond that counts. Frames without a timecode count from their arrival.
+ */
+
+namespace ledStream
+{
+
+constexpr uint16_t port = 4048;           // standard DDP port
+constexpr unsigned int jitterSlots = 4;   // must be a power of 2
+constexpr unsigned int jitterDepth = 2;   // frames kept queued before older ones are dropped as late
+
+struct streamStats
+{
+    uint32_t packetsRecieved;
+    uint32_t packetsLost;      // gaps in the DDP sequence numbers
+    uint32_t framesRecieved;
+    uint32_t framesOverflowed; // complete frames thrown away because the jitter buffer was full
+    uint32_t framesLate;       // frames skipped because newer ones were already waiting
+    uint32_t framesIncomplete; // frames dropped because a packet of theirs went missing
+    uint32_t framesShown;
+    uint32_t latencyLastMicros; // frame sent (or arrived, without a timecode) to strip update
+    uint32_t latencyMaxMicros;
+    uint32_t latencyAverageMicros;
+};
+
+void begin();
+
+void poll();
+
+bool takeFrame(const uint8_t **pixels, unsigned int *length);
+
+void frameShown();
+
+streamStats getStats();
+
+void resetStats();
+
+} // namespace ledStream
+
+#endif
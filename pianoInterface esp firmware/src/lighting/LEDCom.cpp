@@ -2,16 +2,162 @@
 #include <NeoPixelBus.h>
 
 #include "../m_constants.h"
+#include "../profiler.h"
 #include "color.h"
+#include "gamma.h"
 #include "LEDCom.h"
+#include "segments.h"
+#include "whiteCalibration.h"
 
 namespace
 {
-NeoPixelBus<NeoGrbwFeature, Neo800KbpsMethod> strip(_KEYCOUNT, _PIXELPIN);
+// One strip per segment, each on its own RMT channel. Show() only starts the transfer, so the
+// segments all send at once and the next frame gets worked out while they do.
+class segmentStrip
+{
+public:
+    virtual ~segmentStrip() {}
+    virtual void begin() = 0;
+    virtual uint8_t *pixels() = 0;
+    virtual void show() = 0;
+};
+
+template <class Method>
+class rmtSegmentStrip : public segmentStrip
+{
+public:
+    rmtSegmentStrip(uint16_t ledCount, uint8_t pin) : strip(ledCount, pin) {}
+
+    void begin() override
+    {
+        strip.Begin();
+    }
 
+    uint8_t *pixels() override
+    {
+        return strip.Pixels();
+    }
+
+    // Every pixel is rewritten each frame so the buffer doesn't need to be kept in sync
+    void show() override
+    {
+        strip.Dirty();
+        strip.Show(false);
+    }
+
+private:
+    NeoPixelBus<NeoGrbwFeature, Method> strip;
+};
+
+segmentStrip *segmentStrips[segments::count] = {};
+bool stripStarted = false;
+
+segmentStrip *createSegmentStrip(unsigned int channel, const segments::segment &seg)
+{
+    switch (channel)
+    {
+    case 0:
+        return new rmtSegmentStrip<NeoEsp32Rmt0800KbpsMethod>(seg.ledCount, seg.pin);
+    case 1:
+        return new rmtSegmentStrip<NeoEsp32Rmt1800KbpsMethod>(seg.ledCount, seg.pin);
+    case 2:
+        return new rmtSegmentStrip<NeoEsp32Rmt2800KbpsMethod>(seg.ledCount, seg.pin);
+    case 3:
+        return new rmtSegmentStrip<NeoEsp32Rmt3800KbpsMethod>(seg.ledCount, seg.pin);
+    case 4:
+        return new rmtSegmentStrip<NeoEsp32Rmt4800KbpsMethod>(seg.ledCount, seg.pin);
+    case 5:
+        return new rmtSegmentStrip<NeoEsp32Rmt5800KbpsMethod>(seg.ledCount, seg.pin);
+    case 6:
+        return new rmtSegmentStrip<NeoEsp32Rmt6800KbpsMethod>(seg.ledCount, seg.pin);
+    default:
+        return new rmtSegmentStrip<NeoEsp32Rmt7800KbpsMethod>(seg.ledCount, seg.pin);
+    }
+}
+
+// Sets a single LED anywhere on the strip. Only for the odd pixel, the output stage writes the segments directly.
+void setStripPixel(uint16_t led, RgbwColor c)
+{
+    for (unsigned int s = 0; s < segments::count; s++)
+    {
+        if (led < segments::layout[s].ledCount)
+        {
+            NeoGrbwFeature::applyPixelColor(segmentStrips[s]->pixels(), led, c);
+            return;
+        }
+        led -= segments::layout[s].ledCount;
+    }
+}
+
+// The frame buffer holds one color per key, the output stage spreads each key over its LEDs
 color colors[_KEYCOUNT];
 colorF colorsF[_KEYCOUNT];
 bool stripDirty = true;
+bool colorsFStale = false; // colors was written directly and colorsF needs to be rebuilt before being read
+
+static_assert(sizeof(color) == 3, "color must be tightly packed RGB to be written from raw pixel data");
+
+// Key to LED mapping, rebuilt whenever the layout changes
+constexpr uint8_t noKey = 0xFF;
+static_assert(_KEYCOUNT < noKey, "key indices have to fit in a byte");
+settings::ledLayout layout = {0, 0, 0};
+LEDCom::ledSpan keySpans[_KEYCOUNT];
+uint8_t ledKeys[_LEDCOUNT]; // key each LED belongs to, noKey for LEDs between or past the keys
+
+// Output stage state
+uint16_t whiteBalance[3] = {256, 256, 256}; // per channel scale, 8.8 fixed point
+uint8_t ditherError[_LEDCOUNT][4];          // per LED and R, G, B and W, fraction left over from the last frame, carried into the next
+bool ditherActive = false;                  // some pixel is between two strip values and has to keep being refreshed
+uint16_t levels[_KEYCOUNT][4];              // every key in 8.8 levels, R, G, B and W, before the power limit
+uint32_t sentPixels[_LEDCOUNT];             // every LED as last sent, R, G, B and W packed, to tell if a frame changed anything
+
+// Power limiter, current is estimated as proportional to the sum of all channel levels
+constexpr uint32_t fullScale = 1 << 16;
+
+// Sum of levels a budget leaves for the dies once the idle draw of the strip is taken off
+constexpr uint32_t levelsForBudget(uint32_t milliamps)
+{
+    return milliamps > _LEDCOUNT * _PIXEL_IDLE_MILLIAMPS ? (uint32_t)((uint64_t)(milliamps - _LEDCOUNT * _PIXEL_IDLE_MILLIAMPS) * 65535 / _CHANNEL_MILLIAMPS) : 0;
+}
+static_assert(_POWER_BUDGET_MILLIAMPS > _LEDCOUNT * _PIXEL_IDLE_MILLIAMPS, "the power budget doesn't even cover the idle strip");
+uint32_t budgetLevels = levelsForBudget(_POWER_BUDGET_MILLIAMPS);
+uint32_t powerScale = fullScale; // 16.16 scale applied to every channel
+uint32_t frameLevels = 0;        // sum of the levels of the last frame before scaling
+bool powerRecovering = false;    // the scale is still on its way back up and the strip has to keep being refreshed
+
+// 0 - 1 channel value to a gamma corrected, white balanced strip value in 8.8 fixed point
+inline uint32_t outputLevel(float value, uint16_t balance)
+{
+    int index = (int)(value * gammaCorrection::maxIndex + 0.5f);
+    index = index < 0 ? 0 : (index > (int)gammaCorrection::maxIndex ? gammaCorrection::maxIndex : index);
+    return ((uint32_t)gammaCorrection::lut::values[index] * balance) >> 8;
+}
+
+// Moves the light common to all three RGB channels over to the white die. Takes and returns 8.8 levels.
+inline uint32_t extractWhite(uint32_t &r, uint32_t &g, uint32_t &b)
+{
+    uint32_t common = r < g ? (r < b ? r : b) : (g < b ? g : b);
+    if (common > whiteCalibration::maxLevel)
+    {
+        common = whiteCalibration::maxLevel;
+    }
+    r -= common;
+    g -= common;
+    b -= common;
+
+    // Interpolates between the two table entries around the level
+    const uint16_t *entries = whiteCalibration::lut::values + (common >> 8);
+    return entries[0] + (((uint32_t)(entries[1] - entries[0]) * (common & 0xFF)) >> 8);
+}
+
+// Temporal dithering: adds the fraction carried over from the last frame and keeps the new fraction for the next
+inline uint8_t dither(uint32_t level, uint8_t &error)
+{
+    level += error;
+    error = level & 0xFF;
+    level >>= 8;
+    return level > 255 ? 255 : level;
+}
 
 bool overlayError = false;
 uint8_t errorCode = 0;
@@ -22,27 +168,42 @@ namespace LEDCom
 
 void stripInit()
 {
-    strip.Begin();
-    strip.Show();
+    memset(ledKeys, noKey, sizeof(ledKeys));
+    setLayout(settings::getPalette().layout);
+    for (unsigned int s = 0; s < segments::count; s++)
+    {
+        segmentStrips[s] = createSegmentStrip(s, segments::layout[s]);
+        segmentStrips[s]->begin();
+    }
+    stripStarted = true;
+    updateLEDS();
 }
 
-void setColor(uint8_t led, uint8_t r, uint8_t g, uint8_t b)
+void setColor(uint8_t key, uint8_t r, uint8_t g, uint8_t b)
 {
-    colors[led] = {r, g, b};
-    colorsF[led] = colorToColorF({r, g, b});
+    colors[key] = {r, g, b};
+    colorsF[key] = colorToColorF({r, g, b});
     stripDirty = true;
 }
 
-void setColor(uint8_t led, colorF c)
+void setColor(uint8_t key, colorF c)
 {
-    colors[led] = colorFToColor(c);
-    colorsF[led] = c;
+    colors[key] = colorFToColor(c);
+    colorsF[key] = c;
     stripDirty = true;
 }
 
-colorF getColor(uint8_t led)
+colorF getColor(uint8_t key)
 {
-    return colorsF[led];
+    if (colorsFStale)
+    {
+        for (size_t i = 0; i < _KEYCOUNT; i++)
+        {
+            colorsF[i] = colorToColorF(colors[i]);
+        }
+        colorsFStale = false;
+    }
+    return colorsF[key];
 }
 
 void setAll(colorF c)
@@ -55,21 +216,162 @@ void setAll(colorF c)
     stripDirty = true;
 }
 
+// Copies raw RGB data, one color per LED in strip order, into the frame buffer. Colors are kept
+// per key, so each pixel goes to the key above its LED and pixels for LEDs under no key are dropped.
+// With one LED per key that is every pixel on the LED it was sent for.
+void writePixels(const uint8_t *rgb, unsigned int count)
+{
+    if (count > _LEDCOUNT)
+    {
+        count = _LEDCOUNT;
+    }
+    for (unsigned int led = 0; led < count; led++)
+    {
+        const uint8_t key = ledKeys[led];
+        if (key != noKey)
+        {
+            colors[key] = {rgb[led * 3], rgb[led * 3 + 1], rgb[led * 3 + 2]};
+        }
+    }
+    colorsFStale = true;
+    stripDirty = true;
+}
+
+// Per channel scale applied on the way out to the strip, 1.0 leaves a channel as is
+void setWhiteBalance(colorF balance)
+{
+    const float channels[3] = {balance.r, balance.g, balance.b};
+    for (int i = 0; i < 3; i++)
+    {
+        float scale = channels[i] < 0.0f ? 0.0f : (channels[i] > 1.0f ? 1.0f : channels[i]);
+        uint16_t fixed = (uint16_t)(scale * 256.0f + 0.5f);
+        if (fixed != whiteBalance[i])
+        {
+            whiteBalance[i] = fixed;
+            stripDirty = true;
+        }
+    }
+}
+
+// Works out which LEDs sit under every key. Does nothing if the layout hasn't changed.
+void setLayout(settings::ledLayout newLayout)
+{
+    if (newLayout == layout)
+    {
+        return;
+    }
+    layout = newLayout;
+    memset(ledKeys, noKey, sizeof(ledKeys));
+
+    for (unsigned int key = 0; key < _KEYCOUNT; key++)
+    {
+        // Distance along the strip from the first LED, rounded to whole LEDs
+        int start = (key * layout.ledsPerKey + 8) / 16;
+        int end = ((key + 1) * layout.ledsPerKey + 8) / 16;
+        int first = layout.reversed ? layout.firstLed - end + 1 : layout.firstLed + start;
+        int last = first + (end - start); // one past the end
+        first = first < 0 ? 0 : first;
+        last = last > _LEDCOUNT ? _LEDCOUNT : last;
+
+        ledSpan &span = keySpans[key];
+        span.first = first;
+        span.count = last > first ? last - first : 0;
+        for (int led = first; led < last; led++)
+        {
+            ledKeys[led] = key;
+        }
+    }
+    stripDirty = true;
+}
+
+// The LEDs under a key
+ledSpan getKeySpan(uint8_t key)
+{
+    return keySpans[key];
+}
+
 void setErrorCode(uint8_t code)
 {
     overlayError = true;
     errorCode = code;
 }
 
-void updateLEDS()
+// Scale for the next frame. Drops straight to whatever keeps the frame within budget
+// and creeps back up over a few dozen frames so the limit doesn't pump with the animation.
+uint32_t limitPower(uint32_t total)
 {
-    if (!stripDirty)
-        return;
+    uint32_t target = total > budgetLevels ? (uint32_t)((uint64_t)budgetLevels * fullScale / total) : fullScale;
+    if (target <= powerScale)
+    {
+        powerRecovering = false;
+        return target;
+    }
+    powerRecovering = true;
+    return powerScale + ((target - powerScale + 15) >> 4);
+}
+
+// Output stage: gamma, white balance and white extraction for every key while the frame's current is
+// added up, then the power limit and dithering for every LED on the way out to the strip.
+// While any LED is dithering or the power limit is easing off the strip is refreshed every frame even if nothing changed.
+// Returns true if a frame was sent and some LED in it differs from the frame before.
+bool updateLEDS()
+{
+    PROFILE_ZONE("updateLEDS");
+    if (!stripStarted || (!stripDirty && !ditherActive && !powerRecovering))
+        return false;
+
+    if (colorsFStale)
+    {
+        getColor(0);
+    }
+
+    const uint16_t balanceR = whiteBalance[0], balanceG = whiteBalance[1], balanceB = whiteBalance[2];
+    uint32_t total = 0;
+    for (size_t key = 0; key < _KEYCOUNT; key++)
+    {
+        const colorF &c = colorsF[key];
+        uint32_t r = outputLevel(c.r, balanceR);
+        uint32_t g = outputLevel(c.g, balanceG);
+        uint32_t b = outputLevel(c.b, balanceB);
+        uint32_t w = extractWhite(r, g, b);
+        uint16_t *level = levels[key];
+        level[0] = r;
+        level[1] = g;
+        level[2] = b;
+        level[3] = w;
+        total += (r + g + b + w) * keySpans[key].count;
+    }
+    frameLevels = total;
+    powerScale = limitPower(total);
 
-    for (size_t pix = 0; pix < _KEYCOUNT; pix++)
+    const uint32_t scale = powerScale;
+    static const uint16_t off[4] = {0, 0, 0, 0};
+    uint8_t fractions = 0;
+    bool changed = false;
+    size_t led = 0;
+    for (unsigned int s = 0; s < segments::count; s++)
     {
-        strip.SetPixelColor(pix, RgbColor(colors[pix].r, colors[pix].g, colors[pix].b));
+        uint8_t *pixels = segmentStrips[s]->pixels();
+        const uint16_t segmentLeds = segments::layout[s].ledCount;
+        for (uint16_t i = 0; i < segmentLeds; i++, led++)
+        {
+            const uint8_t key = ledKeys[led];
+            const uint16_t *level = key == noKey ? off : levels[key];
+            uint8_t *error = ditherError[led];
+            uint32_t r = level[0] * scale >> 16;
+            uint32_t g = level[1] * scale >> 16;
+            uint32_t b = level[2] * scale >> 16;
+            uint32_t w = level[3] * scale >> 16;
+            fractions |= (r | g | b | w) & 0xFF;
+            const RgbwColor pixel(dither(r, error[0]), dither(g, error[1]), dither(b, error[2]), dither(w, error[3]));
+            const uint32_t packed = (uint32_t)pixel.R << 24 | (uint32_t)pixel.G << 16 | (uint32_t)pixel.B << 8 | pixel.W;
+            changed |= packed != sentPixels[led];
+            sentPixels[led] = packed;
+            NeoGrbwFeature::applyPixelColor(pixels, i, pixel);
+        }
     }
+    ditherActive = fractions != 0;
+
     // Display the errorCode on top of everything else;
     if (errorCode)
     {
@@ -77,12 +379,42 @@ void updateLEDS()
         {
             if (errorCode >> i & 0x01)
             {
-                strip.SetPixelColor(i, RgbColor(0, 0, 255));
+                setStripPixel(i, RgbwColor(0, 0, 255, 0));
             }
         }
     }
-    strip.Show();
+    for (unsigned int s = 0; s < segments::count; s++)
+    {
+        segmentStrips[s]->show();
+    }
     stripDirty = false;
+    return changed;
 }
 
-}
\ No newline at end of file
+// Changes the current the strip may draw, _POWER_BUDGET_MILLIAMPS until then. Takes effect on the next frame. THREAD 0
+void setPowerBudget(uint32_t milliamps)
+{
+    budgetLevels = levelsForBudget(milliamps);
+    stripDirty = true;
+}
+
+// Estimated current of the strip for the last frame after the power limit
+uint32_t getEstimatedMilliamps()
+{
+    uint64_t scaled = (uint64_t)frameLevels * powerScale >> 16;
+    return _LEDCOUNT * _PIXEL_IDLE_MILLIAMPS + (uint32_t)(scaled * _CHANNEL_MILLIAMPS / 65535);
+}
+
+// Time it takes to send a frame out, see segments.h
+uint32_t getFrameTransferMicros()
+{
+    return segments::frameTransferMicros();
+}
+
+// 0 - 1, how much the power limit is dimming the strip by. 1 is not at all.
+float getPowerScale()
+{
+    return powerScale / (float)fullScale;
+}
+
+}
@@ -3,24 +3,52 @@
 
 #include <stdint.h>
 
+#include "../settings.h"
 #include "color.h"
 
+/**
+ * Colors are set per key, 0 being the lowest key with an LED (MIDI::ledNoteOffset).
+ * The output stage spreads every key over the LEDs under it as set by settings::ledLayout.
+ */
+
 namespace LEDCom
 {
 
+struct ledSpan
+{
+    uint16_t first; // lowest LED index under the key
+    uint8_t count;
+};
+
 void stripInit();
 
-void setColor(uint8_t led, uint8_t r, uint8_t g, uint8_t b);
+void setColor(uint8_t key, uint8_t r, uint8_t g, uint8_t b);
 
-void setColor(uint8_t led, colorF c);
+void setColor(uint8_t key, colorF c);
 
-colorF getColor(uint8_t led);
+colorF getColor(uint8_t key);
 
 void setAll(colorF c);
 
+void writePixels(const uint8_t *rgb, unsigned int count);
+
+void setWhiteBalance(colorF balance);
+
+void setLayout(settings::ledLayout newLayout);
+
+ledSpan getKeySpan(uint8_t key);
+
 void setErrorCode(uint8_t code);
 
-void updateLEDS();
+bool updateLEDS();
+
+void setPowerBudget(uint32_t milliamps);
+
+uint32_t getEstimatedMilliamps();
+
+float getPowerScale();
+
+uint32_t getFrameTransferMicros();
 
 }
 
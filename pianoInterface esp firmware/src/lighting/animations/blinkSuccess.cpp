@@ -3,6 +3,7 @@
 
 #include "../../m_constants.h"
 #include "../../settings.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -13,12 +14,13 @@ namespace animations
 
 void blinkSuccess(const float time)
 {
+    PROFILE_ZONE("blinkSuccess");
     float brightness = sin((float)time * 20.0f) * 0.5f + 0.5f;
     setAll({0.0f, brightness, 0.0f});
     if (time >= 1.0f)
     {
         setAnimationComplete();
-        setAll(settings::getColorSetting(settings::Colors::Ambiant));
+        setAll(settings::getPalette().get(settings::Colors::Ambiant));
     }
 }
 
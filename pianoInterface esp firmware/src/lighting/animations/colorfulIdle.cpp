@@ -2,6 +2,7 @@
 #include <cmath>
 
 #include "../../m_constants.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -11,6 +12,7 @@ namespace animations
 {
     void colorfulIdle(const float time)
     {
+        PROFILE_ZONE("colorfulIdle");
                 for (unsigned int i = 0; i < _KEYCOUNT; i++)
         {
             float index = i * HSLRange_Over_KeyCount + time * 1000;
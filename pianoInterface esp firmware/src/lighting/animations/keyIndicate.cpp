@@ -5,6 +5,7 @@
 #include "../../pinaoCom.h"
 #include "../../music.h"
 #include "../../settings.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -15,6 +16,9 @@ namespace animations
 
 void keyIndicate()
 {
+    PROFILE_ZONE("keyIndicate");
+        const settings::palette &pal = settings::getPalette();
+
         for (size_t i = 0; i < _KEYCOUNT; i++)
         {
             bool state = MIDI::getNoteState(i + MIDI::ledNoteOffset);
@@ -22,20 +26,20 @@ void keyIndicate()
             {
                 if (music::isBlackNote(i + MIDI::ledNoteOffset))
                 {
-                    setColor(_KEYCOUNT - 1 - i, settings::getColorSetting(settings::Colors::IndicateBlack));
+                    setColor(i, pal.get(settings::Colors::IndicateBlack));
                 }
                 else
                 {
-                    setColor(_KEYCOUNT - 1 - i, settings::getColorSetting(settings::Colors::IndicateWhite));
+                    setColor(i, pal.get(settings::Colors::IndicateWhite));
                 }
             }
             else if (!music::isBlackNote(i + MIDI::ledNoteOffset))
             {
-                setColor(_KEYCOUNT - 1 - i, settings::getColorSetting(settings::Colors::Ambiant));
+                setColor(i, pal.get(settings::Colors::Ambiant));
             }
             else
             {
-                setColor(_KEYCOUNT - 1 - i, Colors::Off);
+                setColor(i, Colors::Off);
             }
         }
 }
@@ -5,6 +5,7 @@
 #include "../../pinaoCom.h"
 #include "../../music.h"
 #include "../../settings.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -20,6 +21,9 @@ namespace animations
 
 void keyIndicateFade(const float deltaTime)
 {
+    PROFILE_ZONE("keyIndicateFade");
+    const settings::palette &pal = settings::getPalette();
+
     for (size_t i = 0; i < _KEYCOUNT; i++)
     {
         // Note event: reset the timer
@@ -30,13 +34,13 @@ void keyIndicateFade(const float deltaTime)
 
         if (music::isBlackNote(i + MIDI::ledNoteOffset))
         {
-            setColor(_KEYCOUNT - 1 - i, settings::getColorSetting(settings::Colors::IndicateBlack) * ((float)keyTimers[i] / indicateFadeTime));
+            setColor(i, pal.get(settings::Colors::IndicateBlack) * ((float)keyTimers[i] / indicateFadeTime));
         }
         else
         {
-            colorF col = settings::getColorSetting(settings::Colors::IndicateWhite) * ((float)keyTimers[i] / indicateFadeTime);
-            col = colorMax(col, settings::getColorSetting(settings::Colors::Ambiant));
-            setColor(_KEYCOUNT - 1 - i, col);
+            colorF col = pal.get(settings::Colors::IndicateWhite) * ((float)keyTimers[i] / indicateFadeTime);
+            col = colorMax(col, pal.get(settings::Colors::Ambiant));
+            setColor(i, col);
         }
         keyTimers[i] -= deltaTime;
         if (keyTimers[i] < 0.0f)
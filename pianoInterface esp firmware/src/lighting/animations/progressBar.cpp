@@ -2,6 +2,7 @@
 #include <cmath>
 
 #include "../../m_constants.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -11,24 +12,25 @@ namespace animations
 {
 void progressBar(float progress)
 {
+    PROFILE_ZONE("progressBar");
     float filledInKeys = _KEYCOUNT * progress;
     for (size_t i = 0; i < _KEYCOUNT; i++)
     {
         // full On
         if (i <= filledInKeys)
         {
-            setColor(_KEYCOUNT - i - 1, Colors::Red);
+            setColor(i, Colors::Red);
         }
         // Partially lit
         else if (i < filledInKeys + 1)
         {
             float opacity = filledInKeys - i;
-            setColor(_KEYCOUNT - i - 1, colorF{opacity, 0.0f, 0.0f});
+            setColor(i, colorF{opacity, 0.0f, 0.0f});
         }
         // Off
         else
         {
-            setColor(_KEYCOUNT - i - 1, Colors::Off);
+            setColor(i, Colors::Off);
         }
     }
 }
@@ -2,6 +2,7 @@
 #include <cmath>
 
 #include "../../m_constants.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -11,6 +12,7 @@ namespace animations
 {
     void pulseError(const float time)
     {
+        PROFILE_ZONE("pulseError");
         float brightness = sin((float)time * 2.0f) * 0.5f + 0.5f;
         setAll({brightness, 0.0f, 0.0f});
     }
@@ -5,6 +5,7 @@
 #include "../../pinaoCom.h"
 #include "../../music.h"
 #include "../../settings.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -21,6 +22,8 @@ namespace animations
 
 void rainbowFade(const float deltaTime, const float time)
 {
+    PROFILE_ZONE("rainbowFade");
+    const colorF ambiant = settings::getPalette().get(settings::Colors::Ambiant);
     for (unsigned int i = 0; i < _KEYCOUNT; i++)
     {
         float index = i * HSLRange_Over_KeyCount + time * 1000;
@@ -40,14 +43,14 @@ void rainbowFade(const float deltaTime, const float time)
         }
 
 
-        colorF col = col = memes[i] * ((float)keyTimers[i] / indicateFadeTime);
+        colorF col = memes[i] * ((float)keyTimers[i] / indicateFadeTime);
 
         if (!music::isBlackNote(i + MIDI::ledNoteOffset))
         {
-            col = colorMax(col, settings::getColorSetting(settings::Colors::Ambiant));
+            col = colorMax(col, ambiant);
         }
 
-        setColor(_KEYCOUNT - 1 - i, col);
+        setColor(i, col);
 
         keyTimers[i] -= deltaTime;
         if (keyTimers[i] < 0.0f)
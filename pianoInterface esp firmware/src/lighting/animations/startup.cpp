@@ -3,6 +3,7 @@
 
 #include "../../m_constants.h"
 #include "../../settings.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -13,6 +14,7 @@ namespace animations
 
 void startUp(const float time)
 {
+    PROFILE_ZONE("startUp");
     float filledInKeys = _KEYCOUNT * (time / 1.0f);
     for (size_t i = 0; i < _KEYCOUNT; i++)
     {
@@ -37,7 +39,7 @@ void startUp(const float time)
     if (time >= 1.0f)
     {
         setAnimationComplete();
-        setAll(settings::getColorSetting(settings::Colors::Ambiant));
+        setAll(settings::getPalette().get(settings::Colors::Ambiant));
     }
 }
 
@@ -0,0 +1,23 @@
+#include <stdint.h>
+
+#include "../../ledStream.h"
+#include "../../profiler.h"
+#include "../LEDCom.h"
+#include "../animator.h"
+
+namespace animations
+{
+
+// Shows frames recieved over the network. The strip is only touched when a new frame has arrived.
+void stream()
+{
+    PROFILE_ZONE("stream");
+    const uint8_t *pixels;
+    unsigned int length;
+    if (ledStream::takeFrame(&pixels, &length))
+    {
+        LEDCom::writePixels(pixels, length / 3);
+    }
+}
+
+} // namespace animations
@@ -1,10 +1,13 @@
+#include <Arduino.h>
 #include <stdint.h>
 #include <cmath>
 
+#include "../../learning.h"
 #include "../../m_constants.h"
 #include "../../pinaoCom.h"
 #include "../../music.h"
 #include "../../settings.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -13,109 +16,178 @@ using namespace animator;
 namespace
 {
 constexpr float inFrameFadeTime = 0.26f; // seconds
+constexpr unsigned int maxFramesPerRender = 16; // stops empty frames from advancing the song forever
+constexpr unsigned int maxLookaheadFrames = 4;
+
+// Ring cache of the frames following the live frame. It is only touched when the live
+// frame changes, so rendering the lookahead costs the same no matter how many frames are shown.
+music::songFrame lookaheadFrames[maxLookaheadFrames];
+unsigned int lookaheadHead = 0;       // ring position of the frame right after the live frame
+unsigned int lookaheadCount = 0;      // how many frames are in the cache
+unsigned int lookaheadLiveIndex = 0;  // live frame index the cache was built for
+unsigned int lookaheadLastIndex = 0;  // song index of the last frame in the cache
+colorF lookaheadLayer[_KEYCOUNT];     // color of every key from the cached frames
+
+// Rebuilds the per-key lookahead colors from the cache, nearest frame brightest
+void buildLookaheadLayer()
+{
+    const float brightness = settings::getPalette().get(settings::Floats::LookaheadBrightness);
+    for (size_t i = 0; i < _KEYCOUNT; i++)
+    {
+        lookaheadLayer[i] = Colors::Off;
+    }
+    for (unsigned int n = 0; n < lookaheadCount; n++)
+    {
+        const music::songFrame &frame = lookaheadFrames[(lookaheadHead + n) % maxLookaheadFrames];
+        const float scale = brightness * (float)(lookaheadCount - n) / (float)lookaheadCount;
+        forEachKey(frame.keys, [&](uint8_t note) {
+            if (note >= MIDI::ledNoteOffset && note < _KEYCOUNT + MIDI::ledNoteOffset)
+            {
+                colorF col = testKey(frame.hands, note) ? Colors::Red : Colors::Blue;
+                lookaheadLayer[note - MIDI::ledNoteOffset] = colorMax(lookaheadLayer[note - MIDI::ledNoteOffset], col * scale);
+            }
+        });
+    }
 }
 
-namespace animations
+// Brings the lookahead cache up to date with the live frame. When the song has only moved on by
+// one frame, a single new frame is decoded into the ring. Returns whether the cache changed.
+bool updateLookahead(bool rebuild)
 {
+    // Clamped while still a float, the setting comes straight from a client and can be anything
+    float frames = settings::getPalette().get(settings::Floats::LookaheadFrames);
+    frames = frames > 0.0f ? (frames < (float)maxLookaheadFrames ? frames : (float)maxLookaheadFrames) : 0.0f;
+    unsigned int count = (unsigned int)frames;
+    const unsigned int songLength = music::frameCount();
+    if (count >= songLength)
+    {
+        count = songLength == 0 ? 0 : songLength - 1;
+    }
 
-void waiting(float deltaTime, bool firstFrame, bool fullRefresh)
-{
-    // update notes pressed down during this frame
-    for (size_t i = 0; i < _KEYCOUNT; i++)
+    const unsigned int live = music::currentFrameIndex();
+    if (!rebuild && live == lookaheadLiveIndex && count == lookaheadCount)
+    {
+        return false;
+    }
+
+    if (!rebuild && count == lookaheadCount && count != 0 && music::followingFrameIndex(lookaheadLiveIndex) == live)
+    {
+        lookaheadLastIndex = music::followingFrameIndex(lookaheadLastIndex);
+        music::getFrame(lookaheadLastIndex, &lookaheadFrames[lookaheadHead]);
+        lookaheadHead = (lookaheadHead + 1) % maxLookaheadFrames;
+    }
+    else
     {
-        if (MIDI::getLogicalState(i + MIDI::ledNoteOffset))
+        lookaheadHead = 0;
+        lookaheadLastIndex = live;
+        for (unsigned int n = 0; n < count; n++)
         {
-            pressedThisFrame[i] = true;
+            lookaheadLastIndex = music::followingFrameIndex(lookaheadLastIndex);
+            music::getFrame(lookaheadLastIndex, &lookaheadFrames[n]);
         }
     }
+    lookaheadCount = count;
+    lookaheadLiveIndex = live;
+    buildLookaheadLayer();
+    return true;
+}
 
-    colorF WW = settings::getColorSetting(settings::Colors::WaitingWhite);
-    colorF WB = settings::getColorSetting(settings::Colors::WaitingBlack);
-    colorF IFW = settings::getColorSetting(settings::Colors::InFrameWhite);
-    colorF IFB = settings::getColorSetting(settings::Colors::InFrameBlack);
-    colorF AMB = settings::getColorSetting(settings::Colors::Ambiant);
-
-    setAll(Colors::Off);
+// Starts the fade on every note which has just been matched
+void flashKeys(const keyMask &keys)
+{
+    forEachKey(keys, [](uint8_t note) {
+        if (note >= MIDI::ledNoteOffset && note < _KEYCOUNT + MIDI::ledNoteOffset)
+        {
+            keyTimers[note - MIDI::ledNoteOffset] = inFrameFadeTime;
+        }
+    });
+}
 
-    using namespace music;
-    songFrame frame = currentFrame();
+// Moves through every frame which has been completed. Returns how many frames were completed.
+unsigned int advanceCompletedFrames(uint32_t time)
+{
+    unsigned int completed = 0;
+    while (learning::frameComplete() && completed < maxFramesPerRender)
+    {
+        music::nextFrame();
+        learning::setFrame(music::currentFrame().keys, time);
+        completed++;
+    }
+    return completed;
+}
+}
 
-    bool allInFrame = true;
+namespace animations
+{
 
-    uint8_t *notes = frame.firstNote;
+void waiting(float deltaTime, bool firstFrame, bool fullRefresh)
+{
+    PROFILE_ZONE("waiting");
+    using namespace music;
+    const uint32_t now = micros();
 
-    unsigned int index = 0;
-    while (true)
+    if (firstFrame)
     {
-        // get rid of last bit which is used to specify the hand
-        uint8_t note = notes[index] & 0b01111111;   
-        uint8_t hand = notes[index] & 0b10000000;
-        
-        unsigned int keyIndex = (note - MIDI::ledNoteOffset);
-        if (note >= MIDI::ledNoteOffset && note < _KEYCOUNT + MIDI::ledNoteOffset)
-        {
-          //  if (music::isBlackNote(keyIndex))
-           // {
-                //keyFadeTargets[keyIndex] = WB;
-                //keyFadeTargets[keyIndex] = hand == 0 ? Colors::Red : Colors::Blue;
-
-                if( notes[index] > 100){
-                    keyFadeTargets[keyIndex] = Colors::Red;
-                }
-                else{
-                    keyFadeTargets[keyIndex] = Colors::Blue;
-                }
-          //  }
-           // else
-           // {
-                //keyFadeTargets[keyIndex] = WW;
-           // }
-            if (pressedThisFrame[note - MIDI::ledNoteOffset] && MIDI::getNoteState(note))
-            {
-                keyTimers[keyIndex] = inFrameFadeTime;
-            }
-            else
-            {
-                allInFrame = false;
-            }
-        }
-        if (notes[index] == *frame.lastNote)
-        {
-            break;
-        }
-        index++;
+        MIDI::clearNoteEvents();
+        learning::reset(MIDI::getNoteStates());
+    }
+    if (firstFrame || fullRefresh)
+    {
+        learning::setFrame(currentFrame().keys, now);
     }
 
-    if (allInFrame)
+    // Feed every note event since the last render to the matcher one at a time.
+    // Fast passages can complete several frames between two renders.
+    unsigned int framesCompleted = advanceCompletedFrames(now);
+    MIDI::noteEvent e;
+    while (MIDI::popNoteEvent(&e))
     {
-        nextFrame();
+        keyMask matchedBefore = learning::matchedKeys();
+        learning::noteEvent(e);
+        flashKeys(learning::matchedKeys() & ~matchedBefore);
+        framesCompleted += advanceCompletedFrames(e.time);
     }
-    if (allInFrame || firstFrame || fullRefresh)
+    const uint32_t eventsHandledTime = micros();
+    learning::update(eventsHandledTime);
+    framesCompleted += advanceCompletedFrames(eventsHandledTime);
+    bool allInFrame = framesCompleted != 0;
+    bool lookaheadChanged = updateLookahead(firstFrame || fullRefresh);
+
+    const settings::palette &pal = settings::getPalette();
+    colorF AMB = pal.get(settings::Colors::Ambiant);
+
+    setAll(Colors::Off);
+
+    if (allInFrame || firstFrame || fullRefresh || lookaheadChanged)
     {
         for (size_t i = 0; i < _KEYCOUNT; i++)
         {
-            pressedThisFrame[i] = false;
-
             if (music::isBlackNote(i + MIDI::ledNoteOffset))
             {
-                keyFadeTargets[i] = Colors::Off;
+                keyFadeTargets[i] = lookaheadLayer[i];
             }
             else
             {
-                keyFadeTargets[i] = AMB;
+                keyFadeTargets[i] = colorMax(AMB, lookaheadLayer[i]);
             }
         }
     }
 
+    songFrame frame = currentFrame();
+    forEachKey(frame.keys, [&](uint8_t note) {
+        if (note >= MIDI::ledNoteOffset && note < _KEYCOUNT + MIDI::ledNoteOffset)
+        {
+            keyFadeTargets[note - MIDI::ledNoteOffset] = testKey(frame.hands, note) ? Colors::Red : Colors::Blue;
+        }
+    });
+
     // colors
     for (size_t i = 0; i < _KEYCOUNT; i++)
     {
-        bool black = music::isBlackNote(i + MIDI::ledNoteOffset);
-
         // skip needless division
         if (keyTimers[i] == 0)
         {
-            setColor(_KEYCOUNT - 1 - i, keyFadeTargets[i]);
+            setColor(i, keyFadeTargets[i]);
         }
         else
         {
@@ -124,9 +196,7 @@ void waiting(float deltaTime, bool firstFrame, bool fullRefresh)
             colorF inFrameCol = allInFrame ? color{230, 255, 230} : Colors::Green;
 
             colorF col = mix(inFrameCol, keyFadeTargets[i], 1.0f - t);
-
-            //colorF col = mix(black ? IFB : IFW, keyFadeTargets[i], 1.0f - t);
-            setColor(_KEYCOUNT - 1 - i, col);
+            setColor(i, col);
         }
         keyTimers[i] -= deltaTime;
         if (keyTimers[i] < 0)
@@ -6,6 +6,7 @@
 #include "../../music.h"
 #include "../../settings.h"
 #include "../../m_error.h"
+#include "../../profiler.h"
 #include "../color.h"
 #include "../animator.h"
 
@@ -33,6 +34,7 @@ namespace animations
 
 void wave(float deltaTime, bool firstFrame)
 {
+    PROFILE_ZONE("wave");
     if (firstFrame)
     {
         waveCount = 0;
@@ -64,7 +66,7 @@ void wave(float deltaTime, bool firstFrame)
                     assert_fatal(availableIndex < maxWaves, ErrorCode::IMPOSSIBLE_INTERNAL);
                 }
                 
-                waveSpawnPositions[availableIndex] = _KEYCOUNT - 1 - i;
+                waveSpawnPositions[availableIndex] = i;
                 waveTimers[availableIndex] = 0.0f;
                 waveCount++;
             }
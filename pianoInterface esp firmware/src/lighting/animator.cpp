@@ -16,18 +16,17 @@ namespace animator
 
 float keyTimers[_KEYCOUNT];
 colorF keyFadeTargets[_KEYCOUNT];
-bool pressedThisFrame[_KEYCOUNT];
 
 // sets a color to push to the strip at the end of the frame
-void setColor(uint8_t led, colorF c)
+void setColor(uint8_t key, colorF c)
 {
-    LEDCom::setColor(led, c);
+    LEDCom::setColor(key, c);
 }
 
 // same as setColor, but adds to the existing color
-void addColor(uint8_t led, colorF c)
+void addColor(uint8_t key, colorF c)
 {
-    LEDCom::setColor(led, LEDCom::getColor(led) + c);
+    LEDCom::setColor(key, LEDCom::getColor(key) + c);
 }
 
 void setAll(colorF c)
@@ -45,11 +44,11 @@ color sweepHSL(unsigned int index)
     }
     if (index <= 255 * 1)
     {
-        return {255, index, 0};
+        return {255, static_cast<uint8_t>(index), 0};
     }
     else if (index <= 255 * 2)
     {
-        return {255 - (uint8_t)(index - 255), 255, 0};
+        return {static_cast<uint8_t>(255 - (index - 255)), 255, 0};
     }
     else if (index <= 255 * 3)
     {
@@ -57,15 +56,15 @@ color sweepHSL(unsigned int index)
     }
     else if (index <= 255 * 4)
     {
-        return {0, 255 - (index - 255 * 3), 255};
+        return {0, static_cast<uint8_t>(255 - (index - 255 * 3)), 255};
     }
     else if (index <= 255 * 5)
     {
-        return {index - 255 * 4, 0, 255};
+        return {static_cast<uint8_t>(index - 255 * 4), 0, 255};
     }
     else if (index <= 255 * 6)
     {
-        return {255, 0, 255 - (index - 255 * 5)};
+        return {255, 0, static_cast<uint8_t>(255 - (index - 255 * 5))};
     }
     fatalError(ErrorCode::IMPOSSIBLE_INTERNAL);
     return {255, 255, 255};
@@ -78,10 +77,7 @@ void resetAnimation()
     //  reset all the events in the logical layer
     if(MIDI::getLogicalLayerEnabled())
     {
-        for (size_t i = 0; i < _PIANOSIZE; i++)
-        {
-            MIDI::getLogicalState(i);
-        }
+        MIDI::getLogicalStates();
     }
 }
 
@@ -23,11 +23,10 @@ constexpr float HSLRange_Over_KeyCount = 1530.0f / (float)_KEYCOUNT;
 
 extern float keyTimers[_KEYCOUNT]; // general use per-key timers for animations
 extern colorF keyFadeTargets[_KEYCOUNT]; // general use colorLayer
-extern bool pressedThisFrame[_KEYCOUNT]; // keeps track of notes that have been pressed this frame (not just held down from the last frame)
 
-void setColor(uint8_t led, colorF col);
+void setColor(uint8_t key, colorF col);
 
-void addColor(uint8_t led, colorF col);
+void addColor(uint8_t key, colorF col);
 
 void setAll(colorF c);
 
@@ -52,6 +51,7 @@ namespace animations
     void waiting(const float deltaTime, bool firstFrame, bool fullRefresh);
     void wave(const float deltaTime, bool firstFrame);
     void rainbowFade(const float deltaTime, const float time);
+    void stream();
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+#ifndef GAMMA_H
+#define GAMMA_H
+
+#include <stdint.h>
+
+#include "../indexList.h"
+
+/**
+ * Gamma 2.2 lookup table generated at compile time. Indexed by a 12 bit linear
+ * brightness, gives the strip value in 8.8 fixed point so the fraction can be
+ * dithered over frames instead of being thrown away.
+ */
+
+namespace gammaCorrection
+{
+
+constexpr unsigned int indexBits = 12;
+constexpr unsigned int tableSize = 1 << indexBits;
+constexpr unsigned int maxIndex = tableSize - 1;
+
+// x^(1/5) by Newton's method, x in [0, 1]. Starting above the root it converges from above.
+constexpr double fifthRoot(double x, double r = 1.0, int iterations = 24)
+{
+    return iterations == 0 || x == 0.0 ? (x == 0.0 ? 0.0 : r) : fifthRoot(x, (4.0 * r + x / (r * r * r * r)) / 5.0, iterations - 1);
+}
+
+// x^2.2 = x^2 * x^(1/5)
+constexpr double correct(double x)
+{
+    return x * x * fifthRoot(x);
+}
+
+constexpr uint16_t entry(unsigned int index)
+{
+    return static_cast<uint16_t>(correct((double)index / maxIndex) * 65535.0 + 0.5);
+}
+
+template <class List>
+struct table;
+
+template <unsigned int... I>
+struct table<meta::indexList<I...>>
+{
+    static constexpr uint16_t values[sizeof...(I)] = {entry(I)...};
+};
+
+template <unsigned int... I>
+constexpr uint16_t table<meta::indexList<I...>>::values[sizeof...(I)];
+
+typedef table<meta::makeIndexList<tableSize>::type> lut;
+
+static_assert(lut::values[0] == 0 && lut::values[maxIndex] == 65535, "gamma table has to span the full range");
+
+} // namespace gammaCorrection
+
+#endif
@@ -1,8 +1,13 @@
 #include <Arduino.h>
 
 #include "../m_constants.h"
+#include "../latency.h"
+#include "../ledStream.h"
 #include "../m_error.h"
+#include "../metrics.h"
+#include "../profiler.h"
 #include "../settings.h"
+#include "../trace.h"
 #include "animator.h"
 #include "color.h"
 #include "LEDCom.h"
@@ -50,12 +55,18 @@ void init()
 // Sets the animation mode and starts running it
 void setAnimationMode(AnimationMode mode)
 {
+    trace::recordModeChange(static_cast<uint8_t>(mode));
     animationMode = mode;
     animationFirstFrame = true;
     animationStartTime = micros() / 1000000.0f;
     animator::resetAnimation();
 }
 
+AnimationMode getAnimationMode()
+{
+    return animationMode;
+}
+
 // Skips less steps in certain animation modes
 void forceRefresh()
 {
@@ -65,6 +76,7 @@ void forceRefresh()
 float lastTime = 0;
 void updateAnimation()
 {
+    PROFILE_ZONE("updateAnimation");
     if (animationCompleted())
     {
         animationMode = AnimationMode::None;
@@ -84,12 +96,8 @@ void updateAnimation()
         LEDCom::setAll(Colors::Off);
         break;
     case AnimationMode::Ambiant : 
-        for (size_t i = 0; i < _KEYCOUNT; i++)
-        {
-            //if!blackkey
-            LEDCom::setAll(settings::getColorSetting(settings::Colors::Ambiant));
-        }
-        
+        //if!blackkey
+        LEDCom::setAll(settings::getPalette().get(settings::Colors::Ambiant));
         break;
     case AnimationMode::Startup:
         animations::startUp(time);
@@ -118,13 +126,31 @@ void updateAnimation()
     case AnimationMode::Wave :
         animations::wave(deltaTime, animationFirstFrame);
         break;
+    case AnimationMode::Stream :
+        animations::stream();
+        break;
     default:
         fatalError(ErrorCode::IMPOSSIBLE_INTERNAL);
         break;
     }
     animationFirstFrame = false;
     fullRefresh = false;
-    LEDCom::updateLEDS();
+    latency::frameRendered();
+    const settings::palette &pal = settings::getPalette();
+    LEDCom::setLayout(pal.layout);
+    LEDCom::setWhiteBalance(pal.get(settings::Colors::WhiteBalance));
+    uint32_t showStart = micros();
+    bool shown = LEDCom::updateLEDS();
+    metrics::recordShowMicros(micros() - showStart);
+    if (shown)
+    {
+        latency::frameShown();
+    }
+
+    if (animationMode == AnimationMode::Stream)
+    {
+        ledStream::frameShown();
+    }
 }
 
 void displayErrorCode(byte error)
@@ -21,7 +21,8 @@ enum class AnimationMode{
     Waiting, // (Learning Mode)
     None,
     Ambiant,
-    Wave
+    Wave,
+    Stream // Pixels recieved over the network
 };
 
 namespace AnimationParameters
@@ -31,6 +32,7 @@ namespace AnimationParameters
 
 void init();
 void setAnimationMode(AnimationMode mode);
+AnimationMode getAnimationMode();
 void forceRefresh();
 void updateAnimation();
 void displayErrorCode(uint8_t error);
@@ -0,0 +1,72 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include <stdint.h>
+
+#include "../m_constants.h"
+
+/**
+ * The strip can be split into segments, each wired to its own pin and sent out on its own
+ * RMT channel. All segments send at the same time, so a frame takes as long as the longest
+ * segment rather than the whole strip.
+ *
+ * Segments follow each other along the LED index in the order listed and have to add up to
+ * _LEDCOUNT. Split long runs evenly so no one segment holds the rest up.
+ *
+ * A board wired to more than one pin defines SEGMENT_LAYOUT as its list of {pin, ledCount},
+ * e.g. -DSEGMENT_LAYOUT="{13, 44}, {12, _LEDCOUNT - 44}". The default is the whole strip on _PIXELPIN.
+ */
+
+#ifndef SEGMENT_LAYOUT
+#define SEGMENT_LAYOUT {_PIXELPIN, _LEDCOUNT}
+#endif
+
+namespace segments
+{
+
+struct segment
+{
+    uint8_t pin;
+    uint16_t ledCount;
+};
+
+constexpr segment layout[] = {SEGMENT_LAYOUT};
+
+constexpr unsigned int count = sizeof(layout) / sizeof(layout[0]);
+constexpr unsigned int maxCount = 8; // RMT channels on the ESP32
+
+// Timing of the SK6812 RGBW: 32 bits per LED at 800kHz then the latch
+constexpr uint32_t bitNanos = 1250;
+constexpr uint32_t bitsPerLed = 32;
+constexpr uint32_t latchMicros = 80;
+
+constexpr uint32_t transferMicros(uint32_t ledCount)
+{
+    return (ledCount * bitsPerLed * bitNanos + 999) / 1000 + latchMicros;
+}
+
+constexpr uint32_t totalLeds(unsigned int index = 0)
+{
+    return index >= count ? 0 : layout[index].ledCount + totalLeds(index + 1);
+}
+
+// How long it takes to send a frame with all segments going at once
+constexpr uint32_t frameTransferMicros(unsigned int index = 0)
+{
+    return index >= count ? 0
+                          : (transferMicros(layout[index].ledCount) > frameTransferMicros(index + 1)
+                                 ? transferMicros(layout[index].ledCount)
+                                 : frameTransferMicros(index + 1));
+}
+
+constexpr uint16_t firstLed(unsigned int index)
+{
+    return index == 0 ? 0 : firstLed(index - 1) + layout[index - 1].ledCount;
+}
+
+static_assert(count >= 1 && count <= maxCount, "between 1 and 8 segments");
+static_assert(totalLeds() == _LEDCOUNT, "the segments have to add up to _LEDCOUNT");
+
+} // namespace segments
+
+#endif
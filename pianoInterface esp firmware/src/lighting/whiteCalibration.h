@@ -0,0 +1,62 @@
+#ifndef WHITE_CALIBRATION_H
+#define WHITE_CALIBRATION_H
+
+#include <stdint.h>
+
+#include "../indexList.h"
+
+/**
+ * Calibration of the strip's white die against its RGB dies. The part of a color common to
+ * all three RGB channels is shown with the white die instead, which gives the same light
+ * for about a third of the current.
+ *
+ * response holds the light of the white die at evenly spaced drive levels (0, 1/4, ... full),
+ * as a fraction of the light of all three RGB dies at full. Measure these for the strip in use,
+ * the defaults assume a white die as bright as full RGB white with a linear response.
+ */
+
+namespace whiteCalibration
+{
+
+constexpr unsigned int segments = 4;
+constexpr double response[segments + 1] = {0.0, 0.25, 0.5, 0.75, 1.0};
+
+constexpr unsigned int tableSize = 257; // one entry per high byte of an 8.8 level plus the end point to interpolate to
+
+// Most RGB white the white die can take over, as an 8.8 level
+constexpr uint32_t maxLevel = response[segments] >= 1.0 ? 65535 : static_cast<uint32_t>(response[segments] * 65535.0);
+
+// Drive level (0 - 1) of the white die for the given light, by inverting the response curve
+constexpr double driveFor(double light, unsigned int segment = 0)
+{
+    return segment >= segments ? 1.0
+                               : light <= response[segment + 1]
+                                     ? (segment + (light - response[segment]) / (response[segment + 1] - response[segment])) / segments
+                                     : driveFor(light, segment + 1);
+}
+
+constexpr uint16_t entry(unsigned int index)
+{
+    return static_cast<uint16_t>(driveFor(index / 256.0) * 65535.0 + 0.5);
+}
+
+template <class List>
+struct table;
+
+template <unsigned int... I>
+struct table<meta::indexList<I...>>
+{
+    static constexpr uint16_t values[sizeof...(I)] = {entry(I)...};
+};
+
+template <unsigned int... I>
+constexpr uint16_t table<meta::indexList<I...>>::values[sizeof...(I)];
+
+// RGB white as an 8.8 level (looked up by its high byte) to white die drive as an 8.8 level
+typedef table<meta::makeIndexList<tableSize>::type> lut;
+
+static_assert(lut::values[0] == 0, "no light has to mean the white die is off");
+
+} // namespace whiteCalibration
+
+#endif
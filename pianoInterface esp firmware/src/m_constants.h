@@ -1,12 +1,26 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
-constexpr uint8_t _KEYCOUNT = 88;
-constexpr uint8_t _PIANOSIZE =   88;
+#include "keyboard.h"
+
+// The keyboard, 61, 76 or 88 keys. Every per key table and buffer follows from it.
+typedef keyboard::standard<88>::type _KEYBOARD;
+
+constexpr uint8_t _KEYCOUNT = _KEYBOARD::keyCount;
+constexpr uint8_t _PIANOSIZE = _KEYBOARD::keyCount;
 constexpr uint8_t _PIXELPIN = 13; 
+constexpr uint16_t _LEDCOUNT = _KEYCOUNT; // pixels on the strip, settings::ledLayout says which keys they belong to
+
+// Strip power, the limiter dims every frame which would draw more than the budget. One LED per key
+// stays under the default whatever it shows, LEDCom::setPowerBudget() lowers it for a weaker supply.
+constexpr uint32_t _POWER_BUDGET_MILLIAMPS = 4000; // what the supply can deliver to the strip
+constexpr uint32_t _CHANNEL_MILLIAMPS = 20;        // one die at full
+constexpr uint32_t _PIXEL_IDLE_MILLIAMPS = 1;      // an LED with everything off
 
 #define _SSID "Dennis"
 #define _NETWORKKEY "7804663459"
 #define _DEVICE_NETWORK_NAME "PianoESP"
+#define _ACCESS_POINT_KEY "pianoesp" // at least 8 characters
+#define _OTA_KEY "piano-update-key" // signs firmware images, see ota.h. Change it before building a device
 
 #endif
\ No newline at end of file
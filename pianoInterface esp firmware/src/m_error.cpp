@@ -28,7 +28,7 @@ bool fatalError(ErrorCode errorCode, bool exec)
     currentError = errorCode;
     lights::setRedLED(true);
     #ifdef ENABLE_SERIAL
-    Serial.println("ErrorCode: " + String(static_cast<uint8_t>(errorCode)));
+    Serial.printf("ErrorCode: %u\n", static_cast<unsigned int>(errorCode));
     #endif
     lights::displayErrorCode(static_cast<uint8_t>(errorCode));
     lights::setAnimationMode(lights::AnimationMode::PulseError);
@@ -0,0 +1,179 @@
+#include <Arduino.h>
+#include <atomic>
+#include <esp_heap_caps.h>
+#include <new>
+#include <stdlib.h>
+
+#include "memoryStats.h"
+
+namespace
+{
+    std::atomic<uint32_t> allocations(0);
+    std::atomic<uint32_t> frees(0);
+
+    inline void countAllocation()
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void countFree()
+    {
+        frees.fetch_add(1, std::memory_order_relaxed);
+    }
+} // namespace
+
+#if defined(CONFIG_HEAP_USE_HOOKS)
+
+// Called by the heap for every allocation and free, whether from malloc, new or heap_caps.
+// They run with the heap locked so they can't allocate or block.
+extern "C" void IRAM_ATTR esp_heap_trace_alloc_hook(void *pointer, size_t size, uint32_t caps)
+{
+    countAllocation();
+}
+
+extern "C" void IRAM_ATTR esp_heap_trace_free_hook(void *pointer)
+{
+    countFree();
+}
+
+#elif defined(MEMORYSTATS_WRAP_MALLOC)
+
+// Linked with -Wl,--wrap=malloc,--wrap=free,--wrap=calloc,--wrap=realloc every call to these
+// from the firmware comes here first, see memoryStats.h
+extern "C"
+{
+    void *__real_malloc(size_t size);
+    void __real_free(void *pointer);
+    void *__real_calloc(size_t count, size_t size);
+    void *__real_realloc(void *pointer, size_t size);
+
+    void *__wrap_malloc(size_t size)
+    {
+        countAllocation();
+        return __real_malloc(size);
+    }
+
+    void __wrap_free(void *pointer)
+    {
+        if (pointer != nullptr)
+        {
+            countFree();
+        }
+        __real_free(pointer);
+    }
+
+    void *__wrap_calloc(size_t count, size_t size)
+    {
+        countAllocation();
+        return __real_calloc(count, size);
+    }
+
+    // Counted as a new allocation, and a free of the old one if there was one
+    void *__wrap_realloc(void *pointer, size_t size)
+    {
+        if (pointer != nullptr)
+        {
+            countFree();
+        }
+        if (size != 0 || pointer == nullptr)
+        {
+            countAllocation();
+        }
+        return __real_realloc(pointer, size);
+    }
+}
+
+#else
+
+// Neither heap hooks nor wrapped malloc, so only new and delete get counted
+#define MEMORYSTATS_COUNT_NEW
+
+#endif
+
+namespace
+{
+    void *allocate(size_t size)
+    {
+#ifdef MEMORYSTATS_COUNT_NEW
+        countAllocation();
+#endif
+        return malloc(size == 0 ? 1 : size);
+    }
+
+    void release(void *pointer)
+    {
+#ifdef MEMORYSTATS_COUNT_NEW
+        if (pointer != nullptr)
+        {
+            countFree();
+        }
+#endif
+        free(pointer);
+    }
+} // namespace
+
+// Replacements for the global allocation functions. The C++ runtime's own would call a malloc
+// the wrapper never sees, as its calls were bound when it was built.
+void *operator new(size_t size)
+{
+    return allocate(size);
+}
+void *operator new[](size_t size)
+{
+    return allocate(size);
+}
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate(size);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate(size);
+}
+void operator delete(void *pointer) noexcept
+{
+    release(pointer);
+}
+void operator delete[](void *pointer) noexcept
+{
+    release(pointer);
+}
+void operator delete(void *pointer, size_t) noexcept
+{
+    release(pointer);
+}
+void operator delete[](void *pointer, size_t) noexcept
+{
+    release(pointer);
+}
+
+namespace memoryStats
+{
+
+// How many allocations have been made since boot. Compare two readings to count the allocations made in between.
+uint32_t allocationCount()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+// Whether allocations made with malloc are counted as well as those made with new
+bool countsMalloc()
+{
+#ifdef MEMORYSTATS_COUNT_NEW
+    return false;
+#else
+    return true;
+#endif
+}
+
+heapStats getHeapStats()
+{
+    return {
+        allocations.load(std::memory_order_relaxed),
+        frees.load(std::memory_order_relaxed),
+        (uint32_t)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+        (uint32_t)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+        (uint32_t)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT)};
+}
+
+} // namespace memoryStats
@@ -0,0 +1,40 @@
+#ifndef MEMORYSTATS_H
+#define MEMORYSTATS_H
+
+#include <stdint.h>
+
+/**
+ * Counts heap allocations so it can be checked that the request handlers and the
+ * render loop stay allocation free, along with the state of the heap itself for
+ * spotting fragmentation over long uptimes.
+ *
+ * Arduino String, the WiFi stack and C code call malloc directly, so counting new
+ * alone misses most of them. Every allocation is counted when either of these is set up:
+ *  - CONFIG_HEAP_USE_HOOKS in the ESP-IDF sdkconfig, the heap calls a hook on every
+ *    allocation and free (ESP-IDF 5.1 on)
+ *  - MEMORYSTATS_WRAP_MALLOC defined and the firmware linked with
+ *    -Wl,--wrap=malloc,--wrap=free,--wrap=calloc,--wrap=realloc, as the host build does
+ * Without either only new and delete are counted and countsMalloc() says so.
+ */
+
+namespace memoryStats
+{
+
+struct heapStats
+{
+    uint32_t allocations;      // since boot
+    uint32_t frees;            // since boot
+    uint32_t freeBytes;
+    uint32_t minimumFreeBytes; // lowest the free heap has been since boot
+    uint32_t largestFreeBlock; // much smaller than freeBytes means the heap is fragmented
+};
+
+uint32_t allocationCount();
+
+bool countsMalloc();
+
+heapStats getHeapStats();
+
+} // namespace memoryStats
+
+#endif
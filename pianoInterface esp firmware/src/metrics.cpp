@@ -0,0 +1,197 @@
+#include <Arduino.h>
+#include <atomic>
+#include <stdarg.h>
+
+#include "circularBuffer.h"
+#include "histogram.h"
+#include "latency.h"
+#include "lighting/LEDCom.h"
+#include "memoryStats.h"
+#include "metrics.h"
+
+namespace
+{
+    // THREAD 0
+    histogram frameMicros;
+    histogram showMicros;
+    uint32_t lastFrameMicros = 0;
+    std::atomic<uint32_t> frameAverageMicros(0);
+
+    // THREAD 1
+    std::atomic<uint32_t> midiEvents(0);
+    std::atomic<uint32_t> midiEventsDropped(0);
+
+    // NETWORK THREAD
+    histogram httpMicros;
+
+    struct taskEntry
+    {
+        const char *name;
+        TaskHandle_t handle;
+    };
+    taskEntry tasks[metrics::maxTasks];
+    std::atomic<unsigned int> taskCount(0);
+
+    // NETWORK THREAD snapshot state
+    char text[metrics::textSize];
+    unsigned int textLength = 0;
+    uint32_t lastSnapshotMillis = 0;
+    uint32_t lastSnapshotMidiEvents = 0;
+
+    void append(const char *format, ...) __attribute__((format(printf, 1, 2)));
+    void append(const char *format, ...)
+    {
+        if (textLength >= sizeof(text) - 1)
+        {
+            return;
+        }
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(text + textLength, sizeof(text) - textLength, format, args);
+        va_end(args);
+        if (length > 0)
+        {
+            textLength += length;
+            textLength = textLength > sizeof(text) - 1 ? sizeof(text) - 1 : textLength;
+        }
+    }
+
+    void appendGauge(const char *name, const char *help, double value)
+    {
+        append("# HELP %s %s\n# TYPE %s gauge\n%s %g\n", name, help, name, name, value);
+    }
+
+    // Whole numbers in full, %g would round anything past six digits
+    void appendGauge(const char *name, const char *help, uint32_t value)
+    {
+        append("# HELP %s %s\n# TYPE %s gauge\n%s %u\n", name, help, name, name, value);
+    }
+
+    void appendCounter(const char *name, const char *help, uint32_t value)
+    {
+        append("# HELP %s %s\n# TYPE %s counter\n%s %u\n", name, help, name, name, value);
+    }
+
+    void appendSummary(const char *name, const char *help, const histogram &h)
+    {
+        append("# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+        append("%s{quantile=\"0.5\"} %u\n%s{quantile=\"0.99\"} %u\n%s{quantile=\"1\"} %u\n%s_sum %u\n%s_count %u\n",
+               name, h.percentile(0.5f), name, h.percentile(0.99f), name, h.max(), name, h.valueSum(), name, h.count());
+    }
+} // namespace
+
+namespace metrics
+{
+
+// THREAD 0: Call once at the end of every loop
+void frameEnd()
+{
+    uint32_t now = micros();
+    if (lastFrameMicros != 0)
+    {
+        uint32_t frameTime = now - lastFrameMicros;
+        frameMicros.record(frameTime);
+        uint32_t average = frameAverageMicros.load(std::memory_order_relaxed);
+        frameAverageMicros.store(average == 0 ? frameTime : average + ((int32_t)(frameTime - average) >> 4), std::memory_order_relaxed);
+    }
+    lastFrameMicros = now;
+}
+
+// THREAD 0: How long the output stage and strip Show() took
+void recordShowMicros(uint32_t micros)
+{
+    showMicros.record(micros);
+}
+
+// THREAD 1
+void midiEvent()
+{
+    midiEvents.fetch_add(1, std::memory_order_relaxed);
+}
+
+// THREAD 1: A note event was thrown away because THREAD 0 wasn't keeping up
+void midiEventDropped()
+{
+    midiEventsDropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+// NETWORK THREAD
+void recordHttpMicros(uint32_t micros)
+{
+    httpMicros.record(micros);
+}
+
+// Adds a task whose stack high water mark is reported. Call once per task, from any thread.
+void registerTask(const char *name, TaskHandle_t task)
+{
+    unsigned int index = taskCount.load(std::memory_order_relaxed);
+    if (index >= maxTasks || task == nullptr)
+    {
+        return;
+    }
+    tasks[index] = {name, task};
+    taskCount.store(index + 1, std::memory_order_release);
+}
+
+// NETWORK THREAD: Renders every metric as Prometheus text into the snapshot buffer. Returns its length.
+unsigned int snapshot()
+{
+    textLength = 0;
+    text[0] = '\0';
+
+    uint32_t now = millis();
+    uint32_t events = midiEvents.load(std::memory_order_relaxed);
+    float seconds = (now - lastSnapshotMillis) / 1000.0f;
+    float eventRate = lastSnapshotMillis == 0 || seconds <= 0.0f ? 0.0f : (events - lastSnapshotMidiEvents) / seconds;
+    lastSnapshotMillis = now;
+    lastSnapshotMidiEvents = events;
+
+    uint32_t averageFrame = frameAverageMicros.load(std::memory_order_relaxed);
+    appendSummary("piano_frame_micros", "Time between the starts of two render loops.", frameMicros);
+    appendGauge("piano_fps", "Frames per second from the average frame time.", averageFrame == 0 ? 0.0 : 1000000.0 / averageFrame);
+    appendSummary("piano_strip_show_micros", "Output stage and strip Show() time per frame.", showMicros);
+    appendGauge("piano_strip_milliamps", "Estimated strip current after the power limit.", LEDCom::getEstimatedMilliamps());
+    appendGauge("piano_strip_power_scale", "How far the power limit is dimming the strip, 1 is not at all.", LEDCom::getPowerScale());
+
+    appendCounter("piano_midi_events_total", "Note on and off events recieved from the piano.", events);
+    appendGauge("piano_midi_events_per_second", "MIDI events per second since the last snapshot.", eventRate);
+    appendCounter("piano_midi_events_dropped_total", "Note events dropped because the render loop fell behind.", midiEventsDropped.load(std::memory_order_relaxed));
+    latency::stageStats keyLatency = latency::getStats(latency::Stage::Total);
+    append("# HELP piano_key_latency_micros Key press to frame going out, see /getLatencyStats for the stages.\n"
+           "# TYPE piano_key_latency_micros summary\n"
+           "piano_key_latency_micros{quantile=\"0.5\"} %u\npiano_key_latency_micros{quantile=\"0.99\"} %u\n"
+           "piano_key_latency_micros{quantile=\"1\"} %u\npiano_key_latency_micros_sum %u\npiano_key_latency_micros_count %u\n",
+           keyLatency.p50Micros, keyLatency.p99Micros, keyLatency.maxMicros, keyLatency.sumMicros, latency::getSampleCount());
+
+    appendGauge("piano_event_queue_depth", "Events waiting for the render loop.", (uint32_t)EventQueLength());
+    appendSummary("piano_http_request_micros", "Time to handle an HTTP request once its headers are in.", httpMicros);
+
+    memoryStats::heapStats heap = memoryStats::getHeapStats();
+    appendGauge("piano_heap_free_bytes", "Free heap.", heap.freeBytes);
+    appendGauge("piano_heap_minimum_free_bytes", "Lowest the free heap has been since boot.", heap.minimumFreeBytes);
+    appendGauge("piano_heap_largest_free_block_bytes", "Largest block that can be allocated.", heap.largestFreeBlock);
+    appendCounter("piano_heap_allocations_total",
+                  memoryStats::countsMalloc() ? "Heap allocations since boot, malloc and new." : "Allocations through new since boot, this build doesn't count malloc.",
+                  heap.allocations);
+
+    append("# HELP piano_task_stack_free_bytes Least free stack each task has had.\n# TYPE piano_task_stack_free_bytes gauge\n");
+    unsigned int count = taskCount.load(std::memory_order_acquire);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        append("piano_task_stack_free_bytes{task=\"%s\"} %u\n", tasks[i].name, (unsigned int)uxTaskGetStackHighWaterMark(tasks[i].handle));
+    }
+    return textLength;
+}
+
+// The text of the last snapshot
+const char *getText()
+{
+    return text;
+}
+
+unsigned int getTextLength()
+{
+    return textLength;
+}
+
+} // namespace metrics
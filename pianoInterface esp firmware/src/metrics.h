@@ -0,0 +1,36 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/**
+ * Runtime counters and histograms, served as Prometheus text on GET /metrics and readable
+ * in pages over any transport with the GetMetricsText command. Recording is a relaxed
+ * atomic add or two so it is safe from any thread, the hot paths included.
+ */
+
+namespace metrics
+{
+
+constexpr unsigned int textSize = 4096; // the whole rendered snapshot, about 3.4KB today
+constexpr unsigned int maxTasks = 6;
+
+void frameEnd();
+void recordShowMicros(uint32_t micros);
+
+void midiEvent();
+void midiEventDropped();
+
+void recordHttpMicros(uint32_t micros);
+
+void registerTask(const char *name, TaskHandle_t task);
+
+unsigned int snapshot();
+const char *getText();
+unsigned int getTextLength();
+
+} // namespace metrics
+
+#endif
@@ -1,4 +1,5 @@
 #include <Arduino.h>
+#include <atomic>
 
 #include "circularBuffer.h"
 #include "m_error.h"
@@ -7,60 +8,182 @@
 
 namespace
 {
-music::songFrame frameData[music::maxSongLength]; // all the frames in the song
-byte noteData[music::maxNoteCount];               // all the actual notes in the  song
+// The song is kept as it was uploaded, the notes of every frame one after another. Frames are
+// only decoded into masks when they are asked for, which is the live frame and the few lookahead
+// frames. Decoded masks for the whole song would take 24 bytes a frame, 120KB of DRAM at maxSongLength.
+struct song
+{
+    uint8_t notes[music::maxNoteCount];               // all the actual notes in the song
+    uint16_t frameStarts[music::maxSongLength + 1];   // index in notes of the first note of each frame, and of the end of the song
+    unsigned int frameCount;
+    unsigned int noteCount;
+    char name[music::maxSongNameLength + 1];
+    uint16_t generation; // set when the song is swapped in
+};
+
+// The live song which THREAD 0 plays and the one the network thread uploads into. Once an upload
+// is complete THREAD 0 swaps the two between frames, so neither thread ever sees the other's song
+// half written. About 18KB each.
+song songs[2] = {{{0}, {0}, 0, 0, "no song loaded", 0}, {{0}, {0}, 0, 0, "", 0}};
+std::atomic<song *> liveSong(&songs[0]);
+std::atomic<bool> uploadReady(false); // the network thread has finished with the upload song and it waits to be swapped in
 
-String songName = "no song loaded";
+// NETWORK THREAD
+bool uploading = false;
 
-unsigned int frameLoaderIndex = 0; // tracks what frame is being loaded in
-unsigned int notesLoaded = 0;      // how many notes have been loaded in so far
 unsigned int liveFrameIndex = 0;   // the current frame being played
 
+music::songFrame liveFrame = {emptyKeyMask, emptyKeyMask}; // the live frame decoded, only valid when liveFrameDecoded is set
+bool liveFrameDecoded = false;
+
 bool looping = false;       // whether or not to perform looping
 unsigned int loopStart = 0; // first frame of the song loop
 unsigned int loopEnd = 0;   // last frame of the song loop
+
+// Only THREAD 0 ever changes the live song
+const song &live()
+{
+    return *liveSong.load(std::memory_order_relaxed);
+}
+
+song &uploadSong()
+{
+    return liveSong.load(std::memory_order_relaxed) == &songs[0] ? songs[1] : songs[0];
+}
+
+// Adjusts a frame index for the looping settings and the song length
+unsigned int wrapFrameIndex(unsigned int index)
+{
+    if (looping)
+    {
+        if (index >= loopEnd)
+        {
+            index = loopStart;
+        }
+        else if (index < loopStart)
+        {
+            index = loopStart;
+        }
+    }
+    if (index >= live().frameCount)
+    {
+        index = 0;
+    }
+    return index;
+}
+
+// Builds the masks of a frame from its notes
+music::songFrame decodeFrame(unsigned int index)
+{
+    const song &s = live();
+    music::songFrame frame = {emptyKeyMask, emptyKeyMask};
+    for (unsigned int i = s.frameStarts[index]; i < s.frameStarts[index + 1]; i++)
+    {
+        uint8_t note = s.notes[i] & ~music::handBit;
+        if (note >= _PIANOSIZE)
+        {
+            continue;
+        }
+        setKey(frame.keys, note);
+        if (s.notes[i] & music::handBit)
+        {
+            setKey(frame.hands, note);
+        }
+    }
+    return frame;
+}
 } // namespace
 
 namespace music
 {
 
-// Clears loading data and gets ready to load a new song
-void resetSongLoader()
+// NETWORK THREAD: Starts uploading a new song while the live one keeps playing. Longer names are cut short.
+// Returns false if the last upload hasn't been swapped in by THREAD 0 yet.
+bool beginUpload(const char *name, unsigned int nameLength)
 {
-    frameLoaderIndex = 0;
-    notesLoaded = 0;
-    liveFrameIndex = 0;
-    loopStart = 0;
-    loopEnd = 0;
+    if (uploadReady.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    song &s = uploadSong();
+    s.frameCount = 0;
+    s.noteCount = 0;
+    s.frameStarts[0] = 0;
+    nameLength = nameLength > maxSongNameLength ? maxSongNameLength : nameLength;
+    memcpy(s.name, name, nameLength);
+    s.name[nameLength] = '\0';
+    uploading = true;
+    return true;
+}
+
+// NETWORK THREAD: Adds a new frame to the end of the song being uploaded. Returns false if it doesn't fit.
+bool uploadFrame(const uint8_t *notes, uint8_t noteCount)
+{
+    song &s = uploadSong();
+    if (!uploading || s.frameCount >= maxSongLength || s.noteCount + noteCount > maxNoteCount)
+    {
+        return false;
+    }
+    memcpy(s.notes + s.noteCount, notes, noteCount);
+    s.noteCount += noteCount;
+    s.frameCount++;
+    s.frameStarts[s.frameCount] = s.noteCount;
+    return true;
+}
+
+// NETWORK THREAD: Hands the uploaded song over to THREAD 0, which takes it with swapInUpload()
+bool endUpload()
+{
+    if (!uploading || uploadSong().frameCount == 0)
+    {
+        uploading = false;
+        return false;
+    }
+    uploading = false;
+    uploadReady.store(true, std::memory_order_release);
+    return true;
 }
 
-// Adds a new frame to the end of the song
-void loadFrame(byte *notes, byte noteCount)
+// THREAD 0: Makes a finished upload the live song, starting at its first frame with no loop.
+// Returns false if there wasn't one.
+bool swapInUpload()
 {
-    memcpy(noteData + notesLoaded, notes, noteCount);
-    frameData[frameLoaderIndex] = {noteData + notesLoaded, noteData + notesLoaded + noteCount - 1};
-    frameLoaderIndex++;
-    notesLoaded += noteCount;
+    if (!uploadReady.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    song &uploaded = uploadSong();
+    uploaded.generation = live().generation + 1;
+    liveSong.store(&uploaded, std::memory_order_release);
+    liveFrameIndex = 0;
+    liveFrameDecoded = false;
+    looping = false;
+    loopStart = 0;
+    loopEnd = 0;
+    uploadReady.store(false, std::memory_order_release);
+    return true;
 }
 
 // Retrieves a previously loaded frame
 bool getFrame(unsigned int frameIndex, songFrame *frame)
 {
-    if (!assert_fatal(frameIndex < notesLoaded, ErrorCode::INVALID_SONG_FRAME_INDEX))
+    if (!assert_fatal(frameIndex < live().frameCount, ErrorCode::INVALID_SONG_FRAME_INDEX))
     {
         return false;
     }
 
-    *frame = frameData[frameIndex];
-    return assert_fatal(frame != nullptr, ErrorCode::NULL_SONG_FRAME);
+    *frame = decodeFrame(frameIndex);
+    return true;
 }
 
-// Retrieves the frame at the live frame index of the loaded song
+// Retrieves the frame at the live frame index of the loaded song. It is only decoded once each time the live frame changes.
 songFrame currentFrame()
 {
-    songFrame frame;
-    getFrame(liveFrameIndex, &frame);
-    return frame;
+    if (!liveFrameDecoded && getFrame(liveFrameIndex, &liveFrame))
+    {
+        liveFrameDecoded = true;
+    }
+    return liveFrame;
 }
 
 // Retrieves live frame index of the loaded song
@@ -69,6 +192,26 @@ int currentFrameIndex()
     return liveFrameIndex;
 }
 
+// How many frames the loaded song has
+unsigned int frameCount()
+{
+    return live().frameCount;
+}
+
+// Goes up by one every time a new song is swapped in
+uint16_t getSongGeneration()
+{
+    return liveSong.load(std::memory_order_acquire)->generation;
+}
+
+// NETWORK THREAD: The live song as it is stored. It stays put until the network thread's own
+// next beginUpload(), even if THREAD 0 swaps another song in meanwhile.
+songView getLiveSong()
+{
+    const song &s = *liveSong.load(std::memory_order_acquire);
+    return {s.generation, s.frameCount, s.name, s.notes, s.frameStarts};
+}
+
 // Advances the song to the next frame
 void nextFrame()
 {
@@ -80,28 +223,24 @@ void nextFrame()
 // Note: animation forced refresh may be required after setting the frame index manually
 void setFrame(unsigned int index)
 {
-    liveFrameIndex = index;
-    if (looping)
-    {
-        if (liveFrameIndex >= loopEnd)
-        {
-            liveFrameIndex = loopStart;
-        }
-        else if (liveFrameIndex < loopStart)
-        {
-            liveFrameIndex = loopStart;
-        }
-    }
-    if (liveFrameIndex >= notesLoaded)
+    index = wrapFrameIndex(index);
+    if (index != liveFrameIndex)
     {
-        liveFrameIndex = 0;
+        liveFrameIndex = index;
+        liveFrameDecoded = false;
     }
 }
 
+// The frame which will be played after the given frame, taking looping into account
+unsigned int followingFrameIndex(unsigned int index)
+{
+    return wrapFrameIndex(index + 1);
+}
+
 // Updates the settings used to automatically loop a portion of the song
 void setLoopingSettings(bool enabled, unsigned int start, unsigned int end)
 {
-    if (start >= end || end > frameLoaderIndex)
+    if (start >= end || end > live().frameCount)
     {
         fatalError(ErrorCode::INVALID_LOOP_SETTING);
     }
@@ -127,14 +266,10 @@ int getLoopEnd()
     return loopEnd;
 }
 
-void setSongName(String name)
-{
-    songName = name;
-}
-
-String getSongName()
+// Safe from the network thread, the only one which writes the other song
+const char *getSongName()
 {
-    return songName;
+    return liveSong.load(std::memory_order_acquire)->name;
 }
 
-} // namespace music
\ No newline at end of file
+} // namespace music
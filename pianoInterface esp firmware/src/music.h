@@ -4,24 +4,45 @@
 #include <Arduino.h>
 #include <stdint.h>
 
+#include "keyMask.h"
 #include "m_constants.h"
 
 namespace music
 {
 
-// Describes where in the note data array describes a step in a song 
+// Describes a step in a song. Frames are stored as their notes and decoded into masks
+// when they are fetched, so matching a chord never has to walk the notes.
 struct songFrame
 {
-    uint8_t *firstNote;
-    uint8_t *lastNote;
+    keyMask keys;  // every note in the frame
+    keyMask hands; // notes in the frame which have the hand bit set
 };
 
+constexpr uint8_t handBit = 0b10000000; // high bit of a song note specifies the hand
+constexpr uint8_t frameEndMarker = 250;  // ends each frame in uploaded song data
+
 constexpr unsigned int maxSongLength = 5000;
 constexpr unsigned int maxNoteCount = 8192;
-
-void resetSongLoader();
-
-void loadFrame(uint8_t *notes, uint8_t noteCount);
+constexpr unsigned int maxSongNameLength = 32;
+
+// Uploads go into a second song buffer from the network thread while the live song keeps
+// playing. THREAD 0 swaps the finished upload in with swapInUpload().
+bool beginUpload(const char *name, unsigned int nameLength);
+bool uploadFrame(const uint8_t *notes, uint8_t noteCount);
+bool endUpload();
+bool swapInUpload();
+uint16_t getSongGeneration();
+
+// The live song for the trace dump, frame f is notes[frameStarts[f]] up to notes[frameStarts[f + 1]]
+struct songView
+{
+    uint16_t generation;
+    unsigned int frameCount;
+    const char *name;
+    const uint8_t *notes;
+    const uint16_t *frameStarts;
+};
+songView getLiveSong();
 
 bool getFrame(unsigned int frameIndex, songFrame *frame);
 
@@ -29,32 +50,27 @@ songFrame currentFrame();
 
 int currentFrameIndex();
 
+unsigned int frameCount();
+
 void nextFrame();
 
 void setFrame(unsigned int index);
 
+unsigned int followingFrameIndex(unsigned int index);
+
 void setLoopingSettings(bool enabled, unsigned int start, unsigned int end);
 
 bool getLoopingEnabled();
 int getLoopStart();
 int getLoopEnd();
 
-void setSongName(String name);
-String getSongName();
-
-constexpr unsigned int noteNumberInOctive(unsigned int note)
-{
-    return note <= 2 ? note + 9 : (note - 3) - ((note - 3) / 12) * 12;
-};
+const char *getSongName();
 
+// Single table lookup, see keyboard::model
 constexpr bool isBlackNote(unsigned int note)
 {
-    return (noteNumberInOctive(note) == 1 ||
-            noteNumberInOctive(note) == 3 ||
-            noteNumberInOctive(note) == 6 ||
-            noteNumberInOctive(note) == 8 ||
-            noteNumberInOctive(note) == 10);
-};
+    return _KEYBOARD::isBlack(note);
+}
 
 }
 #endif
@@ -1,352 +1,436 @@
 #include <Arduino.h>
-#include <ArduinoOTA.h>
 #include <WiFi.h>
-#include <WebServer.h>
 #include <WiFiUdp.h>
+#include <atomic>
 
 #include "circularBuffer.h"
+#include "commands.h"
+#include "httpServer.h"
 #include "lighting/lighting.h"
 #include "lighting/color.h"
+#include "ledStream.h"
 #include "m_constants.h"
 #include "m_error.h"
+#include "metrics.h"
+#include "profiler.h"
 #include "music.h"
 #include "pinaoCom.h"
 #include "network.h"
 #include "settings.h"
 #include "serialDebug.h"
+#include "trace.h"
+#include "webSocket.h"
 
 namespace
 {
-    unsigned long lastMessageMillis = 0;
-    byte messageBuffer[8];
-    byte songStreamBuffer[music::maxNoteCount];
-    char songConversionBuffer[music::maxNoteCount];
-
-    unsigned int loaderFrameIndex;      // What frame of the song was last loaded
-    byte frameNoteIndex;                // How many notes for the currently loading frame have been loaded
-    byte currentFrameNotes[_PIANOSIZE]; // Storage for loading notes in the frame before being memcopied by ::music
-
-    WebServer webServer(80);
-    WiFiClient client; // persistant accross poll calls.
-
-    // combine to bytes into the unsigned short they make together
-    uint16_t concatBytes(uint8_t A, uint8_t B)
+    // An HTTP route which runs a command. The query arguments fill in the
+    // command's request fields in order.
+    struct httpRoute
+    {
+        const char *uri;
+        commands::Opcode opcode;
+        const char *args[4];
+    };
+
+    const httpRoute httpRoutes[] = {
+        {"/getStatus", commands::Opcode::GetStatus, {}},
+        {"/getSongIndex", commands::Opcode::GetSongIndex, {}},
+        {"/setSongIndex", commands::Opcode::SetSongIndex, {"index"}},
+        {"/getSongName", commands::Opcode::GetSongName, {}},
+        {"/changeSetting", commands::Opcode::ChangeSetting, {"setting", "A", "B", "C"}},
+        {"/getSettings", commands::Opcode::GetSetting, {"setting"}},
+        {"/changeFloatSetting", commands::Opcode::ChangeFloatSetting, {"setting", "value"}},
+        {"/getFloatSetting", commands::Opcode::GetFloatSetting, {"setting"}},
+        {"/setLoopSetting", commands::Opcode::SetLoopSetting, {"enabled", "start", "end"}},
+        {"/getLoopSetting", commands::Opcode::GetLoopSetting, {}},
+        {"/restoreSettings", commands::Opcode::RestoreSettings, {}},
+        {"/saveSettings", commands::Opcode::SaveSettings, {}},
+        {"/setAnimationMode", commands::Opcode::SetAnimationMode, {"mode"}},
+        {"/getStreamStats", commands::Opcode::GetStreamStats, {}},
+        {"/getHeapStats", commands::Opcode::GetHeapStats, {}},
+        {"/getNetworkStatus", commands::Opcode::GetNetworkStatus, {}},
+        {"/getOtaStatus", commands::Opcode::GetOtaStatus, {}},
+        {"/setLedLayout", commands::Opcode::SetLedLayout, {"firstLed", "ledsPerKey", "reversed"}},
+        {"/getLedLayout", commands::Opcode::GetLedLayout, {}},
+        {"/getLatencyStats", commands::Opcode::GetLatencyStats, {}},
+        {"/resetLatencyStats", commands::Opcode::ResetLatencyStats, {}}};
+    constexpr unsigned int httpRouteCount = sizeof(httpRoutes) / sizeof(httpRoutes[0]);
+
+    // NETWORK THREAD connection state, the atomics are also read by other threads
+    std::atomic<network::ConnectionState> connectionState(network::ConnectionState::Connecting);
+    std::atomic<bool> connected(false);
+    std::atomic<bool> accessPointActive(false);
+    unsigned long stateStartMillis = 0;
+    unsigned long backoffMillis = 0;
+    unsigned int failedAttempts = 0;
+    bool everConnected = false;
+
+    void printFailureReason(wl_status_t status)
     {
-        uint16_t combined = A;
-        combined = combined << 8;
-        combined |= B;
-        return combined;
+        switch (status)
+        {
+        case WL_NO_SSID_AVAIL:
+            debug::println("WIFI: network not found");
+            break;
+        case WL_CONNECT_FAILED:
+            debug::println("WIFI: connection failed");
+            break;
+        case WL_CONNECTION_LOST:
+            debug::println("WIFI: connection lost");
+            break;
+        case WL_DISCONNECTED:
+            debug::println("WIFI: disconnected");
+            break;
+        default:
+            debug::println("WIFI: connection timed out");
+            break;
+        }
     }
 
-    int intArg(const char * name){
-        return webServer.arg(name).toInt();
+    void onConnected()
+    {
+        debug::println("WIFI: connected");
+        failedAttempts = 0;
+        if (accessPointActive.load())
+        {
+            WiFi.softAPdisconnect();
+            accessPointActive.store(false);
+        }
+        connectionState.store(network::ConnectionState::Connected);
+        connected.store(true, std::memory_order_release);
+
+        // Let the user know the first time the network comes up, if the render loop has room for it
+        if (!everConnected)
+        {
+            everConnected = true;
+            TryPushEvent([]() {
+                lights::AnimationMode mode = lights::getAnimationMode();
+                lights::setAnimationMode(lights::AnimationMode::BlinkSuccess);
+                while (!lights::animationCompleted())
+                {
+                    lights::updateAnimation();
+                }
+                lights::setAnimationMode(mode);
+            });
+        }
     }
 } // namespace
 
 namespace network
 {
-    void handleGetStatus();
-    void handleGetIndex();
-    void handleSetIndex();
-    void handleUploadSong();
-    void handleChangeSetting();
-    void handleSetLoopSetting();
-    void handleGetLoopSetting();
-    void handleGetSongName();
-    void handleRestoreSettings();
-    void handleGetSettings();
-    void handleSetAnimationMode();
-    void handleSaveSettings();
+    void handleRequest(const http::request &req);
+    void handleUploadSong(const http::request &req);
+    void handleCommandRoute(const http::request &req, const httpRoute &route);
 
-    // Starts connecting to the WIFI network
+    // Starts connecting to the WIFI network. The connection is then looked after by updateConnection().
     void beginConnection()
     {
         //WiFi.setHostname(hostName);
         WiFi.mode(WIFI_AP_STA);
+        WiFi.setAutoReconnect(false); // reconnects are paced by the backoff instead
         WiFi.begin(_SSID, _NETWORKKEY);
+        connectionState.store(ConnectionState::Connecting);
+        stateStartMillis = millis();
     }
 
-    // Blocks until WIFI connection has been established.
-    // Returns success.
-    bool waitForConnection()
+    // NETWORK THREAD: Steps the connection state machine. Never blocks.
+    void updateConnection()
     {
-        unsigned int attempts = 0;
-        wl_status_t status;
-        do
+        unsigned long now = millis();
+        wl_status_t status = WiFi.status();
+
+        switch (connectionState.load())
         {
-            status = WiFi.status();
-            delay(100);
-            attempts++;
-            if (attempts == 60)
+        case ConnectionState::Connecting:
+            if (status == WL_CONNECTED)
+            {
+                onConnected();
+            }
+            else if (now - stateStartMillis > connectTimeoutMillis)
             {
-                switch (status)
+                printFailureReason(status);
+                WiFi.disconnect();
+                failedAttempts++;
+                if (failedAttempts >= accessPointAfterFailures && !accessPointActive.load())
+                {
+                    // Give clients a way in until the network comes back
+                    WiFi.softAP(_DEVICE_NETWORK_NAME, _ACCESS_POINT_KEY);
+                    accessPointActive.store(true);
+                    debug::println("WIFI: started access point");
+                }
+                unsigned int shift = failedAttempts - 1 < 6 ? failedAttempts - 1 : 6;
+                backoffMillis = backoffBaseMillis << shift;
+                if (backoffMillis > backoffMaxMillis)
                 {
-                case WL_NO_SSID_AVAIL:
-                    fatalError(ErrorCode::WIFI_NO_SSID_AVAIL);
-                    break;
-                case WL_CONNECT_FAILED:
-                    fatalError(ErrorCode::WIFI_CONNECTION_FAILED);
-                    break;
-                case WL_CONNECTION_LOST:
-                    fatalError(ErrorCode::WIFI_CONNECTION_LOST);
-                    break;
-                case WL_DISCONNECTED:
-                    fatalError(ErrorCode::WIFI_DISCONNECTED);
-                    break;
-                default:
-                    fatalError(ErrorCode::WIFI_CONNECTION_TIMEOUT);
-                    break;
+                    backoffMillis = backoffMaxMillis;
                 }
-                return false;
+                connectionState.store(ConnectionState::Backoff);
+                stateStartMillis = now;
             }
-        } while (status != WL_CONNECTED);
-
-        if (status != WL_CONNECTED)
-        {
-            fatalError(ErrorCode::IMPOSSIBLE_INTERNAL);
-            return false;
-        }
-
-        // OTA stuff
-        ArduinoOTA.onStart([]() {
-            String type;
-            if (ArduinoOTA.getCommand() == U_FLASH)
+            break;
+        case ConnectionState::Connected:
+            if (status != WL_CONNECTED)
             {
-                type = "sketch";
+                debug::println("WIFI: connection lost, reconnecting");
+                connected.store(false, std::memory_order_release);
+                WiFi.begin(_SSID, _NETWORKKEY);
+                connectionState.store(ConnectionState::Connecting);
+                stateStartMillis = now;
             }
-            else
-            { // U_SPIFFS
-                type = "filesystem";
+            break;
+        case ConnectionState::Backoff:
+            if (now - stateStartMillis > backoffMillis)
+            {
+                WiFi.begin(_SSID, _NETWORKKEY);
+                connectionState.store(ConnectionState::Connecting);
+                stateStartMillis = now;
             }
-        });
+            break;
+        }
+    }
 
-        ArduinoOTA.begin();
+    ConnectionState getConnectionState()
+    {
+        return connectionState.load();
+    }
 
-        return true;
+    bool isAccessPointActive()
+    {
+        return accessPointActive.load();
     }
 
     // Starts the TCP server
     void startServer()
     {
-        webServer.on("/getStatus", handleGetStatus);
-        webServer.on("/getSongIndex", handleGetIndex);
-        webServer.on("/setSongIndex", handleSetIndex);
-        webServer.on("/uploadSong", HTTP_POST, handleUploadSong);
-        webServer.on("/getSongName", handleGetSongName);
-        webServer.on("/changeSetting", handleChangeSetting);
-        webServer.on("/setLoopSetting", handleSetLoopSetting);
-        webServer.on("/getLoopSetting", handleGetLoopSetting);
-        webServer.on("/restoreSettings", handleRestoreSettings);
-        webServer.on("/getSettings", handleGetSettings);
-        webServer.on("/setAnimationMode", handleSetAnimationMode);
-        webServer.on("/saveSettings", handleSaveSettings);
-        webServer.begin();
+        http::begin(handleRequest);
+        websocket::begin();
+        ledStream::begin();
     }
 
-    // Whether the network is currently connected
+    // Whether the station is currently connected to the WIFI network
     bool isConnected()
     {
-        return false;
+        return connected.load(std::memory_order_acquire);
     }
 
-    void pollOTA()
-    {
-        ArduinoOTA.handle();
-    }
-
-    // Checks for incoming messages and handles them
+    // NETWORK THREAD: Checks for incoming messages and handles at most one client.
+    // Handlers must not touch state used by the render loop directly. Changes are
+    // pushed onto the event que and applied by THREAD 0 instead.
     void pollEvents()
     {
-        webServer.handleClient();
+        http::poll();
+        websocket::poll();
+        ledStream::poll();
         return;
     }
 
-    void handleGetStatus()
-    {
-        // formattedClientReply("Status: Error lock code: %d", static_cast<uint8_t>(getCurrentError()));
-        webServer.send(200, "text/plane", "OK");
-    }
-
-    void handleGetIndex()
+    void writeTraceText(const char *text, unsigned int length)
     {
-        webServer.send(200, "text/plane", String(music::currentFrameIndex()));
+        http::writeStream(text, length);
     }
 
-    void handleSetIndex()
+    void writeTraceData(const uint8_t *data, unsigned int length)
     {
-        music::setFrame(intArg("index"));
-        Event e;
-        e.action = []() {
-            lights::forceRefresh();
-        };
-        PushEvent(e);
-        webServer.send(200, "text/plane", "OK");
+        http::writeStream(reinterpret_cast<const char *>(data), length);
     }
 
-    void handleUploadSong()
+    void handleRequest(const http::request &req)
     {
-        if (!webServer.hasArg("plain") || !webServer.hasArg("name") || !webServer.hasArg("frames") || !webServer.hasArg("notes"))
+        PROFILE_ZONE("handleRequest");
+        if (strcmp(req.path, "/uploadSong") == 0 && req.post)
         {
-            debug::println("no content");
-            webServer.send(400, "text/html", "missing parameter");
+            handleUploadSong(req);
             return;
         }
+        if (strcmp(req.path, "/metrics") == 0)
+        {
+            metrics::snapshot();
+            http::send(200, metrics::getText());
+            return;
+        }
+        if (strcmp(req.path, "/profile") == 0)
+        {
+            if (!profiler::enabled())
+            {
+                http::send(404, "profiling is turned off, see profiler.h");
+                return;
+            }
+            http::beginStream(200, "application/json");
+            profiler::writeTrace(writeTraceText);
+            return;
+        }
+        if (strcmp(req.path, "/trace") == 0)
+        {
+            http::beginStream(200, "application/octet-stream");
+            trace::writeDump(writeTraceData);
+            return;
+        }
+        for (unsigned int i = 0; i < httpRouteCount; i++)
+        {
+            if (strcmp(req.path, httpRoutes[i].uri) == 0)
+            {
+                handleCommandRoute(req, httpRoutes[i]);
+                return;
+            }
+        }
+        http::send(404, "not found");
+    }
 
-        music::setSongName(webServer.arg("name"));
-        unsigned int expectedSongLength = intArg("frames");
-        unsigned int expectedNoteCount = intArg("notes");
-
-        Serial.println("expecting " + String(expectedSongLength) + " frames and " + String(expectedNoteCount) + " notes");
-
-        frameNoteIndex = 0;
-        loaderFrameIndex = 0;
-        
-        String data = webServer.arg("plain");
-
-        data.toCharArray(songConversionBuffer, music::maxNoteCount);
-        auto temp = reinterpret_cast<unsigned char *>(songConversionBuffer);
-
-        music::resetSongLoader();
+    // Thin adapter from a route's query arguments to a binary command. The reply
+    // fields are sent back as comma separated text, or "OK" when there are none.
+    void handleCommandRoute(const http::request &req, const httpRoute &route)
+    {
+        commands::commandInfo info;
+        commands::getInfo(static_cast<uint8_t>(route.opcode), &info);
 
-        int byteCount = expectedNoteCount + expectedSongLength;
-        uint16_t lastFrameIndex = 0;
-        byte frameLength = 0;
-        uint16_t frameCount = 0, noteCount = 0;
-        for (size_t i = 0; i < byteCount; i++)
+        uint8_t request[1 + 16];
+        unsigned int requestLength = 0;
+        request[requestLength++] = static_cast<uint8_t>(route.opcode);
+        for (unsigned int i = 0; info.requestFormat[i] != '\0'; i++)
         {
-            if (temp[i] == 250U)
+            long value = 0;
+            float floatValue = 0;
+            if (info.requestFormat[i] == 'f' ? !http::floatArg(req, route.args[i], &floatValue) : !http::intArg(req, route.args[i], &value))
+            {
+                http::send(400, "missing parameter");
+                return;
+            }
+            // Checked before they are cut down to the field, 256 must not turn into 0
+            const long fieldMax = info.requestFormat[i] == 'B' ? 0xFF : 0xFFFF;
+            if (info.requestFormat[i] != 'f' && (value < 0 || value > fieldMax))
             {
-                music::loadFrame(temp + lastFrameIndex, frameLength);
-                lastFrameIndex = i + 1;
-                frameCount++;
-                frameLength = 0;
+                http::send(400, "parameter out of range");
+                return;
             }
-            else
+            switch (info.requestFormat[i])
+            {
+            case 'B':
+                request[requestLength++] = value;
+                break;
+            case 'H':
             {
-                noteCount++;
-                frameLength++;
+                request[requestLength++] = value & 0xFF;
+                request[requestLength++] = (value >> 8) & 0xFF;
+                break;
+            }
+            case 'f':
+            {
+                memcpy(request + requestLength, &floatValue, sizeof(floatValue));
+                requestLength += sizeof(floatValue);
+                break;
+            }
+            default:
+                fatalError(ErrorCode::IMPOSSIBLE_INTERNAL);
+                return;
             }
         }
 
-        if (expectedNoteCount != noteCount || expectedSongLength != frameCount)
+        uint8_t reply[commands::maxReplySize];
+        unsigned int replyLength = commands::dispatch(request, requestLength, reply, sizeof(reply));
+        commands::Status status = static_cast<commands::Status>(reply[1]);
+        if (status != commands::Status::OK)
         {
-            webServer.send(400, "text/plain", "Failed");
-            fatalError(ErrorCode::SONG_LOAD_UNEXPECTED_FRAME_COUNT);
+            http::send(status == commands::Status::Busy ? 503 : 400, commands::statusText(status));
             return;
         }
 
-        webServer.send(200, "text/plain", "Upload ok");
-
-        Event e;
-        e.action = []() {
-            lights::setAnimationMode(lights::AnimationMode::BlinkSuccess);
-            while (!lights::animationCompleted())
+        char text[commands::maxReplySize * 4];
+        unsigned int textLength = 0;
+        const uint8_t *field = reply + 2;
+        const uint8_t *replyEnd = reply + replyLength;
+        text[0] = '\0';
+        for (unsigned int i = 0; info.replyFormat[i] != '\0'; i++)
+        {
+            const char *separator = i == 0 ? "" : ",";
+            switch (info.replyFormat[i])
             {
-                lights::updateAnimation();
+            case 'B':
+                textLength += snprintf(text + textLength, sizeof(text) - textLength, "%s%u", separator, field[0]);
+                field += 1;
+                break;
+            case 'H':
+                textLength += snprintf(text + textLength, sizeof(text) - textLength, "%s%u", separator, field[0] | (field[1] << 8));
+                field += 2;
+                break;
+            case 'I':
+            {
+                uint32_t value = field[0] | (field[1] << 8) | (field[2] << 16) | ((uint32_t)field[3] << 24);
+                textLength += snprintf(text + textLength, sizeof(text) - textLength, "%s%u", separator, (unsigned int)value);
+                field += 4;
+                break;
             }
-            lights::setAnimationMode(lights::AnimationMode::Waiting);
-        };
-        PushEvent(e);
-
-        music::setLoopingSettings(true, 0, expectedSongLength - 1);
-    }
-
-    void handleGetSongName()
-    {
-        webServer.send(200, "text/plane", music::getSongName());
+            case 'f':
+            {
+                float value;
+                memcpy(&value, field, sizeof(value));
+                textLength += snprintf(text + textLength, sizeof(text) - textLength, "%s%f", separator, value);
+                field += 4;
+                break;
+            }
+            case 's':
+                textLength += snprintf(text + textLength, sizeof(text) - textLength, "%s%.*s", separator, (int)(replyEnd - field), field);
+                field = replyEnd;
+                break;
+            }
+        }
+        http::send(200, textLength == 0 ? "OK" : text);
     }
 
-    void handleChangeSetting()
+    // Streams the body through the same upload commands the other transports use
+    void handleUploadSong(const http::request &req)
     {
-        int setting = intArg("setting");
-        if(setting > 7)
+        long frames, notes;
+        if (req.contentLength == 0 || !http::hasArg(req, "name") || !http::intArg(req, "frames", &frames) || !http::intArg(req, "notes", &notes))
         {
-            webServer.send(400, "text/plane", "Invalid setting number");
-            fatalError(ErrorCode::INVALID_SETTING);
+            debug::println("no content");
+            http::send(400, "missing parameter");
             return;
         }
-        int argA = intArg("A");
-        int argB = intArg("B");
-        int argC = intArg("C");
-        settings::saveColorSetting(static_cast<unsigned int>(setting), {argA, argB, argC});
-    }
 
-    void handleSetLoopSetting()
-    {
-        bool enabled = intArg("enabled");
-        int loopStart = intArg("start");
-        int loopEnd = intArg("end");
-        music::setLoopingSettings(enabled, loopStart, loopEnd);
-        webServer.send(200, "text/plane", "OK");
-    }
-    void handleGetLoopSetting()
-    {
-        int enabled = music::getLoopingEnabled() ? 1: 0;
-        String reply = String(enabled) + "," + String(music::getLoopStart()) + "," + String(music::getLoopEnd());
-        webServer.send(200, "text/plane", reply);
-    }
-
-    void handleRestoreSettings()
-    {
-        settings::restoreDefaults();
-        webServer.send(200, "text/plane", "OK");
-    }
-
-    void handleGetSettings()
-    {
-        // if (messageBuffer[1] > 7)
-        // {
-        //     fatalError(ErrorCode::INVALID_SETTING);
-        //     ClientReply("ER:Invalid setting");
-        //     disconnectClient();
-        //     return;
-        // }
+        uint8_t request[commands::maxRequestSize];
+        uint8_t reply[commands::maxReplySize];
+
+        request[0] = static_cast<uint8_t>(commands::Opcode::BeginSongUpload);
+        request[1] = frames & 0xFF;
+        request[2] = (frames >> 8) & 0xFF;
+        request[3] = notes & 0xFF;
+        request[4] = (notes >> 8) & 0xFF;
+        int nameLength = http::copyArg(req, "name", reinterpret_cast<char *>(request + 5), music::maxSongNameLength + 1);
+        commands::dispatch(request, 5 + nameLength, reply, sizeof(reply));
+        if (reply[1] == static_cast<uint8_t>(commands::Status::Busy))
+        {
+            http::send(503, commands::statusText(commands::Status::Busy));
+            return;
+        }
 
-        // color col = settings::getColorSetting(static_cast<unsigned int>(messageBuffer[1]));
-        // {
-        //     // formattedClientReply("OK:%c%c%c", col.r, col.b, col.b);
-        //     formattedClientReply("OK:%d,%d,%d", col.r, col.g, col.b);
-        // }
-    }
+        // Anything after the song data is ignored
+        unsigned int songRemaining = frames + notes;
+        while (songRemaining != 0 && reply[1] == static_cast<uint8_t>(commands::Status::OK))
+        {
+            unsigned int capacity = songRemaining < sizeof(request) - 1 ? songRemaining : sizeof(request) - 1;
+            unsigned int chunkLength = http::readBody(request + 1, capacity);
+            if (chunkLength == 0)
+            {
+                break;
+            }
+            request[0] = static_cast<uint8_t>(commands::Opcode::SongData);
+            commands::dispatch(request, 1 + chunkLength, reply, sizeof(reply));
+            songRemaining -= chunkLength;
+        }
 
-    void handleSetAnimationMode()
-    {
-        int mode = intArg("mode");
-        if (mode > 5)
+        request[0] = static_cast<uint8_t>(commands::Opcode::EndSongUpload);
+        commands::dispatch(request, 1, reply, sizeof(reply));
+        if (reply[1] == static_cast<uint8_t>(commands::Status::Busy))
         {
-            webServer.send(400, "text/plane", "Invalid mode");
+            http::send(503, commands::statusText(commands::Status::Busy)); // staged, the next upload hands it over
             return;
         }
-        switch (mode)
+        if (reply[1] != static_cast<uint8_t>(commands::Status::OK))
         {
-        case 0:
-            _pushModeSwitchEvent(lights::AnimationMode::None);
-            break;
-        case 1:
-            _pushModeSwitchEvent(lights::AnimationMode::Ambiant);
-            break;
-        case 2:
-            _pushModeSwitchEvent(lights::AnimationMode::ColorfulIdle);
-            break;
-        case 3:
-            _pushModeSwitchEvent(lights::AnimationMode::KeyIndicate);
-            break;
-        case 4:
-            _pushModeSwitchEvent(lights::AnimationMode::KeyIndicateFade);
-            break;
-        case 5:
-            _pushModeSwitchEvent(lights::AnimationMode::Waiting);
-            break;
-        default:
-            fatalError(ErrorCode::IMPOSSIBLE_INTERNAL);
-            break;
+            http::send(400, "Failed");
+            return;
         }
-        webServer.send(200, "text/plane", "OK");
-    }
 
-    void handleSaveSettings()
-    {
-        settings::commitSettings();
-        webServer.send(200, "text/plane", "OK");
+        http::send(200, "Upload ok");
     }
 } // namespace network
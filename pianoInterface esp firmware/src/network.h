@@ -1,20 +1,35 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <stdint.h>
+
 namespace network
 {
+    enum class ConnectionState : uint8_t
+    {
+        Connecting = 0,
+        Connected = 1,
+        Backoff = 2 // waiting before the next attempt
+    };
+
+    constexpr unsigned long connectTimeoutMillis = 10000;
+    constexpr unsigned long backoffBaseMillis = 1000; // doubles with every failed attempt
+    constexpr unsigned long backoffMaxMillis = 60000;
+    constexpr unsigned int accessPointAfterFailures = 3; // a soft AP is started after this many failures in a row
+
     void beginConnection();
 
-    bool waitForConnection();
+    void updateConnection();
+
+    ConnectionState getConnectionState();
+
+    bool isAccessPointActive();
 
     void startServer();
 
     bool isConnected();
 
     void pollEvents();
-
-    // Check the network for firmware updates
-    void pollOTA();
 }
 
 #endif
\ No newline at end of file
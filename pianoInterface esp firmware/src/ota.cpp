@@ -0,0 +1,404 @@
+#include <Arduino.h>
+#include <Update.h>
+#include <WiFi.h>
+#include <atomic>
+#include <esp_ota_ops.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mbedtls/md.h>
+
+#include "m_constants.h"
+#include "m_error.h"
+#include "metrics.h"
+#include "ota.h"
+#include "serialDebug.h"
+
+namespace
+{
+    constexpr unsigned int headerBufferSize = 512;
+    constexpr UBaseType_t taskPriority = 1;
+
+    WiFiServer server(ota::port);
+    TaskHandle_t otaTask = nullptr;
+
+    // OTA TASK state
+    char headerBuffer[headerBufferSize];
+    uint8_t chunk[ota::chunkSize];
+    mbedtls_md_context_t imageHmac; // set up once, restarted for every image
+
+    // Written by the OTA task, read by anyone
+    std::atomic<ota::State> state(ota::State::Idle);
+    std::atomic<uint32_t> bytesWritten(0);
+    std::atomic<uint32_t> imageSize(0);
+
+    // THREAD 0 frame timing, reset by the OTA task when an update starts
+    std::atomic<bool> waitingForFrame(false);
+    std::atomic<bool> resetFrameStats(false);
+    std::atomic<uint32_t> frameMax(0);
+    std::atomic<uint32_t> frameAverage(0);
+    uint32_t lastFrameMicros = 0;
+
+    // THREAD 0 image validation
+    bool pendingVerify = false;
+
+    // Blocks until THREAD 0 has just sent a frame out so the flash write lands in the idle part of the frame
+    void waitForRenderFrame()
+    {
+        waitingForFrame.store(true, std::memory_order_release);
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ota::frameWaitMillis));
+        waitingForFrame.store(false, std::memory_order_release);
+    }
+
+    void sendResponse(WiFiClient &client, int code, const char *text)
+    {
+        char response[192];
+        int length = snprintf(response, sizeof(response),
+                              "HTTP/1.1 %d %s\r\n"
+                              "Content-Type: text/plain\r\n"
+                              "Connection: close\r\n\r\n"
+                              "%s",
+                              code, code == 200 ? "OK" : code == 401 ? "Unauthorized" : code == 403 ? "Forbidden" : "Bad Request", text);
+        client.write(reinterpret_cast<uint8_t *>(response), length);
+    }
+
+    // Reads the request header. Returns the length of it including the blank line, or 0 on failure.
+    // Any body bytes which came along with it are left in the buffer after the header.
+    unsigned int readHeader(WiFiClient &client, unsigned int *bufferLength)
+    {
+        unsigned int length = 0;
+        unsigned long lastByte = millis();
+        while (client.connected() && length < headerBufferSize - 1 && millis() - lastByte < ota::timeoutMillis)
+        {
+            int available = client.available();
+            if (available <= 0)
+            {
+                vTaskDelay(1);
+                continue;
+            }
+            int count = client.read(reinterpret_cast<uint8_t *>(headerBuffer + length),
+                                    available < (int)(headerBufferSize - 1 - length) ? available : headerBufferSize - 1 - length);
+            if (count > 0)
+            {
+                length += count;
+                lastByte = millis();
+            }
+            headerBuffer[length] = '\0';
+            char *headerEnd = strstr(headerBuffer, "\r\n\r\n");
+            if (headerEnd != nullptr)
+            {
+                *bufferLength = length;
+                return headerEnd + 4 - headerBuffer;
+            }
+        }
+        return 0;
+    }
+
+    // Finds a query argument in the request line. The value runs to the next '&' or ' '.
+    const char *findArg(const char *name, unsigned int *valueLength)
+    {
+        const char *lineEnd = strstr(headerBuffer, "\r\n");
+        const char *arg = strchr(headerBuffer, '?');
+        unsigned int nameLength = strlen(name);
+        while (arg != nullptr && arg < lineEnd)
+        {
+            arg++;
+            if (strncmp(arg, name, nameLength) == 0 && arg[nameLength] == '=')
+            {
+                const char *value = arg + nameLength + 1;
+                *valueLength = strcspn(value, "& ");
+                return value;
+            }
+            arg = strpbrk(arg, "& ");
+            if (arg != nullptr && *arg == ' ')
+            {
+                break;
+            }
+        }
+        return nullptr;
+    }
+
+    // Reads the 64 hex digit X-Signature header. Returns false if it isn't there or isn't valid.
+    bool readSignature(uint8_t *signature)
+    {
+        const char *header = strcasestr(headerBuffer, "\r\nX-Signature:");
+        if (header == nullptr)
+        {
+            return false;
+        }
+        const char *digits = header + strlen("\r\nX-Signature:");
+        digits += strspn(digits, " ");
+        for (unsigned int i = 0; i < ota::signatureSize * 2; i++)
+        {
+            char c = digits[i];
+            uint8_t nibble = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : 0xFF;
+            if (nibble == 0xFF)
+            {
+                return false;
+            }
+            signature[i / 2] = (signature[i / 2] << 4) | nibble;
+        }
+        return true;
+    }
+
+    // Compares every byte whatever the first difference is, so timing gives nothing away
+    bool signatureMatches(const uint8_t *expected, const uint8_t *actual)
+    {
+        uint8_t difference = 0;
+        for (unsigned int i = 0; i < ota::signatureSize; i++)
+        {
+            difference |= expected[i] ^ actual[i];
+        }
+        return difference == 0;
+    }
+
+    void failUpdate(WiFiClient &client, const char *reason, int code = 400)
+    {
+        debug::print("OTA: ");
+        debug::println(reason);
+        state.store(ota::State::Failed);
+        sendResponse(client, code, reason);
+    }
+
+    // OTA TASK: Recieves an image from the client and writes it a chunk per render frame
+    void handleClient(WiFiClient &client)
+    {
+        unsigned int bufferLength = 0;
+        unsigned int headerLength = readHeader(client, &bufferLength);
+        if (headerLength == 0)
+        {
+            return;
+        }
+        if (strncmp(headerBuffer, "POST /update", strlen("POST /update")) != 0)
+        {
+            sendResponse(client, 400, "expected POST /update");
+            return;
+        }
+        // Anyone near the piano can join the access point, its key is in the source
+        if (client.localIP() == WiFi.softAPIP())
+        {
+            sendResponse(client, 403, "no updates through the access point");
+            return;
+        }
+        uint8_t signature[ota::signatureSize];
+        if (!readSignature(signature))
+        {
+            sendResponse(client, 401, "X-Signature required");
+            return;
+        }
+
+        const char *contentLength = strcasestr(headerBuffer, "\r\nContent-Length:");
+        uint32_t size = contentLength == nullptr ? 0 : strtoul(contentLength + strlen("\r\nContent-Length:"), nullptr, 10);
+        unsigned int valueLength = 0;
+        const char *simulateArg = findArg("simulate", &valueLength);
+        bool simulate = simulateArg != nullptr && *simulateArg == '1';
+        char md5[33] = "";
+        const char *md5Arg = findArg("md5", &valueLength);
+        if (md5Arg != nullptr && valueLength == 32)
+        {
+            memcpy(md5, md5Arg, 32);
+            md5[32] = '\0';
+        }
+
+        if (size == 0 || !Update.begin(size))
+        {
+            failUpdate(client, "image doesn't fit");
+            return;
+        }
+        if (md5[0] != '\0')
+        {
+            Update.setMD5(md5);
+        }
+
+        mbedtls_md_hmac_starts(&imageHmac, reinterpret_cast<const unsigned char *>(_OTA_KEY), strlen(_OTA_KEY));
+        resetFrameStats.store(true, std::memory_order_release);
+        imageSize.store(size);
+        bytesWritten.store(0);
+        state.store(ota::State::Recieving);
+
+        // Whatever came in with the header goes first
+        unsigned int pending = bufferLength - headerLength;
+        if (pending > size)
+        {
+            pending = size;
+        }
+        memcpy(chunk, headerBuffer + headerLength, pending);
+        uint32_t written = 0;
+        unsigned long lastByte = millis();
+        while (written < size)
+        {
+            uint32_t wanted = size - written < ota::chunkSize ? size - written : ota::chunkSize;
+            while (pending < wanted && (client.connected() || client.available()) && millis() - lastByte < ota::timeoutMillis)
+            {
+                int count = client.read(chunk + pending, wanted - pending);
+                if (count > 0)
+                {
+                    pending += count;
+                    lastByte = millis();
+                }
+                else
+                {
+                    vTaskDelay(1);
+                }
+            }
+            if (pending < wanted)
+            {
+                Update.abort();
+                failUpdate(client, "client stopped sending");
+                return;
+            }
+
+            mbedtls_md_hmac_update(&imageHmac, chunk, pending);
+            waitForRenderFrame();
+            if (Update.write(chunk, pending) != pending)
+            {
+                failUpdate(client, Update.errorString());
+                Update.abort();
+                return;
+            }
+            written += pending;
+            bytesWritten.store(written);
+            pending = 0;
+        }
+
+        state.store(ota::State::Verifying);
+        uint8_t imageSignature[ota::signatureSize];
+        mbedtls_md_hmac_finish(&imageHmac, imageSignature);
+        if (!signatureMatches(imageSignature, signature))
+        {
+            Update.abort();
+            failUpdate(client, "bad signature", 403);
+            return;
+        }
+        if (simulate)
+        {
+            Update.abort();
+            state.store(ota::State::Succeeded);
+            sendResponse(client, 200, "simulated update complete");
+            return;
+        }
+
+        // Checks the md5 and the image itself before the boot partition is switched
+        waitForRenderFrame();
+        if (!Update.end())
+        {
+            failUpdate(client, Update.errorString());
+            return;
+        }
+
+        state.store(ota::State::Succeeded);
+        sendResponse(client, 200, "update complete, restarting");
+        client.stop();
+        debug::println("OTA: restarting into the new image");
+        delay(500);
+        ESP.restart();
+    }
+
+    void otaTaskFunc(void *pvParameters)
+    {
+        mbedtls_md_init(&imageHmac);
+        mbedtls_md_setup(&imageHmac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+        server.begin();
+        for (;;)
+        {
+            WiFiClient client = server.available();
+            if (client)
+            {
+                handleClient(client);
+                client.stop();
+            }
+            vTaskDelay(pdMS_TO_TICKS(50));
+        }
+    }
+} // namespace
+
+// Called by the Arduino core at boot. Returning true leaves it to checkImage() to decide
+// whether a freshly updated image gets kept.
+extern "C" bool verifyRollbackLater()
+{
+    return true;
+}
+
+namespace ota
+{
+
+// Starts the update task on core 0. The WIFI stack must already be running.
+void begin()
+{
+    esp_ota_img_states_t imageState;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &imageState) == ESP_OK)
+    {
+        pendingVerify = imageState == ESP_OTA_IMG_PENDING_VERIFY;
+    }
+
+    xTaskCreatePinnedToCore(
+        otaTaskFunc,
+        "ota",
+        6000,
+        NULL,
+        taskPriority,
+        &otaTask,
+        0);
+    metrics::registerTask("ota", otaTask);
+}
+
+// THREAD 0: Call once the frame has been sent out to the strip. Keeps frame time stats and
+// lets the OTA task write its next chunk.
+void renderFrameEnd()
+{
+    uint32_t now = micros();
+    uint32_t frameTime = now - lastFrameMicros;
+    lastFrameMicros = now;
+
+    if (resetFrameStats.exchange(false, std::memory_order_acquire))
+    {
+        frameMax.store(0, std::memory_order_relaxed);
+        frameAverage.store(0, std::memory_order_relaxed);
+    }
+    else
+    {
+        if (frameTime > frameMax.load(std::memory_order_relaxed))
+        {
+            frameMax.store(frameTime, std::memory_order_relaxed);
+        }
+        uint32_t average = frameAverage.load(std::memory_order_relaxed);
+        frameAverage.store(average == 0 ? frameTime : average + ((int32_t)(frameTime - average) >> 4), std::memory_order_relaxed);
+    }
+
+    if (otaTask != nullptr && waitingForFrame.load(std::memory_order_acquire))
+    {
+        xTaskNotifyGive(otaTask);
+    }
+}
+
+// THREAD 0: Keeps a freshly updated image once it has run cleanly for long enough, or goes back
+// to the previous image if it hits an error first. Call before the error lock takes over the loop.
+void checkImage()
+{
+    if (!pendingVerify)
+    {
+        return;
+    }
+    if (isErrorLocked())
+    {
+        debug::println("OTA: new image failed, rolling back");
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+        pendingVerify = false;
+    }
+    else if (millis() > validationMillis)
+    {
+        esp_ota_mark_app_valid_cancel_rollback();
+        pendingVerify = false;
+    }
+}
+
+otaStatus getStatus()
+{
+    return {
+        state.load(),
+        bytesWritten.load(),
+        imageSize.load(),
+        frameMax.load(std::memory_order_relaxed),
+        frameAverage.load(std::memory_order_relaxed)};
+}
+
+} // namespace ota
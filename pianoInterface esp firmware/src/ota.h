@@ -0,0 +1,65 @@
+#ifndef OTA_H
+#define OTA_H
+
+#include <stdint.h>
+
+/**
+ * Firmware updates over the network, handled by a low priority task on core 0 so
+ * the render loop never waits on them.
+ *
+ * POST /update on the ota port with the image as the body and an X-Signature header holding
+ * the HMAC-SHA256 of the image keyed with _OTA_KEY, as 64 hex digits:
+ *
+ *   curl -H "X-Signature: $(openssl dgst -sha256 -hmac "$KEY" -r firm.bin | cut -c1-64)" \
+ *        --data-binary @firm.bin http://piano:8266/update
+ *
+ * The image is only switched to once its signature checks out, and clients which come in
+ * through the soft access point are turned away. Optional query arguments: md5=<32 hex digits>
+ * to check the image against, simulate=1 to write the image to the spare partition without
+ * switching to it.
+ *
+ * Flash writes stall both cores while they run, so the image is written at most one
+ * sector per render frame, right after the frame has gone out to the strip. A new image
+ * has to run for validationMillis without an error before it is kept, otherwise the
+ * previous one is booted again.
+ */
+
+namespace ota
+{
+
+constexpr uint16_t port = 8266;
+constexpr unsigned int chunkSize = 1024;             // bytes handed to the updater at a time, never more than one sector flush
+constexpr unsigned int signatureSize = 32;           // HMAC-SHA256
+constexpr unsigned long frameWaitMillis = 50;        // write anyway if no render frame finishes in this long
+constexpr unsigned long timeoutMillis = 5000;        // client stopped sending
+constexpr unsigned long validationMillis = 30000;    // how long a new image has to run cleanly
+
+enum class State : uint8_t
+{
+    Idle = 0,
+    Recieving = 1,
+    Verifying = 2,
+    Succeeded = 3, // about to restart into the new image, or a simulated update finished
+    Failed = 4
+};
+
+struct otaStatus
+{
+    State state;
+    uint32_t bytesWritten;
+    uint32_t imageSize;
+    uint32_t frameMaxMicros;     // longest render frame since the update started
+    uint32_t frameAverageMicros; // average render frame since the update started
+};
+
+void begin();
+
+void renderFrameEnd();
+
+void checkImage();
+
+otaStatus getStatus();
+
+} // namespace ota
+
+#endif
@@ -2,14 +2,19 @@
 #include <usbh_midi.h>
 #include <usbhub.h>
 #include <SPI.h>
+#include <atomic>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/semphr.h"
 
+#include "keyMask.h"
+#include "latency.h"
+#include "metrics.h"
+#include "profiler.h"
 #include "pinaoCom.h"
 #include "m_error.h"
 #include "m_constants.h"
+#include "trace.h"
 
 /**
  * 
@@ -30,27 +35,86 @@ USB Usb;
 USBH_MIDI Midi(&Usb);
 bool USBInit = false;
 uint16_t pid, vid;
-SemaphoreHandle_t xMutex; // for copying the logical state buffer
 bool logicalLayerEnabled = false;
 
-// This array contains the states of notes as they are in REAL TIME. This is written to
-// as midi notes are pressed and released. Nothing else should be writing to this. When reading
-// from this array, it can be assumed that these are the true state of what notes are currently being pressed.
-bool noteStates[_PIANOSIZE];
-
-// This array is written to by the MIDI in realtime, but with true values only. That is to say the piano com thread only sets when
-// notes are pressed, but doesn't clear the values when they are released. When the com thread writes to this array, a dirty flag is set.
-// A slow frequency poll from the main thread occasionally coppies this buffer and clears all the values. A mutex is used when this operation
-// is executed.
-bool logicalStateBuffer[_PIANOSIZE];
-
-// This array serves the purpose of replacing the functionality of note pressed events. It is ocasionlly coppied from the logicalStateBuffer 
-// and uses no mutex so it may be read from at any frequency. this is a way of differentiating the diference between
-// multiple note presses and a note just being held down without using a circular event buffer. When a note is pressed, the array
-// is written to and a flag is set. The LED logic layer can then set the note value back off without the note having to be released.
-// This makes subsequint reads from the array apear that the note is not pressed which means that any true value in the array is
-// in effect a note pressed "event". This can only cause errors if a note is pressed more often than the array is polled.
-bool logicalStateLayer[_PIANOSIZE];
+// This bitset contains the states of notes as they are in REAL TIME. This is written to
+// as midi notes are pressed and released by THREAD 1 only. When reading from it, it can be assumed that
+// these are the true state of what notes are currently being pressed. The words are atomic so single notes
+// can be read at any time. noteStateSequence is odd while a write is in progress so that a reader of the
+// whole set can detect a torn snapshot and retry instead of taking a lock.
+std::atomic<uint32_t> noteStateWords[keyMaskWords];
+std::atomic<uint32_t> noteStateSequence(0);
+
+// Velocity of the last note on event for each note. Written before the note's state bit is set.
+std::atomic<uint8_t> noteVelocities[_PIANOSIZE];
+
+// This bitset is written to by the MIDI in realtime, but with true values only. That is to say the piano com thread only sets when
+// notes are pressed, but doesn't clear the values when they are released. A slow frequency poll from the main thread occasionally
+// swaps the words out for zero which copies and clears the buffer in one atomic step per word.
+std::atomic<uint32_t> logicalStateBuffer[keyMaskWords];
+
+// This bitset serves the purpose of replacing the functionality of note pressed events. It is ocasionlly coppied from the logicalStateBuffer
+// and is only touched by THREAD 0 so it may be read from at any frequency. this is a way of differentiating the diference between
+// multiple note presses and a note just being held down without using a circular event buffer. When a note is pressed, the bit
+// is set. The LED logic layer can then set the note value back off without the note having to be released.
+// This makes subsequint reads from the layer apear that the note is not pressed which means that any set bit in the layer is
+// in effect a note pressed "event". This can only cause errors if a note is pressed more often than the layer is polled.
+keyMask logicalStateLayer;
+
+// Single producer (THREAD 1), single consumer (THREAD 0) queue of timestamped note events. The producer only
+// writes the head and the consumer only writes the tail, so no lock is needed. Events are dropped when full.
+MIDI::noteEvent noteEvents[MIDI::noteEventBufferSize];
+std::atomic<uint32_t> noteEventHead(0);
+std::atomic<uint32_t> noteEventTail(0);
+
+// THREAD 1 ONLY: Adds a note event for THREAD 0 to consume
+void pushNoteEvent(uint8_t noteNumber, uint8_t velocity, uint32_t time)
+{
+    uint32_t head = noteEventHead.load(std::memory_order_relaxed);
+    if (head - noteEventTail.load(std::memory_order_acquire) >= MIDI::noteEventBufferSize)
+    {
+        metrics::midiEventDropped();
+        return;
+    }
+    noteEvents[head & (MIDI::noteEventBufferSize - 1)] = {time, noteNumber, velocity};
+    noteEventHead.store(head + 1, std::memory_order_release);
+}
+
+// THREAD 1 ONLY: Updates the real time state of a note. captureMicros is when the USB packet came in.
+void writeNoteState(uint8_t noteNumber, bool state, uint8_t velocity, uint32_t captureMicros)
+{
+    metrics::midiEvent();
+    if (state)
+    {
+        noteVelocities[noteNumber].store(velocity, std::memory_order_relaxed);
+    }
+
+    const uint32_t bit = 1UL << (noteNumber & 31);
+    std::atomic<uint32_t> &word = noteStateWords[noteNumber >> 5];
+
+    uint32_t sequence = noteStateSequence.load(std::memory_order_relaxed);
+    noteStateSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (state)
+    {
+        word.fetch_or(bit, std::memory_order_relaxed);
+    }
+    else
+    {
+        word.fetch_and(~bit, std::memory_order_relaxed);
+    }
+    noteStateSequence.store(sequence + 2, std::memory_order_release);
+
+    if (logicalLayerEnabled)
+    {
+        if (state)
+        {
+            latency::notePressed(noteNumber, captureMicros);
+            logicalStateBuffer[noteNumber >> 5].fetch_or(bit, std::memory_order_release);
+        }
+        pushNoteEvent(noteNumber, state ? velocity : 0, captureMicros);
+    }
+}
 
 } // namespace
 
@@ -65,7 +129,6 @@ bool initUSBHost()
     {
         return false;
     }
-    xMutex = xSemaphoreCreateMutex();
 
     vid = pid = 0;
     USBInit = true;
@@ -75,17 +138,20 @@ bool initUSBHost()
 // THREAD 1: Gets new note events from the MIDI device
 void pollMIDI()
 {
+    PROFILE_ZONE("pollMIDI");
 
     assert_fatal(USBInit, ErrorCode::USB_HOST_INITIALISATION);
 
-    Usb.Task();
+    {
+        PROFILE_ZONE("USB::Task");
+        Usb.Task();
+    }
     if (Usb.getUsbTaskState() != USB_STATE_RUNNING)
     {
         // Nothing to do right now
         return;
     }
 
-    char buf[24];
     uint8_t midiBuf[64];
     uint16_t rcvd;
 
@@ -95,10 +161,13 @@ void pollMIDI()
         vid = Midi.vid;
         pid = Midi.pid;
     }
-    Serial.println("Recieved ");
 
 #ifdef MICROBRUTE_DEBUG
-    Midi.RecvData(&rcvd, midiBuf);
+    {
+        PROFILE_ZONE("RecvData"); // USB::dispatchPkt runs inside
+        Midi.RecvData(&rcvd, midiBuf);
+    }
+    uint32_t captureMicros = micros();
     //   if (Midi.RecvData(&rcvd, midiBuf) == 0)
     //rcvd = Midi.RecvData(midiBuf);
     //Midi.RecvRawData(midiBuf);
@@ -112,12 +181,13 @@ void pollMIDI()
             {
                 noteNumber = 52;
             }
-            noteStates[noteNumber] = state;
+            writeNoteState(noteNumber, state, midiBuf[3], captureMicros);
 
             //Serial.print("Rec3333d ");
             Serial.print("Recieved ");
             Serial.print(rcvd);
             Serial.print(" : ");
+            char buf[24];
             for (int i = 0; i < rcvd; i++)
             {
                 sprintf(buf, " %d", midiBuf[i]);
@@ -129,7 +199,11 @@ void pollMIDI()
 
 #else
     //if (assert_fatal(Midi.RecvData(&rcvd, midiBuf) == 0, ErrorCode::USB_TIMEOUT))
-    Midi.RecvData(&rcvd, midiBuf);
+    {
+        PROFILE_ZONE("RecvData"); // USB::dispatchPkt runs inside
+        Midi.RecvData(&rcvd, midiBuf);
+    }
+    uint32_t captureMicros = micros();
     //if (Midi.RecvData(&rcvd, midiBuf) == 0)
     if(rcvd != 0)
     {
@@ -143,34 +217,66 @@ void pollMIDI()
         // }
         // Serial.println("");
 
-        if(logicalLayerEnabled){
-            xSemaphoreTake(xMutex, portMAX_DELAY);
-        }
         for (size_t i = 0; i < 64 / 4; i+= 4)
         {
-            if (midiBuf[i] == 9)
-            {
-                // For now, velocity is ignored and just used to get the note state.
-                bool state = midiBuf[i + 3] != 0;
-                byte noteNumber = midiBuf[i+2] - noteNumberOffset;
-                noteStates[noteNumber] = state;
-                if (logicalLayerEnabled)
-                {
-                    logicalStateBuffer[noteNumber] |= state;
-                }
-            }
-        }
-        if(logicalLayerEnabled){
-            xSemaphoreGive(xMutex);
+            handlePacket(midiBuf + i, captureMicros);
         }
     }
 #endif
 }
 
+// THREAD 1: Parses one 4 byte USB MIDI event packet. The trace replay feeds recorded packets in here too.
+void handlePacket(const uint8_t *packet, uint32_t captureMicros)
+{
+    if (packet[0] == 9)
+    {
+        trace::recordMidiPacket(packet, captureMicros);
+
+        // Velocity is kept on the side. A velocity of zero means the note was released.
+        bool state = packet[3] != 0;
+        byte noteNumber = packet[2] - noteNumberOffset;
+        if (noteNumber >= _PIANOSIZE)
+        {
+            return;
+        }
+        writeNoteState(noteNumber, state, packet[3], captureMicros);
+    }
+}
+
 // Gets the pressed state of a note in real time
 bool getNoteState(byte noteNumber)
 {
-    return noteStates[noteNumber];
+    return (noteStateWords[noteNumber >> 5].load(std::memory_order_relaxed) >> (noteNumber & 31)) & 1;
+}
+
+// Gets a consistent snapshot of the pressed state of every note in real time
+keyMask getNoteStates()
+{
+    keyMask states;
+    uint32_t before, after;
+    do
+    {
+        before = noteStateSequence.load(std::memory_order_acquire);
+        for (size_t i = 0; i < keyMaskWords; i++)
+        {
+            states.words[i] = noteStateWords[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = noteStateSequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return states;
+}
+
+// Whether any note is being pressed in real time
+bool anyNoteDown()
+{
+    return !isEmpty(getNoteStates());
+}
+
+// Velocity of the last time the note was pressed
+uint8_t getNoteVelocity(byte noteNumber)
+{
+    return noteVelocities[noteNumber].load(std::memory_order_relaxed);
 }
 
 // THREAD 0: Gets the logical 'event' state of a note from the third note layer.
@@ -178,21 +284,54 @@ bool getNoteState(byte noteNumber)
 // Note: The notes in this layer are only updated 100 times per second (see firm.ino).
 bool getLogicalState(byte noteNumber)
 {
-    bool val = logicalStateLayer[noteNumber];
-    logicalStateLayer[noteNumber] = 0; // reset to simulate event logic
+    bool val = testKey(logicalStateLayer, noteNumber);
+    clearKey(logicalStateLayer, noteNumber); // reset to simulate event logic
     return val;
 }
 
-// THREAD 0: Thread safe copy from the real time logical state buffer to the led managed logical state layer.
+// THREAD 0: Gets the logical 'event' state of every note at once. Same as calling getLogicalState for each note.
+keyMask getLogicalStates()
+{
+    keyMask val = logicalStateLayer;
+    logicalStateLayer = emptyKeyMask;
+    return val;
+}
+
+// THREAD 0: Takes the oldest note event from the note event queue.
+// Note: Events are only recorded while the logical layer is enabled.
+bool popNoteEvent(noteEvent *e)
+{
+    uint32_t tail = noteEventTail.load(std::memory_order_relaxed);
+    if (tail == noteEventHead.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    *e = noteEvents[tail & (noteEventBufferSize - 1)];
+    noteEventTail.store(tail + 1, std::memory_order_release);
+    if (e->velocity != 0)
+    {
+        latency::notePickedUp(e->note);
+    }
+    return true;
+}
+
+// THREAD 0: Throws away any note events which haven't been handled yet
+void clearNoteEvents()
+{
+    noteEventTail.store(noteEventHead.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+// THREAD 0: Lock free move from the real time logical state buffer to the led managed logical state layer.
 // Copy this a few hundred times per second.
 void copyLogicalStateBuffer(){
-    xSemaphoreTake(xMutex, portMAX_DELAY);
-    memcpy(logicalStateLayer, logicalStateBuffer, sizeof(byte) * _PIANOSIZE);
-    memset(logicalStateBuffer, 0, sizeof(logicalStateBuffer));
-    xSemaphoreGive(xMutex);
+    for (size_t i = 0; i < keyMaskWords; i++)
+    {
+        logicalStateLayer.words[i] = logicalStateBuffer[i].exchange(0, std::memory_order_acquire);
+    }
+    latency::notesPickedUp(logicalStateLayer);
 }
 
-// Enabled or disables the logical layer functionality which can effect performance costs due to mutex use
+// Enabled or disables the logical layer functionality
 void setLogicalLayerEnable(bool enabled){
     logicalLayerEnabled = enabled;
 }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 
+#include "keyMask.h"
 #include "m_constants.h"
 
 /**
@@ -14,17 +15,39 @@
 namespace MIDI
 {
 
-constexpr uint8_t noteNumberOffset = 21; // MIDI note number for the first note
+constexpr uint8_t noteNumberOffset = _KEYBOARD::firstNote; // MIDI note number for the first note
 constexpr uint8_t ledNoteOffset = 0 ; // First note on the piano which has an LED 
 
+// A note being pressed or released, stamped with the time it was recieved from the MIDI device
+struct noteEvent
+{
+    uint32_t time;    // micros() when the event was recieved
+    uint8_t note;     // 0 based note number
+    uint8_t velocity; // 0 if the note was released
+};
+
+constexpr unsigned int noteEventBufferSize = 64; // must be a power of 2
+
 bool initUSBHost();
 
 void pollMIDI(); 
+void handlePacket(const uint8_t *packet, uint32_t captureMicros);
 
 bool getNoteState(uint8_t noteNumber); 
 
+keyMask getNoteStates();
+
+bool anyNoteDown();
+
+uint8_t getNoteVelocity(uint8_t noteNumber);
+
 bool getLogicalState(uint8_t noteNumber);
 
+keyMask getLogicalStates();
+
+bool popNoteEvent(noteEvent *e);
+void clearNoteEvents();
+
 void copyLogicalStateBuffer();
 
 void setLogicalLayerEnable(bool enabled);
@@ -0,0 +1,152 @@
+#include <Arduino.h>
+#include <atomic>
+
+#include "profiler.h"
+
+#ifdef ENABLE_PROFILING
+
+#ifdef ESP32
+#include <esp_timer.h>
+#else
+#include <time.h>
+#endif
+
+namespace
+{
+    // The cycle counters of the two cores don't run in step, so zones are placed on the trace by
+    // the microsecond timer both cores share and only their length comes from the cycle counter
+    struct zoneRecord
+    {
+        const char *name;
+        uint32_t endMicros; // timerMicros() when the zone was recorded
+        uint32_t length;    // ticks
+    };
+
+    // One ring per core. Slots are claimed with an atomic add so a task preempted half way
+    // through a record can't have its slot taken by another task on the same core.
+    zoneRecord rings[profiler::coreCount][profiler::ringSize];
+    std::atomic<uint32_t> heads[profiler::coreCount];
+    std::atomic<bool> paused(false);
+
+    unsigned int currentCore()
+    {
+#ifdef ESP32
+        return xPortGetCoreID();
+#else
+        return 0;
+#endif
+    }
+
+    uint32_t timerMicros()
+    {
+#ifdef ESP32
+        return (uint32_t)esp_timer_get_time();
+#else
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint32_t)((uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+#endif
+    }
+
+    uint32_t ticksPerMicro()
+    {
+#ifdef ESP32
+        return ESP.getCpuFreqMHz();
+#else
+        return 1000;
+#endif
+    }
+} // namespace
+
+namespace profiler
+{
+
+#ifndef ESP32
+// Nanoseconds on the host
+uint32_t ticks()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+#endif
+
+// Any thread: Adds a finished zone to the ring of the core it ran on
+void record(const char *name, uint32_t start, uint32_t end)
+{
+    if (paused.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    unsigned int core = currentCore();
+    uint32_t slot = heads[core].fetch_add(1, std::memory_order_relaxed) & (ringSize - 1);
+    rings[core][slot] = {name, timerMicros(), end - start};
+}
+
+// NETWORK THREAD: Writes every zone in the rings as Chrome trace event JSON. Recording stops
+// while it runs so the rings hold still. Timestamps are microseconds from the end of the
+// zone recorded first, so a zone which began before it can start a little below 0.
+void writeTrace(textWriter write)
+{
+    paused.store(true, std::memory_order_relaxed);
+    delay(2); // let any zone being written right now finish
+
+    // The first zone recorded over both rings, wrap safe for the 71 minutes the timer takes to wrap
+    const uint32_t now = timerMicros();
+    uint32_t oldest = now;
+    for (unsigned int core = 0; core < coreCount; core++)
+    {
+        uint32_t head = heads[core].load(std::memory_order_relaxed);
+        uint32_t count = head < ringSize ? head : ringSize;
+        for (uint32_t i = head - count; i != head; i++)
+        {
+            const zoneRecord &rec = rings[core][i & (ringSize - 1)];
+            if (now - rec.endMicros > now - oldest)
+            {
+                oldest = rec.endMicros;
+            }
+        }
+    }
+
+    const float perMicro = ticksPerMicro();
+    char line[160];
+    write("{\"traceEvents\":[", 16);
+    bool first = true;
+    for (unsigned int core = 0; core < coreCount; core++)
+    {
+        int length = snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"core %u\"}}",
+                              first ? "" : ",", core, core);
+        write(line, length);
+        first = false;
+
+        uint32_t head = heads[core].load(std::memory_order_relaxed);
+        uint32_t count = head < ringSize ? head : ringSize;
+        for (uint32_t i = head - count; i != head; i++)
+        {
+            const zoneRecord &rec = rings[core][i & (ringSize - 1)];
+            const float duration = rec.length / perMicro;
+            length = snprintf(line, sizeof(line), ",{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%u}",
+                              rec.name, (float)(rec.endMicros - oldest) - duration, duration, core);
+            write(line, length);
+        }
+    }
+    write("]}", 2);
+
+    paused.store(false, std::memory_order_relaxed);
+}
+
+} // namespace profiler
+
+#else
+
+namespace profiler
+{
+
+void writeTrace(textWriter write)
+{
+    write("{\"traceEvents\":[]}", 18);
+}
+
+} // namespace profiler
+
+#endif
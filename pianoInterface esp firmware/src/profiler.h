@@ -0,0 +1,80 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+
+// Uncomment to record profiling zones. When off every PROFILE_ZONE compiles to nothing.
+// #define ENABLE_PROFILING
+
+/**
+ * Scoped profiling markers timed with the CPU cycle counter. Put PROFILE_ZONE("name") at the
+ * top of a block and the time until the end of the block is recorded into a ring buffer for the
+ * core it ran on. The name has to be a string literal. Zones are placed on the trace by
+ * esp_timer_get_time(), which both cores share, as their cycle counters aren't in step.
+ *
+ * GET /profile sends the rings as Chrome trace event JSON (load it in chrome://tracing or
+ * Perfetto), one track per core.
+ */
+
+#ifdef ENABLE_PROFILING
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name) profiler::zone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#else
+#define PROFILE_ZONE(name)
+#endif
+
+namespace profiler
+{
+
+constexpr unsigned int ringSize = 512; // zones kept per core, must be a power of 2
+constexpr unsigned int coreCount = 2;
+
+#ifdef ENABLE_PROFILING
+
+#ifdef ESP32
+inline uint32_t ticks()
+{
+    uint32_t count;
+    __asm__ __volatile__("rsr %0, ccount"
+                         : "=a"(count));
+    return count;
+}
+#else
+uint32_t ticks();
+#endif
+
+void record(const char *name, uint32_t start, uint32_t end);
+
+class zone
+{
+public:
+    explicit zone(const char *name) : name(name), start(ticks()) {}
+    ~zone()
+    {
+        record(name, start, ticks());
+    }
+
+private:
+    const char *name;
+    uint32_t start;
+};
+
+#endif
+
+constexpr bool enabled()
+{
+#ifdef ENABLE_PROFILING
+    return true;
+#else
+    return false;
+#endif
+}
+
+typedef void (*textWriter)(const char *text, unsigned int length);
+
+void writeTrace(textWriter write);
+
+} // namespace profiler
+
+#endif
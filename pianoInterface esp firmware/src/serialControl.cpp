@@ -0,0 +1,169 @@
+#include <Arduino.h>
+#include <atomic>
+
+#include "commands.h"
+#include "serialControl.h"
+
+namespace
+{
+    constexpr unsigned int headerSize = 3;
+    constexpr unsigned int crcSize = 2;
+    constexpr unsigned int readChunkSize = 64;
+
+    enum class RxState : uint8_t
+    {
+        Sync,
+        LengthLow,
+        LengthHigh,
+        Payload,
+        CrcLow,
+        CrcHigh
+    };
+
+    RxState state = RxState::Sync;
+    uint8_t payload[commands::maxRequestSize];
+    uint16_t payloadLength = 0;
+    uint16_t payloadRecieved = 0;
+    uint16_t frameCrc = 0;    // running crc of the frame being read
+    uint16_t recievedCrc = 0;
+    unsigned long lastByteMillis = 0;
+
+    std::atomic<uint32_t> droppedFrames(0);
+
+    uint16_t crc16(uint16_t crc, uint8_t byte)
+    {
+        crc ^= (uint16_t)byte << 8;
+        for (int i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+        return crc;
+    }
+
+    uint16_t crc16(uint16_t crc, const uint8_t *data, unsigned int length)
+    {
+        for (unsigned int i = 0; i < length; i++)
+        {
+            crc = crc16(crc, data[i]);
+        }
+        return crc;
+    }
+
+    void dropFrame()
+    {
+        droppedFrames.fetch_add(1, std::memory_order_relaxed);
+        state = RxState::Sync;
+    }
+
+    // Runs a complete request and sends the reply back as one frame
+    void handleFrame()
+    {
+        uint8_t frame[headerSize + commands::maxReplySize + crcSize];
+        unsigned int replyLength = commands::dispatch(payload, payloadLength, frame + headerSize, commands::maxReplySize);
+
+        frame[0] = serialControl::syncByte;
+        frame[1] = replyLength & 0xFF;
+        frame[2] = replyLength >> 8;
+        uint16_t crc = crc16(0xFFFF, frame + 1, 2 + replyLength);
+        frame[headerSize + replyLength] = crc & 0xFF;
+        frame[headerSize + replyLength + 1] = crc >> 8;
+        Serial.write(frame, headerSize + replyLength + crcSize);
+    }
+
+    void readByte(uint8_t byte)
+    {
+        switch (state)
+        {
+        case RxState::Sync:
+            if (byte == serialControl::syncByte)
+            {
+                state = RxState::LengthLow;
+            }
+            break;
+        case RxState::LengthLow:
+            payloadLength = byte;
+            frameCrc = crc16(0xFFFF, byte);
+            state = RxState::LengthHigh;
+            break;
+        case RxState::LengthHigh:
+            payloadLength |= byte << 8;
+            frameCrc = crc16(frameCrc, byte);
+            payloadRecieved = 0;
+            if (payloadLength == 0 || payloadLength > commands::maxRequestSize)
+            {
+                dropFrame();
+                break;
+            }
+            state = RxState::Payload;
+            break;
+        case RxState::Payload:
+            payload[payloadRecieved++] = byte;
+            frameCrc = crc16(frameCrc, byte);
+            if (payloadRecieved == payloadLength)
+            {
+                state = RxState::CrcLow;
+            }
+            break;
+        case RxState::CrcLow:
+            recievedCrc = byte;
+            state = RxState::CrcHigh;
+            break;
+        case RxState::CrcHigh:
+            recievedCrc |= byte << 8;
+            if (recievedCrc != frameCrc)
+            {
+                dropFrame();
+                break;
+            }
+            state = RxState::Sync;
+            handleFrame();
+            break;
+        }
+    }
+} // namespace
+
+namespace serialControl
+{
+
+// Opens the serial port. Must be called before anything else uses Serial.
+void begin()
+{
+    Serial.setRxBufferSize(rxBufferSize);
+    Serial.begin(baudRate);
+}
+
+// NETWORK THREAD: Handles every complete frame waiting in the RX buffer
+void poll()
+{
+    unsigned long now = millis();
+    bool recieved = false;
+    uint8_t chunk[readChunkSize];
+    int available;
+    while ((available = Serial.available()) > 0)
+    {
+        size_t count = Serial.readBytes(chunk, available < (int)readChunkSize ? available : readChunkSize);
+        for (size_t i = 0; i < count; i++)
+        {
+            readByte(chunk[i]);
+        }
+        recieved = true;
+    }
+
+    // Bytes that waited in the RX buffer while the thread was busy elsewhere still count, only a
+    // frame nothing more came in for is given up on
+    if (recieved)
+    {
+        lastByteMillis = now;
+    }
+    else if (state != RxState::Sync && now - lastByteMillis > frameTimeoutMillis)
+    {
+        dropFrame();
+    }
+}
+
+uint32_t getDroppedFrames()
+{
+    return droppedFrames.load(std::memory_order_relaxed);
+}
+
+} // namespace serialControl
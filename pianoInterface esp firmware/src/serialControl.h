@@ -0,0 +1,34 @@
+#ifndef SERIALCONTROL_H
+#define SERIALCONTROL_H
+
+#include <stdint.h>
+
+/**
+ * Carries the command protocol (see commands.h) over the USB serial port so the
+ * device can be controlled with no network at all.
+ *
+ * Frame: [sync, length low, length high, payload..., crc low, crc high]
+ * The payload is a command request, or a reply when sent by the device. The crc is
+ * CRC-16/CCITT-FALSE over the length bytes and the payload. Frames with a bad crc are
+ * dropped and the host should retry once it times out waiting for the reply.
+ * Each reply is written to the port in one go so debug text printed from other
+ * threads can only ever land between frames. The host skips anything before a sync byte.
+ */
+
+namespace serialControl
+{
+
+constexpr unsigned long baudRate = 921600;
+constexpr uint8_t syncByte = 0xA5;
+constexpr unsigned int rxBufferSize = 1024;     // UART driver ring buffer, filled from the RX interrupt
+constexpr unsigned long frameTimeoutMillis = 50; // a frame nothing more of has come in for this long is thrown away
+
+void begin();
+
+void poll();
+
+uint32_t getDroppedFrames();
+
+} // namespace serialControl
+
+#endif
@@ -1,52 +1,334 @@
 #include <Arduino.h>
-#include <EEPROM.h>
+#include <atomic>
+#include <esp_partition.h>
 
 #include "lighting/color.h"
+#include "m_constants.h"
+#include "serialDebug.h"
 #include "settings.h"
 
+/**
+ * Settings are kept as one versioned blob in the "settings" flash partition (see partitions.csv),
+ * which is used as an append only journal across two sectors. Each sector is split into 64 byte
+ * slots. Slot 0 holds the sector header and every commit appends a whole record to the next slot.
+ * When the sector fills up the other one is erased, given the record and only then its header,
+ * so the newest complete record always survives a power cut at any point of a commit.
+ * A record's magic is written after the rest of it so a slot with a magic is always complete,
+ * and the crc catches a torn magic.
+ */
+
 namespace
 {
-    color colorSettingValues[settings::colorSettingCount];
-    float floatSettingValues[settings::floatSettingCount];
-}
+    constexpr uint32_t sectorSize = 4096;
+    constexpr uint32_t slotSize = 64;
+    constexpr uint32_t slotsPerSector = sectorSize / slotSize; // including the header slot
+    constexpr uint32_t sectorMagic = 0x4A475453;               // "STGJ"
+    constexpr uint32_t recordMagic = 0x52475453;               // "STGR"
+    constexpr uint32_t erasedWord = 0xFFFFFFFF;
+
+    // Bump whenever settingsBlob changes. Records with another version are ignored and the defaults used instead.
+    constexpr uint16_t settingsVersion = 4;
+
+    struct settingsBlob
+    {
+        color colors[settings::colorSettingCount];
+        float floats[settings::floatSettingCount];
+        settings::ledLayout layout;
+    };
+
+    struct sectorHeader
+    {
+        uint32_t magic;
+        uint32_t generation; // the sector with the highest generation is the live one
+        uint32_t crc;
+    };
+
+    struct record
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t length;
+        uint32_t crc; // over version, length and payload
+        uint8_t payload[slotSize - 12];
+    };
+    static_assert(sizeof(record) == slotSize, "a record has to fill exactly one slot");
+    static_assert(sizeof(settingsBlob) <= sizeof(record::payload), "settings no longer fit in a record");
+    static_assert(sizeof(settingsBlob) == settings::snapshotSize, "settings::snapshotSize is out of date");
+
+    constexpr color colorSettingDefaults[settings::colorSettingCount] = {
+        {21, 21, 21},   // Ambiant, the dimmest step the strip can show once gamma corrected
+        {255, 0, 0},    // IndicateWhite
+        {0, 0, 255},    // IndicateBlack
+        {255, 0, 0},    // WaitingWhite
+        {255, 0, 0},    // WaitingBlack
+        {0, 255, 0},    // InFrameWhite
+        {0, 255, 0},    // InFrameBlack
+        {255, 255, 255} // WhiteBalance
+    };
+
+    constexpr float floatSettingDefaults[settings::floatSettingCount] = {
+        0.6f,  // IndicateFadeTime
+        0.0f,  // VelocityThreshold
+        0.3f,  // ChordWindow
+        0.15f, // ReleaseTolerance
+        2.0f,  // LookaheadFrames
+        0.35f  // LookaheadBrightness
+    };
+
+    // One LED per key with the strip running from the highest key down
+    constexpr settings::ledLayout ledLayoutDefault = {_LEDCOUNT - 1, 16, 1};
+
+    settingsBlob values;
+
+    // The live palette and a spare the next one is built in. Settings only change on THREAD 0 (through
+    // the event que) between frames, so THREAD 0 never has the spare in use while it gets rebuilt.
+    // Other threads can still be reading it when two changes come in one frame, they copy the
+    // palette and check paletteSequence to see whether it was rebuilt meanwhile. The sequence is
+    // odd while a rebuild is under way.
+    settings::palette palettes[2];
+    std::atomic<const settings::palette *> livePalette(&palettes[0]);
+    std::atomic<uint32_t> paletteSequence(0);
+
+    const esp_partition_t *partition = nullptr;
+    int activeSector = -1;      // -1 until anything has been written
+    uint32_t activeGeneration = 0;
+    uint32_t nextSlot = 0;      // where the next record goes in the active sector
+
+    uint32_t crc32(uint32_t crc, const void *data, size_t length)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        crc = ~crc;
+        for (size_t i = 0; i < length; i++)
+        {
+            crc ^= bytes[i];
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+            }
+        }
+        return ~crc;
+    }
+
+    uint32_t slotOffset(int sector, uint32_t slot)
+    {
+        return sector * sectorSize + slot * slotSize;
+    }
+
+    uint32_t recordCrc(const record &rec)
+    {
+        uint32_t crc = crc32(0, &rec.version, sizeof(rec.version) + sizeof(rec.length));
+        return crc32(crc, rec.payload, rec.length <= sizeof(rec.payload) ? rec.length : sizeof(rec.payload));
+    }
+
+    bool readHeader(int sector, uint32_t *generation)
+    {
+        sectorHeader header;
+        if (esp_partition_read(partition, slotOffset(sector, 0), &header, sizeof(header)) != ESP_OK)
+        {
+            return false;
+        }
+        if (header.magic != sectorMagic || header.crc != crc32(0, &header, offsetof(sectorHeader, crc)))
+        {
+            return false;
+        }
+        *generation = header.generation;
+        return true;
+    }
+
+    uint32_t readSlotMagic(int sector, uint32_t slot)
+    {
+        uint32_t magic = erasedWord;
+        esp_partition_read(partition, slotOffset(sector, slot), &magic, sizeof(magic));
+        return magic;
+    }
+
+    bool slotErased(int sector, uint32_t slot)
+    {
+        uint32_t words[slotSize / 4];
+        if (esp_partition_read(partition, slotOffset(sector, slot), words, sizeof(words)) != ESP_OK)
+        {
+            return false;
+        }
+        for (uint32_t word : words)
+        {
+            if (word != erasedWord)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Writes the record body before its magic so a slot with a magic is always complete
+    bool writeRecord(int sector, uint32_t slot, const record &rec)
+    {
+        uint32_t offset = slotOffset(sector, slot);
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&rec);
+        return esp_partition_write(partition, offset + sizeof(rec.magic), bytes + sizeof(rec.magic), sizeof(rec) - sizeof(rec.magic)) == ESP_OK &&
+               esp_partition_write(partition, offset, &rec.magic, sizeof(rec.magic)) == ESP_OK;
+    }
+
+    // Starts a fresh sector holding just this record. The header goes last so the sector
+    // only takes over once the record is safely in it.
+    bool startSector(int sector, const record &rec)
+    {
+        if (esp_partition_erase_range(partition, sector * sectorSize, sectorSize) != ESP_OK || !writeRecord(sector, 1, rec))
+        {
+            return false;
+        }
+        sectorHeader header = {sectorMagic, activeGeneration + 1, 0};
+        header.crc = crc32(0, &header, offsetof(sectorHeader, crc));
+        if (esp_partition_write(partition, slotOffset(sector, 0), &header, sizeof(header)) != ESP_OK)
+        {
+            return false;
+        }
+        activeSector = sector;
+        activeGeneration = header.generation;
+        nextSlot = 2;
+        return true;
+    }
+
+    // Builds a palette from the current values in the spare buffer and swaps it in
+    void publishPalette()
+    {
+        settings::palette *spare = livePalette.load(std::memory_order_relaxed) == &palettes[0] ? &palettes[1] : &palettes[0];
+        const uint32_t sequence = paletteSequence.load(std::memory_order_relaxed);
+        paletteSequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < settings::colorSettingCount; i++)
+        {
+            spare->colors[i] = values.colors[i];
+        }
+        memcpy(spare->floats, values.floats, sizeof(spare->floats));
+        spare->layout = values.layout;
+        livePalette.store(spare, std::memory_order_release);
+        paletteSequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    void useDefaults()
+    {
+        memcpy(values.colors, colorSettingDefaults, sizeof(values.colors));
+        memcpy(values.floats, floatSettingDefaults, sizeof(values.floats));
+        values.layout = ledLayoutDefault;
+        publishPalette();
+    }
+} // namespace
 
 namespace settings
 {
 
 void init()
 {
-    EEPROM.begin(sizeof(color) * colorSettingCount + sizeof(float) * floatSettingCount + 10);
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "settings");
+    if (partition == nullptr || partition->size < 2 * sectorSize)
+    {
+        partition = nullptr;
+        debug::println("SETTINGS: no settings partition, changes won't be saved");
+    }
+    useDefaults();
 }
 
+// Writes the current settings as a new record in the journal
 void commitSettings()
 {
-    EEPROM.commit();
+    if (partition == nullptr)
+    {
+        return;
+    }
+
+    record rec;
+    memset(&rec, 0xFF, sizeof(rec));
+    rec.magic = recordMagic;
+    rec.version = settingsVersion;
+    rec.length = sizeof(values);
+    memcpy(rec.payload, &values, sizeof(values));
+    rec.crc = recordCrc(rec);
+
+    // A torn slot left by a power cut is never written over, the journal moves to the other sector instead
+    if (activeSector >= 0 && nextSlot < slotsPerSector && slotErased(activeSector, nextSlot))
+    {
+        if (writeRecord(activeSector, nextSlot, rec))
+        {
+            nextSlot++;
+            return;
+        }
+    }
+
+    if (!startSector(activeSector == 0 ? 1 : 0, rec))
+    {
+        debug::println("SETTINGS: failed to write settings");
+    }
 }
 
 // Set all settings to their default values
 void restoreDefaults()
 {
-    saveColorSetting(settings::Colors::Ambiant, {1, 1, 1});
-    saveColorSetting(settings::Colors::IndicateWhite, {255, 0, 0});
-    saveColorSetting(settings::Colors::IndicateBlack, {0, 0, 255});
-    saveColorSetting(settings::Colors::WaitingWhite, {255, 0, 0});
-    saveColorSetting(settings::Colors::WaitingBlack, {255, 0, 0});
-    saveColorSetting(settings::Colors::InFrameWhite, {0, 255, 0});
-    saveColorSetting(settings::Colors::InFrameBlack, {0, 255, 0});
-    saveFloatSetting(settings::Floats::IndicateFadeTime, 0.6f);
+    useDefaults();
     commitSettings();
 }
 
+// Finds the live sector from the two headers, binary searches it for the end of the journal
+// and reads the newest record. Normally only that one record gets read in full and checked.
 void loadSettings()
 {
-    for (size_t i = 0; i < colorSettingCount; i++)
+    useDefaults();
+    activeSector = -1;
+    activeGeneration = 0;
+    nextSlot = 0;
+    if (partition == nullptr)
     {
-        EEPROM.get(i * sizeof(color), colorSettingValues[i]);
+        return;
     }
-    for (size_t i = 0; i < floatSettingCount; i++)
+
+    uint32_t generations[2];
+    bool valid[2] = {readHeader(0, &generations[0]), readHeader(1, &generations[1])};
+    if (!valid[0] && !valid[1])
     {
-        EEPROM.get(i * sizeof(color) + colorSettingCount * sizeof(color), floatSettingValues[i]);
-    }    
+        debug::println("SETTINGS: nothing saved yet, using defaults");
+        return;
+    }
+    activeSector = !valid[1] || (valid[0] && generations[0] > generations[1]) ? 0 : 1;
+    activeGeneration = generations[activeSector];
+
+    // Records are appended in order so the used slots are all at the start of the sector
+    uint32_t low = 1, high = slotsPerSector;
+    while (low < high)
+    {
+        uint32_t middle = (low + high) / 2;
+        if (readSlotMagic(activeSector, middle) == erasedWord)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    nextSlot = low;
+
+    for (uint32_t slot = nextSlot - 1; slot >= 1; slot--)
+    {
+        record rec;
+        if (esp_partition_read(partition, slotOffset(activeSector, slot), &rec, sizeof(rec)) == ESP_OK &&
+            rec.magic == recordMagic && rec.crc == recordCrc(rec))
+        {
+            if (rec.version == settingsVersion && rec.length == sizeof(values))
+            {
+                memcpy(&values, rec.payload, sizeof(values));
+                if (!layoutFits(values.layout))
+                {
+                    debug::println("SETTINGS: saved LED layout doesn't fit the strip, using the default");
+                    values.layout = ledLayoutDefault;
+                }
+                publishPalette();
+            }
+            else
+            {
+                debug::println("SETTINGS: saved settings are from another version, using defaults");
+            }
+            return;
+        }
+    }
 }
 
 void saveColorSetting(settings::Colors setting, color value)
@@ -54,30 +336,100 @@ void saveColorSetting(settings::Colors setting, color value)
     saveColorSetting(static_cast<unsigned int>(setting), value);
 }
 
+// THREAD 0
 void saveColorSetting(unsigned int setting, color value)
 {
-    EEPROM.put(setting * sizeof(color), value);
-    colorSettingValues[setting] = value;
+    values.colors[setting] = value;
+    publishPalette();
 }
 
+// THREAD 0
 void saveFloatSetting(settings::Floats setting, float value)
 {
-    EEPROM.put(static_cast<unsigned int>(setting) * sizeof(float) + colorSettingCount * sizeof(color), value);
-    floatSettingValues[static_cast<unsigned int>(setting)] = value;
+    values.floats[static_cast<unsigned int>(setting)] = value;
+    publishPalette();
 }
 
 color getColorSetting(settings::Colors setting)
 {
-    return colorSettingValues[static_cast<unsigned int>(setting)];
+    return values.colors[static_cast<unsigned int>(setting)];
 }
 color getColorSetting(unsigned int setting)
 {
-return colorSettingValues[setting];
+return values.colors[setting];
+}
+
+float getFloatSetting(settings::Floats setting)
+{
+    return values.floats[static_cast<unsigned int>(setting)];
 }
 
-bool getFloatSetting(settings::Floats setting)
+// THREAD 0
+// Whether every key's LEDs are on the strip, reading the layout the way LEDCom::setLayout() does
+bool layoutFits(ledLayout layout)
 {
-    return floatSettingValues[static_cast<unsigned int>(setting)];
+    if (layout.ledsPerKey == 0 || layout.reversed > 1 || layout.firstLed >= _LEDCOUNT)
+    {
+        return false;
+    }
+    const unsigned int length = (_KEYCOUNT * layout.ledsPerKey + 8) / 16; // LEDs from the first key to the end of the last
+    return layout.reversed ? length <= layout.firstLed + 1u : layout.firstLed + length <= _LEDCOUNT;
+}
+
+// Returns false and keeps the current layout if the new one doesn't fit the strip
+bool saveLedLayout(ledLayout layout)
+{
+    if (!layoutFits(layout))
+    {
+        return false;
+    }
+    values.layout = layout;
+    publishPalette();
+    return true;
+}
+
+ledLayout getLedLayout()
+{
+    return values.layout;
+}
+
+// THREAD 0: The palette to render the frame with. Take it once at the start of the frame.
+const palette &getPalette()
+{
+    return *livePalette.load(std::memory_order_acquire);
+}
+
+// Any thread, copied again until no rebuild got in the way
+palette copyPalette()
+{
+    palette copy;
+    uint32_t before;
+    uint32_t after;
+    do
+    {
+        before = paletteSequence.load(std::memory_order_acquire);
+        copy = *livePalette.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = paletteSequence.load(std::memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+    return copy;
+}
+
+// THREAD 0: Copies every setting out in the form they are saved in, snapshotSize bytes
+void copySnapshot(uint8_t *out)
+{
+    memcpy(out, &values, sizeof(values));
+}
+
+// THREAD 0: Takes on settings from copySnapshot() without saving them
+void restoreSnapshot(const uint8_t *snapshot)
+{
+    memcpy(&values, snapshot, sizeof(values));
+    if (!layoutFits(values.layout))
+    {
+        values.layout = ledLayoutDefault;
+    }
+    publishPalette();
 }
 
 void dumpToSerial()
@@ -86,14 +438,16 @@ void dumpToSerial()
     Serial.println("Printing settings:");
     for (size_t i = 0; i < colorSettingCount; i++)
     {
-        sprintf(buff, "color %d = R:%d G:%d B: %d", i, colorSettingValues[i].r, colorSettingValues[i].g, colorSettingValues[i].b);
+        sprintf(buff, "color %u = R:%d G:%d B: %d", (unsigned int)i, values.colors[i].r, values.colors[i].g, values.colors[i].b);
         Serial.println(buff);
     }
     for (size_t i = 0; i < floatSettingCount; i++)
     {
-        sprintf(buff, "float %d = %f", i, floatSettingValues[i]);
+        sprintf(buff, "float %u = %f", (unsigned int)i, values.floats[i]);
         Serial.println(buff);
     }
+    sprintf(buff, "led layout = first:%d per key:%d/16 reversed:%d", values.layout.firstLed, values.layout.ledsPerKey, values.layout.reversed);
+    Serial.println(buff);
 }
 
-} // namespace settings
\ No newline at end of file
+} // namespace settings
@@ -14,16 +14,54 @@ enum class Colors
     WaitingWhite = 3,
     WaitingBlack = 4,
     InFrameWhite = 5,
-    InFrameBlack = 6
+    InFrameBlack = 6,
+    WhiteBalance = 7 // per channel scale applied at the strip, 255 leaves a channel as is
 };
-constexpr unsigned int colorSettingCount = 7;
+constexpr unsigned int colorSettingCount = 8;
 
 enum class Floats
 {
     IndicateFadeTime = 0,
-    VelocityThreshold = 1
+    VelocityThreshold = 1,
+    ChordWindow = 2,     // seconds a note may be pressed before its frame starts and still count towards it
+    ReleaseTolerance = 3, // seconds a released note still counts towards the current frame
+    LookaheadFrames = 4,  // how many upcoming frames learning mode shows (0 - 4)
+    LookaheadBrightness = 5 // brightness of the first upcoming frame (0.0 - 1.0)
+};
+constexpr unsigned int floatSettingCount = 6;
+
+// How the keys line up with the LEDs on the strip. Each key gets the span of LEDs under it,
+// which is ledsPerKey long starting at firstLed for the lowest key.
+struct ledLayout
+{
+    uint16_t firstLed;  // LED under the start of the lowest key
+    uint8_t ledsPerKey; // in 16ths of an LED so strips of any density can line up with the keys
+    uint8_t reversed;   // 1 if the strip runs from the highest key down
+
+    bool operator==(const ledLayout &other) const
+    {
+        return firstLed == other.firstLed && ledsPerKey == other.ledsPerKey && reversed == other.reversed;
+    }
+};
+
+// Every setting in the form the render path uses it. Rebuilt and swapped in whenever a setting
+// changes so a frame never sees a half updated color. A published palette stays as it is until
+// the next change after it, which is all THREAD 0 needs. Other threads take a copy.
+struct palette
+{
+    colorF colors[colorSettingCount];
+    float floats[floatSettingCount];
+    ledLayout layout;
+
+    colorF get(Colors setting) const
+    {
+        return colors[static_cast<unsigned int>(setting)];
+    }
+    float get(Floats setting) const
+    {
+        return floats[static_cast<unsigned int>(setting)];
+    }
 };
-constexpr unsigned int floatSettingCount = 1;
 
 void init();
 
@@ -38,10 +76,26 @@ void saveColorSetting(unsigned int setting, color value);
 
 void saveFloatSetting(settings::Floats setting, float value);
 
+// The getters read the values THREAD 0 writes, other threads go through copyPalette()
 color getColorSetting(settings::Colors setting);
 color getColorSetting(unsigned int setting);
 
-bool getFloatSetting(settings::Floats setting);
+float getFloatSetting(settings::Floats setting);
+
+bool layoutFits(ledLayout layout);
+
+bool saveLedLayout(ledLayout layout);
+
+ledLayout getLedLayout();
+
+const palette &getPalette();
+// For threads other than THREAD 0, which can't hold on to the palette while settings change
+palette copyPalette();
+
+// Every setting as one block, for the trace checkpoints (see trace.h)
+constexpr unsigned int snapshotSize = colorSettingCount * 3 + floatSettingCount * 4 + sizeof(ledLayout);
+void copySnapshot(uint8_t *out);
+void restoreSnapshot(const uint8_t *snapshot);
 
 void dumpToSerial();
 
@@ -0,0 +1,191 @@
+#include <Arduino.h>
+#include <atomic>
+#include <string.h>
+
+#include "lighting/lighting.h"
+#include "music.h"
+#include "trace.h"
+
+namespace
+{
+    // Slots are claimed with an atomic add, a command claims all of its records in one go so
+    // they stay together when several threads record at once.
+    trace::record ring[trace::ringSize];
+    std::atomic<uint32_t> head(0);
+    std::atomic<bool> recording(true);
+    std::atomic<bool> paused(false);
+
+    // THREAD 0
+    bool checkpointTaken = false;
+    uint16_t checkpointGeneration = 0;
+    uint32_t checkpointHead = 0; // head right after the last checkpoint
+    uint32_t checkpointTime = 0;
+
+    bool claim(unsigned int count, uint32_t *first)
+    {
+        if (!recording.load(std::memory_order_relaxed) || paused.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+        *first = head.fetch_add(count, std::memory_order_relaxed);
+        return true;
+    }
+
+    void fill(uint32_t slot, uint32_t time, trace::RecordType type, const uint8_t *data, unsigned int length)
+    {
+        trace::record &rec = ring[slot & (trace::ringSize - 1)];
+        rec.micros = time;
+        rec.type = type;
+        rec.length = length;
+        memcpy(rec.data, data, length);
+    }
+
+    // A type record holding the length, then the bytes spread over CommandData records, all claimed in one go.
+    // Returns false if recording is off.
+    bool recordBlock(trace::RecordType type, const uint8_t *data, unsigned int length)
+    {
+        const unsigned int dataRecords = (length + trace::recordDataSize - 1) / trace::recordDataSize;
+        uint32_t slot;
+        if (!claim(1 + dataRecords, &slot))
+        {
+            return false;
+        }
+        const uint32_t now = micros();
+        const uint8_t lengthBytes[2] = {static_cast<uint8_t>(length & 0xFF), static_cast<uint8_t>(length >> 8)};
+        fill(slot++, now, type, lengthBytes, 2);
+        for (unsigned int offset = 0; offset < length; offset += trace::recordDataSize)
+        {
+            unsigned int chunk = length - offset < trace::recordDataSize ? length - offset : trace::recordDataSize;
+            fill(slot++, now, trace::RecordType::CommandData, data + offset, chunk);
+        }
+        return true;
+    }
+
+    // Sends the live song after the records, its notes in the upload format. Goes out in
+    // pieces of a few hundred bytes rather than a write per frame.
+    void writeSong(trace::dataWriter write)
+    {
+        const music::songView song = music::getLiveSong();
+        const unsigned int nameLength = strlen(song.name);
+        trace::songHeader header = {song.generation, static_cast<uint16_t>(song.frameCount),
+                                    static_cast<uint16_t>(song.frameStarts[song.frameCount] + song.frameCount),
+                                    static_cast<uint8_t>(nameLength), 0};
+        write(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+        write(reinterpret_cast<const uint8_t *>(song.name), nameLength);
+
+        uint8_t buffer[256];
+        unsigned int used = 0;
+        for (unsigned int frame = 0; frame < song.frameCount; frame++)
+        {
+            for (unsigned int i = song.frameStarts[frame]; i <= song.frameStarts[frame + 1]; i++)
+            {
+                if (used == sizeof(buffer))
+                {
+                    write(buffer, used);
+                    used = 0;
+                }
+                buffer[used++] = i < song.frameStarts[frame + 1] ? song.notes[i] : music::frameEndMarker;
+            }
+        }
+        write(buffer, used);
+    }
+} // namespace
+
+namespace trace
+{
+
+// THREAD 1: A USB MIDI event packet as it came in, before it is parsed
+void recordMidiPacket(const uint8_t *packet, uint32_t captureMicros)
+{
+    uint32_t slot;
+    if (claim(1, &slot))
+    {
+        fill(slot, captureMicros, RecordType::MidiPacket, packet, 4);
+    }
+}
+
+// Any thread: A control request as it is handed to the dispatcher
+void recordCommand(const uint8_t *request, unsigned int requestLength)
+{
+    recordBlock(RecordType::Command, request, requestLength);
+}
+
+// THREAD 0: The animation mode was changed
+void recordModeChange(uint8_t mode)
+{
+    uint32_t slot;
+    if (claim(1, &slot))
+    {
+        fill(slot, micros(), RecordType::ModeChange, &mode, 1);
+    }
+}
+
+// THREAD 0: Takes a checkpoint once a new song is live, or when inputs have come in since the
+// last one and checkpointMicros have gone by. An idle device doesn't fill the ring with them.
+void renderFrameEnd()
+{
+    const uint16_t generation = music::getSongGeneration();
+    const uint32_t now = micros();
+    if (checkpointTaken && generation == checkpointGeneration &&
+        (head.load(std::memory_order_relaxed) == checkpointHead || now - checkpointTime < checkpointMicros))
+    {
+        return;
+    }
+
+    checkpoint state;
+    state.songGeneration = generation;
+    state.frameIndex = music::currentFrameIndex();
+    state.loopStart = music::getLoopStart();
+    state.loopEnd = music::getLoopEnd();
+    state.looping = music::getLoopingEnabled();
+    state.mode = static_cast<uint8_t>(lights::getAnimationMode());
+    settings::copySnapshot(state.settings);
+    if (!recordBlock(RecordType::Checkpoint, reinterpret_cast<const uint8_t *>(&state), sizeof(state)))
+    {
+        return; // a dump is being taken, try again next frame
+    }
+    checkpointTaken = true;
+    checkpointGeneration = generation;
+    checkpointHead = head.load(std::memory_order_relaxed);
+    checkpointTime = now;
+}
+
+void setRecording(bool enabled)
+{
+    recording.store(enabled, std::memory_order_relaxed);
+}
+
+// NETWORK THREAD: Writes the header, every record in the ring oldest first and the live song.
+// Recording stops while it runs so the ring holds still. The oldest records may be the tail end
+// of a command or checkpoint whose start was overwritten, readers skip CommandData records
+// without a Command or Checkpoint before them.
+void writeDump(dataWriter write)
+{
+    paused.store(true, std::memory_order_relaxed);
+    delay(2); // let any record being written right now finish
+
+    const uint32_t end = head.load(std::memory_order_relaxed);
+    const uint32_t count = end < ringSize ? end : ringSize;
+
+    dumpHeader header;
+    memcpy(header.magic, dumpMagic, sizeof(header.magic));
+    header.version = dumpVersion;
+    header.recordSize = sizeof(record);
+    header.recordCount = count;
+    header.dumpMicros = micros();
+    write(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+
+    // The ring in at most two contiguous pieces
+    const uint32_t start = (end - count) & (ringSize - 1);
+    const uint32_t firstPiece = ringSize - start < count ? ringSize - start : count;
+    write(reinterpret_cast<const uint8_t *>(ring + start), firstPiece * sizeof(record));
+    if (count > firstPiece)
+    {
+        write(reinterpret_cast<const uint8_t *>(ring), (count - firstPiece) * sizeof(record));
+    }
+    writeSong(write);
+
+    paused.store(false, std::memory_order_relaxed);
+}
+
+} // namespace trace
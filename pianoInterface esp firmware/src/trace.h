@@ -0,0 +1,105 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "settings.h"
+
+/**
+ * A ring of the timestamped inputs which drive the lights: USB MIDI packets, the control commands
+ * which change something from every transport, and animation mode changes. Everything else the
+ * lights do follows from these, so a host build can replay a trace and get the same frames
+ * (see traceReplay.h).
+ *
+ * THREAD 0 adds a checkpoint of the song position, mode and settings whenever a new song has been
+ * swapped in, and otherwise at most once every checkpointMicros while inputs keep coming in. Songs
+ * themselves aren't recorded as they come in, the dump carries the live one instead.
+ *
+ * GET /trace sends a dumpHeader, the records oldest first, then a songHeader followed by the name
+ * and the notes of the live song in the upload format, all little endian.
+ * Recording is always on and costs one atomic add and a 12 byte copy per input.
+ */
+
+namespace trace
+{
+
+enum class RecordType : uint8_t
+{
+    MidiPacket = 1,  // data = the 4 byte USB MIDI event packet
+    Command = 2,     // data = request length (uint16), followed by the request in CommandData records
+    CommandData = 3, // data = the next bytes of the request
+    ModeChange = 4,  // data = lights::AnimationMode
+    Checkpoint = 5   // data = checkpoint length (uint16), followed by the checkpoint in CommandData records
+};
+
+constexpr unsigned int recordDataSize = 6;
+
+struct record
+{
+    uint32_t micros; // micros() when the input came in
+    RecordType type;
+    uint8_t length; // bytes of data used
+    uint8_t data[recordDataSize];
+};
+
+static_assert(sizeof(record) == 12, "records are sent as they are laid out in memory");
+
+constexpr unsigned int ringSize = 1024; // records kept, must be a power of 2
+
+constexpr char dumpMagic[4] = {'P', 'T', 'R', 'C'};
+constexpr uint8_t dumpVersion = 2;
+
+struct dumpHeader
+{
+    char magic[4];
+    uint8_t version;
+    uint8_t recordSize;
+    uint16_t recordCount;
+    uint32_t dumpMicros; // micros() when the dump was taken
+};
+
+static_assert(sizeof(dumpHeader) == 12, "the header is sent as it is laid out in memory");
+
+// State the replay can start from, as THREAD 0 left it at the end of a frame
+struct checkpoint
+{
+    uint16_t songGeneration; // music::getSongGeneration()
+    uint16_t frameIndex;
+    uint16_t loopStart;
+    uint16_t loopEnd;
+    uint8_t looping;
+    uint8_t mode; // lights::AnimationMode
+    uint8_t settings[settings::snapshotSize];
+};
+
+static_assert(sizeof(checkpoint) == 10 + settings::snapshotSize, "checkpoints are recorded as they are laid out in memory");
+
+constexpr uint32_t checkpointMicros = 1000000;
+
+// Follows the records in a dump
+struct songHeader
+{
+    uint16_t generation; // the checkpoints with this generation were taken with this song live
+    uint16_t frameCount;
+    uint16_t dataLength; // bytes of notes and frameEndMarkers after the name
+    uint8_t nameLength;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(songHeader) == 8, "the song header is sent as it is laid out in memory");
+
+void recordMidiPacket(const uint8_t *packet, uint32_t captureMicros);
+void recordCommand(const uint8_t *request, unsigned int requestLength);
+void recordModeChange(uint8_t mode);
+void renderFrameEnd();
+
+// Turns recording on or off, the replay turns it off so it doesn't record itself
+void setRecording(bool enabled);
+
+typedef void (*dataWriter)(const uint8_t *data, unsigned int length);
+
+void writeDump(dataWriter write);
+
+} // namespace trace
+
+#endif
@@ -0,0 +1,299 @@
+#include <Arduino.h>
+#include <string.h>
+
+#include "circularBuffer.h"
+#include "commands.h"
+#include "lighting/lighting.h"
+#include "m_error.h"
+#include "music.h"
+#include "pinaoCom.h"
+#include "settings.h"
+#include "traceReplay.h"
+
+namespace
+{
+    constexpr uint32_t poll100Micros = 1000000 / 100; // the same slow poll as firm.ino
+
+    // Earlier than or at the same time as, wrap safe
+    bool notAfter(uint32_t a, uint32_t b)
+    {
+        return static_cast<int32_t>(a - b) <= 0;
+    }
+
+    // Gathers the bytes of the Command or Checkpoint starting at records[index]. Returns how many
+    // records it takes up, 0 if any of its data is missing (cut off at the start of the ring).
+    unsigned int readBlock(const trace::record *records, unsigned int count, unsigned int index,
+                           uint8_t *out, unsigned int capacity, unsigned int *length)
+    {
+        const trace::record &start = records[index];
+        if (start.length != 2)
+        {
+            return 0;
+        }
+        const unsigned int blockLength = start.data[0] | (start.data[1] << 8);
+        const unsigned int dataRecords = (blockLength + trace::recordDataSize - 1) / trace::recordDataSize;
+        if (blockLength > capacity || index + dataRecords >= count)
+        {
+            return 0;
+        }
+
+        unsigned int received = 0;
+        for (unsigned int i = 1; i <= dataRecords; i++)
+        {
+            const trace::record &rec = records[index + i];
+            if (rec.type != trace::RecordType::CommandData || received + rec.length > blockLength)
+            {
+                return 0;
+            }
+            memcpy(out + received, rec.data, rec.length);
+            received += rec.length;
+        }
+        if (received != blockLength)
+        {
+            return 0;
+        }
+        *length = blockLength;
+        return 1 + dataRecords;
+    }
+
+    // Dispatches the command starting at records[index]. Returns the index of the record after it.
+    // A command missing any of its data is skipped.
+    unsigned int replayCommand(const trace::record *records, unsigned int count, unsigned int index)
+    {
+        uint8_t request[commands::maxRequestSize];
+        uint8_t reply[commands::maxReplySize];
+        unsigned int requestLength;
+        const unsigned int used = readBlock(records, count, index, request, sizeof(request), &requestLength);
+        if (used == 0)
+        {
+            return index + 1;
+        }
+        commands::dispatch(request, requestLength, reply, sizeof(reply));
+        return index + used;
+    }
+
+    // Index of the first whole checkpoint taken with the given song live, count if there isn't one
+    unsigned int findCheckpoint(const trace::record *records, unsigned int count, uint16_t generation, trace::checkpoint *state)
+    {
+        for (unsigned int index = 0; index < count; index++)
+        {
+            unsigned int length;
+            if (records[index].type == trace::RecordType::Checkpoint &&
+                readBlock(records, count, index, reinterpret_cast<uint8_t *>(state), sizeof(*state), &length) != 0 &&
+                length == sizeof(*state) && state->songGeneration == generation)
+            {
+                return index;
+            }
+        }
+        return count;
+    }
+
+    // Uploads the song from the dump and swaps it in, the way the network thread and THREAD 0 would
+    bool loadSong(const traceReplay::song &s)
+    {
+        if (s.frameCount == 0 || !music::beginUpload(s.name, s.nameLength))
+        {
+            return false;
+        }
+        unsigned int frameStart = 0;
+        for (unsigned int i = 0; i < s.dataLength; i++)
+        {
+            if (s.data[i] == music::frameEndMarker)
+            {
+                if (i - frameStart > _PIANOSIZE || !music::uploadFrame(s.data + frameStart, i - frameStart))
+                {
+                    music::endUpload();
+                    return false;
+                }
+                frameStart = i + 1;
+            }
+        }
+        return music::endUpload() && music::swapInUpload();
+    }
+
+    void applyCheckpoint(const trace::checkpoint &state)
+    {
+        settings::restoreSnapshot(state.settings);
+        if (state.looping && state.loopStart < state.loopEnd && state.loopEnd <= music::frameCount())
+        {
+            music::setLoopingSettings(true, state.loopStart, state.loopEnd);
+        }
+        music::setFrame(state.frameIndex);
+        if (state.mode <= static_cast<uint8_t>(lights::AnimationMode::Stream))
+        {
+            lights::setAnimationMode(static_cast<lights::AnimationMode>(state.mode));
+        }
+    }
+
+    // Applies the input at records[index]. Returns the index of the next input.
+    unsigned int replayRecord(const trace::record *records, unsigned int count, unsigned int index)
+    {
+        const trace::record &rec = records[index];
+        switch (rec.type)
+        {
+        case trace::RecordType::MidiPacket:
+            if (rec.length == 4)
+            {
+                MIDI::handlePacket(rec.data, rec.micros);
+            }
+            return index + 1;
+
+        case trace::RecordType::Command:
+            return replayCommand(records, count, index);
+
+        case trace::RecordType::ModeChange:
+        {
+            lights::AnimationMode mode = static_cast<lights::AnimationMode>(rec.data[0]);
+            if (rec.length == 1 && lights::getAnimationMode() != mode)
+            {
+                lights::setAnimationMode(mode);
+            }
+            return index + 1;
+        }
+
+        default:
+            // Checkpoints, which only matter to where the replay starts, CommandData without its
+            // Command, or a record this version doesn't know
+            return index + 1;
+        }
+    }
+} // namespace
+
+namespace traceReplay
+{
+
+// Checks the header of a dump and copies its records out.
+// Returns the number of records, 0 if the dump isn't one this version can read.
+unsigned int parse(const uint8_t *dump, unsigned int length, trace::record *records, unsigned int capacity)
+{
+    trace::dumpHeader header;
+    if (length < sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(&header, dump, sizeof(header));
+    if (memcmp(header.magic, trace::dumpMagic, sizeof(header.magic)) != 0 ||
+        header.version != trace::dumpVersion || header.recordSize != sizeof(trace::record))
+    {
+        return 0;
+    }
+
+    unsigned int count = header.recordCount;
+    if (length - sizeof(header) < count * sizeof(trace::record))
+    {
+        count = (length - sizeof(header)) / sizeof(trace::record); // cut short, keep what is there
+    }
+    if (count > capacity)
+    {
+        count = capacity;
+    }
+    memcpy(records, dump + sizeof(header), count * sizeof(trace::record));
+    return count;
+}
+
+// Finds the song after the records of a dump. Returns false if the dump doesn't have a whole one.
+bool parseSong(const uint8_t *dump, unsigned int length, song *out)
+{
+    trace::dumpHeader header;
+    if (length < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, dump, sizeof(header));
+    if (memcmp(header.magic, trace::dumpMagic, sizeof(header.magic)) != 0 ||
+        header.version != trace::dumpVersion || header.recordSize != sizeof(trace::record))
+    {
+        return false;
+    }
+
+    unsigned int offset = sizeof(header) + header.recordCount * sizeof(trace::record);
+    trace::songHeader songHeader;
+    if (length < offset + sizeof(songHeader))
+    {
+        return false;
+    }
+    memcpy(&songHeader, dump + offset, sizeof(songHeader));
+    offset += sizeof(songHeader);
+    if (length - offset < (unsigned int)songHeader.nameLength + songHeader.dataLength)
+    {
+        return false;
+    }
+    out->generation = songHeader.generation;
+    out->frameCount = songHeader.frameCount;
+    out->name = reinterpret_cast<const char *>(dump + offset);
+    out->nameLength = songHeader.nameLength;
+    out->data = dump + offset + songHeader.nameLength;
+    out->dataLength = songHeader.dataLength;
+    return true;
+}
+
+// Runs the main loop over the trace with the clock stepped a frame at a time.
+// Returns the number of frames drawn.
+unsigned int run(const trace::record *records, unsigned int count, const options &opts)
+{
+    if (count == 0 || opts.frameMicros == 0)
+    {
+        return 0;
+    }
+
+    trace::setRecording(false);
+    MIDI::setLogicalLayerEnable(true);
+
+    // Start from the checkpoint if the song it was taken with is there to load
+    unsigned int first = 0;
+    trace::checkpoint state;
+    if (opts.startSong != nullptr)
+    {
+        const unsigned int at = findCheckpoint(records, count, opts.startSong->generation, &state);
+        if (at < count && loadSong(*opts.startSong))
+        {
+            opts.setClock(records[at].micros);
+            applyCheckpoint(state);
+            first = at;
+        }
+    }
+
+    const uint32_t end = records[count - 1].micros + opts.tailMicros;
+    uint32_t now = records[first].micros;
+    uint32_t poll100Timer = now;
+    unsigned int next = first;
+    unsigned int frames = 0;
+
+    while (notAfter(now, end))
+    {
+        opts.setClock(now);
+
+        while (next < count && notAfter(records[next].micros, now))
+        {
+            next = replayRecord(records, count, next);
+        }
+
+        // The same steps as loop(), minus the network and firmware update parts
+        if (!isErrorLocked())
+        {
+            Event e;
+            while (PopEvent(&e))
+            {
+                RunEvent(e);
+            }
+            if (now - poll100Timer >= poll100Micros)
+            {
+                poll100Timer = now;
+                MIDI::copyLogicalStateBuffer();
+            }
+        }
+        lights::updateAnimation();
+
+        if (opts.onFrame != nullptr)
+        {
+            opts.onFrame(frames, now);
+        }
+        frames++;
+        now += opts.frameMicros;
+    }
+
+    trace::setRecording(true);
+    return frames;
+}
+
+} // namespace traceReplay
@@ -0,0 +1,63 @@
+#ifndef TRACEREPLAY_H
+#define TRACEREPLAY_H
+
+#include <stdint.h>
+
+#include "trace.h"
+
+/**
+ * Replays a trace taken with GET /trace through the lighting and music code, for reproducing
+ * bugs and for regression suites on a host build. The clock belongs to the caller and only
+ * moves when the replay says so, so the same trace always gives the same frames, as fast as
+ * they can be drawn.
+ *
+ * Frames are drawn every frameMicros of trace time rather than when the device drew them.
+ * Inputs are applied at the start of the first frame at or after the time they came in:
+ * MIDI packets go through the MIDI parser, commands through the dispatcher, and mode changes
+ * only take effect when the replay isn't in that mode already, as most of them follow from a
+ * command or a note which has been replayed already.
+ *
+ * Run the replay after the same start up as setup(): settings, lights::init() and InitBuffer().
+ * Given the song from the dump, the replay starts at the first checkpoint taken with that song
+ * live: the song is loaded, the settings, loop, frame and mode are set as they were, and the
+ * inputs before the checkpoint are skipped. Without a song or a matching checkpoint it starts
+ * at the first record from the start up state. Either way what the matcher and the animations
+ * were in the middle of isn't in a checkpoint and starts afresh.
+ * host/tests/replayTest.cpp shows it running on the host build with the simulated clock.
+ */
+
+namespace traceReplay
+{
+
+typedef void (*clockSetter)(uint32_t micros);
+typedef void (*frameHandler)(unsigned int frame, uint32_t micros);
+
+// The live song of a dump, pointing into the dump
+struct song
+{
+    uint16_t generation;
+    unsigned int frameCount;
+    const char *name;
+    unsigned int nameLength;
+    const uint8_t *data; // notes and frameEndMarkers as they are uploaded
+    unsigned int dataLength;
+};
+
+struct options
+{
+    uint32_t frameMicros;  // trace time between two frames
+    uint32_t tailMicros;   // trace time to keep drawing after the last input
+    clockSetter setClock;  // moves the clock micros() and millis() read
+    frameHandler onFrame;  // called once each frame has gone out to the strip, may be null
+    const song *startSong; // from parseSong(), null to start from the start up state
+};
+
+unsigned int parse(const uint8_t *dump, unsigned int length, trace::record *records, unsigned int capacity);
+
+bool parseSong(const uint8_t *dump, unsigned int length, song *out);
+
+unsigned int run(const trace::record *records, unsigned int count, const options &opts);
+
+} // namespace traceReplay
+
+#endif
@@ -0,0 +1,369 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <atomic>
+#include <mbedtls/base64.h>
+#include <mbedtls/sha1.h>
+
+#include "commands.h"
+#include "keyMask.h"
+#include "lighting/lighting.h"
+#include "m_error.h"
+#include "music.h"
+#include "pinaoCom.h"
+#include "webSocket.h"
+
+namespace
+{
+    constexpr unsigned int handshakeBufferSize = 512;
+    constexpr unsigned int rxBufferSize = 4 + 4 + commands::maxRequestSize; // header with the 16 bit length, mask, the longest request
+    // Resync, frame index, animation mode and a NoteOn for every key
+    constexpr unsigned int fullStateSize = 1 + 3 + 2 + _PIANOSIZE * 3;
+    constexpr unsigned int batchBufferSize = 512;
+    static_assert(batchBufferSize >= fullStateSize, "a resync has to fit in one batch");
+    const char *websocketGUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    enum Opcode : uint8_t
+    {
+        OP_TEXT = 0x1,
+        OP_BINARY = 0x2,
+        OP_CLOSE = 0x8,
+        OP_PING = 0x9,
+        OP_PONG = 0xA
+    };
+
+    WiFiServer server(websocket::port);
+    WiFiClient client;
+
+    // NETWORK THREAD state
+    char handshakeBuffer[handshakeBufferSize];
+    unsigned int handshakeLength = 0;
+    bool handshakeDone = false;
+    uint8_t rxBuffer[rxBufferSize];
+    unsigned int rxLength = 0;
+    // Errors are pushed from here, THREAD 0 stops rendering frames once the device is error locked
+    ErrorCode sentError = ErrorCode::NO_ERROR;
+
+    // Written by the network thread, read by THREAD 0
+    std::atomic<bool> clientConnected(false);
+
+    // THREAD 0 builds a batch over a render frame and hands it over through the ready buffer.
+    // batchReady is set by THREAD 0 and cleared by the network thread once it has been sent.
+    uint8_t buildingBatch[batchBufferSize];
+    unsigned int buildingLength = 0;
+    uint8_t readyBatch[batchBufferSize];
+    unsigned int readyLength = 0;
+    std::atomic<bool> batchReady(false);
+
+    // THREAD 0: last state pushed to the client
+    bool resyncNeeded = true;
+    int lastFrameIndex = -1;
+    lights::AnimationMode lastMode = lights::AnimationMode::None;
+    keyMask lastNotes;
+
+    void closeClient()
+    {
+        client.stop();
+        clientConnected.store(false, std::memory_order_release);
+        batchReady.store(false, std::memory_order_release);
+        handshakeDone = false;
+        handshakeLength = 0;
+        rxLength = 0;
+        sentError = ErrorCode::NO_ERROR;
+    }
+
+    void sendFrame(uint8_t opcode, const uint8_t *data, unsigned int length)
+    {
+        uint8_t header[4];
+        unsigned int headerLength = 2;
+        header[0] = 0x80 | opcode; // FIN
+        if (length < 126)
+        {
+            header[1] = length;
+        }
+        else
+        {
+            header[1] = 126;
+            header[2] = length >> 8;
+            header[3] = length & 0xFF;
+            headerLength = 4;
+        }
+        client.write(header, headerLength);
+        if (length != 0)
+        {
+            client.write(data, length);
+        }
+    }
+
+    // Reads the HTTP upgrade request a bit at a time and answers it once it is complete
+    void readHandshake()
+    {
+        while (client.available() && handshakeLength < handshakeBufferSize - 1)
+        {
+            handshakeBuffer[handshakeLength++] = client.read();
+        }
+        handshakeBuffer[handshakeLength] = '\0';
+
+        if (strstr(handshakeBuffer, "\r\n\r\n") == nullptr)
+        {
+            if (handshakeLength == handshakeBufferSize - 1)
+            {
+                closeClient();
+            }
+            return;
+        }
+
+        char *key = strstr(handshakeBuffer, "Sec-WebSocket-Key:");
+        if (key == nullptr)
+        {
+            closeClient();
+            return;
+        }
+        key += strlen("Sec-WebSocket-Key:");
+        while (*key == ' ')
+        {
+            key++;
+        }
+        char *keyEnd = strstr(key, "\r\n");
+        if (keyEnd == nullptr || keyEnd - key > 64)
+        {
+            closeClient();
+            return;
+        }
+        *keyEnd = '\0';
+
+        // Sec-WebSocket-Accept is base64(sha1(key + GUID))
+        char acceptSource[128];
+        snprintf(acceptSource, sizeof(acceptSource), "%s%s", key, websocketGUID);
+        unsigned char hash[20];
+        mbedtls_sha1_ret(reinterpret_cast<unsigned char *>(acceptSource), strlen(acceptSource), hash);
+        unsigned char accept[32];
+        size_t acceptLength = 0;
+        mbedtls_base64_encode(accept, sizeof(accept) - 1, &acceptLength, hash, sizeof(hash));
+        accept[acceptLength] = '\0';
+
+        char response[160];
+        int responseLength = snprintf(response, sizeof(response),
+                                      "HTTP/1.1 101 Switching Protocols\r\n"
+                                      "Upgrade: websocket\r\n"
+                                      "Connection: Upgrade\r\n"
+                                      "Sec-WebSocket-Accept: %s\r\n\r\n",
+                                      accept);
+        client.write(reinterpret_cast<uint8_t *>(response), responseLength);
+
+        handshakeDone = true;
+        rxLength = 0;
+        clientConnected.store(true, std::memory_order_release);
+    }
+
+    // Handles every complete frame sitting in the recieve buffer. Fragmented frames are not supported
+    // and anything longer than commands::maxRequestSize closes the connection, as no command can be.
+    void readFrames()
+    {
+        while (client.available() && rxLength < rxBufferSize)
+        {
+            rxBuffer[rxLength++] = client.read();
+        }
+
+        while (rxLength >= 2)
+        {
+            uint8_t opcode = rxBuffer[0] & 0x0F;
+            bool masked = rxBuffer[1] & 0x80;
+            unsigned int payloadLength = rxBuffer[1] & 0x7F;
+            unsigned int headerLength = 2;
+            if (payloadLength == 126)
+            {
+                if (rxLength < 4)
+                {
+                    return;
+                }
+                payloadLength = (rxBuffer[2] << 8) | rxBuffer[3]; // big endian on the wire
+                headerLength = 4;
+            }
+            if (payloadLength == 127 || headerLength + 4 + payloadLength > rxBufferSize)
+            {
+                closeClient();
+                return;
+            }
+            const uint8_t *mask = rxBuffer + headerLength;
+            if (masked)
+            {
+                headerLength += 4;
+            }
+            if (rxLength < headerLength + payloadLength)
+            {
+                return;
+            }
+
+            uint8_t *payload = rxBuffer + headerLength;
+            if (masked)
+            {
+                for (unsigned int i = 0; i < payloadLength; i++)
+                {
+                    payload[i] ^= mask[i & 3];
+                }
+            }
+
+            switch (opcode)
+            {
+            case OP_BINARY:
+            {
+                uint8_t reply[commands::maxReplySize];
+                unsigned int replyLength = commands::dispatch(payload, payloadLength, reply, sizeof(reply));
+                sendFrame(OP_BINARY, reply, replyLength);
+                break;
+            }
+            case OP_PING:
+                sendFrame(OP_PONG, payload, payloadLength);
+                break;
+            case OP_CLOSE:
+                sendFrame(OP_CLOSE, nullptr, 0);
+                closeClient();
+                return;
+            default:
+                break;
+            }
+
+            unsigned int frameLength = headerLength + payloadLength;
+            memmove(rxBuffer, rxBuffer + frameLength, rxLength - frameLength);
+            rxLength -= frameLength;
+        }
+    }
+
+    // THREAD 0: Adds a message to the batch for this render frame
+    void appendMessage(websocket::Message message, const uint8_t *payload, unsigned int length)
+    {
+        if (buildingLength + 1 + length > batchBufferSize)
+        {
+            // The client will get the full state again instead of a partial history
+            resyncNeeded = true;
+            return;
+        }
+        buildingBatch[buildingLength++] = static_cast<uint8_t>(message);
+        if (length != 0)
+        {
+            memcpy(buildingBatch + buildingLength, payload, length);
+            buildingLength += length;
+        }
+    }
+} // namespace
+
+namespace websocket
+{
+
+// Starts listening for a WebSocket client
+void begin()
+{
+    server.begin();
+}
+
+// NETWORK THREAD: Accepts the client, handles its commands and sends it the latest batch
+void poll()
+{
+    if (!client.connected())
+    {
+        if (handshakeDone || handshakeLength != 0)
+        {
+            closeClient();
+        }
+        client = server.available();
+        if (!client)
+        {
+            return;
+        }
+        client.setNoDelay(true);
+    }
+    else if (server.hasClient())
+    {
+        // Only one client at a time
+        WiFiClient extra = server.available();
+        extra.stop();
+    }
+
+    if (!handshakeDone)
+    {
+        readHandshake();
+        return;
+    }
+
+    readFrames();
+
+    if (handshakeDone && batchReady.load(std::memory_order_acquire))
+    {
+        sendFrame(OP_BINARY, readyBatch, readyLength);
+        batchReady.store(false, std::memory_order_release);
+    }
+
+    // Only ever set once, by fatalError()
+    ErrorCode error = getCurrentError();
+    if (handshakeDone && error != sentError)
+    {
+        uint8_t message[2] = {static_cast<uint8_t>(Message::Error), static_cast<uint8_t>(error)};
+        sendFrame(OP_BINARY, message, sizeof(message));
+        sentError = error;
+    }
+}
+
+// THREAD 0: Collects everything which changed during the render frame and hands it to the network thread
+void renderFrameEnd()
+{
+    if (!clientConnected.load(std::memory_order_acquire))
+    {
+        resyncNeeded = true;
+        buildingLength = 0;
+        return;
+    }
+
+    // Whatever the client missed, it starts over from no notes held and gets sent everything again
+    if (resyncNeeded)
+    {
+        resyncNeeded = false;
+        buildingLength = 0;
+        lastFrameIndex = -1;
+        lastMode = static_cast<lights::AnimationMode>(0xFF);
+        lastNotes = emptyKeyMask;
+        appendMessage(Message::Resync, nullptr, 0);
+    }
+
+    int frameIndex = music::currentFrameIndex();
+    if (frameIndex != lastFrameIndex)
+    {
+        uint8_t payload[2] = {static_cast<uint8_t>(frameIndex), static_cast<uint8_t>(frameIndex >> 8)};
+        appendMessage(Message::FrameIndex, payload, sizeof(payload));
+        lastFrameIndex = frameIndex;
+    }
+
+    lights::AnimationMode mode = lights::getAnimationMode();
+    if (mode != lastMode)
+    {
+        uint8_t payload = static_cast<uint8_t>(mode);
+        appendMessage(Message::AnimationMode, &payload, 1);
+        lastMode = mode;
+    }
+
+    // Only the notes which changed since the last render frame are sent
+    keyMask notes = MIDI::getNoteStates();
+    keyMask changed = notes ^ lastNotes;
+    forEachKey(changed, [&](uint8_t note) {
+        if (testKey(notes, note))
+        {
+            uint8_t payload[2] = {note, MIDI::getNoteVelocity(note)};
+            appendMessage(Message::NoteOn, payload, sizeof(payload));
+        }
+        else
+        {
+            appendMessage(Message::NoteOff, &note, 1);
+        }
+    });
+    lastNotes = notes;
+
+    // Hand the batch over unless the last one is still being sent, in which case it grows until next frame
+    if (buildingLength != 0 && !batchReady.load(std::memory_order_acquire))
+    {
+        memcpy(readyBatch, buildingBatch, buildingLength);
+        readyLength = buildingLength;
+        buildingLength = 0;
+        batchReady.store(true, std::memory_order_release);
+    }
+}
+
+} // namespace websocket
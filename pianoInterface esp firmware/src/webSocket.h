@@ -0,0 +1,39 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdint.h>
+
+/**
+ * A persistent WebSocket (port 81) which pushes live updates to one client so it
+ * doesn't have to poll the HTTP routes. Binary messages from the client are commands
+ * (see commands.h) and get their reply as a binary message. Pushed messages use opcodes
+ * from 0x80 up so they can't be mistaken for replies. Multi byte values are little endian.
+ * All the messages generated during one render frame are sent together as one binary
+ * WebSocket frame.
+ */
+
+namespace websocket
+{
+
+constexpr uint16_t port = 81;
+
+// Pushed to the client
+enum class Message : uint8_t
+{
+    FrameIndex = 0x81,    // uint16 live frame index
+    NoteOn = 0x82,        // uint8 note, uint8 velocity
+    NoteOff = 0x83,       // uint8 note
+    AnimationMode = 0x84, // uint8 lights::AnimationMode
+    Error = 0x85,         // uint8 ErrorCode, sent as soon as the device locks up, on its own
+    Resync = 0x86         // no payload, messages were lost: release every note, the full state follows
+};
+
+void begin();
+
+void poll();
+
+void renderFrameEnd();
+
+} // namespace websocket
+
+#endif